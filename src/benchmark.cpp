@@ -0,0 +1,706 @@
+/*
+Minetest-c55
+Copyright (C) 2010 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "benchmark.h"
+#include "map.h"
+#include "mapblock.h"
+#include "mapgen.h"
+#include "voxel.h"
+#include "noise.h"
+#include "content_mapnode.h"
+#include "main.h"
+#include "settings.h"
+#include "filesys.h"
+#include "porting.h"
+#include "utility.h"
+#include "log.h"
+#include "server.h"
+
+// The world generated by run_mapgen_benchmark()
+#define MAPGEN_BENCHMARK_SEED 13
+// Blocks from -this to this-1 in X and Z
+#define MAPGEN_BENCHMARK_RADIUS 4
+// Blocks from Y_MIN to Y_MAX; around ground level
+#define MAPGEN_BENCHMARK_Y_MIN -3
+#define MAPGEN_BENCHMARK_Y_MAX 2
+
+// The caves lit by run_lighting_benchmark()
+#define LIGHTING_BENCHMARK_SEED 13
+// Edge length of the area in nodes
+#define LIGHTING_BENCHMARK_SIZE 80
+// Height of the open air on top of the area
+#define LIGHTING_BENCHMARK_SKY 4
+#define LIGHTING_BENCHMARK_TUNNELS 60
+#define LIGHTING_BENCHMARK_SHAFTS 6
+#define LIGHTING_BENCHMARK_TORCHES 300
+#define LIGHTING_BENCHMARK_ROUNDS 3
+
+// The terraces flooded by run_liquid_replay_test()
+#define LIQUID_REPLAY_SEED 13
+// Blocks from -this to this-1 in X and Z
+#define LIQUID_REPLAY_RADIUS 3
+// Blocks from Y_MIN to Y_MAX
+#define LIQUID_REPLAY_Y_MIN -1
+#define LIQUID_REPLAY_Y_MAX 1
+#define LIQUID_REPLAY_SOURCES 24
+#define LIQUID_REPLAY_HOLES 16
+// The holes are dug before this pass
+#define LIQUID_REPLAY_HOLE_PASS 15
+#define LIQUID_REPLAY_PASSES 40
+
+// The box generated by run_pregenerate_test()
+#define PREGENERATE_TEST_SEED 13
+#define PREGENERATE_TEST_MIN v3s16(-3,-2,-3)
+#define PREGENERATE_TEST_MAX v3s16(2,1,2)
+// Where the player starts for the blocks generated on demand
+#define PREGENERATE_TEST_PLAYER v3s16(1,0,-2)
+
+static void print_stage(const char *name, u32 time_us, u32 total_us)
+{
+	actionstream<<"  "<<name<<": "<<(time_us/1000)<<" ms ("
+			<<(total_us ? (u64)time_us * 100 / total_us : 0)<<"%)"
+			<<std::endl;
+}
+
+bool run_mapgen_benchmark(const std::string &savedir)
+{
+	if(fs::PathExists(savedir))
+	{
+		errorstream<<"Mapgen benchmark: "<<savedir<<" already exists; "
+				<<"remove it or give another --map-dir"<<std::endl;
+		return false;
+	}
+
+	g_settings->setU64("fixed_map_seed", MAPGEN_BENCHMARK_SEED);
+
+	ServerMap *map = new ServerMap(savedir);
+
+	/*
+		The list of blocks
+	*/
+	core::list<v3s16> blocks;
+	for(s16 x=-MAPGEN_BENCHMARK_RADIUS; x<MAPGEN_BENCHMARK_RADIUS; x++)
+	for(s16 z=-MAPGEN_BENCHMARK_RADIUS; z<MAPGEN_BENCHMARK_RADIUS; z++)
+	for(s16 y=MAPGEN_BENCHMARK_Y_MIN; y<=MAPGEN_BENCHMARK_Y_MAX; y++)
+		blocks.push_back(v3s16(x,y,z));
+
+	actionstream<<"Mapgen benchmark: generating "<<blocks.size()
+			<<" blocks in "<<savedir<<std::endl;
+
+	/*
+		Generate
+	*/
+	u32 stage_time_us[mapgen::BMS_COUNT];
+	for(u32 i=0; i<mapgen::BMS_COUNT; i++)
+		stage_time_us[i] = 0;
+	u32 init_time_us = 0;
+	u32 finish_time_us = 0;
+
+	u32 start_ms = porting::getTimeMs();
+
+	for(core::list<v3s16>::Iterator i = blocks.begin();
+			i != blocks.end(); i++)
+	{
+		core::map<v3s16, MapBlock*> modified_blocks;
+		mapgen::BlockMakeData data;
+
+		u32 t = porting::getTimeUs();
+		map->initBlockMake(&data, *i);
+		init_time_us += porting::getTimeUs() - t;
+
+		mapgen::make_block(&data);
+
+		t = porting::getTimeUs();
+		map->finishBlockMake(&data, modified_blocks);
+		finish_time_us += porting::getTimeUs() - t;
+
+		for(u32 j=0; j<mapgen::BMS_COUNT; j++)
+			stage_time_us[j] += data.stage_time_us[j];
+	}
+
+	u32 total_ms = porting::getTimeMs() - start_ms;
+
+	/*
+		Hash the result
+	*/
+	u32 hash = 2166136261u; // FNV-1a
+	for(core::list<v3s16>::Iterator i = blocks.begin();
+			i != blocks.end(); i++)
+	{
+		MapBlock *block = map->getBlockNoCreateNoEx(*i);
+		if(block == NULL || block->isGenerated() == false)
+		{
+			errorstream<<"Mapgen benchmark: block ("<<i->X<<","<<i->Y
+					<<","<<i->Z<<") was not generated"<<std::endl;
+			continue;
+		}
+		for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+		{
+			MapNode n = block->getNodeNoCheck(v3s16(x,y,z));
+			u8 bytes[3] = {n.param0, n.param1, n.param2};
+			for(u32 j=0; j<3; j++)
+				hash = (hash ^ bytes[j]) * 16777619u;
+		}
+	}
+
+	/*
+		Report
+	*/
+	// make_block() stages are measured by it, the rest here
+	u32 total_us = init_time_us + finish_time_us;
+	for(u32 j=0; j<mapgen::BMS_COUNT; j++)
+		total_us += stage_time_us[j];
+
+	actionstream<<"Mapgen benchmark: "<<blocks.size()<<" blocks in "
+			<<total_ms<<" ms, "
+			<<(total_ms ? blocks.size() * 1000.0 / total_ms : 0)
+			<<" blocks/s"<<std::endl;
+	print_stage("initBlockMake", init_time_us, total_us);
+	for(u32 j=0; j<mapgen::BMS_COUNT; j++)
+		print_stage(mapgen::block_make_stage_names[j],
+				stage_time_us[j], total_us);
+	print_stage("finishBlockMake", finish_time_us, total_us);
+	actionstream<<"  peak memory: "<<porting::getPeakMemoryUsage()
+			<<" kB"<<std::endl;
+
+	char hash_s[20];
+	snprintf(hash_s, 20, "%08x", hash);
+	actionstream<<"  node data hash: "<<hash_s<<std::endl;
+
+	delete map;
+	fs::RecursiveDelete(savedir);
+
+	return true;
+}
+
+/*
+	Fills v with stone that has random tunnels and a few shafts
+	going up to open air. The air under open sky gets sunlight,
+	like MapBlock::propagateSunlight() would do; those nodes and
+	the torches placed in the tunnels are returned as light sources.
+*/
+static void make_benchmark_caves(VoxelManipulator &v,
+		core::list<v3s16> &sunlit, core::list<v3s16> &torches)
+{
+	const s16 size = LIGHTING_BENCHMARK_SIZE;
+	const s16 sky_y = size - LIGHTING_BENCHMARK_SKY;
+
+	VoxelArea area(v3s16(0,0,0), v3s16(size-1,size-1,size-1));
+	v.addArea(area);
+
+	for(s16 z=0; z<size; z++)
+	for(s16 y=0; y<size; y++)
+	for(s16 x=0; x<size; x++)
+	{
+		u32 i = v.m_area.index(x,y,z);
+		v.m_data[i] = MapNode(y >= sky_y ? CONTENT_AIR : CONTENT_STONE);
+		v.m_flags[i] = 0;
+	}
+
+	PseudoRandom pr(LIGHTING_BENCHMARK_SEED);
+
+	/*
+		Tunnels are random walks of spheres; shafts go straight up
+		to the sky
+	*/
+	u32 count = LIGHTING_BENCHMARK_TUNNELS + LIGHTING_BENCHMARK_SHAFTS;
+	for(u32 t=0; t<count; t++)
+	{
+		bool shaft = (t >= LIGHTING_BENCHMARK_TUNNELS);
+		v3f p(pr.range(8, size-9), pr.range(8, sky_y-8), pr.range(8, size-9));
+		v3f dir(0, 1, 0);
+		s16 rad = pr.range(1, 3);
+		s16 steps = shaft ? size : 50;
+		for(s16 step=0; step<steps; step++)
+		{
+			if(shaft == false && step % 8 == 0)
+				dir = v3f(pr.range(-10, 10), pr.range(-5, 5),
+						pr.range(-10, 10)) / 10.0;
+			p += dir;
+			for(s16 z=-rad; z<=rad; z++)
+			for(s16 y=-rad; y<=rad; y++)
+			for(s16 x=-rad; x<=rad; x++)
+			{
+				if(x*x + y*y + z*z > rad*rad)
+					continue;
+				v3s16 p2 = v3s16(p.X, p.Y, p.Z) + v3s16(x,y,z);
+				// Keep a stone border around the caves
+				if(p2.X < 1 || p2.X > size-2 || p2.Z < 1 || p2.Z > size-2
+						|| p2.Y < 1 || p2.Y >= sky_y)
+					continue;
+				v.m_data[v.m_area.index(p2)] = MapNode(CONTENT_AIR);
+			}
+		}
+	}
+
+	/*
+		Torches on cave floors
+	*/
+	for(u32 t=0; t<LIGHTING_BENCHMARK_TORCHES; t++)
+	{
+		for(u32 tries=0; tries<100; tries++)
+		{
+			v3s16 p(pr.range(1, size-2), pr.range(2, sky_y-1),
+					pr.range(1, size-2));
+			MapNode &n = v.m_data[v.m_area.index(p)];
+			MapNode &n_below = v.m_data[v.m_area.index(p-v3s16(0,1,0))];
+			if(n.getContent() != CONTENT_AIR
+					|| n_below.getContent() != CONTENT_STONE)
+				continue;
+			n = MapNode(CONTENT_TORCH);
+			torches.push_back(p);
+			break;
+		}
+	}
+
+	/*
+		Sunlight
+	*/
+	for(s16 z=0; z<size; z++)
+	for(s16 x=0; x<size; x++)
+	{
+		for(s16 y=size-1; y>=0; y--)
+		{
+			MapNode &n = v.m_data[v.m_area.index(x,y,z)];
+			if(n.sunlight_propagates() == false)
+				break;
+			n.setLight(LIGHTBANK_DAY, LIGHT_SUN);
+			sunlit.push_back(v3s16(x,y,z));
+		}
+	}
+}
+
+static u32 compare_light(VoxelManipulator &a, VoxelManipulator &b)
+{
+	u32 differing = 0;
+	const s16 size = LIGHTING_BENCHMARK_SIZE;
+	for(s16 z=0; z<size; z++)
+	for(s16 y=0; y<size; y++)
+	for(s16 x=0; x<size; x++)
+	{
+		v3s16 p(x,y,z);
+		if(a.m_data[a.m_area.index(p)].param1
+				!= b.m_data[b.m_area.index(p)].param1)
+			differing++;
+	}
+	return differing;
+}
+
+static void print_times(const char *name, u32 old_us, u32 new_us)
+{
+	actionstream<<"  "<<name<<": old "<<(old_us/1000)<<" ms, new "
+			<<(new_us/1000)<<" ms ("
+			<<(new_us ? (float)old_us / new_us : 0)<<"x)"<<std::endl;
+}
+
+bool run_lighting_benchmark()
+{
+	const enum LightBank banks[2] = {LIGHTBANK_DAY, LIGHTBANK_NIGHT};
+
+	u32 spread_old_us = 0;
+	u32 spread_new_us = 0;
+	u32 unspread_old_us = 0;
+	u32 unspread_new_us = 0;
+	u32 differing = 0;
+	u32 torch_count = 0;
+
+	for(u32 round=0; round<LIGHTING_BENCHMARK_ROUNDS; round++)
+	{
+		VoxelManipulator v_old;
+		VoxelManipulator v_new;
+		core::list<v3s16> sunlit;
+		core::list<v3s16> torches;
+		make_benchmark_caves(v_old, sunlit, torches);
+		sunlit.clear();
+		torches.clear();
+		make_benchmark_caves(v_new, sunlit, torches);
+		torch_count = torches.size();
+
+		/*
+			Light the caves
+		*/
+		core::map<v3s16, bool> sources_old;
+		LightQueue sources_new;
+		for(core::list<v3s16>::Iterator i = sunlit.begin();
+				i != sunlit.end(); i++)
+		{
+			sources_old.insert(*i, true);
+			sources_new.push_back(LightQueueNode(*i, LIGHTBANKS_BOTH));
+		}
+		for(core::list<v3s16>::Iterator i = torches.begin();
+				i != torches.end(); i++)
+		{
+			sources_old.insert(*i, true);
+			sources_new.push_back(LightQueueNode(*i, LIGHTBANKS_BOTH));
+		}
+
+		u32 t = porting::getTimeUs();
+		for(u32 b=0; b<2; b++)
+			v_old.spreadLight(banks[b], sources_old);
+		spread_old_us += porting::getTimeUs() - t;
+
+		t = porting::getTimeUs();
+		v_new.spreadLight(sources_new);
+		spread_new_us += porting::getTimeUs() - t;
+
+		/*
+			Remove every other torch
+		*/
+		core::map<v3s16, u8> unlight_old[2];
+		LightQueue unlight_new;
+		u32 j = 0;
+		for(core::list<v3s16>::Iterator i = torches.begin();
+				i != torches.end(); i++, j++)
+		{
+			if(j % 2 != 0)
+				continue;
+			MapNode &n_old = v_old.m_data[v_old.m_area.index(*i)];
+			MapNode &n_new = v_new.m_data[v_new.m_area.index(*i)];
+			for(u32 b=0; b<2; b++)
+				unlight_old[b].insert(*i, n_old.getLight(banks[b]));
+			unlight_new.push_back(LightQueueNode(*i, LIGHTBANKS_BOTH,
+					n_new.getLightBanksWithSource()));
+			n_old = MapNode(CONTENT_AIR);
+			n_new = MapNode(CONTENT_AIR);
+		}
+
+		t = porting::getTimeUs();
+		for(u32 b=0; b<2; b++)
+		{
+			core::map<v3s16, bool> light_sources;
+			v_old.unspreadLight(banks[b], unlight_old[b], light_sources);
+			v_old.spreadLight(banks[b], light_sources);
+		}
+		unspread_old_us += porting::getTimeUs() - t;
+
+		t = porting::getTimeUs();
+		{
+			LightQueue light_sources;
+			v_new.unspreadLight(unlight_new, light_sources);
+			v_new.spreadLight(light_sources);
+		}
+		unspread_new_us += porting::getTimeUs() - t;
+
+		differing += compare_light(v_old, v_new);
+	}
+
+	const s16 size = LIGHTING_BENCHMARK_SIZE;
+	actionstream<<"Lighting benchmark: "<<size<<"x"<<size<<"x"<<size
+			<<" nodes of caves with "<<torch_count<<" torches, "
+			<<LIGHTING_BENCHMARK_ROUNDS<<" rounds"<<std::endl;
+	print_times("spread", spread_old_us, spread_new_us);
+	print_times("unspread", unspread_old_us, unspread_new_us);
+
+	if(differing != 0)
+	{
+		errorstream<<"Lighting benchmark: light differs in "<<differing
+				<<" nodes"<<std::endl;
+		return false;
+	}
+	actionstream<<"  results match"<<std::endl;
+	return true;
+}
+
+/*
+	Terraces of stone with air above them
+*/
+static s16 replay_ground_level(s16 x, s16 z)
+{
+	s16 step = ((x + 64) / 7 + (z + 64) / 5) % 5;
+	return step * 4 - 12;
+}
+
+/*
+	Finds the first air node above the ground at x,z
+*/
+static v3s16 replay_surface(ServerMap *map, s16 x, s16 z)
+{
+	s16 y = LIQUID_REPLAY_Y_MIN * MAP_BLOCKSIZE;
+	while(map->getNodeNoEx(v3s16(x,y,z)).getContent() != CONTENT_AIR)
+		y++;
+	return v3s16(x,y,z);
+}
+
+static u32 hash_replay_blocks(ServerMap *map)
+{
+	u32 hash = 2166136261u; // FNV-1a
+	for(s16 bx=-LIQUID_REPLAY_RADIUS; bx<LIQUID_REPLAY_RADIUS; bx++)
+	for(s16 bz=-LIQUID_REPLAY_RADIUS; bz<LIQUID_REPLAY_RADIUS; bz++)
+	for(s16 by=LIQUID_REPLAY_Y_MIN; by<=LIQUID_REPLAY_Y_MAX; by++)
+	{
+		MapBlock *block = map->getBlockNoCreateNoEx(v3s16(bx,by,bz));
+		for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+		{
+			/*
+				Light is left out; it is updated at the end of each
+				call, so it depends on how a pass is split in calls
+			*/
+			MapNode n = block->getNodeNoCheck(v3s16(x,y,z));
+			hash = (hash ^ n.param0) * 16777619u;
+			hash = (hash ^ n.param2) * 16777619u;
+		}
+	}
+	return hash;
+}
+
+/*
+	Floods the terraces from random liquid sources in a new world at
+	savedir, using thread_count map threads, and digs holes in the
+	ground halfway. Returns the hash of the nodes after each pass.
+*/
+static void replay_liquid(const std::string &savedir, u16 thread_count,
+		u32 max_time_ms, core::array<u32> &hashes, u32 &time_ms)
+{
+	g_settings->set("num_map_threads", itos(thread_count));
+	ServerMap *map = new ServerMap(savedir);
+
+	for(s16 bx=-LIQUID_REPLAY_RADIUS; bx<LIQUID_REPLAY_RADIUS; bx++)
+	for(s16 bz=-LIQUID_REPLAY_RADIUS; bz<LIQUID_REPLAY_RADIUS; bz++)
+	for(s16 by=LIQUID_REPLAY_Y_MIN; by<=LIQUID_REPLAY_Y_MAX; by++)
+	{
+		MapBlock *block = map->createBlock(v3s16(bx,by,bz));
+		v3s16 p0 = block->getPosRelative();
+		for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+		{
+			s16 ground = replay_ground_level(p0.X+x, p0.Z+z);
+			MapNode n(p0.Y+y < ground ? CONTENT_STONE : CONTENT_AIR);
+			if(n.getContent() == CONTENT_AIR)
+				n.setLight(LIGHTBANK_DAY, LIGHT_SUN);
+			block->setNodeNoCheck(v3s16(x,y,z), n);
+		}
+		block->setLightingExpired(false);
+	}
+
+	PseudoRandom pr(LIQUID_REPLAY_SEED);
+	const s16 min = -LIQUID_REPLAY_RADIUS * MAP_BLOCKSIZE + 1;
+	const s16 max = LIQUID_REPLAY_RADIUS * MAP_BLOCKSIZE - 2;
+	std::string player_name = "";
+
+	for(u32 i=0; i<LIQUID_REPLAY_SOURCES; i++)
+	{
+		v3s16 p = replay_surface(map, pr.range(min, max), pr.range(min, max));
+		MapNode n(i % 4 == 0 ? CONTENT_LAVASOURCE : CONTENT_WATERSOURCE);
+		core::map<v3s16, MapBlock*> modified_blocks;
+		map->addNodeAndUpdate(p + v3s16(0,2,0), n, modified_blocks,
+				player_name);
+	}
+
+	u32 start_ms = porting::getTimeMs();
+	for(u32 pass=0; pass<LIQUID_REPLAY_PASSES; pass++)
+	{
+		if(pass == LIQUID_REPLAY_HOLE_PASS)
+		{
+			for(u32 i=0; i<LIQUID_REPLAY_HOLES; i++)
+			{
+				v3s16 p = replay_surface(map, pr.range(min, max),
+						pr.range(min, max));
+				for(s16 y=1; y<=3; y++)
+				{
+					core::map<v3s16, MapBlock*> modified_blocks;
+					map->removeNodeAndUpdate(p - v3s16(0,y,0),
+							modified_blocks);
+				}
+			}
+		}
+
+		core::map<v3s16, MapBlock*> modified_blocks;
+		while(map->transformLiquids(modified_blocks, max_time_ms) == false);
+
+		hashes.push_back(hash_replay_blocks(map));
+	}
+	time_ms = porting::getTimeMs() - start_ms;
+
+	delete map;
+	fs::RecursiveDelete(savedir);
+}
+
+bool run_liquid_replay_test(const std::string &savedir)
+{
+	if(fs::PathExists(savedir))
+	{
+		errorstream<<"Liquid replay test: "<<savedir<<" already exists; "
+				<<"remove it or give another --map-dir"<<std::endl;
+		return false;
+	}
+
+	u16 thread_counts[] = {1, 2, 4, 4};
+	// The last one is continued over several calls
+	u32 max_times_ms[] = {0, 0, 0, 1};
+	const u32 run_count = 4;
+
+	core::array<u32> hashes[run_count];
+	bool match = true;
+	for(u32 i=0; i<run_count; i++)
+	{
+		u32 time_ms = 0;
+		replay_liquid(savedir, thread_counts[i], max_times_ms[i],
+				hashes[i], time_ms);
+
+		actionstream<<"Liquid replay test: "<<thread_counts[i]
+				<<" threads";
+		if(max_times_ms[i] != 0)
+			actionstream<<", "<<max_times_ms[i]<<" ms per call";
+		actionstream<<": "<<LIQUID_REPLAY_PASSES<<" passes in "
+				<<time_ms<<" ms"<<std::endl;
+
+		for(u32 pass=0; pass<hashes[i].size(); pass++)
+		{
+			if(hashes[i][pass] == hashes[0][pass])
+				continue;
+			errorstream<<"Liquid replay test: nodes differ from the "
+					<<"first run after pass "<<pass<<std::endl;
+			match = false;
+			break;
+		}
+	}
+
+	char hash_s[20];
+	snprintf(hash_s, 20, "%08x", hashes[0].getLast());
+	actionstream<<"  node data hash: "<<hash_s<<std::endl;
+
+	if(match == false)
+		return false;
+	actionstream<<"  results match"<<std::endl;
+	return true;
+}
+
+/*
+	Generates the box nearest first from PREGENERATE_TEST_PLAYER, as
+	the emerge threads do for a player, in a new world at savedir.
+*/
+static void generate_on_demand(const std::string &savedir)
+{
+	ServerMap *map = new ServerMap(savedir);
+
+	v3s16 p_min = PREGENERATE_TEST_MIN;
+	v3s16 p_max = PREGENERATE_TEST_MAX;
+	v3s16 player = PREGENERATE_TEST_PLAYER;
+	v3s16 d_max(MYMAX(player.X - p_min.X, p_max.X - player.X),
+			MYMAX(player.Y - p_min.Y, p_max.Y - player.Y),
+			MYMAX(player.Z - p_min.Z, p_max.Z - player.Z));
+	s32 max_distance = d_max.X*d_max.X + d_max.Y*d_max.Y + d_max.Z*d_max.Z;
+
+	for(s32 distance=0; distance<=max_distance; distance++)
+	for(s16 z=p_min.Z; z<=p_max.Z; z++)
+	for(s16 y=p_min.Y; y<=p_max.Y; y++)
+	for(s16 x=p_min.X; x<=p_max.X; x++)
+	{
+		v3s16 d = v3s16(x,y,z) - player;
+		if(d.X*d.X + d.Y*d.Y + d.Z*d.Z != distance)
+			continue;
+		core::map<v3s16, MapBlock*> modified_blocks;
+		mapgen::BlockMakeData data;
+		map->initBlockMake(&data, v3s16(x,y,z));
+		mapgen::make_block(&data);
+		map->finishBlockMake(&data, modified_blocks);
+	}
+
+	map->save(false);
+	delete map;
+}
+
+bool run_pregenerate_test(const std::string &savedir)
+{
+	if(fs::PathExists(savedir))
+	{
+		errorstream<<"Pregenerate test: "<<savedir<<" already exists; "
+				<<"remove it or give another --map-dir"<<std::endl;
+		return false;
+	}
+
+	g_settings->setU64("fixed_map_seed", PREGENERATE_TEST_SEED);
+	g_settings->set("num_pregenerate_threads", "2");
+
+	v3s16 p_min = PREGENERATE_TEST_MIN;
+	v3s16 p_max = PREGENERATE_TEST_MAX;
+	std::string pregenerated_dir = savedir + DIR_DELIM + "pregenerated";
+	std::string on_demand_dir = savedir + DIR_DELIM + "on_demand";
+
+	{
+		Server *server = new Server(pregenerated_dir, "");
+		bool kill = false;
+		server->pregenerate(p_min, p_max, kill);
+		delete server;
+	}
+
+	generate_on_demand(on_demand_dir);
+
+	/*
+		Compare the blocks as they are loaded from the disk
+	*/
+	ServerMap *pregenerated = new ServerMap(pregenerated_dir);
+	ServerMap *on_demand = new ServerMap(on_demand_dir);
+
+	u32 block_count = 0;
+	u32 mismatch_count = 0;
+	for(s16 z=p_min.Z; z<=p_max.Z; z++)
+	for(s16 y=p_min.Y; y<=p_max.Y; y++)
+	for(s16 x=p_min.X; x<=p_max.X; x++)
+	{
+		v3s16 p(x,y,z);
+		block_count++;
+		MapBlock *a = pregenerated->emergeBlock(p, false);
+		MapBlock *b = on_demand->emergeBlock(p, false);
+		if(a == NULL || b == NULL
+				|| a->isGenerated() == false || b->isGenerated() == false)
+		{
+			errorstream<<"Pregenerate test: block ("<<x<<","<<y<<","<<z
+					<<") was not generated"<<std::endl;
+			mismatch_count++;
+			continue;
+		}
+		u32 differing_nodes = 0;
+		for(s16 z1=0; z1<MAP_BLOCKSIZE; z1++)
+		for(s16 y1=0; y1<MAP_BLOCKSIZE; y1++)
+		for(s16 x1=0; x1<MAP_BLOCKSIZE; x1++)
+		{
+			MapNode n1 = a->getNodeNoCheck(v3s16(x1,y1,z1));
+			MapNode n2 = b->getNodeNoCheck(v3s16(x1,y1,z1));
+			if(n1.param0 != n2.param0 || n1.param1 != n2.param1
+					|| n1.param2 != n2.param2)
+				differing_nodes++;
+		}
+		if(differing_nodes == 0)
+			continue;
+		errorstream<<"Pregenerate test: block ("<<x<<","<<y<<","<<z
+				<<") differs in "<<differing_nodes<<" nodes"<<std::endl;
+		mismatch_count++;
+	}
+
+	delete pregenerated;
+	delete on_demand;
+	fs::RecursiveDelete(savedir);
+
+	actionstream<<"Pregenerate test: compared "<<block_count
+			<<" blocks"<<std::endl;
+	if(mismatch_count != 0)
+	{
+		errorstream<<"Pregenerate test: "<<mismatch_count
+				<<" blocks differ"<<std::endl;
+		return false;
+	}
+	actionstream<<"  results match"<<std::endl;
+	return true;
+}
@@ -0,0 +1,69 @@
+/*
+Minetest-c55
+Copyright (C) 2010 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef BENCHMARK_HEADER
+#define BENCHMARK_HEADER
+
+#include <string>
+
+/*
+	Generates a fixed set of blocks with a fixed seed in a new world at
+	savedir, without networking. Reports the time spent in each stage,
+	blocks per second, peak memory usage and a hash of the resulting
+	nodes. The hash only changes if the generated terrain changes.
+
+	savedir must not exist; it is deleted afterwards.
+	Returns false on failure.
+*/
+bool run_mapgen_benchmark(const std::string &savedir);
+
+/*
+	Lights a synthetic cave system with sunlight and torches, then
+	removes some of the torches, with both the old recursive light
+	algorithms of VoxelManipulator and the queue-based ones. Reports
+	the time of each and checks that they give the same light.
+
+	Returns false if the results differ.
+*/
+bool run_lighting_benchmark();
+
+/*
+	Floods a terraced world from random liquid sources and digs some
+	holes in it, in a new world at savedir, with different numbers of
+	map threads. Checks that the liquids are the same after each
+	liquid pass in every run.
+
+	savedir must not exist; it is deleted afterwards.
+	Returns false on failure or if the results differ.
+*/
+bool run_liquid_replay_test(const std::string &savedir);
+
+/*
+	Generates a fixed box of blocks with a fixed seed with
+	Server::pregenerate() and one by one nearest first from a point,
+	like for a player, in new worlds in savedir. Checks that the
+	nodes of the blocks are the same in both.
+
+	savedir must not exist; it is deleted afterwards.
+	Returns false on failure or if the results differ.
+*/
+bool run_pregenerate_test(const std::string &savedir);
+
+#endif
+
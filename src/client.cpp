@@ -420,7 +420,8 @@ void Client::step(float dtime)
 			// [3] u8[20] player_name
 			// [23] u8[28] password (new in some version)
 			// [51] u16 client network protocol version (new in some version)
-			SharedBuffer<u8> data(2+1+PLAYERNAME_SIZE+PASSWORD_SIZE+2);
+			// [53] u8 flags (PROTOCOL_FLAG_*)
+			SharedBuffer<u8> data(2+1+PLAYERNAME_SIZE+PASSWORD_SIZE+2+1);
 			writeU16(&data[0], TOSERVER_INIT);
 			writeU8(&data[2], SER_FMT_VER_HIGHEST);
 
@@ -434,7 +435,12 @@ void Client::step(float dtime)
 			snprintf((char*)&data[23], PASSWORD_SIZE, "%s", m_password.c_str());
 			
 			// This should be incremented in each version
-			writeU16(&data[51], 3);
+			writeU16(&data[51], PROTOCOL_VERSION);
+
+			u8 flags = 0;
+			if(g_settings->getBool("enable_network_compression"))
+				flags |= PROTOCOL_FLAG_COMPRESSION;
+			writeU8(&data[53], flags);
 
 			// Send as unreliable
 			Send(0, data, false);
@@ -708,6 +714,42 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		return;
 	}
 
+	/*
+		Decompress and process the packet inside
+	*/
+	if(command == TOCLIENT_COMPRESSED)
+	{
+		if(datasize < 6)
+			return;
+
+		u32 size = readU32(&data[2]);
+
+		std::string s;
+		try{
+			std::string datastring((char*)&data[6], datasize - 6);
+			std::istringstream is(datastring, std::ios_base::binary);
+			std::ostringstream os(std::ios_base::binary);
+			decompressZlib(is, os);
+			s = os.str();
+		}
+		catch(SerializationError &e)
+		{
+			infostream<<"Client: Invalid TOCLIENT_COMPRESSED: "
+					<<e.what()<<std::endl;
+			return;
+		}
+
+		if(s.size() != size || s.size() < 2
+				|| readU16((u8*)&s[0]) == TOCLIENT_COMPRESSED)
+		{
+			infostream<<"Client: Invalid TOCLIENT_COMPRESSED"<<std::endl;
+			return;
+		}
+
+		ProcessData((u8*)&s[0], s.size(), sender_peer_id);
+		return;
+	}
+
 	u8 ser_version = m_server_ser_ver;
 
 	//infostream<<"Client received command="<<(int)command<<std::endl;
@@ -753,6 +795,13 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 			m_map_seed = readU64(&data[2+1+6]);
 			infostream<<"Client: received map seed: "<<m_map_seed<<std::endl;
 		}
+
+		if(datasize >= 2+1+6+8+1)
+		{
+			u8 flags = readU8(&data[2+1+6+8]);
+			infostream<<"Client: server accepted flags: "
+					<<((int)flags&0xff)<<std::endl;
+		}
 		
 		// Reply to server
 		u32 replysize = 2;
@@ -918,6 +967,36 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		//infostream<<"Adding mesh update task for received block"<<std::endl;
 		addUpdateMeshTaskWithEdge(p, true);
 	}
+	else if(command == TOCLIENT_BLOCKDATA_DELTA)
+	{
+		// Ignore too small packet
+		if(datasize < 8)
+			return;
+			
+		v3s16 p;
+		p.X = readS16(&data[2]);
+		p.Y = readS16(&data[4]);
+		p.Z = readS16(&data[6]);
+		
+		std::string datastring((char*)&data[8], datasize-8);
+		std::istringstream istr(datastring, std::ios_base::binary);
+		
+		/*
+			If the block has been deleted, the server gets to know it
+			from TOSERVER_DELETEDBLOCKS and sends it again in full
+		*/
+		MapBlock *block = m_env.getMap().getBlockNoCreateNoEx(p);
+		if(block == NULL || block->isDummy())
+		{
+			infostream<<"Client: Ignoring BLOCKDATA_DELTA for a block"
+					<<" not in memory"<<std::endl;
+			return;
+		}
+
+		block->deSerializeDelta(istr, ser_version);
+
+		addUpdateMeshTaskWithEdge(p, true);
+	}
 	else if(command == TOCLIENT_PLAYERPOS)
 	{
 		infostream<<"Received deprecated TOCLIENT_PLAYERPOS"
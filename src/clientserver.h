@@ -22,13 +22,16 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "utility.h"
 
-#define PROTOCOL_VERSION 3
+#define PROTOCOL_VERSION 4
 
 #define PROTOCOL_ID 0x4f457403
 
 #define PASSWORD_SIZE 28       // Maximum password length. Allows for
                                // base64-encoded SHA-1 (27+\0).
 
+// Flags of TOSERVER_INIT and TOCLIENT_INIT
+#define PROTOCOL_FLAG_COMPRESSION 0x01 // TOCLIENT_COMPRESSED is understood
+
 enum ToClientCommand
 {
 	TOCLIENT_INIT = 0x10,
@@ -40,6 +43,7 @@ enum ToClientCommand
 		[2] u8 deployed version
 		[3] v3s16 player's position + v3f(0,BS/2,0) floatToInt'd 
 		[12] u64 map seed (new as of 2011-02-27)
+		[20] u8 flags (PROTOCOL_FLAG_*) accepted by the server (optional)
 
 		NOTE: The position in here is deprecated; position is
 		      explicitly sent afterwards
@@ -244,6 +248,23 @@ enum ToClientCommand
 	TOCLIENT_CLAN_SPAWNPOINT = 0x3C,
 #endif
 
+	TOCLIENT_BLOCKDATA_DELTA = 0x3D,
+	/*
+		Changes to a block the client already has (protocol version 4)
+		[0] u16 command
+		[2] v3s16 blockpos
+		[8] block flags, changed nodes and metadata, see
+		    MapBlock::serializeDelta
+	*/
+
+	TOCLIENT_COMPRESSED = 0x3E,
+	/*
+		Another packet compressed with zlib. Only sent if the client
+		has set PROTOCOL_FLAG_COMPRESSION in TOSERVER_INIT.
+		[0] u16 command
+		[2] u32 size of the original packet
+		[6] zlib-compressed original packet, including its command
+	*/
 };
 
 enum ToServerCommand
@@ -257,6 +278,7 @@ enum ToServerCommand
 		[3] u8[20] player_name
 		[23] u8[28] password (new in some version)
 		[51] u16 client network protocol version (new in some version)
+		[53] u8 flags (PROTOCOL_FLAG_*) wanted by the client (optional)
 	*/
 
 	TOSERVER_INIT2 = 0x11,
@@ -26,6 +26,42 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 namespace con
 {
 
+/*
+	GatherBuffer
+*/
+
+GatherBuffer GatherBuffer::slice(u32 offset, u32 size) const
+{
+	assert(offset + size <= getSize());
+	GatherBuffer b;
+	b.m_data = m_data;
+	u32 header_size = getHeaderSize();
+	if(offset < header_size)
+	{
+		u32 n = size < header_size - offset ? size : header_size - offset;
+		memcpy(b.addHeader(n), &m_header[m_header_start + offset], n);
+		b.m_offset = m_offset;
+		b.m_size = size - n;
+	}
+	else
+	{
+		b.m_offset = m_offset + offset - header_size;
+		b.m_size = size;
+	}
+	return b;
+}
+
+SharedBuffer<u8> GatherBuffer::flatten() const
+{
+	SharedBuffer<u8> b(getSize());
+	u32 header_size = getHeaderSize();
+	if(header_size != 0)
+		memcpy(*b, getHeader(), header_size);
+	if(m_size != 0)
+		memcpy(&b[header_size], &m_data[m_offset], m_size);
+	return b;
+}
+
 BufferedPacket makePacket(Address &address, u8 *data, u32 datasize,
 		u32 protocol_id, u16 sender_peer_id, u8 channel)
 {
@@ -49,17 +85,32 @@ BufferedPacket makePacket(Address &address, SharedBuffer<u8> &data,
 			protocol_id, sender_peer_id, channel);
 }
 
+BufferedPacket makePacket(Address &address, const GatherBuffer &data,
+		u32 protocol_id, u16 sender_peer_id, u8 channel)
+{
+	// Only the headers are copied
+	BufferedPacket p = makePacket(address, (u8*)data.getHeader(),
+			data.getHeaderSize(), protocol_id, sender_peer_id, channel);
+	if(data.getPayloadSize() != 0)
+	{
+		p.payload = data.getPayloadBuffer();
+		p.payload_offset = data.getPayloadOffset();
+		p.payload_size = data.getPayloadSize();
+	}
+	return p;
+}
+
 SharedBuffer<u8> makeOriginalPacket(
 		SharedBuffer<u8> data)
 {
-	u32 header_size = 1;
-	u32 packet_size = data.getSize() + header_size;
-	SharedBuffer<u8> b(packet_size);
-
-	writeU8(&b[0], TYPE_ORIGINAL);
-
-	memcpy(&b[header_size], *data, data.getSize());
+	return makeOriginalPacket(GatherBuffer(data)).flatten();
+}
 
+GatherBuffer makeOriginalPacket(
+		const GatherBuffer &data)
+{
+	GatherBuffer b = data;
+	writeU8(b.addHeader(1), TYPE_ORIGINAL);
 	return b;
 }
 
@@ -68,44 +119,48 @@ core::list<SharedBuffer<u8> > makeSplitPacket(
 		u32 chunksize_max,
 		u16 seqnum)
 {
-	// Chunk packets, containing the TYPE_SPLIT header
+	core::list<GatherBuffer> gathered = makeSplitPacket(
+			GatherBuffer(data), chunksize_max, seqnum);
 	core::list<SharedBuffer<u8> > chunks;
+	for(core::list<GatherBuffer>::Iterator i = gathered.begin();
+			i != gathered.end(); i++)
+		chunks.push_back(i->flatten());
+	return chunks;
+}
+
+core::list<GatherBuffer> makeSplitPacket(
+		const GatherBuffer &data,
+		u32 chunksize_max,
+		u16 seqnum)
+{
+	// Chunk packets, containing the TYPE_SPLIT header
+	core::list<GatherBuffer> chunks;
 	
 	u32 chunk_header_size = 7;
 	u32 maximum_data_size = chunksize_max - chunk_header_size;
-	u32 start = 0;
-	u32 end = 0;
-	u32 chunk_num = 0;
-	do{
-		end = start + maximum_data_size - 1;
-		if(end > data.getSize() - 1)
-			end = data.getSize() - 1;
-		
-		u32 payload_size = end - start + 1;
-		u32 packet_size = chunk_header_size + payload_size;
+	u32 size = data.getSize();
+	u16 chunk_count = (size + maximum_data_size - 1) / maximum_data_size;
+	if(chunk_count == 0)
+		chunk_count = 1;
 
-		SharedBuffer<u8> chunk(packet_size);
-		
-		writeU8(&chunk[0], TYPE_SPLIT);
-		writeU16(&chunk[1], seqnum);
-		// [3] u16 chunk_count is written at next stage
-		writeU16(&chunk[5], chunk_num);
-		memcpy(&chunk[chunk_header_size], &data[start], payload_size);
+	u32 start = 0;
+	for(u16 chunk_num=0; chunk_num<chunk_count; chunk_num++)
+	{
+		u32 payload_size = size - start;
+		if(payload_size > maximum_data_size)
+			payload_size = maximum_data_size;
+
+		// The chunk refers to the data; only the header is written
+		GatherBuffer chunk = data.slice(start, payload_size);
+		u8 *header = chunk.addHeader(chunk_header_size);
+		writeU8(&header[0], TYPE_SPLIT);
+		writeU16(&header[1], seqnum);
+		writeU16(&header[3], chunk_count);
+		writeU16(&header[5], chunk_num);
 
 		chunks.push_back(chunk);
 		
-		start = end + 1;
-		chunk_num++;
-	}
-	while(end != data.getSize() - 1);
-
-	u16 chunk_count = chunks.getSize();
-
-	core::list<SharedBuffer<u8> >::Iterator i = chunks.begin();
-	for(; i != chunks.end(); i++)
-	{
-		// Write chunk_count
-		writeU16(&((*i)[3]), chunk_count);
+		start += payload_size;
 	}
 
 	return chunks;
@@ -116,8 +171,22 @@ core::list<SharedBuffer<u8> > makeAutoSplitPacket(
 		u32 chunksize_max,
 		u16 &split_seqnum)
 {
-	u32 original_header_size = 1;
+	core::list<GatherBuffer> gathered = makeAutoSplitPacket(
+			GatherBuffer(data), chunksize_max, split_seqnum);
 	core::list<SharedBuffer<u8> > list;
+	for(core::list<GatherBuffer>::Iterator i = gathered.begin();
+			i != gathered.end(); i++)
+		list.push_back(i->flatten());
+	return list;
+}
+
+core::list<GatherBuffer> makeAutoSplitPacket(
+		const GatherBuffer &data,
+		u32 chunksize_max,
+		u16 &split_seqnum)
+{
+	u32 original_header_size = 1;
+	core::list<GatherBuffer> list;
 	if(data.getSize() + original_header_size > chunksize_max)
 	{
 		list = makeSplitPacket(data, chunksize_max, split_seqnum);
@@ -135,21 +204,17 @@ SharedBuffer<u8> makeReliablePacket(
 		SharedBuffer<u8> data,
 		u16 seqnum)
 {
-	/*dstream<<"BEGIN SharedBuffer<u8> makeReliablePacket()"<<std::endl;
-	dstream<<"data.getSize()="<<data.getSize()<<", data[0]="
-			<<((unsigned int)data[0]&0xff)<<std::endl;*/
-	u32 header_size = 3;
-	u32 packet_size = data.getSize() + header_size;
-	SharedBuffer<u8> b(packet_size);
-
-	writeU8(&b[0], TYPE_RELIABLE);
-	writeU16(&b[1], seqnum);
-
-	memcpy(&b[header_size], *data, data.getSize());
+	return makeReliablePacket(GatherBuffer(data), seqnum).flatten();
+}
 
-	/*dstream<<"data.getSize()="<<data.getSize()<<", data[0]="
-			<<((unsigned int)data[0]&0xff)<<std::endl;*/
-	//dstream<<"END SharedBuffer<u8> makeReliablePacket()"<<std::endl;
+GatherBuffer makeReliablePacket(
+		const GatherBuffer &data,
+		u16 seqnum)
+{
+	GatherBuffer b = data;
+	u8 *header = b.addHeader(RELIABLE_HEADER_SIZE);
+	writeU8(&header[0], TYPE_RELIABLE);
+	writeU16(&header[1], seqnum);
 	return b;
 }
 
@@ -157,68 +222,120 @@ SharedBuffer<u8> makeReliablePacket(
 	ReliablePacketBuffer
 */
 
+#define RELIABLE_BUFFER_INITIAL_CAPACITY 32
+// Seqnums further apart than this can't be ordered
+#define RELIABLE_BUFFER_MAX_CAPACITY 32768
+
+ReliablePacketBuffer::ReliablePacketBuffer():
+	m_slots(NULL),
+	m_capacity(0),
+	m_size(0),
+	m_first(0),
+	m_last(0),
+	m_clock(0.0),
+	m_any_acked(false),
+	m_highest_acked(0),
+	m_loss_checked(0)
+{
+}
+ReliablePacketBuffer::~ReliablePacketBuffer()
+{
+	delete[] m_slots;
+}
 void ReliablePacketBuffer::print()
 {
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++)
+	if(empty())
+		return;
+	for(u16 s=m_first; ; s++)
 	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		dout_con<<s<<" ";
+		if(findSlot(s) != NULL)
+			dout_con<<s<<" ";
+		if(s == m_last)
+			break;
 	}
 }
 bool ReliablePacketBuffer::empty()
 {
-	return m_list.empty();
+	return m_size == 0;
 }
 u32 ReliablePacketBuffer::size()
 {
-	return m_list.getSize();
+	return m_size;
+}
+ReliablePacketBuffer::Slot * ReliablePacketBuffer::findSlot(u16 seqnum)
+{
+	if(empty())
+		return NULL;
+	Slot *slot = &m_slots[seqnum & (m_capacity - 1)];
+	if(slot->used == false || slot->seqnum != seqnum)
+		return NULL;
+	return slot;
+}
+BufferedPacket ReliablePacketBuffer::getPacket(Slot *slot)
+{
+	BufferedPacket p = slot->packet;
+	p.time = m_clock - slot->sent_at;
+	p.totaltime = m_clock - slot->buffered_at;
+	return p;
+}
+BufferedPacket ReliablePacketBuffer::removeSlot(Slot *slot)
+{
+	BufferedPacket p = getPacket(slot);
+	slot->used = false;
+	// Release the data
+	slot->packet = BufferedPacket();
+	m_size--;
+	if(empty())
+	{
+		// All queued send times are stale
+		m_send_times.clear();
+	}
+	else if(slot->seqnum == m_first)
+	{
+		// Skip to the next packet. Each seqnum is skipped only once.
+		do{
+			m_first++;
+		}while(m_slots[m_first & (m_capacity - 1)].used == false);
+	}
+	return p;
 }
-RPBSearchResult ReliablePacketBuffer::findPacket(u16 seqnum)
+void ReliablePacketBuffer::reallocate(u32 capacity)
 {
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++)
+	Slot *slots = new Slot[capacity];
+	for(u32 i=0; i<m_capacity; i++)
 	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		/*dout_con<<"findPacket(): finding seqnum="<<seqnum
-				<<", comparing to s="<<s<<std::endl;*/
-		if(s == seqnum)
-			break;
+		if(m_slots[i].used)
+			slots[m_slots[i].seqnum & (capacity - 1)] = m_slots[i];
 	}
-	return i;
+	delete[] m_slots;
+	m_slots = slots;
+	m_capacity = capacity;
 }
-RPBSearchResult ReliablePacketBuffer::notFound()
+bool ReliablePacketBuffer::isStale(const SendTime &t)
 {
-	return m_list.end();
+	Slot *slot = findSlot(t.seqnum);
+	return (slot == NULL || slot->sent_at != t.sent_at);
 }
 u16 ReliablePacketBuffer::getFirstSeqnum()
 {
 	if(empty())
 		throw NotFoundException("Buffer is empty");
-	BufferedPacket p = *m_list.begin();
-	return readU16(&p.data[BASE_HEADER_SIZE+1]);
+	return m_first;
 }
 BufferedPacket ReliablePacketBuffer::popFirst()
 {
 	if(empty())
 		throw NotFoundException("Buffer is empty");
-	BufferedPacket p = *m_list.begin();
-	core::list<BufferedPacket>::Iterator i = m_list.begin();
-	m_list.erase(i);
-	return p;
+	return removeSlot(findSlot(m_first));
 }
 BufferedPacket ReliablePacketBuffer::popSeqnum(u16 seqnum)
 {
-	RPBSearchResult r = findPacket(seqnum);
-	if(r == notFound()){
+	Slot *slot = findSlot(seqnum);
+	if(slot == NULL){
 		dout_con<<"Not found"<<std::endl;
 		throw NotFoundException("seqnum not found in buffer");
 	}
-	BufferedPacket p = *r;
-	m_list.erase(r);
-	return p;
+	return removeSlot(slot);
 }
 void ReliablePacketBuffer::insert(BufferedPacket &p)
 {
@@ -227,96 +344,169 @@ void ReliablePacketBuffer::insert(BufferedPacket &p)
 	assert(type == TYPE_RELIABLE);
 	u16 seqnum = readU16(&p.data[BASE_HEADER_SIZE+1]);
 
-	// Find the right place for the packet and insert it there
-
-	// If list is empty, just add it
-	if(m_list.empty())
+	// Find the seqnums the ring has to cover
+	u16 first = m_first;
+	u16 last = m_last;
+	if(empty())
 	{
-		m_list.push_back(p);
-		// Done.
-		return;
-	}
-	// Otherwise find the right place
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	// Find the first packet in the list which has a higher seqnum
-	for(; i != m_list.end(); i++){
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		if(s == seqnum){
-			throw AlreadyExistsException("Same seqnum in list");
-		}
-		if(seqnum_higher(s, seqnum)){
-			break;
-		}
+		first = seqnum;
+		last = seqnum;
 	}
-	// If we're at the end of the list, add the packet to the
-	// end of the list
-	if(i == m_list.end())
+	else if((u16)(seqnum - last) < RELIABLE_BUFFER_MAX_CAPACITY)
+		last = seqnum;
+	else if((u16)(first - seqnum) < RELIABLE_BUFFER_MAX_CAPACITY)
+		first = seqnum;
+	u32 span = (u32)(u16)(last - first) + 1;
+	if(span > RELIABLE_BUFFER_MAX_CAPACITY)
+		throw InvalidIncomingDataException("Seqnum too far from buffered ones");
+
+	if(findSlot(seqnum) != NULL)
+		throw AlreadyExistsException("Same seqnum in list");
+
+	if(span > m_capacity)
 	{
-		m_list.push_back(p);
-		// Done.
-		return;
+		u32 capacity = m_capacity == 0 ?
+				RELIABLE_BUFFER_INITIAL_CAPACITY : m_capacity;
+		while(capacity < span)
+			capacity *= 2;
+		reallocate(capacity);
 	}
-	// Insert before i
-	m_list.insert_before(i, p);
+	m_first = first;
+	m_last = last;
+
+	Slot *slot = &m_slots[seqnum & (m_capacity - 1)];
+	slot->used = true;
+	slot->seqnum = seqnum;
+	slot->packet = p;
+	slot->buffered_at = m_clock;
+	slot->sent_at = m_clock;
+	m_size++;
+
+	/*
+		Drop stale send times from the start, so that they don't pile up
+		in buffers which are never checked for timeouts
+	*/
+	while(m_send_times.empty() == false && isStale(m_send_times.front()))
+		m_send_times.pop_front();
+	SendTime t = {seqnum, m_clock};
+	m_send_times.push_back(t);
 }
 
 void ReliablePacketBuffer::incrementTimeouts(float dtime)
 {
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++){
-		i->time += dtime;
-		i->totaltime += dtime;
-	}
+	m_clock += dtime;
 }
 
 void ReliablePacketBuffer::resetTimedOuts(float timeout)
 {
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++){
-		if(i->time >= timeout)
-			i->time = 0.0;
+	/*
+		Move the timed out packets from the start of the send times
+		to the end. Count is fixed so that they aren't seen again.
+	*/
+	u32 count = m_send_times.size();
+	for(u32 i=0; i<count; i++)
+	{
+		SendTime t = m_send_times.front();
+		if(isStale(t) == false)
+		{
+			if(m_clock - t.sent_at < timeout)
+				break;
+			t.sent_at = m_clock;
+			findSlot(t.seqnum)->sent_at = m_clock;
+			m_send_times.pop_front();
+			m_send_times.push_back(t);
+			continue;
+		}
+		m_send_times.pop_front();
 	}
 }
 
 bool ReliablePacketBuffer::anyTotaltimeReached(float timeout)
 {
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++){
-		if(i->totaltime >= timeout)
-			return true;
-	}
-	return false;
+	if(empty())
+		return false;
+	return (m_clock - findSlot(m_first)->buffered_at >= timeout);
 }
 
 core::list<BufferedPacket> ReliablePacketBuffer::getTimedOuts(float timeout)
 {
 	core::list<BufferedPacket> timed_outs;
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++)
+	for(u32 i=0; i<m_send_times.size(); i++)
 	{
-		if(i->time >= timeout)
-			timed_outs.push_back(*i);
+		SendTime &t = m_send_times[i];
+		if(isStale(t))
+			continue;
+		// The rest have been sent later
+		if(m_clock - t.sent_at < timeout)
+			break;
+		timed_outs.push_back(getPacket(findSlot(t.seqnum)));
 	}
 	return timed_outs;
 }
 
+core::list<BufferedPacket> ReliablePacketBuffer::getPassedByAck(u16 seqnum)
+{
+	core::list<BufferedPacket> lost;
+	if(m_any_acked == false || (u16)(seqnum - m_highest_acked)
+			< RELIABLE_BUFFER_MAX_CAPACITY)
+		m_highest_acked = seqnum;
+	m_any_acked = true;
+	if(empty())
+		return lost;
+	// The ones before the first packet need no checking
+	if((u16)(m_loss_checked - m_first) >= RELIABLE_BUFFER_MAX_CAPACITY)
+		m_loss_checked = m_first;
+	for(;;)
+	{
+		u16 passed_by = m_highest_acked - m_loss_checked;
+		if(passed_by >= RELIABLE_BUFFER_MAX_CAPACITY
+				|| passed_by < FAST_RETRANSMIT_ACKS)
+			break;
+		Slot *slot = findSlot(m_loss_checked);
+		if(slot != NULL)
+		{
+			// Re-sent now; restart its timeout
+			slot->sent_at = m_clock;
+			SendTime t = {m_loss_checked, m_clock};
+			m_send_times.push_back(t);
+			lost.push_back(getPacket(slot));
+		}
+		m_loss_checked++;
+	}
+	return lost;
+}
+
 /*
 	IncomingSplitBuffer
 */
 
-IncomingSplitBuffer::~IncomingSplitBuffer()
+#define SPLIT_BUFFER_INITIAL_SLOTS 32
+
+// Releases the chunks but keeps the arrays allocated
+static void freeSplitPacket(IncomingSplitPacket *sp)
+{
+	for(u32 i=0; i<sp->chunk_count; i++)
+		sp->chunks[i] = SharedBuffer<u8>();
+	sp->used = false;
+}
+
+IncomingSplitBuffer::IncomingSplitBuffer():
+	m_count(0)
+{
+	reallocate(SPLIT_BUFFER_INITIAL_SLOTS);
+}
+void IncomingSplitBuffer::reallocate(u32 capacity)
 {
-	core::map<u16, IncomingSplitPacket*>::Iterator i;
-	i = m_buf.getIterator();
-	for(; i.atEnd() == false; i++)
+	core::array<IncomingSplitPacket> slots(capacity);
+	for(u32 i=0; i<capacity; i++)
+		slots.push_back(IncomingSplitPacket());
+	// Slots which don't collide in the old array won't in the new one
+	for(u32 i=0; i<m_slots.size(); i++)
 	{
-		delete i.getNode()->getValue();
+		if(m_slots[i].used)
+			slots[m_slots[i].seqnum & (capacity - 1)] = m_slots[i];
 	}
+	m_slots = slots;
 }
 /*
 	This will throw a GotSplitPacketException when a full
@@ -332,17 +522,45 @@ SharedBuffer<u8> IncomingSplitBuffer::insert(BufferedPacket &p, bool reliable)
 	u16 chunk_count = readU16(&p.data[BASE_HEADER_SIZE+3]);
 	u16 chunk_num = readU16(&p.data[BASE_HEADER_SIZE+5]);
 
-	// Add if doesn't exist
-	if(m_buf.find(seqnum) == NULL)
+	IncomingSplitPacket *sp = &m_slots[seqnum & (m_slots.size() - 1)];
+	if(sp->used && sp->seqnum != seqnum)
 	{
-		IncomingSplitPacket *sp = new IncomingSplitPacket();
+		if(sp->reliable == false)
+		{
+			dout_con<<"NOTE: Dropping incomplete unreliable split packet"
+					<<" to make room for another one"<<std::endl;
+			freeSplitPacket(sp);
+			m_count--;
+		}
+		else
+		{
+			// Reliable ones are kept; make room for both
+			do{
+				reallocate(m_slots.size() * 2);
+				sp = &m_slots[seqnum & (m_slots.size() - 1)];
+			}while(sp->used && sp->seqnum != seqnum);
+		}
+	}
+
+	// Take the slot if it is free
+	if(sp->used == false)
+	{
+		sp->used = true;
+		sp->seqnum = seqnum;
 		sp->chunk_count = chunk_count;
+		sp->received_count = 0;
+		sp->totalsize = 0;
+		sp->time = 0.0;
 		sp->reliable = reliable;
-		m_buf[seqnum] = sp;
+		while(sp->chunks.size() < chunk_count)
+			sp->chunks.push_back(SharedBuffer<u8>());
+		while(sp->received.size() < chunk_count)
+			sp->received.push_back(false);
+		for(u32 i=0; i<chunk_count; i++)
+			sp->received[i] = false;
+		m_count++;
 	}
 	
-	IncomingSplitPacket *sp = m_buf[seqnum];
-	
 	// TODO: These errors should be thrown or something? Dunno.
 	if(chunk_count != sp->chunk_count)
 		derr_con<<"Connection: WARNING: chunk_count="<<chunk_count
@@ -353,8 +571,11 @@ SharedBuffer<u8> IncomingSplitBuffer::insert(BufferedPacket &p, bool reliable)
 				<<" != sp->reliable="<<sp->reliable
 				<<std::endl;
 
+	if(chunk_num >= sp->chunk_count)
+		throw InvalidIncomingDataException("Chunk number out of range");
+
 	// If chunk already exists, cancel
-	if(sp->chunks.find(chunk_num) != NULL)
+	if(sp->received[chunk_num])
 		throw AlreadyExistsException("Chunk already in buffer");
 	
 	// Cut chunk data out of packet
@@ -364,62 +585,51 @@ SharedBuffer<u8> IncomingSplitBuffer::insert(BufferedPacket &p, bool reliable)
 	
 	// Set chunk data in buffer
 	sp->chunks[chunk_num] = chunkdata;
+	sp->received[chunk_num] = true;
+	sp->received_count++;
+	sp->totalsize += chunkdatasize;
 	
 	// If not all chunks are received, return empty buffer
 	if(sp->allReceived() == false)
 		return SharedBuffer<u8>();
 
-	// Calculate total size
-	u32 totalsize = 0;
-	core::map<u16, SharedBuffer<u8> >::Iterator i;
-	i = sp->chunks.getIterator();
-	for(; i.atEnd() == false; i++)
-	{
-		totalsize += i.getNode()->getValue().getSize();
-	}
-	
-	SharedBuffer<u8> fulldata(totalsize);
+	SharedBuffer<u8> fulldata(sp->totalsize);
 
 	// Copy chunks to data buffer
 	u32 start = 0;
 	for(u32 chunk_i=0; chunk_i<sp->chunk_count;
 			chunk_i++)
 	{
-		SharedBuffer<u8> buf = sp->chunks[chunk_i];
-		u16 chunkdatasize = buf.getSize();
+		SharedBuffer<u8> &buf = sp->chunks[chunk_i];
+		u32 chunkdatasize = buf.getSize();
 		memcpy(&fulldata[start], *buf, chunkdatasize);
-		start += chunkdatasize;;
+		start += chunkdatasize;
 	}
 
-	// Remove sp from buffer
-	m_buf.remove(seqnum);
-	delete sp;
+	// Free the slot for the next packet
+	freeSplitPacket(sp);
+	m_count--;
 
 	return fulldata;
 }
 void IncomingSplitBuffer::removeUnreliableTimedOuts(float dtime, float timeout)
 {
-	core::list<u16> remove_queue;
-	core::map<u16, IncomingSplitPacket*>::Iterator i;
-	i = m_buf.getIterator();
-	for(; i.atEnd() == false; i++)
+	if(m_count == 0)
+		return;
+	for(u32 i=0; i<m_slots.size(); i++)
 	{
-		IncomingSplitPacket *p = i.getNode()->getValue();
+		IncomingSplitPacket *sp = &m_slots[i];
 		// Reliable ones are not removed by timeout
-		if(p->reliable == true)
+		if(sp->used == false || sp->reliable == true)
 			continue;
-		p->time += dtime;
-		if(p->time >= timeout)
-			remove_queue.push_back(i.getNode()->getKey());
-	}
-	core::list<u16>::Iterator j;
-	j = remove_queue.begin();
-	for(; j != remove_queue.end(); j++)
-	{
-		dout_con<<"NOTE: Removing timed out unreliable split packet"
-				<<std::endl;
-		delete m_buf[*j];
-		m_buf.remove(*j);
+		sp->time += dtime;
+		if(sp->time >= timeout)
+		{
+			dout_con<<"NOTE: Removing timed out unreliable split packet"
+					<<std::endl;
+			freeSplitPacket(sp);
+			m_count--;
+		}
 	}
 }
 
@@ -432,11 +642,48 @@ Channel::Channel()
 	next_outgoing_seqnum = SEQNUM_INITIAL;
 	next_incoming_seqnum = SEQNUM_INITIAL;
 	next_outgoing_split_seqnum = SEQNUM_INITIAL;
+	cwnd = CONGESTION_WINDOW_INITIAL;
+	ssthresh = CONGESTION_WINDOW_MAX;
+	in_recovery = false;
+	recovery_seqnum = SEQNUM_INITIAL;
+	reliables_sent = 0;
+	reliables_timed_out = 0;
+	reliables_fast_resent = 0;
+	loss_events = 0;
 }
 Channel::~Channel()
 {
 }
 
+void Channel::ackReceived(u16 seqnum)
+{
+	if(in_recovery && seqnum_higher(recovery_seqnum, seqnum) == false)
+		in_recovery = false;
+
+	if(cwnd < ssthresh)
+		cwnd += 1.0;
+	else
+		cwnd += 1.0 / cwnd;
+	if(cwnd > CONGESTION_WINDOW_MAX)
+		cwnd = CONGESTION_WINDOW_MAX;
+}
+
+void Channel::packetLost(bool timeout)
+{
+	// The packets of the last decreased window may still be lost
+	if(in_recovery && timeout == false)
+		return;
+
+	loss_events++;
+	ssthresh = cwnd / 2;
+	if(ssthresh < CONGESTION_WINDOW_MIN)
+		ssthresh = CONGESTION_WINDOW_MIN;
+	cwnd = timeout ? CONGESTION_WINDOW_MIN : ssthresh;
+
+	in_recovery = true;
+	recovery_seqnum = next_outgoing_seqnum;
+}
+
 /*
 	Peer
 */
@@ -461,20 +708,6 @@ Peer::~Peer()
 
 void Peer::reportRTT(float rtt)
 {
-	if(rtt >= 0.0){
-		if(rtt < 0.01){
-			if(m_max_packets_per_second < 100)
-				m_max_packets_per_second += 10;
-		} else if(rtt < 0.2){
-			if(m_max_packets_per_second < 100)
-				m_max_packets_per_second += 2;
-		} else {
-			m_max_packets_per_second *= 0.8;
-			if(m_max_packets_per_second < 10)
-				m_max_packets_per_second = 10;
-		}
-	}
-
 	if(rtt < -0.999)
 	{}
 	else if(avg_rtt < 0.0)
@@ -499,6 +732,26 @@ void Peer::reportRTT(float rtt)
 		timeout = RESEND_TIMEOUT_MAX;
 	resend_timeout = timeout;
 }
+
+float Peer::getPacketRate()
+{
+	float window = 0;
+	for(u16 i=0; i<CHANNEL_COUNT; i++)
+		window += channels[i].cwnd;
+
+	float rtt = avg_rtt;
+	if(rtt < 0.0)
+		rtt = PACING_RTT_UNKNOWN;
+	if(rtt < PACING_RTT_MIN)
+		rtt = PACING_RTT_MIN;
+
+	float rate = 2 * window / rtt;
+	if(rate < PACKETS_PER_SECOND_MIN)
+		rate = PACKETS_PER_SECOND_MIN;
+	if(rate > PACKETS_PER_SECOND_MAX)
+		rate = PACKETS_PER_SECOND_MAX;
+	return rate;
+}
 				
 /*
 	Connection
@@ -509,6 +762,8 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout):
 	m_max_packet_size(max_packet_size),
 	m_timeout(timeout),
 	m_peer_id(0),
+	m_send_batch_size(0),
+	m_receive_buffer(RECEIVE_BATCH_SIZE * RECEIVE_DATAGRAM_MAXSIZE),
 	m_bc_peerhandler(NULL),
 	m_bc_receive_timeout(0),
 	m_indentation(0)
@@ -524,6 +779,8 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 	m_max_packet_size(max_packet_size),
 	m_timeout(timeout),
 	m_peer_id(0),
+	m_send_batch_size(0),
+	m_receive_buffer(RECEIVE_BATCH_SIZE * RECEIVE_DATAGRAM_MAXSIZE),
 	m_bc_peerhandler(peerhandler),
 	m_bc_receive_timeout(0),
 	m_indentation(0)
@@ -571,8 +828,11 @@ void * Connection::Thread()
 		}
 
 		send(dtime);
+		flushSends();
 
 		receive();
+		// ACKs and replies
+		flushSends();
 		
 		END_DEBUG_EXCEPTION_HANDLER(derr_con);
 	}
@@ -627,6 +887,7 @@ void Connection::send(float dtime)
 			j.atEnd() == false; j++)
 	{
 		Peer *peer = j.getNode()->getValue();
+		peer->m_max_packets_per_second = peer->getPacketRate();
 		peer->m_sendtime_accu += dtime;
 		peer->m_num_sent = 0;
 		peer->m_max_num_sent = peer->m_sendtime_accu *
@@ -638,7 +899,9 @@ void Connection::send(float dtime)
 		Peer *peer = getPeerNoEx(packet.peer_id);
 		if(!peer)
 			continue;
-		if(peer->channels[packet.channelnum].outgoing_reliables.size() >= 5){
+		Channel *channel = &peer->channels[packet.channelnum];
+		if(packet.reliable &&
+				channel->outgoing_reliables.size() >= channel->cwnd){
 			postponed_packets.push_back(packet);
 		} else if(peer->m_num_sent < peer->m_max_num_sent){
 			rawSendAsPacket(packet.peer_id, packet.channelnum,
@@ -667,11 +930,10 @@ void Connection::send(float dtime)
 void Connection::receive()
 {
 	u32 datasize = 100000;
-	// TODO: We can not know how many layers of header there are.
-	// For now, just assume there are no other than the base headers.
-	u32 packet_maxsize = datasize + BASE_HEADER_SIZE;
-	SharedBuffer<u8> packetdata(packet_maxsize);
-
+	
+	UDPDatagram datagrams[RECEIVE_BATCH_SIZE];
+	int datagram_count = 0;
+	int datagram_i = 0;
 	bool single_wait_done = false;
 	
 	for(;;)
@@ -690,25 +952,36 @@ void Connection::receive()
 			}
 		}
 		
-		if(single_wait_done){
-			if(m_socket.WaitData(0) == false)
+		/* Get the next batch of datagrams when this is processed */
+		if(datagram_i == datagram_count)
+		{
+			for(int i=0; i<RECEIVE_BATCH_SIZE; i++)
+			{
+				datagrams[i].data = &m_receive_buffer[
+						i * RECEIVE_DATAGRAM_MAXSIZE];
+				datagrams[i].size = RECEIVE_DATAGRAM_MAXSIZE;
+			}
+			// Wait only for the first batch
+			datagram_count = m_socket.ReceiveMany(datagrams,
+					RECEIVE_BATCH_SIZE, !single_wait_done);
+			datagram_i = 0;
+			single_wait_done = true;
+			if(datagram_count == 0)
 				break;
 		}
-		
-		single_wait_done = true;
 
-		Address sender;
-		s32 received_size = m_socket.Receive(sender, *packetdata, packet_maxsize);
+		Address sender = datagrams[datagram_i].address;
+		u8 *packetdata = (u8*)datagrams[datagram_i].data;
+		s32 received_size = datagrams[datagram_i].size;
+		datagram_i++;
 
-		if(received_size < 0)
-			break;
 		if(received_size < BASE_HEADER_SIZE)
 			continue;
 		if(readU32(&packetdata[0]) != m_protocol_id)
 			continue;
 		
-		u16 peer_id = readPeerId(*packetdata);
-		u8 channelnum = readChannel(*packetdata);
+		u16 peer_id = readPeerId(packetdata);
+		u8 channelnum = readChannel(packetdata);
 		if(channelnum > CHANNEL_COUNT-1){
 			PrintInfo(derr_con);
 			derr_con<<"Receive(): Invalid channel "<<channelnum<<std::endl;
@@ -932,6 +1205,12 @@ void Connection::runTimeouts(float dtime)
 
 			channel->outgoing_reliables.resetTimedOuts(resend_timeout);
 
+			if(timed_outs.empty() == false)
+			{
+				channel->packetLost(true);
+				channel->reliables_timed_out += timed_outs.size();
+			}
+
 			j = timed_outs.begin();
 			for(; j != timed_outs.end(); j++)
 			{
@@ -1039,7 +1318,7 @@ void Connection::disconnect()
 	}
 }
 
-void Connection::sendToAll(u8 channelnum, SharedBuffer<u8> data, bool reliable)
+void Connection::sendToAll(u8 channelnum, GatherBuffer data, bool reliable)
 {
 	core::map<u16, Peer*>::Iterator j;
 	j = m_peers.getIterator();
@@ -1051,7 +1330,7 @@ void Connection::sendToAll(u8 channelnum, SharedBuffer<u8> data, bool reliable)
 }
 
 void Connection::send(u16 peer_id, u8 channelnum,
-		SharedBuffer<u8> data, bool reliable)
+		GatherBuffer data, bool reliable)
 {
 	dout_con<<getDesc()<<" sending to peer_id="<<peer_id<<std::endl;
 
@@ -1066,29 +1345,27 @@ void Connection::send(u16 peer_id, u8 channelnum,
 	if(reliable)
 		chunksize_max -= RELIABLE_HEADER_SIZE;
 
-	core::list<SharedBuffer<u8> > originals;
+	core::list<GatherBuffer> originals;
 	originals = makeAutoSplitPacket(data, chunksize_max,
 			channel->next_outgoing_split_seqnum);
 	
-	core::list<SharedBuffer<u8> >::Iterator i;
+	core::list<GatherBuffer>::Iterator i;
 	i = originals.begin();
 	for(; i != originals.end(); i++)
 	{
-		SharedBuffer<u8> original = *i;
-		
-		sendAsPacket(peer_id, channelnum, original, reliable);
+		sendAsPacket(peer_id, channelnum, *i, reliable);
 	}
 }
 
 void Connection::sendAsPacket(u16 peer_id, u8 channelnum,
-		SharedBuffer<u8> data, bool reliable)
+		GatherBuffer data, bool reliable)
 {
 	OutgoingPacket packet(peer_id, channelnum, data, reliable);
 	m_outgoing_queue.push_back(packet);
 }
 
 void Connection::rawSendAsPacket(u16 peer_id, u8 channelnum,
-		SharedBuffer<u8> data, bool reliable)
+		GatherBuffer data, bool reliable)
 {
 	Peer *peer = getPeerNoEx(peer_id);
 	if(!peer)
@@ -1100,7 +1377,7 @@ void Connection::rawSendAsPacket(u16 peer_id, u8 channelnum,
 		u16 seqnum = channel->next_outgoing_seqnum;
 		channel->next_outgoing_seqnum++;
 
-		SharedBuffer<u8> reliable = makeReliablePacket(data, seqnum);
+		GatherBuffer reliable = makeReliablePacket(data, seqnum);
 
 		// Add base headers and make a packet
 		BufferedPacket p = makePacket(peer->address, reliable,
@@ -1109,6 +1386,7 @@ void Connection::rawSendAsPacket(u16 peer_id, u8 channelnum,
 		try{
 			// Buffer the packet
 			channel->outgoing_reliables.insert(p);
+			channel->reliables_sent++;
 		}
 		catch(AlreadyExistsException &e)
 		{
@@ -1135,12 +1413,36 @@ void Connection::rawSendAsPacket(u16 peer_id, u8 channelnum,
 
 void Connection::rawSend(const BufferedPacket &packet)
 {
-	try{
-		m_socket.Send(packet.address, *packet.data, packet.data.getSize());
-	} catch(SendFailedException &e){
-		derr_con<<"Connection::rawSend(): SendFailedException: "
-				<<packet.address.serializeString()<<std::endl;
+	if(m_send_batch_size == SEND_BATCH_SIZE)
+		flushSends();
+	m_send_batch[m_send_batch_size++] = packet;
+}
+
+void Connection::flushSends()
+{
+	if(m_send_batch_size == 0)
+		return;
+	UDPDatagram datagrams[SEND_BATCH_SIZE];
+	for(u32 i=0; i<m_send_batch_size; i++)
+	{
+		datagrams[i].address = m_send_batch[i].address;
+		BufferedPacket &p = m_send_batch[i];
+		datagrams[i].data = *p.data;
+		datagrams[i].size = p.data.getSize();
+		// The payload is gathered by the socket
+		datagrams[i].tail = p.payload_size == 0 ? NULL
+				: &p.payload[p.payload_offset];
+		datagrams[i].tail_size = p.payload_size;
 	}
+	int sent = m_socket.SendMany(datagrams, m_send_batch_size);
+	if(sent != (int)m_send_batch_size)
+		derr_con<<"Connection::flushSends(): Failed to send "
+				<<(m_send_batch_size - sent)<<" of "
+				<<m_send_batch_size<<" packets"<<std::endl;
+	// Release the data
+	for(u32 i=0; i<m_send_batch_size; i++)
+		m_send_batch[i] = BufferedPacket();
+	m_send_batch_size = 0;
 }
 
 Peer* Connection::getPeer(u16 peer_id)
@@ -1293,6 +1595,24 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 				Peer *peer = getPeer(peer_id);
 				peer->reportRTT(rtt);
 
+				channel->ackReceived(seqnum);
+
+				// Re-send the packets this one has passed too often
+				core::list<BufferedPacket> lost =
+						channel->outgoing_reliables.getPassedByAck(seqnum);
+				if(lost.empty() == false)
+					channel->packetLost(false);
+				for(core::list<BufferedPacket>::Iterator
+						i = lost.begin(); i != lost.end(); i++)
+				{
+					PrintInfo(derr_con);
+					derr_con<<"RE-SENDING lost RELIABLE, seqnum="
+							<<readU16(&(i->data[BASE_HEADER_SIZE+1]))
+							<<" (acked "<<seqnum<<")"<<std::endl;
+					rawSend(*i);
+					channel->reliables_fast_resent++;
+				}
+
 				//PrintInfo(dout_con);
 				//dout_con<<"RTT = "<<rtt<<std::endl;
 
@@ -1428,6 +1748,15 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 		//DEBUG
 		//assert(channel->incoming_reliables.size() < 100);
 
+		/*
+			Senders don't get further ahead than their congestion window.
+			Not ACKing the packet makes a legitimate sender re-send it.
+		*/
+		if(is_future_packet && (u16)(seqnum - channel->next_incoming_seqnum)
+				>= RELIABLE_INCOMING_WINDOW)
+			throw InvalidIncomingDataException(
+					"Reliable packet too far ahead");
+
 		// Send a CONTROLTYPE_ACK
 		SharedBuffer<u8> reply(4);
 		writeU8(&reply[0], TYPE_CONTROL);
@@ -1536,7 +1865,15 @@ ConnectionEvent Connection::waitEvent(u32 timeout_ms)
 
 void Connection::putCommand(ConnectionCommand &c)
 {
-	m_command_queue.push_back(c);
+	/*
+		The reference counts of the data are not thread safe. The data
+		was copied for the command, so after c lets go of it, only the
+		connection thread refers to it. Do that while the queue is
+		locked.
+	*/
+	JMutexAutoLock lock(m_command_queue.getMutex());
+	m_command_queue.getList().push_back(c);
+	c.data = SharedBuffer<u8>();
 }
 
 void Connection::Serve(unsigned short port)
@@ -1606,7 +1943,8 @@ u32 Connection::Receive(u16 &peer_id, SharedBuffer<u8> &data)
 	throw NoIncomingDataException("No incoming data");
 }
 
-void Connection::SendToAll(u8 channelnum, SharedBuffer<u8> data, bool reliable)
+void Connection::SendToAll(u8 channelnum, const GatherBuffer &data,
+		bool reliable)
 {
 	assert(channelnum < CHANNEL_COUNT);
 
@@ -1616,7 +1954,7 @@ void Connection::SendToAll(u8 channelnum, SharedBuffer<u8> data, bool reliable)
 }
 
 void Connection::Send(u16 peer_id, u8 channelnum,
-		SharedBuffer<u8> data, bool reliable)
+		const GatherBuffer &data, bool reliable)
 {
 	assert(channelnum < CHANNEL_COUNT);
 
@@ -1654,6 +1992,29 @@ void Connection::PrintInfo(std::ostream &out)
 	out<<getDesc()<<": ";
 }
 
+void Connection::PrintInfo(std::ostream &out, u16 peer_id)
+{
+	JMutexAutoLock peerlock(m_peers_mutex);
+	Peer *peer = getPeerNoEx(peer_id);
+	if(peer == NULL)
+		return;
+	out<<"Peer "<<peer_id<<": avg_rtt="<<peer->avg_rtt
+			<<", resend_timeout="<<peer->resend_timeout
+			<<", packets/s="<<peer->m_max_packets_per_second<<std::endl;
+	for(u16 i=0; i<CHANNEL_COUNT; i++)
+	{
+		Channel *channel = &peer->channels[i];
+		out<<"  channel "<<i<<": cwnd="<<channel->cwnd
+				<<", ssthresh="<<channel->ssthresh
+				<<", in_flight="<<channel->outgoing_reliables.size()
+				<<", sent="<<channel->reliables_sent
+				<<", timed_out="<<channel->reliables_timed_out
+				<<", fast_resent="<<channel->reliables_fast_resent
+				<<", loss_events="<<channel->loss_events
+				<<std::endl;
+	}
+}
+
 void Connection::PrintInfo()
 {
 	PrintInfo(dout_con);
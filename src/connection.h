@@ -109,23 +109,130 @@ inline u8 readChannel(u8 *packetdata)
 }
 
 #define SEQNUM_MAX 65535
+/*
+	Seqnums wrap around; higher is ahead of lower if it is less than half
+	of the range after it. An old seqnum just before a wrap-around must not
+	count as one in the future.
+*/
 inline bool seqnum_higher(u16 higher, u16 lower)
 {
-	if(lower > higher && lower - higher > SEQNUM_MAX/2){
-		return true;
-	}
-	return (higher > lower);
+	u16 d = higher - lower;
+	return (d != 0 && d <= SEQNUM_MAX/2);
 }
 
+/*
+	Data of an outgoing packet: headers in a room of their own,
+	followed by a slice of a reference counted buffer. Headers are
+	added in front without copying the data after them, and the chunks
+	of a split packet are slices of the same buffer. The socket gathers
+	the two parts when sending.
+*/
+#define GATHER_HEADER_ROOM 32
+
+class GatherBuffer
+{
+public:
+	GatherBuffer():
+		m_header_start(GATHER_HEADER_ROOM),
+		m_offset(0),
+		m_size(0)
+	{}
+	GatherBuffer(SharedBuffer<u8> data):
+		m_header_start(GATHER_HEADER_ROOM),
+		m_data(data),
+		m_offset(0),
+		m_size(data.getSize())
+	{}
+	GatherBuffer(SharedBuffer<u8> data, u32 offset, u32 size):
+		m_header_start(GATHER_HEADER_ROOM),
+		m_data(data),
+		m_offset(offset),
+		m_size(size)
+	{
+		assert(offset + size <= data.getSize());
+	}
+	GatherBuffer(const GatherBuffer &other)
+	{
+		*this = other;
+	}
+	// Copies only the used part of the header room
+	GatherBuffer & operator=(const GatherBuffer &other)
+	{
+		m_header_start = other.m_header_start;
+		memcpy(&m_header[m_header_start], &other.m_header[m_header_start],
+				GATHER_HEADER_ROOM - m_header_start);
+		m_data = other.m_data;
+		m_offset = other.m_offset;
+		m_size = other.m_size;
+		return *this;
+	}
+	// Returns room for size bytes of headers in front of the current ones
+	u8 * addHeader(u32 size)
+	{
+		assert(size <= m_header_start);
+		m_header_start -= size;
+		return &m_header[m_header_start];
+	}
+	const u8 * getHeader() const
+	{
+		return &m_header[m_header_start];
+	}
+	u32 getHeaderSize() const
+	{
+		return GATHER_HEADER_ROOM - m_header_start;
+	}
+	SharedBuffer<u8> getPayloadBuffer() const
+	{
+		return m_data;
+	}
+	u32 getPayloadOffset() const
+	{
+		return m_offset;
+	}
+	u32 getPayloadSize() const
+	{
+		return m_size;
+	}
+	u32 getSize() const
+	{
+		return getHeaderSize() + m_size;
+	}
+	// size bytes from offset, including the headers in that range
+	GatherBuffer slice(u32 offset, u32 size) const;
+	// Copies all of the data into one buffer
+	SharedBuffer<u8> flatten() const;
+
+private:
+	u8 m_header[GATHER_HEADER_ROOM];
+	u32 m_header_start;
+	SharedBuffer<u8> m_data;
+	u32 m_offset;
+	u32 m_size;
+};
+
 struct BufferedPacket
 {
 	BufferedPacket(u8 *a_data, u32 a_size):
-		data(a_data, a_size), time(0.0), totaltime(0.0)
+		data(a_data, a_size), payload_offset(0), payload_size(0),
+		time(0.0), totaltime(0.0)
 	{}
 	BufferedPacket(u32 a_size):
-		data(a_size), time(0.0), totaltime(0.0)
+		data(a_size), payload_offset(0), payload_size(0),
+		time(0.0), totaltime(0.0)
+	{}
+	BufferedPacket():
+		payload_offset(0), payload_size(0),
+		time(0.0), totaltime(0.0)
 	{}
 	SharedBuffer<u8> data; // Data of the packet, including headers
+	/*
+		If payload_size != 0, data has only the headers and the rest
+		of the packet is a slice of payload, shared with other packets.
+		Only outgoing packets are made like this.
+	*/
+	SharedBuffer<u8> payload;
+	u32 payload_offset;
+	u32 payload_size;
 	float time; // Seconds from buffering the packet or re-sending
 	float totaltime; // Seconds from buffering the packet
 	Address address; // Sender or destination
@@ -136,16 +243,30 @@ BufferedPacket makePacket(Address &address, u8 *data, u32 datasize,
 		u32 protocol_id, u16 sender_peer_id, u8 channel);
 BufferedPacket makePacket(Address &address, SharedBuffer<u8> &data,
 		u32 protocol_id, u16 sender_peer_id, u8 channel);
+// The payload of data is left in place
+BufferedPacket makePacket(Address &address, const GatherBuffer &data,
+		u32 protocol_id, u16 sender_peer_id, u8 channel);
+
+/*
+	These have a version for GatherBuffers, which adds the headers
+	without copying the data.
+*/
 
 // Add the TYPE_ORIGINAL header to the data
 SharedBuffer<u8> makeOriginalPacket(
 		SharedBuffer<u8> data);
+GatherBuffer makeOriginalPacket(
+		const GatherBuffer &data);
 
 // Split data in chunks and add TYPE_SPLIT headers to them
 core::list<SharedBuffer<u8> > makeSplitPacket(
 		SharedBuffer<u8> data,
 		u32 chunksize_max,
 		u16 seqnum);
+core::list<GatherBuffer> makeSplitPacket(
+		const GatherBuffer &data,
+		u32 chunksize_max,
+		u16 seqnum);
 
 // Depending on size, make a TYPE_ORIGINAL or TYPE_SPLIT packet
 // Increments split_seqnum if a split packet is made
@@ -153,28 +274,44 @@ core::list<SharedBuffer<u8> > makeAutoSplitPacket(
 		SharedBuffer<u8> data,
 		u32 chunksize_max,
 		u16 &split_seqnum);
+core::list<GatherBuffer> makeAutoSplitPacket(
+		const GatherBuffer &data,
+		u32 chunksize_max,
+		u16 &split_seqnum);
 
 // Add the TYPE_RELIABLE header to the data
 SharedBuffer<u8> makeReliablePacket(
 		SharedBuffer<u8> data,
 		u16 seqnum);
+GatherBuffer makeReliablePacket(
+		const GatherBuffer &data,
+		u16 seqnum);
 
 struct IncomingSplitPacket
 {
-	IncomingSplitPacket()
-	{
-		time = 0.0;
-		reliable = false;
-	}
-	// Key is chunk number, value is data without headers
-	core::map<u16, SharedBuffer<u8> > chunks;
+	IncomingSplitPacket():
+		used(false),
+		seqnum(0),
+		chunk_count(0),
+		received_count(0),
+		totalsize(0),
+		time(0.0),
+		reliable(false)
+	{}
+	bool used; // If false, the slot is free
+	u16 seqnum;
+	// Index is chunk number, value is data without headers
+	core::array<SharedBuffer<u8> > chunks;
+	core::array<bool> received;
 	u32 chunk_count;
+	u32 received_count;
+	u32 totalsize; // Size of the received chunks
 	float time; // Seconds from adding
 	bool reliable; // If true, isn't deleted on timeout
 
 	bool allReceived()
 	{
-		return (chunks.size() == chunk_count);
+		return (received_count == chunk_count);
 	}
 };
 
@@ -264,32 +401,123 @@ with a buffer in the receiving and transmitting end.
 #define SEQNUM_INITIAL 65500
 
 /*
-	A buffer which stores reliable packets and sorts them internally
-	for fast access to the smallest one.
+	Congestion control of the RELIABLE packets of a channel, see Channel.
+	Windows are in packets.
+*/
+#define CONGESTION_WINDOW_INITIAL 5
+#define CONGESTION_WINDOW_MIN 2
+#define CONGESTION_WINDOW_MAX 256
+/*
+	Incoming RELIABLE packets further than this ahead of the next expected
+	seqnum are dropped without an ACK, so that a single bogus seqnum can't
+	grow the incoming buffer of a channel to its maximum capacity.
+*/
+#define RELIABLE_INCOMING_WINDOW 1024
+// A packet is re-sent when this many packets sent after it are ACKed
+#define FAST_RETRANSMIT_ACKS 3
+/*
+	All packets to a peer are paced to send the congestion windows in
+	half a round trip. Round trips shorter than the minimum are rounded
+	up to it.
+*/
+#define PACING_RTT_MIN 0.01
+#define PACING_RTT_UNKNOWN 0.5
+#define PACKETS_PER_SECOND_MIN 10
+#define PACKETS_PER_SECOND_MAX 2000
+
+/*
+	Datagrams are moved to and from the socket in batches of at most
+	this many, to save system calls.
 */
+#define SEND_BATCH_SIZE 64
+#define RECEIVE_BATCH_SIZE 16
+// Largest datagram that can be received
+#define RECEIVE_DATAGRAM_MAXSIZE 65536
 
-typedef core::list<BufferedPacket>::Iterator RPBSearchResult;
+/*
+	A buffer which stores reliable packets in a ring indexed by seqnum.
+	Inserting, finding and removing a packet are O(1); the ring grows
+	in powers of two to cover the seqnums between the first and the
+	last packet.
+
+	Times are kept relative to a clock advanced by incrementTimeouts().
+	Packets are also queued in the order they were (re-)sent, so that
+	timed out ones are found from the start of that queue without
+	looking at the others.
+*/
 
 class ReliablePacketBuffer
 {
 public:
+	ReliablePacketBuffer();
+	~ReliablePacketBuffer();
 	
 	void print();
 	bool empty();
 	u32 size();
-	RPBSearchResult findPacket(u16 seqnum);
-	RPBSearchResult notFound();
 	u16 getFirstSeqnum();
 	BufferedPacket popFirst();
 	BufferedPacket popSeqnum(u16 seqnum);
 	void insert(BufferedPacket &p);
 	void incrementTimeouts(float dtime);
 	void resetTimedOuts(float timeout);
+	/*
+		Checks the first packet only; packets are expected to be
+		inserted in seqnum order, as outgoing ones are.
+	*/
 	bool anyTotaltimeReached(float timeout);
 	core::list<BufferedPacket> getTimedOuts(float timeout);
+	/*
+		Counts an ACK of seqnum for the packets sent before it.
+		Returns the packets that are FAST_RETRANSMIT_ACKS or more
+		behind the highest ACKed seqnum, which are probably lost.
+		Each packet is returned only once.
+	*/
+	core::list<BufferedPacket> getPassedByAck(u16 seqnum);
 
 private:
-	core::list<BufferedPacket> m_list;
+	struct Slot
+	{
+		Slot():
+			used(false),
+			seqnum(0),
+			buffered_at(0.0),
+			sent_at(0.0)
+		{}
+		bool used;
+		u16 seqnum;
+		BufferedPacket packet;
+		double buffered_at;
+		double sent_at;
+	};
+	struct SendTime
+	{
+		u16 seqnum;
+		double sent_at;
+	};
+
+	Slot * findSlot(u16 seqnum);
+	BufferedPacket getPacket(Slot *slot);
+	BufferedPacket removeSlot(Slot *slot);
+	void reallocate(u32 capacity);
+	// True if the packet has been removed or re-sent since t was queued
+	bool isStale(const SendTime &t);
+
+	// Not copyable
+	ReliablePacketBuffer(const ReliablePacketBuffer &);
+	ReliablePacketBuffer & operator=(const ReliablePacketBuffer &);
+
+	Slot *m_slots;
+	u32 m_capacity; // Power of two
+	u32 m_size;
+	u16 m_first; // Seqnum of the first packet
+	u16 m_last; // No packets are after this
+	double m_clock;
+	RingQueue<SendTime> m_send_times;
+	// Highest ACKed seqnum and the next seqnum to check for loss
+	bool m_any_acked;
+	u16 m_highest_acked;
+	u16 m_loss_checked;
 };
 
 /*
@@ -299,7 +527,7 @@ class ReliablePacketBuffer
 class IncomingSplitBuffer
 {
 public:
-	~IncomingSplitBuffer();
+	IncomingSplitBuffer();
 	/*
 		Returns a reference counted buffer of length != 0 when a full split
 		packet is constructed. If not, returns one of length 0.
@@ -309,8 +537,15 @@ class IncomingSplitBuffer
 	void removeUnreliableTimedOuts(float dtime, float timeout);
 	
 private:
-	// Key is seqnum
-	core::map<u16, IncomingSplitPacket*> m_buf;
+	void reallocate(u32 capacity);
+
+	/*
+		Preallocated slots indexed by seqnum; the chunk arrays of a slot
+		are reused by the packets taking it later. An incomplete
+		unreliable packet is dropped if another one needs its slot.
+	*/
+	core::array<IncomingSplitPacket> m_slots;
+	u32 m_count;
 };
 
 class Connection;
@@ -332,6 +567,30 @@ struct Channel
 	ReliablePacketBuffer outgoing_reliables;
 
 	IncomingSplitBuffer incoming_splits;
+
+	/*
+		Congestion control (AIMD): at most cwnd reliable packets are
+		sent and not ACKed. The window grows by a packet for each ACK
+		up to ssthresh (slow start) and by a packet per window after
+		it. It is halved when a packet is lost as detected by later
+		ACKs, at most once per window, and drops to the minimum when a
+		packet times out.
+	*/
+	void ackReceived(u16 seqnum);
+	void packetLost(bool timeout);
+
+	float cwnd;
+	float ssthresh;
+	// Set when the window is decreased; packets sent before
+	// recovery_seqnum don't decrease it again
+	bool in_recovery;
+	u16 recovery_seqnum;
+
+	// Statistics of the outgoing reliable packets
+	u32 reliables_sent;
+	u32 reliables_timed_out;
+	u32 reliables_fast_resent;
+	u32 loss_events;
 };
 
 class Peer;
@@ -372,6 +631,12 @@ class Peer
 	*/
 	void reportRTT(float rtt);
 
+	/*
+		Packets per second to send the congestion windows of the
+		channels in half of avg_rtt
+	*/
+	float getPacketRate();
+
 	Channel channels[CHANNEL_COUNT];
 
 	// Address of the peer
@@ -406,10 +671,10 @@ struct OutgoingPacket
 {
 	u16 peer_id;
 	u8 channelnum;
-	SharedBuffer<u8> data;
+	GatherBuffer data;
 	bool reliable;
 
-	OutgoingPacket(u16 peer_id_, u8 channelnum_, SharedBuffer<u8> data_,
+	OutgoingPacket(u16 peer_id_, u8 channelnum_, const GatherBuffer &data_,
 			bool reliable_):
 		peer_id(peer_id_),
 		channelnum(channelnum_),
@@ -489,7 +754,11 @@ struct ConnectionCommand
 	Address address;
 	u16 peer_id;
 	u8 channelnum;
-	Buffer<u8> data;
+	/*
+		A copy of the data to send, so that the buffer isn't shared
+		with the thread which queued the command. See putCommand().
+	*/
+	SharedBuffer<u8> data;
 	bool reliable;
 	
 	ConnectionCommand(): type(CONNCMD_NONE) {}
@@ -509,19 +778,20 @@ struct ConnectionCommand
 		type = CONNCMD_DISCONNECT;
 	}
 	void send(u16 peer_id_, u8 channelnum_,
-			SharedBuffer<u8> data_, bool reliable_)
+			const GatherBuffer &data_, bool reliable_)
 	{
 		type = CONNCMD_SEND;
 		peer_id = peer_id_;
 		channelnum = channelnum_;
-		data = data_;
+		data = data_.flatten();
 		reliable = reliable_;
 	}
-	void sendToAll(u8 channelnum_, SharedBuffer<u8> data_, bool reliable_)
+	void sendToAll(u8 channelnum_, const GatherBuffer &data_,
+			bool reliable_)
 	{
 		type = CONNCMD_SEND_TO_ALL;
 		channelnum = channelnum_;
-		data = data_;
+		data = data_.flatten();
 		reliable = reliable_;
 	}
 	void deletePeer(u16 peer_id_)
@@ -552,13 +822,16 @@ class Connection: public SimpleThread
 	bool Connected();
 	void Disconnect();
 	u32 Receive(u16 &peer_id, SharedBuffer<u8> &data);
-	void SendToAll(u8 channelnum, SharedBuffer<u8> data, bool reliable);
-	void Send(u16 peer_id, u8 channelnum, SharedBuffer<u8> data, bool reliable);
+	void SendToAll(u8 channelnum, const GatherBuffer &data, bool reliable);
+	void Send(u16 peer_id, u8 channelnum, const GatherBuffer &data,
+			bool reliable);
 	void RunTimeouts(float dtime); // dummy
 	u16 GetPeerID(){ return m_peer_id; }
 	Address GetPeerAddress(u16 peer_id);
 	float GetPeerAvgRTT(u16 peer_id);
 	void DeletePeer(u16 peer_id);
+	// Prints the round trip time and congestion control of a peer
+	void PrintInfo(std::ostream &out, u16 peer_id);
 	
 private:
 	void putEvent(ConnectionEvent &e);
@@ -569,13 +842,15 @@ class Connection: public SimpleThread
 	void serve(u16 port);
 	void connect(Address address);
 	void disconnect();
-	void sendToAll(u8 channelnum, SharedBuffer<u8> data, bool reliable);
-	void send(u16 peer_id, u8 channelnum, SharedBuffer<u8> data, bool reliable);
+	void sendToAll(u8 channelnum, GatherBuffer data, bool reliable);
+	void send(u16 peer_id, u8 channelnum, GatherBuffer data, bool reliable);
 	void sendAsPacket(u16 peer_id, u8 channelnum,
-			SharedBuffer<u8> data, bool reliable);
+			GatherBuffer data, bool reliable);
 	void rawSendAsPacket(u16 peer_id, u8 channelnum,
-			SharedBuffer<u8> data, bool reliable);
+			GatherBuffer data, bool reliable);
+	// Queues the packet to be sent by flushSends()
 	void rawSend(const BufferedPacket &packet);
+	void flushSends();
 	Peer* getPeer(u16 peer_id);
 	Peer* getPeerNoEx(u16 peer_id);
 	core::list<Peer*> getPeers();
@@ -607,6 +882,12 @@ class Connection: public SimpleThread
 	float m_timeout;
 	UDPSocket m_socket;
 	u16 m_peer_id;
+
+	// Packets queued by rawSend()
+	BufferedPacket m_send_batch[SEND_BATCH_SIZE];
+	u32 m_send_batch_size;
+	// Room for RECEIVE_BATCH_SIZE datagrams
+	SharedBuffer<u8> m_receive_buffer;
 	
 	core::map<u16, Peer*> m_peers;
 	JMutex m_peers_mutex;
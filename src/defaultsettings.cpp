@@ -82,6 +82,7 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("view_bobbing_amount", "1.0");
 	settings->setDefault("enable_3d_clouds", "false");
 	settings->setDefault("opaque_water", "false");
+	settings->setDefault("enable_network_compression", "true");
 
 	// Server stuff
 	// "map-dir" doesn't exist by default.
@@ -105,12 +106,32 @@ void set_default_settings(Settings *settings)
 	// This causes frametime jitter on client side, or does it?
 	settings->setDefault("max_simultaneous_block_sends_per_client", "2");
 	settings->setDefault("max_simultaneous_block_sends_server_total", "8");
+	settings->setDefault("max_block_send_rate", "0");
 	settings->setDefault("max_block_send_distance", "7");
 	settings->setDefault("max_block_generate_distance", "5");
+	settings->setDefault("server_block_send_cache_size", "16");
+	settings->setDefault("network_compression_threshold", "256");
+	settings->setDefault("num_emerge_threads", "2");
+	settings->setDefault("num_block_send_threads", "1");
+	settings->setDefault("num_pregenerate_threads", "0");
+	settings->setDefault("num_map_threads", "0");
+	settings->setDefault("max_emerge_queue_blocks_per_client", "25");
+	settings->setDefault("mapgen_sector_cache_size", "256");
+	settings->setDefault("mapgen_terrain_cache_size", "1024");
+	settings->setDefault("mapgen_save_ground_levels", "true");
 	settings->setDefault("time_send_interval", "20");
 	settings->setDefault("time_speed", "96");
 	settings->setDefault("server_unload_unused_data_timeout", "60");
+	settings->setDefault("liquid_transform_max_time", "0.05");
+	settings->setDefault("active_block_max_time", "0.02");
 	settings->setDefault("server_map_save_interval", "10");
+	settings->setDefault("server_map_save_queue_max_mb", "64");
+	settings->setDefault("server_map_save_batch_size", "1024");
+	settings->setDefault("server_map_save_max_delay", "2.0");
+	settings->setDefault("sqlite_journal_mode", "");
+	settings->setDefault("sqlite_synchronous", "");
+	settings->setDefault("sqlite_wal_autocheckpoint", "1000");
+	settings->setDefault("sqlite_wal_checkpoint_interval", "0");
 	settings->setDefault("full_block_send_enable_min_time_from_building", "2.0");
 	settings->setDefault("enable_experimental", "false");
 	settings->setDefault("crafted_teleports", "4");
@@ -26,6 +26,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "serverobject.h"
 #include "content_sao.h"
 #include "mapgen.h"
+#include "noise.h"
 #include "settings.h"
 #include "log.h"
 #include "profiler.h"
@@ -263,6 +264,201 @@ void ActiveBlockList::update(core::list<v3s16> &active_positions,
 	}
 }
 
+static void getMob_dungeon_master(Settings &properties)
+{
+	properties.set("looks", "dungeon_master");
+	properties.setFloat("yaw", 1.57);
+	properties.setFloat("hp", 30);
+	properties.setBool("bright_shooting", true);
+	properties.set("shoot_type", "fireball");
+	properties.set("shoot_y", "0.7");
+	properties.set("player_hit_damage", "1");
+	properties.set("player_hit_distance", "1.0");
+	properties.set("player_hit_interval", "0.5");
+	properties.setBool("mindless_rage", myrand_range(0,100)==0);
+}
+
+/*
+	Active block modifiers of the game
+*/
+
+// Convert mud under proper lighting to grass
+class GrowGrassABM : public ActiveBlockModifier
+{
+public:
+	content_t getTriggerContent(u32 i){ return CONTENT_MUD; }
+	float getActiveInterval(){ return 10.0; }
+	u32 getActiveChance(){ return 20; }
+	void triggerEvent(ServerEnvironment *env, v3s16 p, MapNode n,
+			u32 active_object_count_wider)
+	{
+		ServerMap *map = &env->getServerMap();
+		MapNode n_top = map->getNodeNoEx(p+v3s16(0,1,0));
+		if(content_features(n_top).air_equivalent &&
+				n_top.getLightBlend(env->getDayNightRatio()) >= 13)
+		{
+			n.setContent(CONTENT_GRASS);
+			map->addNodeWithEvent(p, n);
+		}
+	}
+};
+
+// Convert grass into mud if under something else than air
+class RemoveGrassABM : public ActiveBlockModifier
+{
+public:
+	content_t getTriggerContent(u32 i){ return CONTENT_GRASS; }
+	float getActiveInterval(){ return 10.0; }
+	u32 getActiveChance(){ return 1; }
+	void triggerEvent(ServerEnvironment *env, v3s16 p, MapNode n,
+			u32 active_object_count_wider)
+	{
+		ServerMap *map = &env->getServerMap();
+		MapNode n_top = map->getNodeNoEx(p+v3s16(0,1,0));
+		if(content_features(n_top).air_equivalent == false)
+		{
+			n.setContent(CONTENT_MUD);
+			map->addNodeWithEvent(p, n);
+		}
+	}
+};
+
+// Rats spawn around regular trees
+class SpawnRatsAroundTreesABM : public ActiveBlockModifier
+{
+public:
+	u32 getTriggerContentCount(){ return 2; }
+	content_t getTriggerContent(u32 i)
+	{
+		return i == 0 ? CONTENT_TREE : CONTENT_JUNGLETREE;
+	}
+	float getActiveInterval(){ return 10.0; }
+	u32 getActiveChance(){ return 200; }
+	// Nothing spawns for the time nobody was around
+	bool getSimpleCatchUp(){ return false; }
+	void triggerEvent(ServerEnvironment *env, v3s16 p, MapNode n,
+			u32 active_object_count_wider)
+	{
+		if(active_object_count_wider != 0)
+			return;
+		ServerMap *map = &env->getServerMap();
+		v3s16 p1 = p + v3s16(myrand_range(-2, 2),
+				0, myrand_range(-2, 2));
+		MapNode n1 = map->getNodeNoEx(p1);
+		MapNode n1b = map->getNodeNoEx(p1+v3s16(0,-1,0));
+		if(n1b.getContent() == CONTENT_GRASS &&
+				n1.getContent() == CONTENT_AIR)
+		{
+			v3f pos = intToFloat(p1, BS);
+			ServerActiveObject *obj = new RatSAO(env, 0, pos);
+			env->addActiveObject(obj);
+		}
+	}
+};
+
+// Fun things spawn in caves and dungeons
+class SpawnInCavesABM : public ActiveBlockModifier
+{
+public:
+	u32 getTriggerContentCount(){ return 2; }
+	content_t getTriggerContent(u32 i)
+	{
+		return i == 0 ? CONTENT_STONE : CONTENT_MOSSYCOBBLE;
+	}
+	float getActiveInterval(){ return 10.0; }
+	u32 getActiveChance(){ return 200; }
+	bool getSimpleCatchUp(){ return false; }
+	void triggerEvent(ServerEnvironment *env, v3s16 p, MapNode n,
+			u32 active_object_count_wider)
+	{
+		if(active_object_count_wider != 0)
+			return;
+		ServerMap *map = &env->getServerMap();
+		v3s16 p1 = p + v3s16(0,1,0);
+		MapNode n1a = map->getNodeNoEx(p1+v3s16(0,0,0));
+		if(n1a.getLightBlend(env->getDayNightRatio()) > 3)
+			return;
+		MapNode n1b = map->getNodeNoEx(p1+v3s16(0,1,0));
+		if(n1a.getContent() != CONTENT_AIR ||
+				n1b.getContent() != CONTENT_AIR)
+			return;
+		v3f pos = intToFloat(p1, BS);
+		int i = myrand()%5;
+		if(i == 0 || i == 1){
+			actionstream<<"A dungeon master spawns at "
+					<<PP(p1)<<std::endl;
+			Settings properties;
+			getMob_dungeon_master(properties);
+			ServerActiveObject *obj = new MobV2SAO(
+					env, 0, pos, &properties);
+			env->addActiveObject(obj);
+		} else if(i == 2 || i == 3){
+			actionstream<<"Rats spawn at "
+					<<PP(p1)<<std::endl;
+			for(int j=0; j<3; j++){
+				ServerActiveObject *obj = new RatSAO(
+						env, 0, pos);
+				env->addActiveObject(obj);
+			}
+		} else {
+			actionstream<<"An oerkki spawns at "
+					<<PP(p1)<<std::endl;
+			ServerActiveObject *obj = new Oerkki1SAO(
+					env, 0, pos);
+			env->addActiveObject(obj);
+		}
+	}
+};
+
+// Make trees from saplings!
+class MakeTreesFromSaplingsABM : public ActiveBlockModifier
+{
+public:
+	content_t getTriggerContent(u32 i){ return CONTENT_SAPLING; }
+	float getActiveInterval(){ return 10.0; }
+	u32 getActiveChance(){ return 50; }
+	void triggerEvent(ServerEnvironment *env, v3s16 p, MapNode n,
+			u32 active_object_count_wider)
+	{
+		ServerMap *map = &env->getServerMap();
+
+		actionstream<<"A sapling grows into a tree at "
+				<<PP(p)<<std::endl;
+
+		core::map<v3s16, MapBlock*> modified_blocks;
+		v3s16 tree_p = p;
+		ManualMapVoxelManipulator vmanip(map);
+		v3s16 tree_blockp = getNodeBlockPos(tree_p);
+		vmanip.initialEmerge(tree_blockp - v3s16(1,1,1), tree_blockp + v3s16(1,1,1));
+		bool is_apple_tree = myrand()%4 == 0;
+		PseudoRandom random(myrand());
+		mapgen::make_tree(vmanip, tree_p, is_apple_tree, random);
+		vmanip.blitBackAll(&modified_blocks);
+
+		// update lighting
+		core::map<v3s16, MapBlock*> lighting_modified_blocks;
+		for(core::map<v3s16, MapBlock*>::Iterator
+			i = modified_blocks.getIterator();
+			i.atEnd() == false; i++)
+		{
+			lighting_modified_blocks.insert(i.getNode()->getKey(), i.getNode()->getValue());
+		}
+		map->updateLighting(lighting_modified_blocks, modified_blocks);
+
+		// Send a MEET_OTHER event
+		MapEditEvent event;
+		event.type = MEET_OTHER;
+		for(core::map<v3s16, MapBlock*>::Iterator
+			i = modified_blocks.getIterator();
+			i.atEnd() == false; i++)
+		{
+			v3s16 p = i.getNode()->getKey();
+			event.modified_blocks.insert(p, true);
+		}
+		map->dispatchEvent(&event);
+	}
+};
+
 /*
 	ServerEnvironment
 */
@@ -273,8 +469,16 @@ ServerEnvironment::ServerEnvironment(ServerMap *map, Server *server):
 	m_random_spawn_timer(3),
 	m_send_recommended_timer(0),
 	m_game_time(0),
-	m_game_time_fraction_counter(0)
+	m_game_time_fraction_counter(0),
+	m_block_work_timer(0),
+	m_block_work_dtime(0),
+	m_block_work_count(0)
 {
+	addActiveBlockModifier(new GrowGrassABM);
+	addActiveBlockModifier(new RemoveGrassABM);
+	addActiveBlockModifier(new SpawnRatsAroundTreesABM);
+	addActiveBlockModifier(new SpawnInCavesABM);
+	addActiveBlockModifier(new MakeTreesFromSaplingsABM);
 }
 
 ServerEnvironment::~ServerEnvironment()
@@ -288,6 +492,11 @@ ServerEnvironment::~ServerEnvironment()
 
 	// Drop/delete map
 	m_map->drop();
+
+	// Delete the active block modifiers
+	for(core::list<ABMWithState>::Iterator
+			i = m_abms.begin(); i != m_abms.end(); i++)
+		delete i->abm;
 }
 
 void ServerEnvironment::serializePlayers(const std::string &savedir)
@@ -622,35 +831,37 @@ void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 		block->setChangedFlag();
 	}
 
-	// TODO: Do something
-	// TODO: Implement usage of ActiveBlockModifier
-	
-	// Here's a quick demonstration
-	v3s16 p0;
-	for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
-	for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
-	for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
+	/*
+		Run the active block modifiers for the time the block was
+		inactive, once with the chance of all the intervals missed
+	*/
+	core::array<ActiveABM> abms;
+	u32 triggers[(MAX_CONTENT+1)/32];
+	memset(triggers, 0, sizeof(triggers));
+	for(core::list<ABMWithState>::Iterator
+			i = m_abms.begin(); i != m_abms.end(); i++)
 	{
-		v3s16 p = p0 + block->getPosRelative();
-		MapNode n = block->getNodeNoEx(p0);
-#if 1
-		// Test something:
-		// Convert all mud under proper day lighting to grass
-		if(n.getContent() == CONTENT_MUD)
+		ActiveBlockModifier *abm = i->abm;
+		if(abm->getSimpleCatchUp() == false)
+			continue;
+		u32 intervals = dtime_s / abm->getActiveInterval();
+		if(intervals == 0)
+			continue;
+		u32 chance = abm->getActiveChance() / intervals;
+		if(chance == 0)
+			chance = 1;
+		for(u32 j=0; j<abm->getTriggerContentCount(); j++)
 		{
-			if(dtime_s > 300)
-			{
-				MapNode n_top = block->getNodeNoEx(p0+v3s16(0,1,0));
-				if(content_features(n_top).air_equivalent &&
-						n_top.getLight(LIGHTBANK_DAY) >= 13)
-				{
-					n.setContent(CONTENT_GRASS);
-					m_map->addNodeWithEvent(p, n);
-				}
-			}
+			ActiveABM aabm;
+			aabm.abm = abm;
+			aabm.content = abm->getTriggerContent(j);
+			aabm.chance = chance;
+			abms.push_back(aabm);
+			triggers[aabm.content >> 5] |= (u32)1 << (aabm.content & 31);
 		}
-#endif
 	}
+	if(abms.size() != 0)
+		runBlockABMs(block, abms, triggers);
 }
 
 void ServerEnvironment::clearAllObjects()
@@ -739,18 +950,220 @@ void ServerEnvironment::clearAllObjects()
 			<<" in "<<num_blocks_cleared<<" blocks"<<std::endl;
 }
 
-static void getMob_dungeon_master(Settings &properties)
+void ServerEnvironment::addActiveBlockModifier(ActiveBlockModifier *abm)
 {
-	properties.set("looks", "dungeon_master");
-	properties.setFloat("yaw", 1.57);
-	properties.setFloat("hp", 30);
-	properties.setBool("bright_shooting", true);
-	properties.set("shoot_type", "fireball");
-	properties.set("shoot_y", "0.7");
-	properties.set("player_hit_damage", "1");
-	properties.set("player_hit_distance", "1.0");
-	properties.set("player_hit_interval", "0.5");
-	properties.setBool("mindless_rage", myrand_range(0,100)==0);
+	assert(abm->getActiveChance() != 0);
+	ABMWithState a;
+	a.abm = abm;
+	m_abms.push_back(a);
+}
+
+void ServerEnvironment::startBlockWorkRound(float dtime)
+{
+	m_block_work_dtime = dtime;
+
+	m_block_work_queue.clear();
+	for(core::map<v3s16, bool>::Iterator
+			i = m_active_blocks.m_list.getIterator();
+			i.atEnd()==false; i++)
+		m_block_work_queue.push_back(i.getNode()->getKey());
+	m_block_work_count = m_block_work_queue.size();
+
+	/*
+		Find the modifiers whose interval has passed
+	*/
+	m_active_abms.clear();
+	memset(m_abm_triggers, 0, sizeof(m_abm_triggers));
+	for(core::list<ABMWithState>::Iterator
+			i = m_abms.begin(); i != m_abms.end(); i++)
+	{
+		ActiveBlockModifier *abm = i->abm;
+		if(i->timer.step(dtime, abm->getActiveInterval()) == false)
+			continue;
+		for(u32 j=0; j<abm->getTriggerContentCount(); j++)
+		{
+			ActiveABM aabm;
+			aabm.abm = abm;
+			aabm.content = abm->getTriggerContent(j);
+			aabm.chance = abm->getActiveChance();
+			m_active_abms.push_back(aabm);
+			m_abm_triggers[aabm.content >> 5] |=
+					(u32)1 << (aabm.content & 31);
+		}
+	}
+}
+
+void ServerEnvironment::stepBlockWork(float dtime)
+{
+	u32 max_time_us = 1000000 * g_settings->getFloat("active_block_max_time");
+	u32 time_start = porting::getTimeUs();
+
+	m_block_work_timer += dtime;
+
+	/*
+		Start a new round when the previous one is done, on the step
+		nearest to the time it is up. The round gets the time since the
+		previous one started, which is longer than the interval if the
+		work can't keep up.
+	*/
+	if(m_block_work_queue.empty())
+	{
+		if(m_block_work_timer + dtime/2 < ACTIVE_BLOCK_WORK_INTERVAL)
+			return;
+		startBlockWorkRound(m_block_work_timer);
+		m_block_work_timer = 0;
+	}
+
+	/*
+		Do the part of the round that belongs to the time passed in it,
+		or what fits in the time budget
+	*/
+	float progress = m_block_work_timer / ACTIVE_BLOCK_WORK_INTERVAL;
+	if(progress > 1.0)
+		progress = 1.0;
+	u32 done_count = m_block_work_count - m_block_work_queue.size();
+	u32 wanted_count = ceil(progress * m_block_work_count);
+	u32 handled_count = 0;
+	while(done_count < wanted_count && m_block_work_queue.empty() == false)
+	{
+		v3s16 p = m_block_work_queue.pop_front();
+		done_count++;
+
+		// The block may have stopped being active during the round
+		if(m_active_blocks.contains(p) == false)
+			continue;
+		MapBlock *block = m_map->getBlockNoCreateNoEx(p);
+		if(block==NULL)
+			continue;
+
+		doBlockWork(block);
+		handled_count++;
+
+		if(max_time_us != 0
+				&& porting::getTimeUs() - time_start >= max_time_us)
+			break;
+	}
+
+	g_profiler->avg("SEnv: active blocks handled per step", handled_count);
+
+	/*
+		Report how much longer than the interval the round took
+	*/
+	if(m_block_work_queue.empty())
+	{
+		float lag = m_block_work_timer - ACTIVE_BLOCK_WORK_INTERVAL;
+		if(lag < 0)
+			lag = 0;
+		g_profiler->avg("SEnv: active block work lag (s)", lag);
+		if(m_block_work_lag_report_interval.step(m_block_work_timer, 10.0)
+				&& lag >= ACTIVE_BLOCK_WORK_INTERVAL)
+		{
+			infostream<<"ServerEnvironment: Active block work is lagging "
+					<<lag<<"s behind with "<<m_block_work_count
+					<<" active blocks; active_block_max_time may be too"
+					<<" small"<<std::endl;
+		}
+	}
+}
+
+void ServerEnvironment::doBlockWork(MapBlock *block)
+{
+	v3s16 p = block->getPos();
+
+	// Reset block usage timer
+	block->resetUsageTimer();
+	
+	// Set current time as timestamp
+	block->setTimestampNoChangedFlag(m_game_time);
+
+	// Run node metadata
+	bool changed = block->m_node_metadata.step(m_block_work_dtime);
+	if(changed)
+	{
+		MapEditEvent event;
+		event.type = MEET_BLOCK_NODE_METADATA_CHANGED;
+		event.p = p;
+		m_map->dispatchEvent(&event);
+
+		block->setChangedFlag();
+	}
+
+	// Run the active block modifiers
+	runBlockABMs(block, m_active_abms, m_abm_triggers);
+}
+
+void ServerEnvironment::runBlockABMs(MapBlock *block,
+		core::array<ActiveABM> &abms, u32 *triggers)
+{
+	v3s16 p = block->getPos();
+
+	// Skip the block without looking at the nodes if it has nothing
+	// to trigger
+	bool has_triggers = false;
+	for(u32 j=0; j<abms.size(); j++)
+	{
+		if(block->mayContainContent(abms[j].content))
+		{
+			has_triggers = true;
+			break;
+		}
+	}
+	if(has_triggers == false)
+	{
+		g_profiler->add("SEnv: ABM blocks skipped", 1);
+		return;
+	}
+	g_profiler->add("SEnv: ABM blocks scanned", 1);
+
+	// Find out how many objects this and all the neighbors contain
+	u32 active_object_count_wider = 0;
+	for(s16 x=-1; x<=1; x++)
+	for(s16 y=-1; y<=1; y++)
+	for(s16 z=-1; z<=1; z++)
+	{
+		MapBlock *block = m_map->getBlockNoCreateNoEx(p+v3s16(x,y,z));
+		if(block==NULL)
+			continue;
+		active_object_count_wider +=
+				block->m_static_objects.m_active.size()
+				+ block->m_static_objects.m_stored.size();
+	}
+
+	/*
+		Note that map modifications should be done using the event-
+		making map methods so that the server gets information
+		about them.
+	*/
+	bool triggered = false;
+	v3s16 p0;
+	for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
+	for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
+	for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
+	{
+		MapNode n = block->getNodeNoEx(p0);
+		content_t c = n.getContent();
+		if((triggers[c >> 5] & ((u32)1 << (c & 31))) == 0)
+			continue;
+		triggered = true;
+		v3s16 p = p0 + block->getPosRelative();
+		for(u32 j=0; j<abms.size(); j++)
+		{
+			ActiveABM &aabm = abms[j];
+			if(aabm.content != c)
+				continue;
+			if(myrand() % aabm.chance != 0)
+				continue;
+			aabm.abm->triggerEvent(this, p, n,
+					active_object_count_wider);
+		}
+	}
+
+	/*
+		The content that made the block be scanned has been removed;
+		don't scan it again for that
+	*/
+	if(triggered == false)
+		block->updateContentPresence();
 }
 
 void ServerEnvironment::step(float dtime)
@@ -893,255 +1306,9 @@ void ServerEnvironment::step(float dtime)
 	/*
 		Mess around in active blocks
 	*/
-	if(m_active_blocks_nodemetadata_interval.step(dtime, 1.0))
 	{
-		ScopeProfiler sp(g_profiler, "SEnv: mess in act. blocks avg /1s", SPT_AVG);
-		
-		float dtime = 1.0;
-
-		for(core::map<v3s16, bool>::Iterator
-				i = m_active_blocks.m_list.getIterator();
-				i.atEnd()==false; i++)
-		{
-			v3s16 p = i.getNode()->getKey();
-			
-			/*infostream<<"Server: Block ("<<p.X<<","<<p.Y<<","<<p.Z
-					<<") being handled"<<std::endl;*/
-
-			MapBlock *block = m_map->getBlockNoCreateNoEx(p);
-			if(block==NULL)
-				continue;
-
-			// Reset block usage timer
-			block->resetUsageTimer();
-			
-			// Set current time as timestamp
-			block->setTimestampNoChangedFlag(m_game_time);
-
-			// Run node metadata
-			bool changed = block->m_node_metadata.step(dtime);
-			if(changed)
-			{
-				MapEditEvent event;
-				event.type = MEET_BLOCK_NODE_METADATA_CHANGED;
-				event.p = p;
-				m_map->dispatchEvent(&event);
-
-				block->setChangedFlag();
-			}
-		}
-	}
-	
-	if(m_active_blocks_test_interval.step(dtime, 10.0))
-	{
-		ScopeProfiler sp(g_profiler, "SEnv: modify in blocks avg /10s", SPT_AVG);
-		//float dtime = 10.0;
-		
-		for(core::map<v3s16, bool>::Iterator
-				i = m_active_blocks.m_list.getIterator();
-				i.atEnd()==false; i++)
-		{
-			v3s16 p = i.getNode()->getKey();
-			
-			/*infostream<<"Server: Block ("<<p.X<<","<<p.Y<<","<<p.Z
-					<<") being handled"<<std::endl;*/
-
-			MapBlock *block = m_map->getBlockNoCreateNoEx(p);
-			if(block==NULL)
-				continue;
-			
-			// Set current time as timestamp
-			block->setTimestampNoChangedFlag(m_game_time);
-
-			/*
-				Do stuff!
-
-				Note that map modifications should be done using the event-
-				making map methods so that the server gets information
-				about them.
-
-				Reading can be done quickly directly from the block.
-
-				Everything should bind to inside this single content
-				searching loop to keep things fast.
-			*/
-			// TODO: Implement usage of ActiveBlockModifier
-			
-			// Find out how many objects the block contains
-			//u32 active_object_count = block->m_static_objects.m_active.size();
-			// Find out how many objects this and all the neighbors contain
-			u32 active_object_count_wider = 0;
-			for(s16 x=-1; x<=1; x++)
-			for(s16 y=-1; y<=1; y++)
-			for(s16 z=-1; z<=1; z++)
-			{
-				MapBlock *block = m_map->getBlockNoCreateNoEx(p+v3s16(x,y,z));
-				if(block==NULL)
-					continue;
-				active_object_count_wider +=
-						block->m_static_objects.m_active.size()
-						+ block->m_static_objects.m_stored.size();
-				
-				/*if(block->m_static_objects.m_stored.size() != 0){
-					errorstream<<"ServerEnvironment::step(): "
-							<<PP(block->getPos())<<" contains "
-							<<block->m_static_objects.m_stored.size()
-							<<" stored objects; "
-							<<"when spawning objects, when counting active "
-							<<"objects in wide area. relative position: "
-							<<"("<<x<<","<<y<<","<<z<<")"<<std::endl;
-				}*/
-			}
-
-			v3s16 p0;
-			for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
-			for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
-			for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
-			{
-				v3s16 p = p0 + block->getPosRelative();
-				MapNode n = block->getNodeNoEx(p0);
-
-				/*
-					Test something:
-					Convert mud under proper lighting to grass
-				*/
-				if(n.getContent() == CONTENT_MUD)
-				{
-					if(myrand()%20 == 0)
-					{
-						MapNode n_top = m_map->getNodeNoEx(p+v3s16(0,1,0));
-						if(content_features(n_top).air_equivalent &&
-								n_top.getLightBlend(getDayNightRatio()) >= 13)
-						{
-							n.setContent(CONTENT_GRASS);
-							m_map->addNodeWithEvent(p, n);
-						}
-					}
-				}
-				/*
-					Convert grass into mud if under something else than air
-				*/
-				if(n.getContent() == CONTENT_GRASS)
-				{
-					//if(myrand()%20 == 0)
-					{
-						MapNode n_top = m_map->getNodeNoEx(p+v3s16(0,1,0));
-						if(content_features(n_top).air_equivalent == false)
-						{
-							n.setContent(CONTENT_MUD);
-							m_map->addNodeWithEvent(p, n);
-						}
-					}
-				}
-				/*
-					Rats spawn around regular trees
-				*/
-				if(n.getContent() == CONTENT_TREE ||
-						n.getContent() == CONTENT_JUNGLETREE)
-				{
-   					if(myrand()%200 == 0 && active_object_count_wider == 0)
-					{
-						v3s16 p1 = p + v3s16(myrand_range(-2, 2),
-								0, myrand_range(-2, 2));
-						MapNode n1 = m_map->getNodeNoEx(p1);
-						MapNode n1b = m_map->getNodeNoEx(p1+v3s16(0,-1,0));
-						if(n1b.getContent() == CONTENT_GRASS &&
-								n1.getContent() == CONTENT_AIR)
-						{
-							v3f pos = intToFloat(p1, BS);
-							ServerActiveObject *obj = new RatSAO(this, 0, pos);
-							addActiveObject(obj);
-						}
-					}
-				}
-				/*
-					Fun things spawn in caves and dungeons
-				*/
-				if(n.getContent() == CONTENT_STONE ||
-						n.getContent() == CONTENT_MOSSYCOBBLE)
-				{
-   					if(myrand()%200 == 0 && active_object_count_wider == 0)
-					{
-						v3s16 p1 = p + v3s16(0,1,0);
-						MapNode n1a = m_map->getNodeNoEx(p1+v3s16(0,0,0));
-						if(n1a.getLightBlend(getDayNightRatio()) <= 3){
-							MapNode n1b = m_map->getNodeNoEx(p1+v3s16(0,1,0));
-							if(n1a.getContent() == CONTENT_AIR &&
-									n1b.getContent() == CONTENT_AIR)
-							{
-								v3f pos = intToFloat(p1, BS);
-								int i = myrand()%5;
-								if(i == 0 || i == 1){
-									actionstream<<"A dungeon master spawns at "
-											<<PP(p1)<<std::endl;
-									Settings properties;
-									getMob_dungeon_master(properties);
-									ServerActiveObject *obj = new MobV2SAO(
-											this, 0, pos, &properties);
-									addActiveObject(obj);
-								} else if(i == 2 || i == 3){
-									actionstream<<"Rats spawn at "
-											<<PP(p1)<<std::endl;
-									for(int j=0; j<3; j++){
-										ServerActiveObject *obj = new RatSAO(
-												this, 0, pos);
-										addActiveObject(obj);
-									}
-								} else {
-									actionstream<<"An oerkki spawns at "
-											<<PP(p1)<<std::endl;
-									ServerActiveObject *obj = new Oerkki1SAO(
-											this, 0, pos);
-									addActiveObject(obj);
-								}
-							}
-						}
-					}
-				}
-				/*
-					Make trees from saplings!
-				*/
-				if(n.getContent() == CONTENT_SAPLING)
-				{
-					if(myrand()%50 == 0)
-					{
-						actionstream<<"A sapling grows into a tree at "
-								<<PP(p)<<std::endl;
-
-						core::map<v3s16, MapBlock*> modified_blocks;
-						v3s16 tree_p = p;
-						ManualMapVoxelManipulator vmanip(m_map);
-						v3s16 tree_blockp = getNodeBlockPos(tree_p);
-						vmanip.initialEmerge(tree_blockp - v3s16(1,1,1), tree_blockp + v3s16(1,1,1));
-						bool is_apple_tree = myrand()%4 == 0;
-						mapgen::make_tree(vmanip, tree_p, is_apple_tree);
-						vmanip.blitBackAll(&modified_blocks);
-
-						// update lighting
-						core::map<v3s16, MapBlock*> lighting_modified_blocks;
-						for(core::map<v3s16, MapBlock*>::Iterator
-							i = modified_blocks.getIterator();
-							i.atEnd() == false; i++)
-						{
-							lighting_modified_blocks.insert(i.getNode()->getKey(), i.getNode()->getValue());
-						}
-						m_map->updateLighting(lighting_modified_blocks, modified_blocks);
-
-						// Send a MEET_OTHER event
-						MapEditEvent event;
-						event.type = MEET_OTHER;
-						for(core::map<v3s16, MapBlock*>::Iterator
-							i = modified_blocks.getIterator();
-							i.atEnd() == false; i++)
-						{
-							v3s16 p = i.getNode()->getKey();
-							event.modified_blocks.insert(p, true);
-						}
-						m_map->dispatchEvent(&event);
-					}
-				}
-			}
-		}
+		ScopeProfiler sp(g_profiler, "SEnv: mess in act. blocks avg", SPT_AVG);
+		stepBlockWork(dtime);
 	}
 	
 	/*
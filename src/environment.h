@@ -40,6 +40,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "clans.h"
 #include "teleports.h"
 
+// Seconds between the handlings of an active block
+#define ACTIVE_BLOCK_WORK_INTERVAL 1.0
+
 class Server;
 class ActiveBlockModifier;
 class ServerActiveObject;
@@ -221,10 +224,11 @@ class ServerEnvironment : public Environment
 	void activateBlock(MapBlock *block, u32 additional_dtime=0);
 
 	/*
-		ActiveBlockModifiers (TODO)
+		ActiveBlockModifiers
 		-------------------------------------------
 	*/
 
+	// Environment handles deleting abm
 	void addActiveBlockModifier(ActiveBlockModifier *abm);
 
 	/* Other stuff */
@@ -272,6 +276,39 @@ class ServerEnvironment : public Environment
 	*/
 	void deactivateFarObjects(bool force_delete);
 
+	/*
+		Periodic work of the active blocks: node metadata and
+		ActiveBlockModifiers.
+
+		Every ACTIVE_BLOCK_WORK_INTERVAL seconds a round goes through
+		all the active blocks. It is spread over the steps, handling the
+		share of blocks for the time passed, but at most
+		active_block_max_time of work per step. If the rounds can't
+		keep up, they get longer, and the blocks get the longer time.
+	*/
+	void stepBlockWork(float dtime);
+	// Lists the blocks and the due ActiveBlockModifiers of a round
+	void startBlockWorkRound(float dtime);
+	/*
+		Blocks that don't contain any of the trigger contents of the
+		due ActiveBlockModifiers are skipped without scanning them.
+	*/
+	void doBlockWork(MapBlock *block);
+
+	// A trigger content of an ActiveBlockModifier and the chance to use
+	struct ActiveABM
+	{
+		ActiveBlockModifier *abm;
+		content_t content;
+		u32 chance;
+	};
+	/*
+		Runs the modifiers on the nodes of the block. Bit c of triggers
+		is set if content c is in abms.
+	*/
+	void runBlockABMs(MapBlock *block, core::array<ActiveABM> &abms,
+			u32 *triggers);
+
 	/*
 		Member variables
 	*/
@@ -291,13 +328,33 @@ class ServerEnvironment : public Environment
 	// List of active blocks
 	ActiveBlockList m_active_blocks;
 	IntervalLimiter m_active_blocks_management_interval;
-	IntervalLimiter m_active_blocks_test_interval;
-	IntervalLimiter m_active_blocks_nodemetadata_interval;
 	// Time from the beginning of the game in seconds.
 	// Incremented in step().
 	u32 m_game_time;
 	// A helper variable for incrementing the latter
 	float m_game_time_fraction_counter;
+	// Active block modifiers and the time since they were run
+	struct ABMWithState
+	{
+		ActiveBlockModifier *abm;
+		IntervalLimiter timer;
+	};
+	core::list<ABMWithState> m_abms;
+	/*
+		The current round of active block work; see stepBlockWork()
+	*/
+	// Time since the round started
+	float m_block_work_timer;
+	// Time the round is for
+	float m_block_work_dtime;
+	// Blocks left in the round, and the number at the start
+	RingQueue<v3s16> m_block_work_queue;
+	u32 m_block_work_count;
+	// The trigger contents of the due ActiveBlockModifiers
+	core::array<ActiveABM> m_active_abms;
+	// Bit c is set if content c is in m_active_abms
+	u32 m_abm_triggers[(MAX_CONTENT+1)/32];
+	IntervalLimiter m_block_work_lag_report_interval;
 };
 
 /*
@@ -313,14 +370,24 @@ class ActiveBlockModifier
 	ActiveBlockModifier(){};
 	virtual ~ActiveBlockModifier(){};
 
-	//virtual core::list<u8> update(ServerEnvironment *env) = 0;
 	virtual u32 getTriggerContentCount(){ return 1;}
-	virtual u8 getTriggerContent(u32 i) = 0;
+	virtual content_t getTriggerContent(u32 i) = 0;
+	// In seconds; kept with a precision of one second
 	virtual float getActiveInterval() = 0;
 	// chance of (1 / return value), 0 is disallowed
 	virtual u32 getActiveChance() = 0;
-	// This is called usually at interval for 1/chance of the nodes
-	virtual void triggerEvent(ServerEnvironment *env, v3s16 p) = 0;
+	/*
+		Whether the modifier is run when a block is activated, with the
+		chance divided by the number of intervals the block was inactive
+	*/
+	virtual bool getSimpleCatchUp(){ return true; }
+	/*
+		This is called usually at interval for 1/chance of the nodes.
+		active_object_count_wider is the number of objects in the block
+		of p and the blocks next to it.
+	*/
+	virtual void triggerEvent(ServerEnvironment *env, v3s16 p, MapNode n,
+			u32 active_object_count_wider) = 0;
 };
 
 #ifndef SERVER
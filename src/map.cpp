@@ -60,13 +60,221 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 			BLOB data
 */
 
+/*
+	Lighting and liquid work split into independent tasks, run by the
+	thread calling Map::updateLighting() or Map::transformLiquids() and
+	the helpers in MapThreadPool.
+
+	Tasks must not look anything up from the Map or set nodes through
+	it: the sector and block caches and the change stamps are not
+	thread-safe.
+*/
+class MapTasks
+{
+public:
+	MapTasks(u32 count):
+		m_count(count),
+		m_next(0)
+	{
+		m_mutex.Init();
+	}
+	virtual ~MapTasks()
+	{
+	}
+
+	virtual void run(u32 i) = 0;
+
+	/*
+		Runs tasks until none are left to be taken.
+		Returns false if there were none to begin with.
+	*/
+	bool work()
+	{
+		bool worked = false;
+		for(;;)
+		{
+			u32 i;
+			{
+				JMutexAutoLock lock(m_mutex);
+				if(m_next >= m_count)
+					return worked;
+				i = m_next++;
+			}
+			run(i);
+			worked = true;
+		}
+	}
+
+private:
+	u32 m_count;
+	u32 m_next;
+	JMutex m_mutex;
+};
+
+class MapThreadPool;
+
+class MapThread : public SimpleThread
+{
+	MapThreadPool *m_pool;
+
+public:
+
+	MapThread(MapThreadPool *pool):
+		SimpleThread(),
+		m_pool(pool)
+	{
+	}
+
+	void * Thread();
+};
+
+class MapThreadPool
+{
+public:
+	/*
+		thread_count includes the thread calling run(), so
+		thread_count-1 helper threads are started.
+	*/
+	MapThreadPool(u16 thread_count):
+		m_tasks(NULL)
+	{
+		m_mutex.Init();
+		for(u16 i=1; i<thread_count; i++)
+		{
+			MapThread *thread = new MapThread(this);
+			m_threads.push_back(thread);
+			thread->Start();
+		}
+	}
+	~MapThreadPool()
+	{
+		for(u32 i=0; i<m_threads.size(); i++)
+			m_threads[i]->setRun(false);
+		// Wake up the helpers so that they see they have to stop
+		for(u32 i=0; i<m_threads.size(); i++)
+			m_work.post();
+		for(u32 i=0; i<m_threads.size(); i++)
+		{
+			m_threads[i]->stop();
+			delete m_threads[i];
+		}
+	}
+
+	/*
+		Runs all the tasks, in the calling thread and the helper
+		threads. If another thread is already using the helpers,
+		the calling thread does all of them.
+	*/
+	void run(MapTasks &tasks)
+	{
+		bool shared = false;
+		{
+			JMutexAutoLock lock(m_mutex);
+			if(m_tasks == NULL)
+			{
+				m_tasks = &tasks;
+				shared = true;
+			}
+		}
+
+		// Wake up every helper once
+		if(shared)
+		{
+			for(u32 i=0; i<m_threads.size(); i++)
+				m_work.post();
+		}
+
+		tasks.work();
+
+		if(shared == false)
+			return;
+
+		// Wait for the helpers to finish the tasks they took
+		for(u32 i=0; i<m_threads.size(); i++)
+			m_done.wait();
+		{
+			JMutexAutoLock lock(m_mutex);
+			m_tasks = NULL;
+		}
+	}
+
+	/*
+		Called by the helper threads. Waits until run() has tasks
+		to help with (or the pool is being deleted), works on them
+		and tells run() when done.
+	*/
+	void help()
+	{
+		m_work.wait();
+
+		MapTasks *tasks;
+		{
+			JMutexAutoLock lock(m_mutex);
+			tasks = m_tasks;
+		}
+		// Woken up by the destructor
+		if(tasks == NULL)
+			return;
+
+		tasks->work();
+
+		m_done.post();
+	}
+
+private:
+	JMutex m_mutex;
+	// Tasks being run; NULL if none
+	MapTasks *m_tasks;
+	// Posted by run() once for each helper when there are tasks
+	Semaphore m_work;
+	// Posted by each helper when it has finished with the tasks
+	Semaphore m_done;
+	core::array<MapThread*> m_threads;
+};
+
+void * MapThread::Thread()
+{
+	ThreadStarted();
+
+	log_register_thread("MapThread");
+
+	DSTACK(__FUNCTION_NAME);
+
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	while(getRun())
+	{
+		m_pool->help();
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	return NULL;
+}
+
+static void run_map_tasks(MapThreadPool *pool,
+		MapTasks &tasks)
+{
+	if(pool)
+		pool->run(tasks);
+	else
+		tasks.work();
+}
+
 /*
 	Map
 */
 
 Map::Map(std::ostream &dout):
 	m_dout(dout),
-	m_sector_cache(NULL)
+	m_sector_cache(NULL),
+	m_block_change_stamp(0),
+	m_send_cache_size(0),
+	m_send_cache_stamp(0),
+	m_thread_pool(NULL),
+	m_active_liquid_count(0),
+	m_liquid_phase(0),
+	m_liquid_phase_started(false)
 {
 	/*m_sector_mutex.Init();
 	assert(m_sector_mutex.IsInitialized());*/
@@ -74,6 +282,8 @@ Map::Map(std::ostream &dout):
 
 Map::~Map()
 {
+	delete m_thread_pool;
+
 	/*
 		Free all MapSectors
 	*/
@@ -214,28 +424,75 @@ void Map::setNode(v3s16 p, MapNode & n)
 
 
 /*
-	Goes recursively through the neighbours of the node.
+	Block lookup cache for the light algorithms.
+
+	Keeps the last looked up block so that following nodes in it don't
+	go through the sector lookup again. Inexistent and dummy blocks are
+	returned as NULL instead of throwing InvalidPositionException.
+*/
+class LightBlockCache
+{
+public:
+	LightBlockCache(Map *map):
+		m_map(map),
+		m_block(NULL),
+		m_valid(false)
+	{
+	}
+
+	// Returns the block of p and sets relpos to the position of p in it
+	MapBlock * get(v3s16 p, v3s16 &relpos)
+	{
+		v3s16 blockpos = getNodeBlockPos(p);
+		if(m_valid == false || blockpos != m_blockpos)
+		{
+			m_block = m_map->getBlockNoCreateNoEx(blockpos);
+			if(m_block != NULL && m_block->isDummy())
+				m_block = NULL;
+			m_blockpos = blockpos;
+			m_valid = true;
+		}
+		relpos = p - blockpos * MAP_BLOCKSIZE;
+		return m_block;
+	}
+
+private:
+	Map *m_map;
+	MapBlock *m_block;
+	v3s16 m_blockpos;
+	bool m_valid;
+};
+
+static inline bool relpos_in_block(v3s16 relpos)
+{
+	return (relpos.X >= 0 && relpos.X < MAP_BLOCKSIZE
+			&& relpos.Y >= 0 && relpos.Y < MAP_BLOCKSIZE
+			&& relpos.Z >= 0 && relpos.Z < MAP_BLOCKSIZE);
+}
+
+/*
+	Goes through the neighbours of the queued nodes, for all the banks
+	of each node at once.
 
 	Alters only transparent nodes.
 
 	If the lighting of the neighbour is lower than the lighting of
 	the node was (before changing it to 0 at the step before), the
-	lighting of the neighbour is set to 0 and then the same stuff
-	repeats for the neighbour.
+	lighting of the neighbour is set to 0 and it is queued so that
+	the same stuff repeats for the neighbour.
 
-	The ending nodes of the routine are stored in light_sources.
+	The ending nodes of the routine are queued in light_sources.
 	This is useful when a light is removed. In such case, this
-	routine can be called for the light node and then again for
-	light_sources to re-light the area without the removed light.
+	routine can be called for the light node and then spreadLight()
+	for light_sources to re-light the area without the removed light.
 
-	values of from_nodes are lighting values.
+	The light of from_nodes is their old light, packed like param1.
 */
-void Map::unspreadLight(enum LightBank bank,
-		core::map<v3s16, u8> & from_nodes,
-		core::map<v3s16, bool> & light_sources,
-		core::map<v3s16, MapBlock*>  & modified_blocks)
+void Map::unspreadLight(LightQueue & from_nodes,
+		LightQueue & light_sources,
+		core::map<v3s16, MapBlock*> & modified_blocks)
 {
-	v3s16 dirs[6] = {
+	const v3s16 dirs[6] = {
 		v3s16(0,0,1), // back
 		v3s16(0,1,0), // top
 		v3s16(1,0,0), // right
@@ -243,178 +500,109 @@ void Map::unspreadLight(enum LightBank bank,
 		v3s16(0,-1,0), // bottom
 		v3s16(-1,0,0), // left
 	};
-	
-	if(from_nodes.size() == 0)
-		return;
-	
-	u32 blockchangecount = 0;
-
-	core::map<v3s16, u8> unlighted_nodes;
-	core::map<v3s16, u8>::Iterator j;
-	j = from_nodes.getIterator();
 
 	/*
-		Initialize block cache
+		Block of the current node and of its neighbours
+		that are in other blocks
 	*/
-	v3s16 blockpos_last;
-	MapBlock *block = NULL;
-	// Cache this a bit, too
-	bool block_checked_in_modified = false;
-	
-	for(; j.atEnd() == false; j++)
-	{
-		v3s16 pos = j.getNode()->getKey();
-		v3s16 blockpos = getNodeBlockPos(pos);
-		
-		// Only fetch a new block if the block position has changed
-		try{
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
+	LightBlockCache block_cache(this);
+	LightBlockCache neighbor_cache(this);
+	MapBlock *modified_last = NULL;
 
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
-		}
-		catch(InvalidPositionException &e)
-		{
-			continue;
-		}
+	while(from_nodes.empty() == false)
+	{
+		LightQueueNode q = from_nodes.pop_front();
 
-		if(block->isDummy())
+		v3s16 relpos;
+		MapBlock *block = block_cache.get(q.p, relpos);
+		if(block == NULL)
 			continue;
 
-		// Calculate relative position in block
-		v3s16 relpos = pos - blockpos_last * MAP_BLOCKSIZE;
-
-		// Get node straight from the block
-		MapNode n = block->getNode(relpos);
-
-		u8 oldlight = j.getNode()->getValue();
-
 		// Loop through 6 neighbors
 		for(u16 i=0; i<6; i++)
 		{
 			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
-
-			// Get the block where the node is located
-			v3s16 blockpos = getNodeBlockPos(n2pos);
+			v3s16 n2pos = q.p + dirs[i];
 
-			try
-			{
-				// Only fetch a new block if the block position has changed
-				try{
-					if(block == NULL || blockpos != blockpos_last){
-						block = getBlockNoCreate(blockpos);
-						blockpos_last = blockpos;
+			v3s16 relpos2 = relpos + dirs[i];
+			MapBlock *block2 = block;
+			if(relpos_in_block(relpos2) == false)
+				block2 = neighbor_cache.get(n2pos, relpos2);
+			if(block2 == NULL)
+				continue;
 
-						block_checked_in_modified = false;
-						blockchangecount++;
-					}
-				}
-				catch(InvalidPositionException &e)
-				{
-					continue;
-				}
+			MapNode n2 = block2->getNodeNoCheck(relpos2);
 
-				// Calculate relative position in block
-				v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
-				// Get node straight from the block
-				MapNode n2 = block->getNode(relpos);
+			u8 light2 = n2.getLightBanksWithSource();
+			bool propagates = n2.light_propagates();
+			u8 unlighted = 0;
+			u8 sources = 0;
 
-				bool changed = false;
+			for(u8 bank=0; bank<2; bank++)
+			{
+				if((q.banks & (1<<bank)) == 0)
+					continue;
 
-				//TODO: Optimize output by optimizing light_sources?
+				u8 oldlight = light_of_bank(q.light, bank);
+				u8 current_light = light_of_bank(light2, bank);
 
 				/*
-					If the neighbor is dimmer than what was specified
-					as oldlight (the light of the previous node)
+					If the neighbor is dimmer than the node was,
+					unlight it if it is transparent and has some light.
+					Otherwise it will light this node up again.
 				*/
-				if(n2.getLight(bank) < oldlight)
+				if(current_light < oldlight)
 				{
-					/*
-						And the neighbor is transparent and it has some light
-					*/
-					if(n2.light_propagates() && n2.getLight(bank) != 0)
+					if(propagates && current_light != 0)
 					{
-						/*
-							Set light to 0 and add to queue
-						*/
-
-						u8 current_light = n2.getLight(bank);
-						n2.setLight(bank, 0);
-						block->setNode(relpos, n2);
-
-						unlighted_nodes.insert(n2pos, current_light);
-						changed = true;
-
-						/*
-							Remove from light_sources if it is there
-							NOTE: This doesn't happen nearly at all
-						*/
-						/*if(light_sources.find(n2pos))
-						{
-							infostream<<"Removed from light_sources"<<std::endl;
-							light_sources.remove(n2pos);
-						}*/
+						n2.setLight((enum LightBank)bank, 0);
+						unlighted |= 1<<bank;
 					}
-
-					/*// DEBUG
-					if(light_sources.find(n2pos) != NULL)
-						light_sources.remove(n2pos);*/
 				}
-				else{
-					light_sources.insert(n2pos, true);
+				else
+				{
+					sources |= 1<<bank;
 				}
+			}
+
+			if(unlighted != 0)
+			{
+				block2->setNodeNoCheck(relpos2, n2);
+				from_nodes.push_back(LightQueueNode(n2pos, unlighted, light2));
 
 				// Add to modified_blocks
-				if(changed == true && block_checked_in_modified == false)
+				if(block2 != modified_last)
 				{
-					// If the block is not found in modified_blocks, add.
-					if(modified_blocks.find(blockpos) == NULL)
-					{
-						modified_blocks.insert(blockpos, block);
-					}
-					block_checked_in_modified = true;
+					modified_blocks.insert(block2->getPos(), block2);
+					modified_last = block2;
 				}
 			}
-			catch(InvalidPositionException &e)
-			{
-				continue;
-			}
+
+			if(sources != 0)
+				light_sources.push_back(LightQueueNode(n2pos, sources));
 		}
 	}
-
-	/*infostream<<"unspreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-
-	if(unlighted_nodes.size() > 0)
-		unspreadLight(bank, unlighted_nodes, light_sources, modified_blocks);
 }
 
 /*
 	A single-node wrapper of the above
 */
-void Map::unLightNeighbors(enum LightBank bank,
+void Map::unLightNeighbors(u8 banks,
 		v3s16 pos, u8 lightwas,
-		core::map<v3s16, bool> & light_sources,
-		core::map<v3s16, MapBlock*>  & modified_blocks)
+		LightQueue & light_sources,
+		core::map<v3s16, MapBlock*> & modified_blocks)
 {
-	core::map<v3s16, u8> from_nodes;
-	from_nodes.insert(pos, lightwas);
+	LightQueue from_nodes;
+	from_nodes.push_back(LightQueueNode(pos, banks, lightwas));
 
-	unspreadLight(bank, from_nodes, light_sources, modified_blocks);
+	unspreadLight(from_nodes, light_sources, modified_blocks);
 }
 
 /*
-	Lights neighbors of from_nodes, collects all them and then
-	goes on recursively.
+	Lights neighbors of the queued nodes and queues them in turn,
+	for all the banks of each node at once.
 */
-void Map::spreadLight(enum LightBank bank,
-		core::map<v3s16, bool> & from_nodes,
+void Map::spreadLight(LightQueue & from_nodes,
 		core::map<v3s16, MapBlock*> & modified_blocks)
 {
 	const v3s16 dirs[6] = {
@@ -426,152 +614,101 @@ void Map::spreadLight(enum LightBank bank,
 		v3s16(-1,0,0), // left
 	};
 
-	if(from_nodes.size() == 0)
-		return;
-
-	u32 blockchangecount = 0;
-
-	core::map<v3s16, bool> lighted_nodes;
-	core::map<v3s16, bool>::Iterator j;
-	j = from_nodes.getIterator();
-
 	/*
-		Initialize block cache
+		Block of the current node and of its neighbours
+		that are in other blocks
 	*/
-	v3s16 blockpos_last;
-	MapBlock *block = NULL;
-	// Cache this a bit, too
-	bool block_checked_in_modified = false;
+	LightBlockCache block_cache(this);
+	LightBlockCache neighbor_cache(this);
+	MapBlock *modified_last = NULL;
 
-	for(; j.atEnd() == false; j++)
-	//for(; j != from_nodes.end(); j++)
+	while(from_nodes.empty() == false)
 	{
-		v3s16 pos = j.getNode()->getKey();
-		//v3s16 pos = *j;
-		//infostream<<"pos=("<<pos.X<<","<<pos.Y<<","<<pos.Z<<")"<<std::endl;
-		v3s16 blockpos = getNodeBlockPos(pos);
+		LightQueueNode q = from_nodes.pop_front();
 
-		// Only fetch a new block if the block position has changed
-		try{
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
-
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
-		}
-		catch(InvalidPositionException &e)
-		{
-			continue;
-		}
-
-		if(block->isDummy())
+		v3s16 relpos;
+		MapBlock *block = block_cache.get(q.p, relpos);
+		if(block == NULL)
 			continue;
 
-		// Calculate relative position in block
-		v3s16 relpos = pos - blockpos_last * MAP_BLOCKSIZE;
-
-		// Get node straight from the block
-		MapNode n = block->getNode(relpos);
-
-		u8 oldlight = n.getLight(bank);
-		u8 newlight = diminish_light(oldlight);
+		u8 light = block->getNodeNoCheck(relpos).getLightBanksWithSource();
 
 		// Loop through 6 neighbors
-		for(u16 i=0; i<6; i++){
+		for(u16 i=0; i<6; i++)
+		{
 			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
+			v3s16 n2pos = q.p + dirs[i];
 
-			// Get the block where the node is located
-			v3s16 blockpos = getNodeBlockPos(n2pos);
+			v3s16 relpos2 = relpos + dirs[i];
+			MapBlock *block2 = block;
+			if(relpos_in_block(relpos2) == false)
+				block2 = neighbor_cache.get(n2pos, relpos2);
+			if(block2 == NULL)
+				continue;
 
-			try
-			{
-				// Only fetch a new block if the block position has changed
-				try{
-					if(block == NULL || blockpos != blockpos_last){
-						block = getBlockNoCreate(blockpos);
-						blockpos_last = blockpos;
+			MapNode n2 = block2->getNodeNoCheck(relpos2);
 
-						block_checked_in_modified = false;
-						blockchangecount++;
-					}
-				}
-				catch(InvalidPositionException &e)
-				{
+			u8 light2 = n2.getLightBanksWithSource();
+			bool propagates = n2.light_propagates();
+			u8 queued = 0;
+			u8 lighted = 0;
+
+			for(u8 bank=0; bank<2; bank++)
+			{
+				if((q.banks & (1<<bank)) == 0)
 					continue;
-				}
 
-				// Calculate relative position in block
-				v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
-				// Get node straight from the block
-				MapNode n2 = block->getNode(relpos);
+				u8 oldlight = light_of_bank(light, bank);
+				u8 newlight = diminish_light(oldlight);
+				u8 current_light = light_of_bank(light2, bank);
 
-				bool changed = false;
 				/*
 					If the neighbor is brighter than the current node,
-					add to list (it will light up this node on its turn)
+					queue it (it will light up this node on its turn)
 				*/
-				if(n2.getLight(bank) > undiminish_light(oldlight))
+				if(current_light > undiminish_light(oldlight))
 				{
-					lighted_nodes.insert(n2pos, true);
-					//lighted_nodes.push_back(n2pos);
-					changed = true;
+					queued |= 1<<bank;
 				}
 				/*
 					If the neighbor is dimmer than how much light this node
-					would spread on it, add to list
+					would spread on it, light it and queue it
 				*/
-				if(n2.getLight(bank) < newlight)
+				if(current_light < newlight && propagates)
 				{
-					if(n2.light_propagates())
-					{
-						n2.setLight(bank, newlight);
-						block->setNode(relpos, n2);
-						lighted_nodes.insert(n2pos, true);
-						//lighted_nodes.push_back(n2pos);
-						changed = true;
-					}
+					n2.setLight((enum LightBank)bank, newlight);
+					lighted |= 1<<bank;
 				}
+			}
+
+			if(lighted != 0)
+			{
+				block2->setNodeNoCheck(relpos2, n2);
 
 				// Add to modified_blocks
-				if(changed == true && block_checked_in_modified == false)
+				if(block2 != modified_last)
 				{
-					// If the block is not found in modified_blocks, add.
-					if(modified_blocks.find(blockpos) == NULL)
-					{
-						modified_blocks.insert(blockpos, block);
-					}
-					block_checked_in_modified = true;
+					modified_blocks.insert(block2->getPos(), block2);
+					modified_last = block2;
 				}
 			}
-			catch(InvalidPositionException &e)
-			{
-				continue;
-			}
+
+			if((queued | lighted) != 0)
+				from_nodes.push_back(LightQueueNode(n2pos, queued | lighted));
 		}
 	}
-
-	/*infostream<<"spreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-
-	if(lighted_nodes.size() > 0)
-		spreadLight(bank, lighted_nodes, modified_blocks);
 }
 
 /*
 	A single-node source variation of the above.
 */
-void Map::lightNeighbors(enum LightBank bank,
+void Map::lightNeighbors(u8 banks,
 		v3s16 pos,
 		core::map<v3s16, MapBlock*> & modified_blocks)
 {
-	core::map<v3s16, bool> from_nodes;
-	from_nodes.insert(pos, true);
-	spreadLight(bank, from_nodes, modified_blocks);
+	LightQueue from_nodes;
+	from_nodes.push_back(LightQueueNode(pos, banks));
+	spreadLight(from_nodes, modified_blocks);
 }
 
 v3s16 Map::getBrightestNeighbour(enum LightBank bank, v3s16 p)
@@ -667,8 +804,136 @@ s16 Map::propagateSunlight(v3s16 start,
 	return y + 1;
 }
 
-void Map::updateLighting(enum LightBank bank,
-		core::map<v3s16, MapBlock*> & a_blocks,
+/*
+	Spreads light separately in each of the given areas of vmanip.
+	Light crossing the borders of the areas has to be spread
+	afterwards.
+*/
+class SpreadLightTasks : public MapTasks
+{
+public:
+	SpreadLightTasks(VoxelManipulator &vmanip,
+			core::array<VoxelArea> &areas):
+		MapTasks(areas.size()),
+		m_vmanip(vmanip),
+		m_areas(areas)
+	{
+		for(u32 i=0; i<m_areas.size(); i++)
+			m_queues.push_back(new LightQueue);
+	}
+	~SpreadLightTasks()
+	{
+		for(u32 i=0; i<m_queues.size(); i++)
+			delete m_queues[i];
+	}
+
+	LightQueue & getQueue(u32 i)
+	{
+		return *m_queues[i];
+	}
+
+	void run(u32 i)
+	{
+		m_vmanip.spreadLight(*m_queues[i], m_areas[i]);
+	}
+
+private:
+	VoxelManipulator &m_vmanip;
+	core::array<VoxelArea> &m_areas;
+	core::array<LightQueue*> m_queues;
+};
+
+/*
+	Copies the changed nodes of vmanip to the blocks
+*/
+class BlitLightTasks : public MapTasks
+{
+public:
+	BlitLightTasks(VoxelManipulator &vmanip,
+			core::array<MapBlock*> &blocks):
+		MapTasks(blocks.size()),
+		m_vmanip(vmanip),
+		m_blocks(blocks)
+	{
+		m_changed.set_used(m_blocks.size());
+	}
+
+	core::array<u16> & getChanged(u32 i)
+	{
+		return m_changed[i];
+	}
+
+	void run(u32 i)
+	{
+		m_blocks[i]->copyChangedFrom(m_vmanip, m_changed[i]);
+	}
+
+private:
+	VoxelManipulator &m_vmanip;
+	core::array<MapBlock*> &m_blocks;
+	core::array<core::array<u16> > m_changed;
+};
+
+/*
+	Checks whether day and night light differ in the blocks
+*/
+class DayNightDiffTasks : public MapTasks
+{
+public:
+	DayNightDiffTasks(core::array<MapBlock*> &blocks):
+		MapTasks(blocks.size()),
+		m_blocks(blocks)
+	{
+		m_differs.set_used(m_blocks.size());
+	}
+
+	bool getDiffers(u32 i)
+	{
+		return m_differs[i];
+	}
+
+	void run(u32 i)
+	{
+		m_differs[i] = m_blocks[i]->calcDayNightDiff();
+	}
+
+private:
+	core::array<MapBlock*> &m_blocks;
+	core::array<bool> m_differs;
+};
+
+/*
+	Queues the lighted nodes on the faces of area
+*/
+static void push_area_faces(LightQueue &queue, VoxelManipulator &vmanip,
+		const VoxelArea &area)
+{
+	const v3s16 &a = area.MinEdge;
+	const v3s16 &b = area.MaxEdge;
+	for(s16 z=a.Z; z<=b.Z; z++)
+	for(s16 y=a.Y; y<=b.Y; y++)
+	{
+		bool whole_row = (z == a.Z || z == b.Z || y == a.Y || y == b.Y);
+		s16 step = whole_row ? 1 : MYMAX(b.X - a.X, 1);
+		for(s16 x=a.X; x<=b.X; x+=step)
+		{
+			v3s16 p(x,y,z);
+			u32 i = vmanip.m_area.index(p);
+			if(vmanip.m_flags[i] & (VOXELFLAG_INEXISTENT | VOXELFLAG_NOT_LOADED))
+				continue;
+			u8 light = vmanip.m_data[i].getLightBanksWithSource();
+			u8 banks = 0;
+			if(light_of_bank(light, LIGHTBANK_DAY) != 0)
+				banks |= LIGHTBANKS_DAY;
+			if(light_of_bank(light, LIGHTBANK_NIGHT) != 0)
+				banks |= LIGHTBANKS_NIGHT;
+			if(banks != 0)
+				queue.push_back(LightQueueNode(p, banks));
+		}
+	}
+}
+
+void Map::updateLighting(core::map<v3s16, MapBlock*> & a_blocks,
 		core::map<v3s16, MapBlock*> & modified_blocks)
 {
 	/*m_dout<<DTIME<<"Map::updateLighting(): "
@@ -676,15 +941,11 @@ void Map::updateLighting(enum LightBank bank,
 
 	//TimeTaker timer("updateLighting");
 
-	// For debugging
-	//bool debug=true;
-	//u32 count_was = modified_blocks.size();
-
 	core::map<v3s16, MapBlock*> blocks_to_update;
 
-	core::map<v3s16, bool> light_sources;
+	core::map<v3s16, bool> sunlight_sources;
 
-	core::map<v3s16, u8> unlight_from;
+	LightQueue unlight_from;
 
 	core::map<v3s16, MapBlock*>::Iterator i;
 	i = a_blocks.getIterator();
@@ -692,6 +953,13 @@ void Map::updateLighting(enum LightBank bank,
 	{
 		MapBlock *block = i.getNode()->getValue();
 
+		/*
+			Both banks are updated in the requested blocks. Blocks
+			below them are updated only for the day bank, as far as
+			sunlight has to be propagated down.
+		*/
+		u8 banks = LIGHTBANKS_BOTH;
+
 		for(;;)
 		{
 			// Don't bother with dummy blocks.
@@ -710,56 +978,31 @@ void Map::updateLighting(enum LightBank bank,
 			for(s16 x=0; x<MAP_BLOCKSIZE; x++)
 			for(s16 y=0; y<MAP_BLOCKSIZE; y++)
 			{
-
-				try{
-					v3s16 p(x,y,z);
-					MapNode n = block->getNode(v3s16(x,y,z));
-					u8 oldlight = n.getLight(bank);
-					n.setLight(bank, 0);
-					block->setNode(v3s16(x,y,z), n);
-
-					// Collect borders for unlighting
-					if(x==0 || x == MAP_BLOCKSIZE-1
-					|| y==0 || y == MAP_BLOCKSIZE-1
-					|| z==0 || z == MAP_BLOCKSIZE-1)
-					{
-						v3s16 p_map = p + v3s16(
-								MAP_BLOCKSIZE*pos.X,
-								MAP_BLOCKSIZE*pos.Y,
-								MAP_BLOCKSIZE*pos.Z);
-						unlight_from.insert(p_map, oldlight);
-					}
-				}
-				catch(InvalidPositionException &e)
+				v3s16 p(x,y,z);
+				MapNode n = block->getNodeNoCheck(p);
+				u8 oldlight = n.getLightBanksWithSource();
+				if(banks & LIGHTBANKS_DAY)
+					n.setLight(LIGHTBANK_DAY, 0);
+				if(banks & LIGHTBANKS_NIGHT)
+					n.setLight(LIGHTBANK_NIGHT, 0);
+				block->setNodeNoCheck(p, n);
+
+				// Collect borders for unlighting
+				if(x==0 || x == MAP_BLOCKSIZE-1
+				|| y==0 || y == MAP_BLOCKSIZE-1
+				|| z==0 || z == MAP_BLOCKSIZE-1)
 				{
-					/*
-						This would happen when dealing with a
-						dummy block.
-					*/
-					//assert(0);
-					infostream<<"updateLighting(): InvalidPositionException"
-							<<std::endl;
+					v3s16 p_map = p + pos*MAP_BLOCKSIZE;
+					unlight_from.push_back(
+							LightQueueNode(p_map, banks, oldlight));
 				}
 			}
 
-			if(bank == LIGHTBANK_DAY)
-			{
-				bool bottom_valid = block->propagateSunlight(light_sources);
+			bool bottom_valid = block->propagateSunlight(sunlight_sources);
 
-				// If bottom is valid, we're done.
-				if(bottom_valid)
-					break;
-			}
-			else if(bank == LIGHTBANK_NIGHT)
-			{
-				// For night lighting, sunlight is not propagated
+			// If bottom is valid, we're done.
+			if(bottom_valid)
 				break;
-			}
-			else
-			{
-				// Invalid lighting bank
-				assert(0);
-			}
 
 			/*infostream<<"Bottom for sunlight-propagated block ("
 					<<pos.X<<","<<pos.Y<<","<<pos.Z<<") not valid"
@@ -768,14 +1011,11 @@ void Map::updateLighting(enum LightBank bank,
 			// Bottom sunlight is not valid; get the block and loop to it
 
 			pos.Y--;
-			try{
-				block = getBlockNoCreate(pos);
-			}
-			catch(InvalidPositionException &e)
-			{
-				assert(0);
-			}
+			block = getBlockNoCreateNoEx(pos);
+			assert(block != NULL);
 
+			// For night lighting, sunlight is not propagated
+			banks = LIGHTBANKS_DAY;
 		}
 	}
 	
@@ -798,32 +1038,6 @@ void Map::updateLighting(enum LightBank bank,
 	}
 #endif
 
-#if 0
-	{
-		TimeTaker timer("unspreadLight");
-		unspreadLight(bank, unlight_from, light_sources, modified_blocks);
-	}
-
-	if(debug)
-	{
-		u32 diff = modified_blocks.size() - count_was;
-		count_was = modified_blocks.size();
-		infostream<<"unspreadLight modified "<<diff<<std::endl;
-	}
-
-	{
-		TimeTaker timer("spreadLight");
-		spreadLight(bank, light_sources, modified_blocks);
-	}
-
-	if(debug)
-	{
-		u32 diff = modified_blocks.size() - count_was;
-		count_was = modified_blocks.size();
-		infostream<<"spreadLight modified "<<diff<<std::endl;
-	}
-#endif
-
 	{
 		//MapVoxelManipulator vmanip(this);
 
@@ -864,41 +1078,119 @@ void Map::updateLighting(enum LightBank bank,
 			block->setLightingExpired(false);
 		}
 
+		LightQueue light_sources;
 		{
 			//TimeTaker timer("unSpreadLight");
-			vmanip.unspreadLight(bank, unlight_from, light_sources);
+			vmanip.unspreadLight(unlight_from, light_sources);
+		}
+		for(core::map<v3s16, bool>::Iterator
+				j = sunlight_sources.getIterator();
+				j.atEnd() == false; j++)
+		{
+			light_sources.push_back(LightQueueNode(
+					j.getNode()->getKey(), LIGHTBANKS_DAY));
+		}
+
+		/*
+			Columns of the updated blocks
+		*/
+		core::map<v2s16, u32> column_ids;
+		core::array<VoxelArea> column_areas;
+		if(m_thread_pool)
+		{
+			for(i = blocks_to_update.getIterator(); i.atEnd() == false; i++)
+			{
+				v3s16 p = i.getNode()->getKey();
+				VoxelArea a(p*MAP_BLOCKSIZE,
+						(p+1)*MAP_BLOCKSIZE - v3s16(1,1,1));
+				v2s16 p2d(p.X, p.Z);
+				core::map<v2s16, u32>::Node *n = column_ids.find(p2d);
+				if(n)
+				{
+					column_areas[n->getValue()].addArea(a);
+				}
+				else
+				{
+					column_ids.insert(p2d, column_areas.size());
+					column_areas.push_back(a);
+				}
+			}
 		}
+
+		if(column_areas.size() >= 2)
+		{
+			/*
+				Spread light in each column in parallel, then spread
+				it from the column faces and the sources outside the
+				columns over the whole area. Light only grows while
+				spreading, so the result is the same as when spreading
+				everything at once.
+			*/
+			SpreadLightTasks tasks(vmanip, column_areas);
+			LightQueue stitch;
+			while(light_sources.empty() == false)
+			{
+				LightQueueNode q = light_sources.pop_front();
+				v3s16 blockpos = getNodeBlockPos(q.p);
+				core::map<v2s16, u32>::Node *n =
+						column_ids.find(v2s16(blockpos.X, blockpos.Z));
+				if(n && column_areas[n->getValue()].contains(q.p))
+					tasks.getQueue(n->getValue()).push_back(q);
+				else
+					stitch.push_back(q);
+			}
+			{
+				//TimeTaker timer("spreadLight");
+				run_map_tasks(m_thread_pool, tasks);
+			}
+			for(u32 j=0; j<column_areas.size(); j++)
+				push_area_faces(stitch, vmanip, column_areas[j]);
+			vmanip.spreadLight(stitch);
+		}
+		else
 		{
 			//TimeTaker timer("spreadLight");
-			vmanip.spreadLight(bank, light_sources);
+			vmanip.spreadLight(light_sources);
 		}
+
 		{
 			//TimeTaker timer("blitBack");
-			vmanip.blitBack(modified_blocks);
+			core::array<MapBlock*> blocks;
+			vmanip.getLoadedBlocks(blocks);
+			BlitLightTasks tasks(vmanip, blocks);
+			run_map_tasks(m_thread_pool, tasks);
+			for(u32 j=0; j<blocks.size(); j++)
+			{
+				core::array<u16> &changed = tasks.getChanged(j);
+				if(changed.empty())
+					continue;
+				MapBlock *block = blocks[j];
+				block->nodesChanged(changed);
+				modified_blocks[block->getPos()] = block;
+			}
 		}
 		/*infostream<<"emerge_time="<<emerge_time<<std::endl;
 		emerge_time = 0;*/
 	}
 
-	//m_dout<<"Done ("<<getTimestamp()<<")"<<std::endl;
-}
-
-void Map::updateLighting(core::map<v3s16, MapBlock*> & a_blocks,
-		core::map<v3s16, MapBlock*> & modified_blocks)
-{
-	updateLighting(LIGHTBANK_DAY, a_blocks, modified_blocks);
-	updateLighting(LIGHTBANK_NIGHT, a_blocks, modified_blocks);
-
 	/*
 		Update information about whether day and night light differ
 	*/
-	for(core::map<v3s16, MapBlock*>::Iterator
-			i = modified_blocks.getIterator();
-			i.atEnd() == false; i++)
 	{
-		MapBlock *block = i.getNode()->getValue();
-		block->updateDayNightDiff();
+		core::array<MapBlock*> blocks;
+		for(core::map<v3s16, MapBlock*>::Iterator
+				i = modified_blocks.getIterator();
+				i.atEnd() == false; i++)
+		{
+			blocks.push_back(i.getNode()->getValue());
+		}
+		DayNightDiffTasks tasks(blocks);
+		run_map_tasks(m_thread_pool, tasks);
+		for(u32 j=0; j<blocks.size(); j++)
+			blocks[j]->setDayNightDiff(tasks.getDiffers(j));
 	}
+
+	//m_dout<<"Done ("<<getTimestamp()<<")"<<std::endl;
 }
 
 /*
@@ -931,7 +1223,7 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 	v3s16 bottompos = p + v3s16(0,-1,0);
 
 	bool node_under_sunlight = true;
-	core::map<v3s16, bool> light_sources;
+	LightQueue light_sources;
 
 	/*
 		If there is a node at top and it doesn't have sunlight,
@@ -985,17 +1277,8 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 	/*
 		Remove all light that has come out of this node
 	*/
-
-	enum LightBank banks[] =
-	{
-		LIGHTBANK_DAY,
-		LIGHTBANK_NIGHT
-	};
-	for(s32 i=0; i<2; i++)
 	{
-		enum LightBank bank = banks[i];
-
-		u8 lightwas = getNode(p).getLight(bank);
+		u8 lightwas = getNode(p).getLightBanksWithSource();
 
 		// Add the block of the added node to modified_blocks
 		v3s16 blockpos = getNodeBlockPos(p);
@@ -1010,9 +1293,11 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 		// to 0.
 		// This also collects the nodes at the border which will spread
 		// light again into this.
-		unLightNeighbors(bank, p, lightwas, light_sources, modified_blocks);
+		unLightNeighbors(LIGHTBANKS_BOTH, p, lightwas,
+				light_sources, modified_blocks);
 
-		n.setLight(bank, 0);
+		n.setLight(LIGHTBANK_DAY, 0);
+		n.setLight(LIGHTBANK_NIGHT, 0);
 	}
 
 	/*
@@ -1067,8 +1352,8 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 
 			if(n2.getLight(LIGHTBANK_DAY) == LIGHT_SUN)
 			{
-				unLightNeighbors(LIGHTBANK_DAY,
-						n2pos, n2.getLight(LIGHTBANK_DAY),
+				unLightNeighbors(LIGHTBANKS_DAY,
+						n2pos, n2.getLightBanksWithSource(),
 						light_sources, modified_blocks);
 				n2.setLight(LIGHTBANK_DAY, 0);
 				setNode(n2pos, n2);
@@ -1078,15 +1363,10 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 		}
 	}
 
-	for(s32 i=0; i<2; i++)
-	{
-		enum LightBank bank = banks[i];
-
-		/*
-			Spread light from all nodes that might be capable of doing so
-		*/
-		spreadLight(bank, light_sources, modified_blocks);
-	}
+	/*
+		Spread light from all nodes that might be capable of doing so
+	*/
+	spreadLight(light_sources, modified_blocks);
 
 	/*
 		Update information about whether day and night light differ
@@ -1122,7 +1402,7 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 		MapNode n2 = getNode(p2);
 		if(content_liquid(n2.getContent()) || n2.getContent() == CONTENT_AIR)
 		{
-			m_transforming_liquid.push_back(p2);
+			activateLiquid(p2);
 		}
 
 		}catch(InvalidPositionException &e)
@@ -1161,24 +1441,14 @@ void Map::removeNodeAndUpdate(v3s16 p,
 	{
 	}
 
-	core::map<v3s16, bool> light_sources;
+	LightQueue light_sources;
 
-	enum LightBank banks[] =
-	{
-		LIGHTBANK_DAY,
-		LIGHTBANK_NIGHT
-	};
-	for(s32 i=0; i<2; i++)
-	{
-		enum LightBank bank = banks[i];
-
-		/*
-			Unlight neighbors (in case the node is a light source)
-		*/
-		unLightNeighbors(bank, p,
-				getNode(p).getLight(bank),
-				light_sources, modified_blocks);
-	}
+	/*
+		Unlight neighbors (in case the node is a light source)
+	*/
+	unLightNeighbors(LIGHTBANKS_BOTH, p,
+			getNode(p).getLightBanksWithSource(),
+			light_sources, modified_blocks);
 
 
 	//j
@@ -1219,15 +1489,10 @@ void Map::removeNodeAndUpdate(v3s16 p,
 	n.setContent(replace_material);
 	setNode(p, n);
 
-	for(s32 i=0; i<2; i++)
-	{
-		enum LightBank bank = banks[i];
-
-		/*
-			Recalculate lighting
-		*/
-		spreadLight(bank, light_sources, modified_blocks);
-	}
+	/*
+		Recalculate lighting
+	*/
+	spreadLight(light_sources, modified_blocks);
 
 	/*
 		If the removed node was under sunlight, propagate the
@@ -1240,6 +1505,7 @@ void Map::removeNodeAndUpdate(v3s16 p,
 		/*m_dout<<DTIME<<"Node was under sunlight. "
 				"Propagating sunlight";
 		m_dout<<DTIME<<" -> ybottom="<<ybottom<<std::endl;*/
+		LightQueue sunlit_nodes;
 		s16 y = p.Y;
 		for(; y >= ybottom; y--)
 		{
@@ -1247,8 +1513,9 @@ void Map::removeNodeAndUpdate(v3s16 p,
 			/*m_dout<<DTIME<<"lighting neighbors of node ("
 					<<p2.X<<","<<p2.Y<<","<<p2.Z<<")"
 					<<std::endl;*/
-			lightNeighbors(LIGHTBANK_DAY, p2, modified_blocks);
+			sunlit_nodes.push_back(LightQueueNode(p2, LIGHTBANKS_DAY));
 		}
+		spreadLight(sunlit_nodes, modified_blocks);
 	}
 	else
 	{
@@ -1265,6 +1532,11 @@ void Map::removeNodeAndUpdate(v3s16 p,
 		}
 	}
 
+	enum LightBank banks[] =
+	{
+		LIGHTBANK_DAY,
+		LIGHTBANK_NIGHT
+	};
 	for(s32 i=0; i<2; i++)
 	{
 		enum LightBank bank = banks[i];
@@ -1273,7 +1545,7 @@ void Map::removeNodeAndUpdate(v3s16 p,
 		v3s16 n2p = getBrightestNeighbour(bank, p);
 		try{
 			MapNode n2 = getNode(n2p);
-			lightNeighbors(bank, n2p, modified_blocks);
+			lightNeighbors(1<<bank, n2p, modified_blocks);
 		}
 		catch(InvalidPositionException &e)
 		{
@@ -1314,7 +1586,7 @@ void Map::removeNodeAndUpdate(v3s16 p,
 		MapNode n2 = getNode(p2);
 		if(content_liquid(n2.getContent()) || n2.getContent() == CONTENT_AIR)
 		{
-			m_transforming_liquid.push_back(p2);
+			activateLiquid(p2);
 		}
 
 		}catch(InvalidPositionException &e)
@@ -1482,6 +1754,9 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 					saved_blocks_count++;
 				}
 
+				// Its active liquid goes away with it
+				m_active_liquid_count -= block->getActiveLiquidCount();
+
 				// Delete from memory
 				sector->deleteBlock(block);
 
@@ -1517,6 +1792,50 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 	}
 }
 
+struct SendCacheEntry
+{
+	u32 used;
+	MapBlock *block;
+
+	bool operator<(const SendCacheEntry &other) const
+	{
+		return used < other.used;
+	}
+};
+
+u32 Map::trimSendCaches(u32 max_size)
+{
+	if(m_send_cache_size <= max_size)
+		return 0;
+
+	core::array<SendCacheEntry> entries;
+	for(core::map<v2s16, MapSector*>::Iterator si = m_sectors.getIterator();
+			si.atEnd() == false; si++)
+	{
+		core::list<MapBlock*> blocks;
+		si.getNode()->getValue()->getBlocks(blocks);
+		for(core::list<MapBlock*>::Iterator i = blocks.begin();
+				i != blocks.end(); i++)
+		{
+			if((*i)->getSendCacheSize() == 0)
+				continue;
+			SendCacheEntry e;
+			e.used = (*i)->getSendCacheUsed();
+			e.block = *i;
+			entries.push_back(e);
+		}
+	}
+	entries.sort();
+
+	u32 dropped = 0;
+	for(u32 i=0; i<entries.size() && m_send_cache_size > max_size; i++)
+	{
+		entries[i].block->clearSendCache();
+		dropped++;
+	}
+	return dropped;
+}
+
 void Map::deleteSectors(core::list<v2s16> &list)
 {
 	core::list<v2s16>::Iterator j;
@@ -1607,247 +1926,461 @@ struct NodeNeighbor {
 	v3s16 p;
 };
 
-void Map::transformLiquids(core::map<v3s16, MapBlock*> & modified_blocks)
-{
-	DSTACK(__FUNCTION_NAME);
-	//TimeTaker timer("transformLiquids()");
+/*
+	A block whose active liquid is transformed by a MapTasks task.
 
-	u32 loopcount = 0;
-	u32 initial_size = m_transforming_liquid.size();
+	The task only reads the block and its neighbors and only writes
+	the block; the rest of what it does is collected here and applied
+	by the calling thread afterwards, in a fixed order. Blocks that are
+	transformed at the same time are never next to each other, so the
+	result does not depend on the number of threads.
+*/
+struct LiquidBlockJob
+{
+	MapBlock *block;
+	// Face neighbors in the order of g_6dirs; NULL if not loaded
+	MapBlock *neighbors[6];
+	// Number of active nodes when the job was made
+	u32 active_count;
+	// Indices of the changed nodes of block
+	core::array<u16> changed;
+	// Whether a light source was changed
+	bool lighting_changed;
+	// Nodes outside block to be activated
+	core::array<v3s16> activated;
+	// Viscous nodes to be activated after the pass
+	core::array<v3s16> reflow;
+};
 
-	/*if(initial_size != 0)
-		infostream<<"transformLiquids(): initial_size="<<initial_size<<std::endl;*/
+/*
+	Gets a node next to relpos (in direction g_6dirs[dir]) of the block
+	of job, from a neighboring block if needed
+*/
+static inline MapNode get_liquid_neighbor(LiquidBlockJob &job,
+		v3s16 relpos, u16 dir)
+{
+	v3s16 p = relpos + g_6dirs[dir];
+	if(relpos_in_block(p))
+		return job.block->getNodeNoCheck(p);
+	MapBlock *block = job.neighbors[dir];
+	if(block == NULL)
+		return MapNode(CONTENT_IGNORE);
+	return block->getNodeNoCheck(p - g_6dirs[dir] * MAP_BLOCKSIZE);
+}
 
-	// list of nodes that due to viscosity have not reached their max level height
-	UniqueQueue<v3s16> must_reflow;
-	
-	// List of MapBlocks that will require a lighting update (due to lava)
-	core::map<v3s16, MapBlock*> lighting_modified_blocks;
+static inline void activate_liquid(LiquidBlockJob &job, v3s16 p)
+{
+	if(relpos_in_block(p - job.block->getPosRelative()))
+		job.block->activateLiquid(p);
+	else
+		job.activated.push_back(p);
+}
 
-	while(m_transforming_liquid.size() != 0)
-	{
-		// This should be done here so that it is done when continue is used
-		if(loopcount >= initial_size * 3)
-			break;
-		loopcount++;
+void Map::activateLiquid(v3s16 p)
+{
+	v3s16 blockpos = getNodeBlockPos(p);
+	MapBlock *block = getBlockNoCreateNoEx(blockpos);
+	// Liquid is not transformed in blocks that are not loaded
+	if(block == NULL || block->isDummy())
+		return;
+	if(block->activateLiquid(p) == false)
+		return;
+	m_active_liquid_count++;
+	m_liquid_blocks.insert(blockpos, true);
+}
 
-		/*
-			Get a queued transforming liquid node
-		*/
-		v3s16 p0 = m_transforming_liquid.pop_front();
+/*
+	Transforms an active liquid node p0 of the block of job
+*/
+static void transform_liquid(LiquidBlockJob &job, v3s16 p0)
+{
+	v3s16 relpos0 = p0 - job.block->getPosRelative();
+	MapNode n0 = job.block->getNodeNoCheck(relpos0);
 
-		MapNode n0 = getNodeNoEx(p0);
+	/*
+		Collect information about current node
+	 */
+	s8 liquid_level = -1;
+	u8 liquid_kind = CONTENT_IGNORE;
+	LiquidType liquid_type = content_features(n0.getContent()).liquid_type;
+	switch (liquid_type) {
+		case LIQUID_SOURCE:
+			liquid_level = LIQUID_LEVEL_SOURCE;
+			liquid_kind = content_features(n0.getContent()).liquid_alternative_flowing;
+			break;
+		case LIQUID_FLOWING:
+			liquid_level = (n0.param2 & LIQUID_LEVEL_MASK);
+			liquid_kind = n0.getContent();
+			break;
+		case LIQUID_NONE:
+			// if this is an air node, it *could* be transformed into a liquid. otherwise,
+			// continue with the next node.
+			if (n0.getContent() != CONTENT_AIR)
+				return;
+			liquid_kind = CONTENT_AIR;
+			break;
+	}
 
-		/*
-			Collect information about current node
-		 */
-		s8 liquid_level = -1;
-		u8 liquid_kind = CONTENT_IGNORE;
-		LiquidType liquid_type = content_features(n0.getContent()).liquid_type;
-		switch (liquid_type) {
-			case LIQUID_SOURCE:
-				liquid_level = LIQUID_LEVEL_SOURCE;
-				liquid_kind = content_features(n0.getContent()).liquid_alternative_flowing;
+	/*
+		Collect information about the environment
+	 */
+	const v3s16 *dirs = g_6dirs;
+	NodeNeighbor sources[6]; // surrounding sources
+	int num_sources = 0;
+	NodeNeighbor flows[6]; // surrounding flowing liquid nodes
+	int num_flows = 0;
+	NodeNeighbor airs[6]; // surrounding air
+	int num_airs = 0;
+	NodeNeighbor neutrals[6]; // nodes that are solid or another kind of liquid
+	int num_neutrals = 0;
+	bool flowing_down = false;
+	for (u16 i = 0; i < 6; i++) {
+		NeighborType nt = NEIGHBOR_SAME_LEVEL;
+		switch (i) {
+			case 1:
+				nt = NEIGHBOR_UPPER;
 				break;
-			case LIQUID_FLOWING:
-				liquid_level = (n0.param2 & LIQUID_LEVEL_MASK);
-				liquid_kind = n0.getContent();
+			case 4:
+				nt = NEIGHBOR_LOWER;
 				break;
+		}
+		v3s16 npos = p0 + dirs[i];
+		NodeNeighbor nb = {get_liquid_neighbor(job, relpos0, i), nt, npos};
+		switch (content_features(nb.n.getContent()).liquid_type) {
 			case LIQUID_NONE:
-				// if this is an air node, it *could* be transformed into a liquid. otherwise,
-				// continue with the next node.
-				if (n0.getContent() != CONTENT_AIR)
-					continue;
-				liquid_kind = CONTENT_AIR;
+				if (nb.n.getContent() == CONTENT_AIR) {
+					airs[num_airs++] = nb;
+					// if the current node is a water source the neighbor
+					// should be enqueded for transformation regardless of whether the
+					// current node changes or not.
+					if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
+						activate_liquid(job, npos);
+					// if the current node happens to be a flowing node, it will start to flow down here.
+					if (nb.t == NEIGHBOR_LOWER) {
+						flowing_down = true;
+					}
+				} else {
+					neutrals[num_neutrals++] = nb;
+				}
+				break;
+			case LIQUID_SOURCE:
+				// if this node is not (yet) of a liquid type, choose the first liquid type we encounter 
+				if (liquid_kind == CONTENT_AIR)
+					liquid_kind = content_features(nb.n.getContent()).liquid_alternative_flowing;
+				if (content_features(nb.n.getContent()).liquid_alternative_flowing !=liquid_kind) {
+					neutrals[num_neutrals++] = nb;
+				} else {
+					sources[num_sources++] = nb;
+				}
+				break;
+			case LIQUID_FLOWING:
+				// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
+				if (liquid_kind == CONTENT_AIR)
+					liquid_kind = content_features(nb.n.getContent()).liquid_alternative_flowing;
+				if (content_features(nb.n.getContent()).liquid_alternative_flowing != liquid_kind) {
+					neutrals[num_neutrals++] = nb;
+				} else {
+					flows[num_flows++] = nb;
+					if (nb.t == NEIGHBOR_LOWER)
+						flowing_down = true;
+				}
 				break;
 		}
+	}
 
-		/*
-			Collect information about the environment
-		 */
-		const v3s16 *dirs = g_6dirs;
-		NodeNeighbor sources[6]; // surrounding sources
-		int num_sources = 0;
-		NodeNeighbor flows[6]; // surrounding flowing liquid nodes
-		int num_flows = 0;
-		NodeNeighbor airs[6]; // surrounding air
-		int num_airs = 0;
-		NodeNeighbor neutrals[6]; // nodes that are solid or another kind of liquid
-		int num_neutrals = 0;
-		bool flowing_down = false;
-		for (u16 i = 0; i < 6; i++) {
-			NeighborType nt = NEIGHBOR_SAME_LEVEL;
-			switch (i) {
-				case 1:
-					nt = NEIGHBOR_UPPER;
-					break;
-				case 4:
-					nt = NEIGHBOR_LOWER;
-					break;
-			}
-			v3s16 npos = p0 + dirs[i];
-			NodeNeighbor nb = {getNodeNoEx(npos), nt, npos};
-			switch (content_features(nb.n.getContent()).liquid_type) {
-				case LIQUID_NONE:
-					if (nb.n.getContent() == CONTENT_AIR) {
-						airs[num_airs++] = nb;
-						// if the current node is a water source the neighbor
-						// should be enqueded for transformation regardless of whether the
-						// current node changes or not.
-						if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
-							m_transforming_liquid.push_back(npos);
-						// if the current node happens to be a flowing node, it will start to flow down here.
-						if (nb.t == NEIGHBOR_LOWER) {
-							flowing_down = true;
-						}
-					} else {
-						neutrals[num_neutrals++] = nb;
-					}
+	/*
+		decide on the type (and possibly level) of the current node
+	 */
+	content_t new_node_content;
+	s8 new_node_level = -1;
+	s8 max_node_level = -1;
+	if (num_sources >= 2 || liquid_type == LIQUID_SOURCE) {
+		// liquid_kind will be set to either the flowing alternative of the node (if it's a liquid)
+		// or the flowing alternative of the first of the surrounding sources (if it's air), so
+		// it's perfectly safe to use liquid_kind here to determine the new node content.
+		new_node_content = content_features(liquid_kind).liquid_alternative_source;
+	} else if (num_sources == 1 && sources[0].t != NEIGHBOR_LOWER) {
+		// liquid_kind is set properly, see above
+		new_node_content = liquid_kind;
+		max_node_level = new_node_level = LIQUID_LEVEL_MAX;
+	} else {
+		// no surrounding sources, so get the maximum level that can flow into this node
+		for (u16 i = 0; i < num_flows; i++) {
+			u8 nb_liquid_level = (flows[i].n.param2 & LIQUID_LEVEL_MASK);
+			switch (flows[i].t) {
+				case NEIGHBOR_UPPER:
+					if (nb_liquid_level + WATER_DROP_BOOST > max_node_level) {
+						max_node_level = LIQUID_LEVEL_MAX;
+						if (nb_liquid_level + WATER_DROP_BOOST < LIQUID_LEVEL_MAX)
+							max_node_level = nb_liquid_level + WATER_DROP_BOOST;
+					} else if (nb_liquid_level > max_node_level)
+						max_node_level = nb_liquid_level;
 					break;
-				case LIQUID_SOURCE:
-					// if this node is not (yet) of a liquid type, choose the first liquid type we encounter 
-					if (liquid_kind == CONTENT_AIR)
-						liquid_kind = content_features(nb.n.getContent()).liquid_alternative_flowing;
-					if (content_features(nb.n.getContent()).liquid_alternative_flowing !=liquid_kind) {
-						neutrals[num_neutrals++] = nb;
-					} else {
-						sources[num_sources++] = nb;
-					}
+				case NEIGHBOR_LOWER:
 					break;
-				case LIQUID_FLOWING:
-					// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
-					if (liquid_kind == CONTENT_AIR)
-						liquid_kind = content_features(nb.n.getContent()).liquid_alternative_flowing;
-					if (content_features(nb.n.getContent()).liquid_alternative_flowing != liquid_kind) {
-						neutrals[num_neutrals++] = nb;
-					} else {
-						flows[num_flows++] = nb;
-						if (nb.t == NEIGHBOR_LOWER)
-							flowing_down = true;
+				case NEIGHBOR_SAME_LEVEL:
+					if ((flows[i].n.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK &&
+						nb_liquid_level > 0 && nb_liquid_level - 1 > max_node_level) {
+						max_node_level = nb_liquid_level - 1;
 					}
 					break;
 			}
 		}
 
-		/*
-			decide on the type (and possibly level) of the current node
-		 */
-		content_t new_node_content;
-		s8 new_node_level = -1;
-		s8 max_node_level = -1;
-		if (num_sources >= 2 || liquid_type == LIQUID_SOURCE) {
-			// liquid_kind will be set to either the flowing alternative of the node (if it's a liquid)
-			// or the flowing alternative of the first of the surrounding sources (if it's air), so
-			// it's perfectly safe to use liquid_kind here to determine the new node content.
-			new_node_content = content_features(liquid_kind).liquid_alternative_source;
-		} else if (num_sources == 1 && sources[0].t != NEIGHBOR_LOWER) {
-			// liquid_kind is set properly, see above
+		u8 viscosity = content_features(liquid_kind).liquid_viscosity;
+		if (viscosity > 1 && max_node_level != liquid_level) {
+			// amount to gain, limited by viscosity
+			// must be at least 1 in absolute value
+			s8 level_inc = max_node_level - liquid_level;
+			if (level_inc < -viscosity || level_inc > viscosity)
+				new_node_level = liquid_level + level_inc/viscosity;
+			else if (level_inc < 0)
+				new_node_level = liquid_level - 1;
+			else if (level_inc > 0)
+				new_node_level = liquid_level + 1;
+			if (new_node_level != max_node_level)
+				job.reflow.push_back(p0);
+		} else
+			new_node_level = max_node_level;
+
+		if (new_node_level >= 0)
 			new_node_content = liquid_kind;
-			max_node_level = new_node_level = LIQUID_LEVEL_MAX;
-		} else {
-			// no surrounding sources, so get the maximum level that can flow into this node
-			for (u16 i = 0; i < num_flows; i++) {
-				u8 nb_liquid_level = (flows[i].n.param2 & LIQUID_LEVEL_MASK);
-				switch (flows[i].t) {
-					case NEIGHBOR_UPPER:
-						if (nb_liquid_level + WATER_DROP_BOOST > max_node_level) {
-							max_node_level = LIQUID_LEVEL_MAX;
-							if (nb_liquid_level + WATER_DROP_BOOST < LIQUID_LEVEL_MAX)
-								max_node_level = nb_liquid_level + WATER_DROP_BOOST;
-						} else if (nb_liquid_level > max_node_level)
-							max_node_level = nb_liquid_level;
-						break;
-					case NEIGHBOR_LOWER:
-						break;
-					case NEIGHBOR_SAME_LEVEL:
-						if ((flows[i].n.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK &&
-							nb_liquid_level > 0 && nb_liquid_level - 1 > max_node_level) {
-							max_node_level = nb_liquid_level - 1;
-						}
-						break;
-				}
-			}
+		else
+			new_node_content = CONTENT_AIR;
 
-			u8 viscosity = content_features(liquid_kind).liquid_viscosity;
-			if (viscosity > 1 && max_node_level != liquid_level) {
-				// amount to gain, limited by viscosity
-				// must be at least 1 in absolute value
-				s8 level_inc = max_node_level - liquid_level;
-				if (level_inc < -viscosity || level_inc > viscosity)
-					new_node_level = liquid_level + level_inc/viscosity;
-				else if (level_inc < 0)
-					new_node_level = liquid_level - 1;
-				else if (level_inc > 0)
-					new_node_level = liquid_level + 1;
-				if (new_node_level != max_node_level)
-					must_reflow.push_back(p0);
-			} else
-				new_node_level = max_node_level;
-
-			if (new_node_level >= 0)
-				new_node_content = liquid_kind;
-			else
-				new_node_content = CONTENT_AIR;
+	}
+
+	/*
+		check if anything has changed. if not, just continue with the next node.
+	 */
+	if (new_node_content == n0.getContent() && (content_features(n0.getContent()).liquid_type != LIQUID_FLOWING ||
+									 ((n0.param2 & LIQUID_LEVEL_MASK) == (u8)new_node_level &&
+									 ((n0.param2 & LIQUID_FLOW_DOWN_MASK) == LIQUID_FLOW_DOWN_MASK)
+									 == flowing_down)))
+		return;
+
+
+	/*
+		update the current node
+	 */
+	bool flow_down_enabled = (flowing_down && ((n0.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK));
+	if (content_features(new_node_content).liquid_type == LIQUID_FLOWING) {
+		// set level to last 3 bits, flowing down bit to 4th bit
+		n0.param2 = (flowing_down ? LIQUID_FLOW_DOWN_MASK : 0x00) | (new_node_level & LIQUID_LEVEL_MASK);
+	} else {
+		// set the liquid level and flow bit to 0
+		n0.param2 = ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
+	}
+	n0.setContent(new_node_content);
+	job.changed.push_back(job.block->setNodeNoTracking(relpos0, n0));
+	// If node emits light, MapBlock requires lighting update
+	if(content_features(n0).light_source != 0)
+		job.lighting_changed = true;
+
+	/*
+		enqueue neighbors for update if neccessary
+	 */
+	switch (content_features(n0.getContent()).liquid_type) {
+		case LIQUID_SOURCE:
+		case LIQUID_FLOWING:
+			// make sure source flows into all neighboring nodes
+			for (u16 i = 0; i < num_flows; i++)
+				if (flows[i].t != NEIGHBOR_UPPER)
+					activate_liquid(job, flows[i].p);
+			for (u16 i = 0; i < num_airs; i++)
+				if (airs[i].t != NEIGHBOR_UPPER)
+					activate_liquid(job, airs[i].p);
+			break;
+		case LIQUID_NONE:
+			// this flow has turned to air; neighboring flows might need to do the same
+			for (u16 i = 0; i < num_flows; i++)
+				activate_liquid(job, flows[i].p);
+			break;
+	}
+}
+
+class LiquidTasks : public MapTasks
+{
+public:
+	LiquidTasks(core::array<LiquidBlockJob*> &jobs):
+		MapTasks(jobs.size()),
+		m_jobs(jobs)
+	{
+	}
+
+	/*
+		Transforms the nodes that were active when the job was made;
+		the ones activated meanwhile wait for the next round.
+	*/
+	void run(u32 i)
+	{
+		LiquidBlockJob &job = *m_jobs[i];
+		for(u32 j=0; j<job.active_count; j++)
+			transform_liquid(job, job.block->popActiveLiquid());
+	}
+
+private:
+	core::array<LiquidBlockJob*> &m_jobs;
+};
+
+/*
+	A pass has this many rounds, in which the liquid flows one node
+	or so. Each round has 8 phases; a phase transforms the blocks of
+	one parity of coordinates.
+*/
+#define LIQUID_PASS_ROUNDS 3
+#define LIQUID_PASS_PHASES (LIQUID_PASS_ROUNDS * 8)
+/*
+	A phase is run in batches of blocks with about this many active
+	nodes in total, so that the time limit is checked often enough
+	even when a large lake is flowing
+*/
+#define LIQUID_BATCH_NODES 4096
+
+bool Map::transformLiquids(core::map<v3s16, MapBlock*> & modified_blocks,
+		u32 max_time_ms)
+{
+	DSTACK(__FUNCTION_NAME);
+	//TimeTaker timer("transformLiquids()");
+
+	u32 time_start = porting::getTimeMs();
+
+	u32 loopcount = 0;
+	bool out_of_time = false;
 
+	// List of MapBlocks that will require a lighting update (due to lava)
+	core::map<v3s16, MapBlock*> lighting_modified_blocks;
+
+	while(m_liquid_blocks.size() != 0 || m_liquid_phase != 0
+			|| m_liquid_phase_started)
+	{
+		/*
+			At the start of a phase, take the active blocks of its
+			parity. Blocks activated later wait for the next round.
+		*/
+		if(m_liquid_phase_started == false)
+		{
+			u16 parity = m_liquid_phase % 8;
+			m_liquid_phase_blocks.clear();
+			for(core::map<v3s16, bool>::Iterator
+					i = m_liquid_blocks.getIterator();
+					i.atEnd() == false; i++)
+			{
+				v3s16 p = i.getNode()->getKey();
+				if(((p.X & 1) | (p.Y & 1) << 1 | (p.Z & 1) << 2) == parity)
+					m_liquid_phase_blocks.push_back(p);
+			}
+			m_liquid_phase_started = true;
 		}
 
 		/*
-			check if anything has changed. if not, just continue with the next node.
-		 */
-		if (new_node_content == n0.getContent() && (content_features(n0.getContent()).liquid_type != LIQUID_FLOWING ||
-										 ((n0.param2 & LIQUID_LEVEL_MASK) == (u8)new_node_level &&
-										 ((n0.param2 & LIQUID_FLOW_DOWN_MASK) == LIQUID_FLOW_DOWN_MASK)
-										 == flowing_down)))
-			continue;
+			Make jobs of the next batch of them. The blocks of a phase
+			are not next to each other, so batching doesn't change
+			the result.
+		*/
+		core::array<LiquidBlockJob*> jobs;
+		u32 batch_nodes = 0;
+		while(m_liquid_phase_blocks.size() != 0
+				&& batch_nodes < LIQUID_BATCH_NODES)
+		{
+			core::list<v3s16>::Iterator i = m_liquid_phase_blocks.begin();
+			v3s16 p = *i;
+			m_liquid_phase_blocks.erase(i);
+			MapBlock *block = getBlockNoCreateNoEx(p);
+			if(block == NULL || block->isDummy())
+			{
+				m_liquid_blocks.remove(p);
+				continue;
+			}
+			LiquidBlockJob *job = new LiquidBlockJob;
+			job->block = block;
+			for(u16 j=0; j<6; j++)
+			{
+				MapBlock *b = getBlockNoCreateNoEx(p + g_6dirs[j]);
+				if(b != NULL && b->isDummy())
+					b = NULL;
+				job->neighbors[j] = b;
+			}
+			job->active_count = block->getActiveLiquidCount();
+			job->lighting_changed = false;
+			jobs.push_back(job);
+			batch_nodes += job->active_count;
+		}
 
+		{
+			LiquidTasks tasks(jobs);
+			run_map_tasks(m_thread_pool, tasks);
+		}
 
 		/*
-			update the current node
-		 */
-		bool flow_down_enabled = (flowing_down && ((n0.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK));
-		if (content_features(new_node_content).liquid_type == LIQUID_FLOWING) {
-			// set level to last 3 bits, flowing down bit to 4th bit
-			n0.param2 = (flowing_down ? LIQUID_FLOW_DOWN_MASK : 0x00) | (new_node_level & LIQUID_LEVEL_MASK);
-		} else {
-			// set the liquid level and flow bit to 0
-			n0.param2 = ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
-		}
-		n0.setContent(new_node_content);
-		setNode(p0, n0);
-		v3s16 blockpos = getNodeBlockPos(p0);
-		MapBlock *block = getBlockNoCreateNoEx(blockpos);
-		if(block != NULL) {
-			modified_blocks.insert(blockpos, block);
-			// If node emits light, MapBlock requires lighting update
-			if(content_features(n0).light_source != 0)
+			Apply the results in the order of the jobs
+		*/
+		for(u32 i=0; i<jobs.size(); i++)
+		{
+			LiquidBlockJob &job = *jobs[i];
+			MapBlock *block = job.block;
+			loopcount += job.active_count;
+			m_active_liquid_count -= job.active_count;
+			m_active_liquid_count += block->getActiveLiquidCount();
+			if(job.changed.empty() == false)
+			{
+				block->nodesChanged(job.changed);
+				modified_blocks.insert(block->getPos(), block);
+			}
+			if(job.lighting_changed)
 				lighting_modified_blocks[block->getPos()] = block;
+			for(u32 j=0; j<job.activated.size(); j++)
+				activateLiquid(job.activated[j]);
+			for(u32 j=0; j<job.reflow.size(); j++)
+				m_liquid_reflow.push_back(job.reflow[j]);
+		}
+		for(u32 i=0; i<jobs.size(); i++)
+		{
+			MapBlock *block = jobs[i]->block;
+			if(block->getActiveLiquidCount() == 0)
+				m_liquid_blocks.remove(block->getPos());
+			delete jobs[i];
 		}
 
-		/*
-			enqueue neighbors for update if neccessary
-		 */
-		switch (content_features(n0.getContent()).liquid_type) {
-			case LIQUID_SOURCE:
-			case LIQUID_FLOWING:
-				// make sure source flows into all neighboring nodes
-				for (u16 i = 0; i < num_flows; i++)
-					if (flows[i].t != NEIGHBOR_UPPER)
-						m_transforming_liquid.push_back(flows[i].p);
-				for (u16 i = 0; i < num_airs; i++)
-					if (airs[i].t != NEIGHBOR_UPPER)
-						m_transforming_liquid.push_back(airs[i].p);
-				break;
-			case LIQUID_NONE:
-				// this flow has turned to air; neighboring flows might need to do the same
-				for (u16 i = 0; i < num_flows; i++)
-					m_transforming_liquid.push_back(flows[i].p);
+		if(m_liquid_phase_blocks.size() == 0)
+		{
+			m_liquid_phase_started = false;
+			m_liquid_phase++;
+
+			/*
+				At the end of the pass, continue with the viscous liquid
+				that did not reach its level during it
+			*/
+			if(m_liquid_phase == LIQUID_PASS_PHASES)
+			{
+				m_liquid_phase = 0;
+				while(m_liquid_reflow.size() > 0)
+					activateLiquid(m_liquid_reflow.pop_front());
 				break;
+			}
+		}
+
+		// Out of time; the pass is continued by the next call
+		if(max_time_ms != 0
+				&& porting::getTimeMs() - time_start >= max_time_ms)
+		{
+			out_of_time = true;
+			break;
 		}
 	}
+
 	//infostream<<"Map::transformLiquids(): loopcount="<<loopcount<<std::endl;
-	while (must_reflow.size() > 0)
-		m_transforming_liquid.push_back(must_reflow.pop_front());
 	updateLighting(lighting_modified_blocks, modified_blocks);
+
+	g_profiler->avg("Map: active liquid nodes", m_active_liquid_count);
+	g_profiler->avg("Map: liquid blocks", m_liquid_blocks.size());
+	g_profiler->avg("Map: transformed liquid nodes", loopcount);
+	g_profiler->avg("Map: liquid transform time (ms)",
+			porting::getTimeMs() - time_start);
+	if(out_of_time)
+		g_profiler->add("Map: liquid passes continued", 1);
+
+	return !out_of_time;
 }
 
 NodeMetadata* Map::getNodeMetadata(v3s16 p)
@@ -1887,6 +2420,7 @@ void Map::setNodeMetadata(v3s16 p, NodeMetadata *meta)
 		return;
 	}
 	block->m_node_metadata.set(p_rel, meta);
+	block->nodeMetadataChanged();
 }
 
 void Map::removeNodeMetadata(v3s16 p)
@@ -1901,6 +2435,7 @@ void Map::removeNodeMetadata(v3s16 p)
 		return;
 	}
 	block->m_node_metadata.remove(p_rel);
+	block->nodeMetadataChanged();
 }
 
 void Map::nodeMetadataStep(float dtime,
@@ -1927,9 +2462,147 @@ void Map::nodeMetadataStep(float dtime,
 			MapBlock *block = *i;
 			bool changed = block->m_node_metadata.step(dtime);
 			if(changed)
+			{
+				block->nodeMetadataChanged();
 				changed_blocks[block->getPos()] = block;
+			}
+		}
+	}
+}
+
+/*
+	BlockSaveQueue
+*/
+
+BlockSaveQueue::BlockSaveQueue(u32 max_bytes):
+	m_bytes(0),
+	m_max_bytes(max_bytes),
+	m_waiting(0)
+{
+	m_mutex.Init();
+}
+
+void BlockSaveQueue::push(v3s16 p, const std::string &data)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	// Coalesce with an already queued write
+	core::map<v3s16, std::string>::Node *n = m_blocks.find(p);
+	if(n != NULL)
+	{
+		m_bytes -= n->getValue().size();
+		m_bytes += data.size();
+		n->setValue(data);
+		return;
+	}
+
+	m_blocks.insert(p, data);
+	m_order.push_back(p);
+	m_bytes += data.size();
+}
+
+void BlockSaveQueue::waitForRoom()
+{
+	for(;;)
+	{
+		{
+			JMutexAutoLock lock(m_mutex);
+			if(m_max_bytes == 0 || m_bytes < m_max_bytes)
+				return;
+			m_waiting++;
 		}
+		m_room.wait();
+	}
+}
+
+bool BlockSaveQueue::isFull()
+{
+	JMutexAutoLock lock(m_mutex);
+	return m_max_bytes != 0 && m_bytes >= m_max_bytes;
+}
+
+bool BlockSaveQueue::get(v3s16 p, std::string &dst)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	core::map<v3s16, std::string>::Node *n = m_blocks.find(p);
+	if(n == NULL)
+		return false;
+	dst = n->getValue();
+	return true;
+}
+
+u32 BlockSaveQueue::pop(core::list<SerializedBlock> &dst, u32 max_count)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	u32 count = 0;
+	while(count < max_count && m_order.size() != 0)
+	{
+		core::list<v3s16>::Iterator i = m_order.begin();
+		v3s16 p = *i;
+		m_order.erase(i);
+
+		core::map<v3s16, std::string>::Node *n = m_blocks.find(p);
+		assert(n);
+		SerializedBlock b;
+		b.pos = p;
+		b.data = n->getValue();
+		m_bytes -= b.data.size();
+		m_blocks.remove(p);
+
+		dst.push_back(b);
+		count++;
+	}
+
+	if(m_waiting != 0 && m_bytes < m_max_bytes)
+	{
+		for(u32 i=0; i<m_waiting; i++)
+			m_room.post();
+		m_waiting = 0;
+	}
+	return count;
+}
+
+u32 BlockSaveQueue::size()
+{
+	JMutexAutoLock lock(m_mutex);
+	return m_order.size();
+}
+
+u32 BlockSaveQueue::bytes()
+{
+	JMutexAutoLock lock(m_mutex);
+	return m_bytes;
+}
+
+/*
+	MapSaveThread
+*/
+
+void * MapSaveThread::Thread()
+{
+	ThreadStarted();
+
+	log_register_thread("MapSaveThread");
+
+	DSTACK(__FUNCTION_NAME);
+
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	while(getRun())
+	{
+		/*
+			Give the queue some time to fill up so that blocks are
+			written in large transactions
+		*/
+		if(m_map->saveStep() == false)
+			sleep_ms(20);
 	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	return NULL;
 }
 
 /*
@@ -1939,13 +2612,53 @@ void Map::nodeMetadataStep(float dtime,
 ServerMap::ServerMap(std::string savedir):
 	Map(dout_server),
 	m_seed(0),
+	m_sector_columns_cache(new mapgen::SectorColumnsCache(
+			g_settings->getU16("mapgen_sector_cache_size"))),
+	m_block_terrain_cache(new mapgen::BlockTerrainCache(
+			g_settings->getU16("mapgen_terrain_cache_size"))),
 	/*m_map_metadata_changed(true),*/
 	m_database(NULL),
 	m_database_read(NULL),
-	m_database_write(NULL)
+	m_database_write(NULL),
+	m_database_list(NULL),
+	m_database_read_ground(NULL),
+	m_database_write_ground(NULL),
+	m_save_ground_levels(g_settings->getBool("mapgen_save_ground_levels")),
+	m_save_queue(g_settings->getU16("server_map_save_queue_max_mb")
+			* 1024 * 1024),
+	m_save_thread(this),
+	m_save_batch_size(g_settings->getU16("server_map_save_batch_size")),
+	m_save_max_delay_ms(g_settings->getFloat("server_map_save_max_delay")
+			* 1000),
+	m_save_flush_requested(false),
+	m_save_tick_running(false),
+	m_save_pending(false),
+	m_save_pending_since_ms(0),
+	m_save_count(0),
+	m_wal_checkpoint_interval_ms(
+			g_settings->getFloat("sqlite_wal_checkpoint_interval") * 1000),
+	m_wal_checkpoint_last_ms(0),
+	m_wal_enabled(false)
 {
 	infostream<<__FUNCTION_NAME<<std::endl;
 
+	m_database_mutex.Init();
+	m_sector_ground_levels_mutex.Init();
+
+	if(m_save_batch_size == 0)
+		m_save_batch_size = 1;
+	m_save_thread.Start();
+
+	{
+		u16 count = g_settings->getU16("num_map_threads");
+		if(count == 0)
+			count = porting::getNumberOfProcessors();
+		if(count > 1)
+			m_thread_pool = new MapThreadPool(count);
+		infostream<<"ServerMap: Using "<<count<<" map threads"
+				<<std::endl;
+	}
+
 	//m_chunksize = 8; // Takes a few seconds
 
 	if (g_settings->get("fixed_map_seed").empty())
@@ -2066,7 +2779,21 @@ ServerMap::~ServerMap()
 	}
 	catch(std::exception &e)
 	{
-		infostream<<"Server: Failed to save map to "<<m_savedir
+		infostream<<"Server: Failed to save map to "<<m_savedir
+				<<", exception: "<<e.what()<<std::endl;
+	}
+
+	/*
+		Stop the save thread and write whatever it left behind
+	*/
+	m_save_thread.stop();
+	try
+	{
+		flushSaveQueue();
+	}
+	catch(std::exception &e)
+	{
+		infostream<<"Server: Failed to write queued blocks to "<<m_savedir
 				<<", exception: "<<e.what()<<std::endl;
 	}
 
@@ -2077,9 +2804,16 @@ ServerMap::~ServerMap()
 		sqlite3_finalize(m_database_read);
 	if(m_database_write)
 		sqlite3_finalize(m_database_write);
+	if(m_database_read_ground)
+		sqlite3_finalize(m_database_read_ground);
+	if(m_database_write_ground)
+		sqlite3_finalize(m_database_write_ground);
 	if(m_database)
 		sqlite3_close(m_database);
 
+	delete m_sector_columns_cache;
+	delete m_block_terrain_cache;
+
 #if 0
 	/*
 		Free all MapChunks
@@ -2111,6 +2845,8 @@ void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
 	data->no_op = false;
 	data->seed = m_seed;
 	data->blockpos = blockpos;
+	data->columns_cache = m_sector_columns_cache;
+	data->terrain_cache = m_block_terrain_cache;
 
 	/*
 		Create the whole area of this and the neighboring blocks
@@ -2126,6 +2862,10 @@ void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
 			ServerMapSector *sector = createSector(sectorpos);
 			assert(sector);
 
+			mapgen::SectorGroundLevels &ground_levels =
+					data->ground_levels[(z+1)*3 + (x+1)];
+			getSectorGroundLevels(sectorpos, ground_levels);
+
 			for(s16 y=-1; y<=1; y++)
 			{
 				v3s16 p(blockpos.X+x, blockpos.Y+y, blockpos.Z+z);
@@ -2142,7 +2882,7 @@ void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
 
 						Refer to the map generator heuristics.
 					*/
-					bool ug = mapgen::block_is_underground(data->seed, p);
+					bool ug = mapgen::block_is_underground(ground_levels, p);
 					block->setIsUnderground(ug);
 				}
 
@@ -2150,29 +2890,20 @@ void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
 				block->setLightingExpired(true);
 				// Lighting will be calculated
 				//block->setLightingExpired(false);
+
+				// Don't unload it while it is being generated
+				block->resetUsageTimer();
+
+				data->change_stamps.insert(p, block->getChangeStamp());
 			}
 		}
 	}
 	
 	/*
-		Now we have a big empty area.
-
-		Make a ManualMapVoxelManipulator that contains this and the
-		neighboring blocks
+		make_block() makes the area from the seed alone, so that it
+		is the same whatever there is on the map.
 	*/
-	
-	// The area that contains this block and it's neighbors
-	v3s16 bigarea_blocks_min = blockpos - v3s16(1,1,1);
-	v3s16 bigarea_blocks_max = blockpos + v3s16(1,1,1);
-	
 	data->vmanip = new ManualMapVoxelManipulator(this);
-	//data->vmanip->setMap(this);
-
-	// Add the area
-	{
-		//TimeTaker timer("initBlockMake() initialEmerge");
-		data->vmanip->initialEmerge(bigarea_blocks_min, bigarea_blocks_max);
-	}
 
 	// Data is ready now.
 }
@@ -2196,13 +2927,74 @@ MapBlock* ServerMap::finishBlockMake(mapgen::BlockMakeData *data,
 	data->vmanip.print(infostream);*/
 	
 	/*
-		Blit generated stuff to map
-		NOTE: blitBackAll adds nearly everything to changed_blocks
+		Merge generated stuff to map.
+
+		The central block gets the generated nodes where it has none
+		yet. Elsewhere only the nodes written by make_block() are
+		merged, and where those of several blocks overlap, the map
+		keeps the one chosen by mapgen::written_node_wins(). So the
+		map does not depend on the order the blocks are generated in.
+
+		make_block() runs without the environment lock, so the
+		neighboring blocks may have been modified or unloaded meanwhile.
+		Those are left as they are, so that the modifications are not
+		overwritten.
 	*/
 	{
-		// 70ms @cs=8
-		//TimeTaker timer("finishBlockMake() blitBackAll");
-		data->vmanip->blitBackAll(&changed_blocks);
+		ManualMapVoxelManipulator &vmanip = *(data->vmanip);
+		VoxelArea &area = vmanip.m_area;
+		v3s16 area_blocks_min = getNodeBlockPos(area.MinEdge);
+		v3s16 area_blocks_max = getNodeBlockPos(area.MaxEdge);
+		core::array<u16> changed;
+		for(s16 z=area_blocks_min.Z; z<=area_blocks_max.Z; z++)
+		for(s16 y=area_blocks_min.Y; y<=area_blocks_max.Y; y++)
+		for(s16 x=area_blocks_min.X; x<=area_blocks_max.X; x++)
+		{
+			v3s16 p(x,y,z);
+			MapBlock *block = getBlockNoCreateNoEx(p);
+			if(block == NULL || block->isDummy())
+				continue;
+			bool is_center = (p == blockpos);
+			core::map<v3s16, u32>::Node *n = data->change_stamps.find(p);
+			if(is_center == false && (n == NULL
+					|| block->getChangeStamp() != n->getValue()))
+			{
+				g_profiler->add("finishBlockMake: kept changed blocks", 1);
+				continue;
+			}
+
+			changed.set_used(0);
+			v3s16 node_min = p*MAP_BLOCKSIZE;
+			for(s16 z1=0; z1<MAP_BLOCKSIZE; z1++)
+			for(s16 y1=0; y1<MAP_BLOCKSIZE; y1++)
+			{
+				u32 i = area.index(node_min + v3s16(0,y1,z1));
+				for(s16 x1=0; x1<MAP_BLOCKSIZE; x1++, i++)
+				{
+					v3s16 p1(x1,y1,z1);
+					MapNode live = block->getNodeNoCheck(p1);
+					MapNode &made = vmanip.m_data[i];
+					bool written = (vmanip.m_flags[i]
+							& VMANIP_FLAG_MAPGEN_WRITTEN) != 0;
+					bool take;
+					if(live.getContent() == CONTENT_IGNORE)
+						take = is_center || written;
+					else if(written == false)
+						take = false;
+					else if(is_center == false && mapgen::
+							same_node_ignoring_light(live, data->terrain[i]))
+						take = true;
+					else
+						take = mapgen::written_node_wins(made, live);
+					if(take && !(made == live))
+						changed.push_back(block->setNodeNoTracking(p1, made));
+				}
+			}
+			if(changed.size() == 0)
+				continue;
+			block->nodesChanged(changed);
+			changed_blocks.insert(p, block);
+		}
 	}
 
 	if(enable_mapgen_debug_info)
@@ -2215,102 +3007,30 @@ MapBlock* ServerMap::finishBlockMake(mapgen::BlockMakeData *data,
 	while(data->transforming_liquid.size() > 0)
 	{
 		v3s16 p = data->transforming_liquid.pop_front();
-		m_transforming_liquid.push_back(p);
+		if(changed_blocks.find(getNodeBlockPos(p)) == NULL)
+			continue;
+		activateLiquid(p);
 	}
 	
 	/*
-		Get central block
+		Get central block.
+		It is NULL if it was unloaded while being generated.
 	*/
 	MapBlock *block = getBlockNoCreateNoEx(data->blockpos);
-	assert(block);
-
-	/*
-		Set is_underground flag for lighting with sunlight.
-
-		Refer to map generator heuristics.
-
-		NOTE: This is done in initChunkMake
-	*/
-	//block->setIsUnderground(mapgen::block_is_underground(data->seed, blockpos));
-
-
-	/*
-		Add sunlight to central block.
-		This makes in-dark-spawning monsters to not flood the whole thing.
-		Do not spread the light, though.
-	*/
-	/*core::map<v3s16, bool> light_sources;
-	bool black_air_left = false;
-	block->propagateSunlight(light_sources, true, &black_air_left);*/
-
-	/*
-		NOTE: Lighting and object adding shouldn't really be here, but
-		lighting is a bit tricky to move properly to makeBlock.
-		TODO: Do this the right way anyway, that is, move it to makeBlock.
-		      - There needs to be some way for makeBlock to report back if
-			    the lighting update is going further down because of the
-				new block blocking light
-	*/
+	if(block == NULL)
+		return NULL;
 
 	/*
-		Update lighting
-		NOTE: This takes ~60ms, TODO: Investigate why
+		Lighting was made by make_block()
 	*/
+	for(s16 x=-1; x<=1; x++)
+	for(s16 y=-1; y<=1; y++)
+	for(s16 z=-1; z<=1; z++)
 	{
-		TimeTaker t("finishBlockMake lighting update");
-
-		core::map<v3s16, MapBlock*> lighting_update_blocks;
-#if 1
-		// Center block
-		lighting_update_blocks.insert(block->getPos(), block);
-
-		/*{
-			s16 x = 0;
-			s16 z = 0;
-			v3s16 p = block->getPos()+v3s16(x,1,z);
-			lighting_update_blocks[p] = getBlockNoCreateNoEx(p);
-		}*/
-#endif
-#if 0
-		// All modified blocks
-		// NOTE: Should this be done? If this is not done, then the lighting
-		// of the others will be updated in a different place, one by one, i
-		// think... or they might not? Well, at least they are left marked as
-		// "lighting expired"; it seems that is not handled at all anywhere,
-		// so enabling this will slow it down A LOT because otherwise it
-		// would not do this at all. This causes the black trees.
-		for(core::map<v3s16, MapBlock*>::Iterator
-				i = changed_blocks.getIterator();
-				i.atEnd() == false; i++)
-		{
-			lighting_update_blocks.insert(i.getNode()->getKey(),
-					i.getNode()->getValue());
-		}
-		/*// Also force-add all the upmost blocks for proper sunlight
-		for(s16 x=-1; x<=1; x++)
-		for(s16 z=-1; z<=1; z++)
-		{
-			v3s16 p = block->getPos()+v3s16(x,1,z);
-			lighting_update_blocks[p] = getBlockNoCreateNoEx(p);
-		}*/
-#endif
-		updateLighting(lighting_update_blocks, changed_blocks);
-		
-		/*
-			Set lighting to non-expired state in all of them.
-			This is cheating, but it is not fast enough if all of them
-			would actually be updated.
-		*/
-		for(s16 x=-1; x<=1; x++)
-		for(s16 y=-1; y<=1; y++)
-		for(s16 z=-1; z<=1; z++)
-		{
-			v3s16 p = block->getPos()+v3s16(x,y,z);
-			getBlockNoCreateNoEx(p)->setLightingExpired(false);
-		}
-
-		if(enable_mapgen_debug_info == false)
-			t.stop(true); // Hide output
+		v3s16 p = block->getPos()+v3s16(x,y,z);
+		MapBlock *b = getBlockNoCreateNoEx(p);
+		if(b)
+			b->setLightingExpired(false);
 	}
 
 	/*
@@ -2700,6 +3420,62 @@ s16 ServerMap::findGroundLevel(v2s16 p2d)
 	//return (s16)level;
 }
 
+// getSectorGroundLevels() keeps at most this many sectors in memory
+#define SECTOR_GROUND_LEVELS_CACHE_MAX 65536
+
+void ServerMap::getSectorGroundLevels(v2s16 p2d,
+		mapgen::SectorGroundLevels &dst)
+{
+	{
+		JMutexAutoLock lock(m_sector_ground_levels_mutex);
+		core::map<v2s16, mapgen::SectorGroundLevels>::Node *n =
+				m_sector_ground_levels.find(p2d);
+		if(n != NULL)
+		{
+			dst = n->getValue();
+			return;
+		}
+	}
+
+	bool found = false;
+
+	if(m_save_ground_levels && !loadFromFolders())
+	{
+		verifyDatabase();
+
+		JMutexAutoLock lock(m_database_mutex);
+
+		sqlite3_int64 pos = getBlockAsInteger(v3s16(p2d.X, 0, p2d.Y));
+		if(sqlite3_bind_int64(m_database_read_ground, 1, pos) != SQLITE_OK)
+			infostream<<"WARNING: Could not bind sector position for "
+					<<"ground level load: "<<sqlite3_errmsg(m_database)
+					<<std::endl;
+		if(sqlite3_step(m_database_read_ground) == SQLITE_ROW)
+		{
+			dst.average = sqlite3_column_int(m_database_read_ground, 0);
+			dst.minimum = sqlite3_column_int(m_database_read_ground, 1);
+			dst.maximum = sqlite3_column_int(m_database_read_ground, 2);
+			found = true;
+		}
+		sqlite3_reset(m_database_read_ground);
+	}
+
+	if(!found)
+	{
+		ScopeProfiler sp(g_profiler, "ServerMap: ground levels calc avg",
+				SPT_AVG);
+		mapgen::get_sector_ground_levels(m_seed, p2d, dst);
+	}
+
+	JMutexAutoLock lock(m_sector_ground_levels_mutex);
+	// Dropping everything is fine; they are reloaded from the database
+	if(m_sector_ground_levels.size() >= SECTOR_GROUND_LEVELS_CACHE_MAX)
+		m_sector_ground_levels.clear();
+	m_sector_ground_levels.insert(p2d, dst);
+	if(!found && m_save_ground_levels)
+		m_sector_ground_levels_unsaved.insert(p2d, dst);
+}
+
 void ServerMap::createDatabase() {
 	int e;
 	assert(m_database);
@@ -2715,7 +3491,54 @@ void ServerMap::createDatabase() {
 		infostream<<"Server: Database structure was created";
 }
 
+void ServerMap::configureDatabase() {
+	assert(m_database);
+
+	const std::string allowed =
+			"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	
+	/*
+		Journal mode. "wal" lets loads run while a batch is being
+		committed and makes commits much cheaper on slow disks.
+	*/
+	std::string journal_mode = lowercase(g_settings->get("sqlite_journal_mode"));
+	if(journal_mode != "" && string_allowed(journal_mode, allowed))
+	{
+		std::string sql = "PRAGMA journal_mode=" + journal_mode + ";";
+		if(sqlite3_exec(m_database, sql.c_str(), NULL, NULL, NULL) != SQLITE_OK)
+			infostream<<"WARNING: Database journal mode \""<<journal_mode
+					<<"\" could not be set: "<<sqlite3_errmsg(m_database)
+					<<std::endl;
+		else if(journal_mode == "wal")
+			m_wal_enabled = true;
+	}
+
+	std::string synchronous = lowercase(g_settings->get("sqlite_synchronous"));
+	if(synchronous != "" && string_allowed(synchronous, allowed))
+	{
+		std::string sql = "PRAGMA synchronous=" + synchronous + ";";
+		if(sqlite3_exec(m_database, sql.c_str(), NULL, NULL, NULL) != SQLITE_OK)
+			infostream<<"WARNING: Database synchronous mode \""<<synchronous
+					<<"\" could not be set: "<<sqlite3_errmsg(m_database)
+					<<std::endl;
+	}
+
+	/*
+		Checkpoint policy for WAL: sqlite checkpoints by itself every
+		sqlite_wal_autocheckpoint pages (0 = never); additionally
+		saveStep() checkpoints every sqlite_wal_checkpoint_interval
+		seconds.
+	*/
+	if(m_wal_enabled)
+	{
+		sqlite3_wal_autocheckpoint(m_database,
+				g_settings->getS32("sqlite_wal_autocheckpoint"));
+	}
+}
+
 void ServerMap::verifyDatabase() {
+	JMutexAutoLock lock(m_database_mutex);
+
 	if(m_database)
 		return;
 	
@@ -2741,24 +3564,55 @@ void ServerMap::verifyDatabase() {
 		
 		if(needs_create)
 			createDatabase();
+
+		configureDatabase();
+
+		// Added later than `blocks`, so old databases might lack it
+		d = sqlite3_exec(m_database,
+			"CREATE TABLE IF NOT EXISTS `sector_ground` ("
+				"`pos` INT NOT NULL PRIMARY KEY,"
+				"`average` INT,"
+				"`minimum` INT,"
+				"`maximum` INT"
+			");"
+		, NULL, NULL, NULL);
+		if(d != SQLITE_OK)
+			infostream<<"WARNING: Ground level table could not be created: "
+					<<sqlite3_errmsg(m_database)<<std::endl;
 	
-		d = sqlite3_prepare(m_database, "SELECT `data` FROM `blocks` WHERE `pos`=? LIMIT 1", -1, &m_database_read, NULL);
+		/*
+			These statements are prepared once and reused by every
+			load and save
+		*/
+		d = sqlite3_prepare_v2(m_database, "SELECT `data` FROM `blocks` WHERE `pos`=? LIMIT 1", -1, &m_database_read, NULL);
 		if(d != SQLITE_OK) {
 			infostream<<"WARNING: Database read statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
 			throw FileNotGoodException("Cannot prepare read statement");
 		}
 		
-		d = sqlite3_prepare(m_database, "REPLACE INTO `blocks` VALUES(?, ?)", -1, &m_database_write, NULL);
+		d = sqlite3_prepare_v2(m_database, "REPLACE INTO `blocks` VALUES(?, ?)", -1, &m_database_write, NULL);
 		if(d != SQLITE_OK) {
 			infostream<<"WARNING: Database write statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
 			throw FileNotGoodException("Cannot prepare write statement");
 		}
 		
-		d = sqlite3_prepare(m_database, "SELECT `pos` FROM `blocks`", -1, &m_database_list, NULL);
+		d = sqlite3_prepare_v2(m_database, "SELECT `pos` FROM `blocks`", -1, &m_database_list, NULL);
 		if(d != SQLITE_OK) {
 			infostream<<"WARNING: Database list statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
 			throw FileNotGoodException("Cannot prepare read statement");
 		}
+
+		d = sqlite3_prepare_v2(m_database, "SELECT `average`, `minimum`, `maximum` FROM `sector_ground` WHERE `pos`=? LIMIT 1", -1, &m_database_read_ground, NULL);
+		if(d != SQLITE_OK) {
+			infostream<<"WARNING: Database ground level read statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+			throw FileNotGoodException("Cannot prepare read statement");
+		}
+
+		d = sqlite3_prepare_v2(m_database, "REPLACE INTO `sector_ground` VALUES(?, ?, ?, ?)", -1, &m_database_write_ground, NULL);
+		if(d != SQLITE_OK) {
+			infostream<<"WARNING: Database ground level write statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+			throw FileNotGoodException("Cannot prepare write statement");
+		}
 		
 		infostream<<"Server: Database opened"<<std::endl;
 	}
@@ -2965,8 +3819,13 @@ void ServerMap::listAllLoadableBlocks(core::list<v3s16> &dst)
 				<<"all blocks that are stored in flat files"<<std::endl;
 	}
 	
+	// Make sure queued blocks are listed too
+	flushSaveQueue();
+
 	{
 		verifyDatabase();
+
+		JMutexAutoLock lock(m_database_mutex);
 		
 		while(sqlite3_step(m_database_list) == SQLITE_ROW)
 		{
@@ -3226,16 +4085,188 @@ bool ServerMap::loadSectorFull(v2s16 p2d)
 }
 #endif
 
+/*
+	Blocks are only queued between these; the transactions are made by
+	writeQueuedBlocks().
+	A save tick puts all of its blocks into the queue, however many
+	there are. If the save thread is still behind with the previous
+	ticks, the next one waits for it here instead of writing inline.
+*/
 void ServerMap::beginSave() {
 	verifyDatabase();
-	if(sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
-		infostream<<"WARNING: beginSave() failed, saving might be slow.";
+	if(m_save_queue.isFull())
+	{
+		ScopeProfiler sp(g_profiler, "ServerMap: save queue wait", SPT_AVG);
+		m_save_queue.waitForRoom();
+	}
+	m_save_tick_running.set(true);
 }
 
 void ServerMap::endSave() {
+	g_profiler->avg("ServerMap: save queue size", m_save_queue.size());
+	g_profiler->avg("ServerMap: save queue (kB)",
+			m_save_queue.bytes() / 1024);
+	// Commit everything queued during this save tick as one transaction
+	m_save_flush_requested.set(true);
+	m_save_tick_running.set(false);
+}
+
+u32 ServerMap::writeQueuedBlocks(u32 max_count)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	if(max_count == 0)
+		max_count = m_save_batch_size;
+
+	if(m_save_queue.size() == 0)
+		return 0;
+
 	verifyDatabase();
+
+	/*
+		The database is locked before taking blocks from the queue so
+		that loadBlock() never sees a block that is in neither of them.
+	*/
+	JMutexAutoLock lock(m_database_mutex);
+
+	core::list<SerializedBlock> blocks;
+	if(m_save_queue.pop(blocks, max_count) == 0)
+		return 0;
+
+	TimeTaker timer("ServerMap::writeQueuedBlocks()");
+
+	if(sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
+		infostream<<"WARNING: writeQueuedBlocks(): BEGIN failed, "
+				<<"saving might be slow."<<std::endl;
+
+	for(core::list<SerializedBlock>::Iterator i = blocks.begin();
+			i != blocks.end(); i++)
+	{
+		v3s16 p3d = i->pos;
+		const std::string &data = i->data;
+
+		if(sqlite3_bind_int64(m_database_write, 1, getBlockAsInteger(p3d)) != SQLITE_OK)
+			infostream<<"WARNING: Block position failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
+		if(sqlite3_bind_blob(m_database_write, 2, (void *)data.c_str(), data.size(), NULL) != SQLITE_OK)
+			infostream<<"WARNING: Block data failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
+		int written = sqlite3_step(m_database_write);
+		if(written != SQLITE_DONE)
+			infostream<<"WARNING: Block failed to save ("<<p3d.X<<", "<<p3d.Y<<", "<<p3d.Z<<") "
+			<<sqlite3_errmsg(m_database)<<std::endl;
+		// Make ready for later reuse
+		sqlite3_reset(m_database_write);
+	}
+
+	/*
+		Ground levels calculated since the last write go in the same
+		transaction
+	*/
+	JMutexAutoLock lock2(m_sector_ground_levels_mutex);
+	for(core::map<v2s16, mapgen::SectorGroundLevels>::Iterator
+			i = m_sector_ground_levels_unsaved.getIterator();
+			i.atEnd() == false; i++)
+	{
+		v2s16 p2d = i.getNode()->getKey();
+		const mapgen::SectorGroundLevels &l = i.getNode()->getValue();
+		sqlite3_bind_int64(m_database_write_ground, 1,
+				getBlockAsInteger(v3s16(p2d.X, 0, p2d.Y)));
+		sqlite3_bind_int(m_database_write_ground, 2, l.average);
+		sqlite3_bind_int(m_database_write_ground, 3, l.minimum);
+		sqlite3_bind_int(m_database_write_ground, 4, l.maximum);
+		if(sqlite3_step(m_database_write_ground) != SQLITE_DONE)
+			infostream<<"WARNING: Ground levels of sector ("<<p2d.X<<", "
+					<<p2d.Y<<") failed to save: "
+					<<sqlite3_errmsg(m_database)<<std::endl;
+		sqlite3_reset(m_database_write_ground);
+	}
+	m_sector_ground_levels_unsaved.clear();
+
 	if(sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
-		infostream<<"WARNING: endSave() failed, map might not have saved.";
+		infostream<<"WARNING: writeQueuedBlocks(): COMMIT failed, "
+				<<"map might not have saved."<<std::endl;
+
+	u32 time_ms = timer.stop(true);
+	g_profiler->avg("ServerMap: save flush time (ms)", time_ms);
+	g_profiler->avg("ServerMap: blocks per commit", blocks.size());
+	g_profiler->add("ServerMap: blocks written", blocks.size());
+
+	return blocks.size();
+}
+
+void ServerMap::flushSaveQueue()
+{
+	while(writeQueuedBlocks(0) != 0);
+}
+
+bool ServerMap::saveStep()
+{
+	u32 time_ms = getTimeMs();
+	bool written = false;
+
+	u32 queued = m_save_queue.size();
+	if(queued == 0)
+	{
+		m_save_pending = false;
+	}
+	else
+	{
+		if(m_save_pending == false)
+		{
+			m_save_pending = true;
+			m_save_pending_since_ms = time_ms;
+		}
+
+		if(m_save_tick_running.get())
+		{
+			// Wait for endSave() to commit the tick at once
+		}
+		else if(m_save_flush_requested.get())
+		{
+			m_save_flush_requested.set(false);
+			/*
+				The whole tick goes in, even if it is larger than a
+				batch. The size is read again because the tick may have
+				ended only after the one above was read.
+			*/
+			queued = m_save_queue.size();
+			if(queued != 0)
+				writeQueuedBlocks(queued);
+			written = true;
+		}
+		else if(queued >= m_save_batch_size || m_save_queue.isFull()
+				|| time_ms - m_save_pending_since_ms >= m_save_max_delay_ms)
+		{
+			writeQueuedBlocks(0);
+			written = true;
+		}
+
+		if(written)
+			m_save_pending = false;
+	}
+
+	/*
+		Periodic WAL checkpoint
+	*/
+	if(m_wal_checkpoint_interval_ms != 0
+			&& time_ms - m_wal_checkpoint_last_ms >= m_wal_checkpoint_interval_ms)
+	{
+		m_wal_checkpoint_last_ms = time_ms;
+
+		JMutexAutoLock lock(m_database_mutex);
+		if(m_wal_enabled == false)
+			return written;
+
+		int log_frames = 0;
+		int checkpointed_frames = 0;
+		if(sqlite3_wal_checkpoint_v2(m_database, NULL,
+				SQLITE_CHECKPOINT_PASSIVE, &log_frames,
+				&checkpointed_frames) != SQLITE_OK)
+			infostream<<"WARNING: WAL checkpoint failed: "
+					<<sqlite3_errmsg(m_database)<<std::endl;
+		g_profiler->avg("ServerMap: WAL frames", log_frames);
+	}
+
+	return written;
 }
 
 void ServerMap::saveBlock(MapBlock *block)
@@ -3274,8 +4305,6 @@ void ServerMap::saveBlock(MapBlock *block)
 		[1] data
 	*/
 	
-	verifyDatabase();
-	
 	std::ostringstream o(std::ios_base::binary);
 	
 	o.write((char*)&version, 1);
@@ -3286,23 +4315,18 @@ void ServerMap::saveBlock(MapBlock *block)
 	// Write extra data stored on disk
 	block->serializeDiskExtra(o, version);
 	
-	// Write block to database
-	
-	std::string tmp = o.str();
-	const char *bytes = tmp.c_str();
+	/*
+		Queue block for writing to database.
+		The memory usage is bounded by beginSave() waiting for the
+		save thread.
+	*/
 	
-	if(sqlite3_bind_int64(m_database_write, 1, getBlockAsInteger(p3d)) != SQLITE_OK)
-		infostream<<"WARNING: Block position failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
-	if(sqlite3_bind_blob(m_database_write, 2, (void *)bytes, o.tellp(), NULL) != SQLITE_OK) // TODO this mught not be the right length
-		infostream<<"WARNING: Block data failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
-	int written = sqlite3_step(m_database_write);
-	if(written != SQLITE_DONE)
-		infostream<<"WARNING: Block failed to save ("<<p3d.X<<", "<<p3d.Y<<", "<<p3d.Z<<") "
-		<<sqlite3_errmsg(m_database)<<std::endl;
-	// Make ready for later reuse
-	sqlite3_reset(m_database_write);
+	std::string data = o.str();
+	m_save_queue.push(p3d, data);
 	
-	// We just wrote it to the disk so clear modified flag
+	m_save_count.set(m_save_count.get() + 1);
+
+	// It will be written to the disk so clear modified flag
 	block->resetModified();
 }
 
@@ -3362,6 +4386,7 @@ void ServerMap::loadBlock(std::string sectordir, std::string blockfile, MapSecto
 		if(version < SER_FMT_VER_HIGHEST || save_after_load)
 		{
 			saveBlock(block);
+			flushSaveQueue();
 			
 			// Should be in database now, so delete the old file
 			fs::RecursiveDelete(fullpath);
@@ -3451,19 +4476,80 @@ void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool
 	}
 }
 
+bool ServerMap::readBlock(v3s16 blockpos, std::string &dst)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	/*
+		A block waiting in the save queue is newer than the one in
+		the database
+	*/
+	if(m_save_queue.get(blockpos, dst))
+		return true;
+
+	if(loadFromFolders())
+		return false;
+	
+	verifyDatabase();
+
+	bool found = false;
+	
+	JMutexAutoLock lock(m_database_mutex);
+
+	if(sqlite3_bind_int64(m_database_read, 1, getBlockAsInteger(blockpos)) != SQLITE_OK)
+		infostream<<"WARNING: Could not bind block position for load: "
+			<<sqlite3_errmsg(m_database)<<std::endl;
+	if(sqlite3_step(m_database_read) == SQLITE_ROW) {
+		const char * data = (const char *)sqlite3_column_blob(m_database_read, 0);
+		size_t len = sqlite3_column_bytes(m_database_read, 0);
+		
+		dst.assign(data, len);
+		found = true;
+
+		sqlite3_step(m_database_read);
+	}
+	// We should never get more than 1 row, so ok to reset
+	sqlite3_reset(m_database_read);
+
+	return found;
+}
+
+bool ServerMap::isBlockGeneratedOnDisk(v3s16 blockpos)
+{
+	std::string data;
+	if(readBlock(blockpos, data) == false)
+		return false;
+	
+	/*
+		[0] u8 serialization version
+		[1] u8 flags of MapBlock::serialize()
+	*/
+	if(data.size() < 2)
+		return false;
+	u8 version = data[0];
+	if(!ser_ver_supported(version))
+		return false;
+	// Older versions don't store the flag
+	if(version < 18)
+		return true;
+	u8 flags = data[1];
+	return (flags & 0x08) == 0;
+}
+
 MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 {
 	DSTACK(__FUNCTION_NAME);
 
 	v2s16 p2d(blockpos.X, blockpos.Z);
 
-	if(!loadFromFolders()) {
-		verifyDatabase();
-		
-		if(sqlite3_bind_int64(m_database_read, 1, getBlockAsInteger(blockpos)) != SQLITE_OK)
-			infostream<<"WARNING: Could not bind block position for load: "
-				<<sqlite3_errmsg(m_database)<<std::endl;
-		if(sqlite3_step(m_database_read) == SQLITE_ROW) {
+	/*
+		Loading may queue the block for saving again, so the
+		database must not be locked here
+	*/
+	{
+		std::string datastr;
+		if(readBlock(blockpos, datastr))
+		{
 			/*
 				Make sure sector is loaded
 			*/
@@ -3472,20 +4558,10 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 			/*
 				Load block
 			*/
-			const char * data = (const char *)sqlite3_column_blob(m_database_read, 0);
-			size_t len = sqlite3_column_bytes(m_database_read, 0);
-			
-			std::string datastr(data, len);
-			
 			loadBlock(&datastr, blockpos, sector, false);
 
-			sqlite3_step(m_database_read);
-			// We should never get more than 1 row, so ok to reset
-			sqlite3_reset(m_database_read);
-
 			return getBlockNoCreateNoEx(blockpos);
 		}
-		sqlite3_reset(m_database_read);
 		
 		// Not found in database, try the files
 	}
@@ -4540,20 +5616,43 @@ void ManualMapVoxelManipulator::blitBackAll(
 					<<std::endl;*/
 			continue;
 		}
-		MapBlock *block = m_map->getBlockNoCreateNoEx(p);
-		if(block == NULL)
+		if(blitBackBlock(p, modified_blocks) == false)
 		{
 			infostream<<"WARNING: "<<__FUNCTION_NAME
 					<<": got NULL block "
 					<<"("<<p.X<<","<<p.Y<<","<<p.Z<<")"
 					<<std::endl;
-			continue;
 		}
+	}
+}
+
+bool ManualMapVoxelManipulator::blitBackBlock(v3s16 p,
+		core::map<v3s16, MapBlock*> * modified_blocks)
+{
+	MapBlock *block = m_map->getBlockNoCreateNoEx(p);
+	if(block == NULL)
+		return false;
 
-		block->copyFrom(*this);
+	block->copyFrom(*this);
 
-		if(modified_blocks)
-			modified_blocks->insert(p, block);
+	if(modified_blocks)
+		modified_blocks->insert(p, block);
+	return true;
+}
+
+void ManualMapVoxelManipulator::getLoadedBlocks(core::array<MapBlock*> &dst)
+{
+	for(core::map<v3s16, bool>::Iterator
+			i = m_loaded_blocks.getIterator();
+			i.atEnd() == false; i++)
+	{
+		bool existed = i.getNode()->getValue();
+		if(existed == false)
+			continue;
+		MapBlock *block = m_map->getBlockNoCreateNoEx(i.getNode()->getKey());
+		if(block == NULL || block->isDummy())
+			continue;
+		dst.push_back(block);
 	}
 }
 
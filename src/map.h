@@ -32,6 +32,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "constants.h"
 #include "voxel.h"
 #include "teleports.h"
+#include "mapgen.h"
 
 extern "C" {
 	#include "sqlite3.h"
@@ -42,10 +43,7 @@ class ServerMapSector;
 class ClientMapSector;
 class MapBlock;
 class NodeMetadata;
-
-namespace mapgen{
-	struct BlockMakeData;
-};
+class MapThreadPool;
 
 /*
 	MapEditEvent
@@ -176,21 +174,24 @@ class Map /*: public NodeContainer*/
 	// Returns a CONTENT_IGNORE node if not found
 	MapNode getNodeNoEx(v3s16 p);
 
-	void unspreadLight(enum LightBank bank,
-			core::map<v3s16, u8> & from_nodes,
-			core::map<v3s16, bool> & light_sources,
+	/*
+		Light propagation with queues (see voxel.h).
+		Banks are given as LIGHTBANKS_* masks and handled at once.
+	*/
+	void unspreadLight(LightQueue & from_nodes,
+			LightQueue & light_sources,
 			core::map<v3s16, MapBlock*> & modified_blocks);
 
-	void unLightNeighbors(enum LightBank bank,
+	// lightwas is packed like MapNode::param1
+	void unLightNeighbors(u8 banks,
 			v3s16 pos, u8 lightwas,
-			core::map<v3s16, bool> & light_sources,
+			LightQueue & light_sources,
 			core::map<v3s16, MapBlock*> & modified_blocks);
 	
-	void spreadLight(enum LightBank bank,
-			core::map<v3s16, bool> & from_nodes,
+	void spreadLight(LightQueue & from_nodes,
 			core::map<v3s16, MapBlock*> & modified_blocks);
 	
-	void lightNeighbors(enum LightBank bank,
+	void lightNeighbors(u8 banks,
 			v3s16 pos,
 			core::map<v3s16, MapBlock*> & modified_blocks);
 
@@ -199,10 +200,6 @@ class Map /*: public NodeContainer*/
 	s16 propagateSunlight(v3s16 start,
 			core::map<v3s16, MapBlock*> & modified_blocks);
 	
-	void updateLighting(enum LightBank bank,
-			core::map<v3s16, MapBlock*>  & a_blocks,
-			core::map<v3s16, MapBlock*> & modified_blocks);
-			
 	void updateLighting(core::map<v3s16, MapBlock*>  & a_blocks,
 			core::map<v3s16, MapBlock*> & modified_blocks);
 			
@@ -267,7 +264,27 @@ class Map /*: public NodeContainer*/
 	// For debug printing. Prints "Map: ", "ServerMap: " or "ClientMap: "
 	virtual void PrintInfo(std::ostream &out);
 	
-	void transformLiquids(core::map<v3s16, MapBlock*> & modified_blocks);
+	/*
+		Liquid
+
+		Liquid nodes that may flow are kept active in the sets of
+		their blocks; settled liquid sleeps until a change next to it
+		activates it again.
+
+		transformLiquids() does a pass over the active liquid, letting
+		it flow about three nodes. Blocks that are not next to each
+		other are transformed in parallel by m_thread_pool; the result
+		is the same with any number of threads. If the pass takes more
+		than max_time_ms (0 = no limit), it returns false and the pass
+		is continued by the next call.
+	*/
+	void activateLiquid(v3s16 p);
+	bool transformLiquids(core::map<v3s16, MapBlock*> & modified_blocks,
+			u32 max_time_ms=0);
+	u32 getActiveLiquidCount()
+	{
+		return m_active_liquid_count;
+	}
 
 	/*
 		Node metadata
@@ -285,6 +302,25 @@ class Map /*: public NodeContainer*/
 	*/
 	core::map<v2s16, MapSector*> *getSectorsPtr(){return &m_sectors;}
 
+	// Used by MapBlock to tell apart versions of blocks
+	u32 nextBlockChangeStamp(){ return ++m_block_change_stamp; }
+
+	/*
+		Send caches of the blocks (see MapBlock::getSendCache()).
+		The blocks keep the total size up to date and mark their cache
+		with a new stamp whenever it is used.
+	*/
+	u32 getSendCacheSize(){ return m_send_cache_size; }
+	void sendCacheAdded(u32 size){ m_send_cache_size += size; }
+	void sendCacheRemoved(u32 size){ m_send_cache_size -= size; }
+	u32 nextSendCacheStamp(){ return ++m_send_cache_stamp; }
+	/*
+		Drops the least recently used send caches until their total
+		size is at most max_size.
+		Returns the number of caches dropped.
+	*/
+	u32 trimSendCaches(u32 max_size);
+
 	/*
 		Variables
 	*/
@@ -301,8 +337,112 @@ class Map /*: public NodeContainer*/
 	MapSector *m_sector_cache;
 	v2s16 m_sector_cache_p;
 
-	// Queued transforming water nodes
-	UniqueQueue<v3s16> m_transforming_liquid;
+	// See nextBlockChangeStamp()
+	u32 m_block_change_stamp;
+
+	// See getSendCacheSize()
+	u32 m_send_cache_size;
+	u32 m_send_cache_stamp;
+
+	/*
+		Helper threads for updateLighting() and transformLiquids();
+		NULL if they are done in the calling thread only
+	*/
+	MapThreadPool *m_thread_pool;
+
+	// Blocks with active liquid
+	core::map<v3s16, bool> m_liquid_blocks;
+	// Number of active liquid nodes in all the blocks
+	u32 m_active_liquid_count;
+	// Next phase of the current pass; 0 = no pass going on
+	u16 m_liquid_phase;
+	// Whether m_liquid_phase has started and is continued by the next call
+	bool m_liquid_phase_started;
+	// Blocks of the started phase that are still to be transformed
+	core::list<v3s16> m_liquid_phase_blocks;
+	// Viscous liquid to be activated again after the current pass
+	UniqueQueue<v3s16> m_liquid_reflow;
+};
+
+/*
+	A serialized block waiting to be written to the database
+*/
+struct SerializedBlock
+{
+	v3s16 pos;
+	std::string data;
+};
+
+/*
+	Queue of serialized blocks waiting to be written to the database.
+	Repeated writes to the same position are coalesced into one.
+
+	This is a thread-safe class.
+*/
+class BlockSaveQueue
+{
+public:
+	// max_bytes: size of the data above which waitForRoom() waits;
+	// 0 = no limit
+	BlockSaveQueue(u32 max_bytes);
+
+	// Adds or replaces the data of a block
+	void push(v3s16 p, const std::string &data);
+
+	/*
+		Waits until pop() has made the queued data smaller than
+		max_bytes. Returns at once if it already is.
+	*/
+	void waitForRoom();
+	bool isFull();
+
+	/*
+		Copies the queued data of a block to dst.
+		Returns false if the block is not queued.
+	*/
+	bool get(v3s16 p, std::string &dst);
+
+	/*
+		Moves at most max_count of the oldest blocks to dst.
+		Returns the number of blocks moved.
+	*/
+	u32 pop(core::list<SerializedBlock> &dst, u32 max_count);
+
+	u32 size();
+	// Size of the queued data
+	u32 bytes();
+
+private:
+	// key = position, value = serialized data
+	core::map<v3s16, std::string> m_blocks;
+	// Positions in the order they were first queued
+	core::list<v3s16> m_order;
+	u32 m_bytes;
+	u32 m_max_bytes;
+	// Threads in waitForRoom(); pop() posts m_room once for each
+	u32 m_waiting;
+	Semaphore m_room;
+	JMutex m_mutex;
+};
+
+class ServerMap;
+
+/*
+	Writes blocks queued by ServerMap::saveBlock() to the database
+*/
+class MapSaveThread : public SimpleThread
+{
+	ServerMap *m_map;
+
+public:
+
+	MapSaveThread(ServerMap *map):
+		SimpleThread(),
+		m_map(map)
+	{
+	}
+
+	void * Thread();
 };
 
 /*
@@ -364,6 +504,14 @@ class ServerMap : public Map
 	// Helper for placing objects on ground level
 	s16 findGroundLevel(v2s16 p2d);
 
+	/*
+		Ground level statistics of a sector for the map generator.
+		Calculated once per sector and kept in memory and, if
+		mapgen_save_ground_levels is set, in the database.
+		Thread-safe.
+	*/
+	void getSectorGroundLevels(v2s16 p2d, mapgen::SectorGroundLevels &dst);
+
 	/*
 		Misc. helper functions for fiddling with directory and file
 		names when saving
@@ -383,6 +531,8 @@ class ServerMap : public Map
 	void createDatabase();
 	// Verify we can read/write to the database
 	void verifyDatabase();
+	// Apply journal and checkpoint settings to a newly opened database
+	void configureDatabase();
 	// Get an integer suitable for a block
 	static sqlite3_int64 getBlockAsInteger(const v3s16 pos);
 	static v3s16 getIntegerAsBlock(sqlite3_int64 i);
@@ -390,10 +540,31 @@ class ServerMap : public Map
 	// Returns true if the database file does not exist
 	bool loadFromFolders();
 
-	// Call these before and after saving of blocks
+	/*
+		Call these before and after saving of blocks.
+		The blocks saved between them are committed together;
+		beginSave() waits for the save thread if the save queue is full.
+	*/
 	void beginSave();
 	void endSave();
 
+	/*
+		Writes at most max_count blocks from the save queue to the
+		database in one transaction.
+		Returns the number of blocks written.
+		Can be called from any thread.
+	*/
+	u32 writeQueuedBlocks(u32 max_count);
+	// Writes everything in the save queue to the database
+	void flushSaveQueue();
+	/*
+		Called repeatedly by MapSaveThread.
+		Commits the queue when a save tick has ended, when a full batch
+		is waiting or when the oldest block has waited long enough.
+		Returns true if something was written.
+	*/
+	bool saveStep();
+
 	void save(bool only_changed);
 	//void loadAll();
 	
@@ -422,10 +593,28 @@ class ServerMap : public Map
 	// Returns true if sector now resides in memory
 	//bool deFlushSector(v2s16 p2d);
 	
+	// Serializes the block and queues it for writing to the database
 	void saveBlock(MapBlock *block);
 	// This will generate a sector with getSector if not found.
 	void loadBlock(std::string sectordir, std::string blockfile, MapSector *sector, bool save_after_load=false);
 	MapBlock* loadBlock(v3s16 p);
+	/*
+		Gets the serialized data of a block from the save queue or the
+		database. Doesn't touch the map, so the environment doesn't have
+		to be locked.
+		Returns false if the block is not stored there.
+	*/
+	bool readBlock(v3s16 p, std::string &dst);
+	/*
+		Returns true if the block has been saved after generating it.
+		Doesn't load the block.
+	*/
+	bool isBlockGeneratedOnDisk(v3s16 p);
+	/*
+		Incremented by every saveBlock(). Data got from readBlock() is
+		stale if this has changed in between.
+	*/
+	u32 getSaveCount(){ return m_save_count.get(); }
 	// Database version
 	void loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load=false);
 
@@ -443,6 +632,11 @@ class ServerMap : public Map
 	// Seed used for all kinds of randomness
 	u64 m_seed;
 
+	// Shared by the block generators; see mapgen::SectorColumns
+	mapgen::SectorColumnsCache *m_sector_columns_cache;
+	// Shared by the block generators; see mapgen::BlockTerrain
+	mapgen::BlockTerrainCache *m_block_terrain_cache;
+
 	std::string m_savedir;
 	bool m_map_saving_enabled;
 
@@ -467,6 +661,45 @@ class ServerMap : public Map
 	sqlite3_stmt *m_database_read;
 	sqlite3_stmt *m_database_write;
 	sqlite3_stmt *m_database_list;
+	sqlite3_stmt *m_database_read_ground;
+	sqlite3_stmt *m_database_write_ground;
+	// Serializes all use of the database and statements above
+	JMutex m_database_mutex;
+
+	/*
+		Cache of getSectorGroundLevels(). The unsaved ones are written
+		to the database along with the next batch of blocks.
+	*/
+	core::map<v2s16, mapgen::SectorGroundLevels> m_sector_ground_levels;
+	core::map<v2s16, mapgen::SectorGroundLevels> m_sector_ground_levels_unsaved;
+	bool m_save_ground_levels;
+	JMutex m_sector_ground_levels_mutex;
+
+	/*
+		Write-behind saving.
+		saveBlock() only serializes blocks into m_save_queue;
+		m_save_thread writes them to the database.
+	*/
+	BlockSaveQueue m_save_queue;
+	MapSaveThread m_save_thread;
+	// Maximum number of blocks written in one transaction
+	u32 m_save_batch_size;
+	// Maximum time a block waits in the queue before a commit
+	u32 m_save_max_delay_ms;
+	// Set by endSave() to commit the whole save tick at once
+	MutexedVariable<bool> m_save_flush_requested;
+	// Between beginSave() and endSave(); nothing is committed then
+	MutexedVariable<bool> m_save_tick_running;
+	// These are only accessed by saveStep()
+	bool m_save_pending;
+	u32 m_save_pending_since_ms;
+	// Number of saveBlock() calls
+	MutexedVariable<u32> m_save_count;
+	// Interval of manual WAL checkpoints, 0 = disabled
+	u32 m_wal_checkpoint_interval_ms;
+	u32 m_wal_checkpoint_last_ms;
+	// Set by verifyDatabase(); locked by m_database_mutex
+	bool m_wal_enabled;
 };
 
 /*
@@ -665,6 +898,12 @@ class ManualMapVoxelManipulator : public MapVoxelManipulator
 	
 	// This is much faster with big chunks of generated data
 	void blitBackAll(core::map<v3s16, MapBlock*> * modified_blocks);
+	// Copies the data of one loaded block back to the map.
+	// Returns false if the block doesn't exist.
+	bool blitBackBlock(v3s16 p, core::map<v3s16, MapBlock*> * modified_blocks);
+
+	// Gets the loaded blocks that existed when they were loaded
+	void getLoadedBlocks(core::array<MapBlock*> &dst);
 
 protected:
 	bool m_create_area;
@@ -38,9 +38,19 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, bool dummy):
 		m_generated(false),
 		m_timestamp(BLOCK_TIMESTAMP_UNDEFINED),
 		m_usage_timer(0),
-		m_owner(0) //j
+		m_owner(0), //j
+		m_send_cache_version(SER_FMT_VER_INVALID),
+		m_send_cache_valid(false),
+		m_send_cache_generation(0),
+		m_send_cache_used(0),
+		m_change_stamp(0),
+		m_changes_base(0),
+		m_metadata_stamp(0)
 {
+	allNodesChanged();
+
 	data = NULL;
+	updateContentPresence();
 	if(dummy == false)
 		reallocate();
 	
@@ -68,6 +78,9 @@ MapBlock::~MapBlock()
 	}
 #endif
 
+	// Tells the parent map that the cache is gone
+	clearSendCache();
+
 	if(data)
 		delete[] data;
 }
@@ -108,6 +121,7 @@ void MapBlock::setNodeParent(v3s16 p, MapNode & n)
 		if(data == NULL)
 			throw InvalidPositionException();
 		data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X] = n;
+		contentAdded(n.getContent());
 	}
 }
 
@@ -227,190 +241,150 @@ void MapBlock::replaceMesh(scene::SMesh *mesh_new)
 bool MapBlock::propagateSunlight(core::map<v3s16, bool> & light_sources,
 		bool remove_light, bool *black_air_left)
 {
-	// Whether the sunlight at the top of the bottom block is valid
-	bool block_below_is_valid = true;
-	
 	v3s16 pos_relative = getPosRelative();
-	
+
+	/*
+		The block is swept a layer at a time from top to bottom, for
+		all the columns at once. The neighbor blocks are looked up only
+		once; a dummy block is handled like a missing one.
+	*/
+	MapBlock *block_above = m_parent->getBlockNoCreateNoEx(
+			m_pos + v3s16(0,1,0));
+	if(block_above != NULL && block_above->isDummy())
+		block_above = NULL;
+	MapBlock *block_below = m_parent->getBlockNoCreateNoEx(
+			m_pos + v3s16(0,-1,0));
+	if(block_below != NULL && block_below->isDummy())
+		block_below = NULL;
+
+	// Light coming down in each column, indexed by z*MAP_BLOCKSIZE+x
+	u8 current_light[MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+	// This makes difference to diminishing in water.
+	bool stopped_to_solid_object[MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+
+	for(s16 z=0; z<MAP_BLOCKSIZE; z++)
 	for(s16 x=0; x<MAP_BLOCKSIZE; x++)
 	{
-		for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+		bool no_sunlight = false;
+		// Check if node above block has sunlight
+		if(block_above != NULL)
 		{
-#if 1
-			bool no_sunlight = false;
-			bool no_top_block = false;
-			// Check if node above block has sunlight
-			try{
-				MapNode n = getNodeParent(v3s16(x, MAP_BLOCKSIZE, z));
-				if(n.getContent() == CONTENT_IGNORE)
-				{
-					// Trust heuristics
-					no_sunlight = is_underground;
-				}
-				else if(n.getLight(LIGHTBANK_DAY) != LIGHT_SUN)
-				{
-					no_sunlight = true;
-				}
-			}
-			catch(InvalidPositionException &e)
+			MapNode n = block_above->getNodeNoCheck(x, 0, z);
+			if(n.getContent() == CONTENT_IGNORE)
 			{
-				no_top_block = true;
-				
-				// NOTE: This makes over-ground roofed places sunlighted
-				// Assume sunlight, unless is_underground==true
-				if(is_underground)
-				{
-					no_sunlight = true;
-				}
-				else
-				{
-					MapNode n = getNode(v3s16(x, MAP_BLOCKSIZE-1, z));
-					//if(n.getContent() == CONTENT_WATER || n.getContent() == CONTENT_WATERSOURCE)
-					if(content_features(n).sunlight_propagates == false)
-					{
-						no_sunlight = true;
-					}
-				}
-				// NOTE: As of now, this just would make everything dark.
-				// No sunlight here
-				//no_sunlight = true;
+				// Trust heuristics
+				no_sunlight = is_underground;
 			}
-#endif
-#if 0 // Doesn't work; nothing gets light.
-			bool no_sunlight = true;
-			bool no_top_block = false;
-			// Check if node above block has sunlight
-			try{
-				MapNode n = getNodeParent(v3s16(x, MAP_BLOCKSIZE, z));
-				if(n.getLight(LIGHTBANK_DAY) == LIGHT_SUN)
-				{
-					no_sunlight = false;
-				}
+			else if(n.getLight(LIGHTBANK_DAY) != LIGHT_SUN)
+			{
+				no_sunlight = true;
 			}
-			catch(InvalidPositionException &e)
+		}
+		else
+		{
+			// NOTE: This makes over-ground roofed places sunlighted
+			// Assume sunlight, unless is_underground==true
+			if(is_underground)
 			{
-				no_top_block = true;
+				no_sunlight = true;
 			}
-#endif
-
-			/*std::cout<<"("<<x<<","<<z<<"): "
-					<<"no_top_block="<<no_top_block
-					<<", is_underground="<<is_underground
-					<<", no_sunlight="<<no_sunlight
-					<<std::endl;*/
-		
-			s16 y = MAP_BLOCKSIZE-1;
-			
-			// This makes difference to diminishing in water.
-			bool stopped_to_solid_object = false;
-			
-			u8 current_light = no_sunlight ? 0 : LIGHT_SUN;
-
-			for(; y >= 0; y--)
+			else
 			{
-				v3s16 pos(x, y, z);
-				MapNode &n = getNodeRef(pos);
-				
-				if(current_light == 0)
-				{
-					// Do nothing
-				}
-				else if(current_light == LIGHT_SUN && n.sunlight_propagates())
-				{
-					// Do nothing: Sunlight is continued
-				}
-				else if(n.light_propagates() == false)
-				{
-					/*// DEPRECATED TODO: REMOVE
-					if(grow_grass)
-					{
-						bool upper_is_air = false;
-						try
-						{
-							if(getNodeParent(pos+v3s16(0,1,0)).getContent() == CONTENT_AIR)
-								upper_is_air = true;
-						}
-						catch(InvalidPositionException &e)
-						{
-						}
-						// Turn mud into grass
-						if(upper_is_air && n.getContent() == CONTENT_MUD
-								&& current_light == LIGHT_SUN)
-						{
-							n.d = CONTENT_GRASS;
-						}
-					}*/
-
-					// A solid object is on the way.
-					stopped_to_solid_object = true;
-					
-					// Light stops.
-					current_light = 0;
-				}
-				else
+				MapNode n = getNode(v3s16(x, MAP_BLOCKSIZE-1, z));
+				if(content_features(n).sunlight_propagates == false)
 				{
-					// Diminish light
-					current_light = diminish_light(current_light);
+					no_sunlight = true;
 				}
+			}
+			// NOTE: As of now, this just would make everything dark.
+			// No sunlight here
+			//no_sunlight = true;
+		}
 
-				u8 old_light = n.getLight(LIGHTBANK_DAY);
+		current_light[z*MAP_BLOCKSIZE+x] = no_sunlight ? 0 : LIGHT_SUN;
+		stopped_to_solid_object[z*MAP_BLOCKSIZE+x] = false;
+	}
 
-				if(current_light > old_light || remove_light)
-				{
-					n.setLight(LIGHTBANK_DAY, current_light);
-				}
-				
-				if(diminish_light(current_light) != 0)
-				{
-					light_sources.insert(pos_relative + pos, true);
-				}
+	for(s16 y=MAP_BLOCKSIZE-1; y>=0; y--)
+	for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+	for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+	{
+		u8 &light = current_light[z*MAP_BLOCKSIZE+x];
+		bool &stopped = stopped_to_solid_object[z*MAP_BLOCKSIZE+x];
+		MapNode &n = data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
 
-				if(current_light == 0 && stopped_to_solid_object)
-				{
-					if(black_air_left)
-					{
-						*black_air_left = true;
-					}
-				}
-			}
+		if(light == 0)
+		{
+			// Do nothing
+		}
+		else if(light == LIGHT_SUN && n.sunlight_propagates())
+		{
+			// Do nothing: Sunlight is continued
+		}
+		else if(n.light_propagates() == false)
+		{
+			// A solid object is on the way.
+			stopped = true;
+			
+			// Light stops.
+			light = 0;
+		}
+		else
+		{
+			// Diminish light
+			light = diminish_light(light);
+		}
 
-			// Whether or not the block below should see LIGHT_SUN
-			bool sunlight_should_go_down = (current_light == LIGHT_SUN);
+		u8 old_light = n.getLight(LIGHTBANK_DAY);
 
-			/*
-				If the block below hasn't already been marked invalid:
+		if(light > old_light || remove_light)
+		{
+			n.setLight(LIGHTBANK_DAY, light);
+		}
+		
+		if(diminish_light(light) != 0)
+		{
+			light_sources.insert(pos_relative + v3s16(x,y,z), true);
+		}
 
-				Check if the node below the block has proper sunlight at top.
-				If not, the block below is invalid.
-				
-				Ignore non-transparent nodes as they always have no light
-			*/
-			try
-			{
-			if(block_below_is_valid)
+		if(light == 0 && stopped)
+		{
+			if(black_air_left)
 			{
-				MapNode n = getNodeParent(v3s16(x, -1, z));
-				if(n.light_propagates())
-				{
-					if(n.getLight(LIGHTBANK_DAY) == LIGHT_SUN
-							&& sunlight_should_go_down == false)
-						block_below_is_valid = false;
-					else if(n.getLight(LIGHTBANK_DAY) != LIGHT_SUN
-							&& sunlight_should_go_down == true)
-						block_below_is_valid = false;
-				}
-			}//if
-			}//try
-			catch(InvalidPositionException &e)
+				*black_air_left = true;
+			}
+		}
+	}
+
+	/*
+		Check if the nodes below the block have proper sunlight at top.
+		If not, the block below is invalid.
+		
+		Ignore non-transparent nodes as they always have no light
+	*/
+	if(block_below != NULL)
+	{
+		for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+		{
+			// Whether or not the block below should see LIGHT_SUN
+			bool sunlight_should_go_down =
+					(current_light[z*MAP_BLOCKSIZE+x] == LIGHT_SUN);
+
+			MapNode n = block_below->getNodeNoCheck(x, MAP_BLOCKSIZE-1, z);
+			if(n.light_propagates())
 			{
-				/*std::cout<<"InvalidBlockException for bottom block node"
-						<<std::endl;*/
-				// Just no block below, no need to panic.
+				if(n.getLight(LIGHTBANK_DAY) == LIGHT_SUN
+						&& sunlight_should_go_down == false)
+					return false;
+				else if(n.getLight(LIGHTBANK_DAY) != LIGHT_SUN
+						&& sunlight_should_go_down == true)
+					return false;
 			}
 		}
 	}
 
-	return block_below_is_valid;
+	return true;
 }
 
 
@@ -432,15 +406,58 @@ void MapBlock::copyFrom(VoxelManipulator &dst)
 	// Copy from VoxelManipulator to data
 	dst.copyTo(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
+
+	clearSendCache();
+	allNodesChanged();
+	updateContentPresence();
 }
 
-void MapBlock::updateDayNightDiff()
+void MapBlock::copyChangedFrom(VoxelManipulator &src,
+		core::array<u16> &changed)
 {
 	if(data == NULL)
-	{
-		m_day_night_differs = false;
 		return;
+
+	v3s16 p0 = getPosRelative();
+	assert(src.m_area.contains(VoxelArea(p0,
+			p0 + v3s16(MAP_BLOCKSIZE-1,MAP_BLOCKSIZE-1,MAP_BLOCKSIZE-1))));
+
+	for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+	for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+	{
+		u32 i_src = src.m_area.index(p0.X, p0.Y+y, p0.Z+z);
+		u16 i = z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE;
+		for(s16 x=0; x<MAP_BLOCKSIZE; x++, i_src++, i++)
+		{
+			if(src.m_flags[i_src] & (VOXELFLAG_NOT_LOADED|VOXELFLAG_INEXISTENT))
+				continue;
+			MapNode &n = src.m_data[i_src];
+			if(data[i] == n)
+				continue;
+			data[i] = n;
+			changed.push_back(i);
+		}
+	}
+}
+
+void MapBlock::nodesChanged(core::array<u16> &changed)
+{
+	for(u32 i=0; i<changed.size(); i++)
+	{
+		raiseModified(MOD_STATE_WRITE_NEEDED);
+		nodeChanged(changed[i]);
 	}
+}
+
+void MapBlock::updateDayNightDiff()
+{
+	setDayNightDiff(calcDayNightDiff());
+}
+
+bool MapBlock::calcDayNightDiff()
+{
+	if(data == NULL)
+		return false;
 
 	bool differs = false;
 
@@ -477,7 +494,13 @@ void MapBlock::updateDayNightDiff()
 			differs = false;
 	}
 
-	// Set member variable
+	return differs;
+}
+
+void MapBlock::setDayNightDiff(bool differs)
+{
+	if(differs != m_day_night_differs)
+		clearSendCache();
 	m_day_night_differs = differs;
 }
 
@@ -580,80 +603,118 @@ void MapBlock::serialize(std::ostream &os, u8 version)
 	// All other versions (newest)
 	else
 	{
-		// First byte
-		u8 flags = 0;
-		if(is_underground)
-			flags |= 0x01;
-		if(m_day_night_differs)
-			flags |= 0x02;
-		if(m_lighting_expired)
-			flags |= 0x04;
-		if(version >= 18)
-		{
-			if(m_generated == false)
-				flags |= 0x08;
-		}
-		os.write((char*)&flags, 1);
+		MapBlockSnapshot snapshot;
+		getSnapshot(snapshot, version);
+		snapshot.serialize(os);
+	}
+}
 
-		//j
-		if(version >= 21)
-			os << m_owner;
+void MapBlock::getSnapshot(MapBlockSnapshot &snapshot, u8 version)
+{
+	if(!ser_ver_supported(version) || !snapshotSupported(version))
+		throw VersionMismatchException("ERROR: MapBlock format not supported");
+	
+	if(data == NULL)
+	{
+		throw SerializationError("ERROR: Not writing dummy block.");
+	}
 
-		u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	snapshot.version = version;
 
-		/*
-			Get data
-		*/
+	std::ostringstream os(std::ios_base::binary);
 
-		// Serialize nodes
-		SharedBuffer<u8> databuf_nodelist(nodecount*3);
-		for(u32 i=0; i<nodecount; i++)
-		{
-			data[i].serialize(&databuf_nodelist[i*3], version);
-		}
-		
-		// Create buffer with different parameters sorted
-		SharedBuffer<u8> databuf(nodecount*3);
-		for(u32 i=0; i<nodecount; i++)
-		{
-			databuf[i] = databuf_nodelist[i*3];
-			databuf[i+nodecount] = databuf_nodelist[i*3+1];
-			databuf[i+nodecount*2] = databuf_nodelist[i*3+2];
-		}
+	// First byte
+	u8 flags = 0;
+	if(is_underground)
+		flags |= 0x01;
+	if(m_day_night_differs)
+		flags |= 0x02;
+	if(m_lighting_expired)
+		flags |= 0x04;
+	if(version >= 18)
+	{
+		if(m_generated == false)
+			flags |= 0x08;
+	}
+	os.write((char*)&flags, 1);
 
-		/*
-			Compress data to output stream
-		*/
+	//j
+	if(version >= 21)
+		os << m_owner;
 
-		compress(databuf, os, version);
-		
-		/*
-			NodeMetadata
-		*/
-		if(version >= 14)
+	snapshot.header = os.str();
+
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+
+	/*
+		Get data
+	*/
+
+	// Serialize nodes
+	SharedBuffer<u8> databuf_nodelist(nodecount*3);
+	for(u32 i=0; i<nodecount; i++)
+	{
+		data[i].serialize(&databuf_nodelist[i*3], version);
+	}
+	
+	// Create buffer with different parameters sorted
+	snapshot.nodes.resize(nodecount*3);
+	for(u32 i=0; i<nodecount; i++)
+	{
+		snapshot.nodes[i] = databuf_nodelist[i*3];
+		snapshot.nodes[i+nodecount] = databuf_nodelist[i*3+1];
+		snapshot.nodes[i+nodecount*2] = databuf_nodelist[i*3+2];
+	}
+
+	/*
+		NodeMetadata
+	*/
+	snapshot.metadata = "";
+	if(version >= 14)
+	{
+		std::ostringstream oss(std::ios_base::binary);
+		m_node_metadata.serialize(oss);
+		snapshot.metadata = oss.str();
+	}
+}
+
+/*
+	MapBlockSnapshot
+*/
+
+void MapBlockSnapshot::serialize(std::ostream &os)
+{
+	os.write(header.c_str(), header.size());
+
+	/*
+		Compress data to output stream
+	*/
+
+	SharedBuffer<u8> databuf((u8*)nodes.c_str(), nodes.size());
+	compress(databuf, os, version);
+	
+	/*
+		NodeMetadata
+	*/
+	if(version >= 14)
+	{
+		if(version <= 15)
 		{
-			if(version <= 15)
-			{
-				try{
-					std::ostringstream oss(std::ios_base::binary);
-					m_node_metadata.serialize(oss);
-					os<<serializeString(oss.str());
-				}
-				// This will happen if the string is longer than 65535
-				catch(SerializationError &e)
-				{
-					// Use an empty string
-					os<<serializeString("");
-				}
+			try{
+				os<<serializeString(metadata);
 			}
-			else
+			// This will happen if the string is longer than 65535
+			catch(SerializationError &e)
 			{
-				std::ostringstream oss(std::ios_base::binary);
-				m_node_metadata.serialize(oss);
-				compressZlib(oss.str(), os);
-				//os<<serializeLongString(oss.str());
+				// Use an empty string
+				os<<serializeString("");
 			}
 		}
+		else
+		{
+			compressZlib(metadata, os);
+			//os<<serializeLongString(oss.str());
+		}
 	}
 }
 
@@ -662,6 +723,9 @@ void MapBlock::deSerialize(std::istream &is, u8 version)
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 
+	clearSendCache();
+	allNodesChanged();
+
 	// These have no lighting info
 	if(version <= 1)
 	{
@@ -810,6 +874,218 @@ void MapBlock::deSerialize(std::istream &is, u8 version)
 			}
 		}
 	}
+
+	updateContentPresence();
+}
+
+void MapBlock::updateContentPresence()
+{
+	memset(m_content_presence, 0, sizeof(m_content_presence));
+	if(data == NULL)
+		return;
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	content_t last = CONTENT_IGNORE;
+	contentAdded(last);
+	for(u32 i=0; i<nodecount; i++)
+	{
+		// Runs of the same content are common
+		content_t c = data[i].getContent();
+		if(c == last)
+			continue;
+		contentAdded(c);
+		last = c;
+	}
+}
+
+bool MapBlock::getSendCache(u8 version, SharedBuffer<u8> &data)
+{
+	if(m_send_cache_valid == false || m_send_cache_version != version)
+		return false;
+	data = m_send_cache;
+	if(m_parent)
+		m_send_cache_used = m_parent->nextSendCacheStamp();
+	return true;
+}
+
+void MapBlock::setSendCache(u8 version, SharedBuffer<u8> data)
+{
+	clearSendCache();
+	m_send_cache_generation++;
+	m_send_cache = data;
+	m_send_cache_version = version;
+	m_send_cache_valid = true;
+	if(m_parent)
+	{
+		m_parent->sendCacheAdded(data.getSize());
+		m_send_cache_used = m_parent->nextSendCacheStamp();
+	}
+}
+
+void MapBlock::clearSendCache()
+{
+	m_send_cache_generation++;
+	if(m_send_cache_valid == false)
+		return;
+	if(m_parent)
+		m_parent->sendCacheRemoved(m_send_cache.getSize());
+	m_send_cache = SharedBuffer<u8>();
+	m_send_cache_valid = false;
+}
+
+void MapBlock::newChangeStamp()
+{
+	if(m_parent)
+		m_change_stamp = m_parent->nextBlockChangeStamp();
+	else
+		m_change_stamp++;
+}
+
+/*
+	Format (version >= 18):
+	u8 flags (as in serialize())
+	u16 owner
+	u16 number of runs
+	for each run:
+		u16 index of first node
+		u16 number of nodes
+		nodes in MapNode::serialize() format
+	u8 1 if node metadata follows, else 0
+	zlib-compressed node metadata
+*/
+bool MapBlock::serializeDelta(std::ostream &os, u8 version, u32 since_stamp)
+{
+	if(version < 18)
+		return false;
+	if(data == NULL)
+		return false;
+	if(since_stamp < m_changes_base)
+		return false;
+
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+
+	// Mark changed nodes
+	bool changed[MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+	memset(changed, 0, sizeof(changed));
+	for(u32 i=0; i<m_changes.size(); i++)
+	{
+		if(m_changes[i].stamp > since_stamp)
+			changed[m_changes[i].index] = true;
+	}
+
+	/*
+		Collect runs. A run header takes as much space as a node, so
+		runs separated by a single unchanged node are joined.
+	*/
+	core::list<v2u32> runs;
+	for(u32 i=0; i<nodecount; i++)
+	{
+		if(changed[i] == false)
+			continue;
+		if(runs.size() != 0)
+		{
+			v2u32 &last = *runs.getLast();
+			if(i <= last.X + last.Y + 1)
+			{
+				last.Y = i - last.X + 1;
+				continue;
+			}
+		}
+		runs.push_back(v2u32(i, 1));
+	}
+
+	u8 flags = 0;
+	if(is_underground)
+		flags |= 0x01;
+	if(m_day_night_differs)
+		flags |= 0x02;
+	if(m_lighting_expired)
+		flags |= 0x04;
+	if(m_generated == false)
+		flags |= 0x08;
+	writeU8(os, flags);
+	writeU16(os, m_owner);
+
+	writeU16(os, runs.size());
+	u32 nodelen = MapNode::serializedLength(version);
+	SharedBuffer<u8> nodebuf(nodelen);
+	for(core::list<v2u32>::Iterator
+			i = runs.begin(); i != runs.end(); i++)
+	{
+		writeU16(os, i->X);
+		writeU16(os, i->Y);
+		for(u32 j=i->X; j<i->X+i->Y; j++)
+		{
+			data[j].serialize(*nodebuf, version);
+			os.write((char*)*nodebuf, nodelen);
+		}
+	}
+
+	if(m_metadata_stamp > since_stamp)
+	{
+		writeU8(os, 1);
+		std::ostringstream oss(std::ios_base::binary);
+		m_node_metadata.serialize(oss);
+		compressZlib(oss.str(), os);
+	}
+	else
+	{
+		writeU8(os, 0);
+	}
+
+	return true;
+}
+
+void MapBlock::deSerializeDelta(std::istream &is, u8 version)
+{
+	if(data == NULL)
+		throw SerializationError("MapBlock::deSerializeDelta: dummy block");
+
+	u8 flags = readU8(is);
+	is_underground = (flags & 0x01) ? true : false;
+	m_day_night_differs = (flags & 0x02) ? true : false;
+	m_lighting_expired = (flags & 0x04) ? true : false;
+	m_generated = (flags & 0x08) ? false : true;
+	m_owner = readU16(is);
+
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	u32 nodelen = MapNode::serializedLength(version);
+	SharedBuffer<u8> nodebuf(nodelen);
+	u16 runcount = readU16(is);
+	for(u16 i=0; i<runcount; i++)
+	{
+		u32 first = readU16(is);
+		u32 count = readU16(is);
+		if(first + count > nodecount)
+			throw SerializationError("MapBlock::deSerializeDelta: bad run");
+		for(u32 j=first; j<first+count; j++)
+		{
+			is.read((char*)*nodebuf, nodelen);
+			if(is.gcount() != (s32)nodelen)
+				throw SerializationError
+						("MapBlock::deSerializeDelta: no enough input data");
+			data[j].deSerialize(*nodebuf, version);
+		}
+	}
+
+	if(readU8(is) != 0)
+	{
+		// Ignore errors
+		try{
+			std::ostringstream oss(std::ios_base::binary);
+			decompressZlib(is, oss);
+			std::istringstream iss(oss.str(), std::ios_base::binary);
+			m_node_metadata.deSerialize(iss);
+		}
+		catch(SerializationError &e)
+		{
+			dstream<<"WARNING: MapBlock::deSerializeDelta(): Ignoring an error"
+					<<" while deserializing node metadata"<<std::endl;
+		}
+	}
+
+	raiseModified(MOD_STATE_WRITE_NEEDED);
+	allNodesChanged();
+	updateContentPresence();
 }
 
 void MapBlock::serializeDiskExtra(std::ostream &os, u8 version)
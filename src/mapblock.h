@@ -52,6 +52,39 @@ enum{
 	FACE_LEFT
 };*/
 
+/*
+	Node changes recorded in a MapBlock for sending deltas to clients.
+	If there are more changes than this, clients get the whole block.
+*/
+#define MAPBLOCK_CHANGE_LOG_MAX 256
+
+struct MapBlockNodeChange
+{
+	// See MapBlock::getChangeStamp()
+	u32 stamp;
+	// Index of the node in MapBlock data
+	u16 index;
+};
+
+/*
+	Data of a MapBlock copied for serializing it without access to the
+	block, for compressing it in another thread.
+	See MapBlock::getSnapshot()
+*/
+struct MapBlockSnapshot
+{
+	u8 version;
+	// Data written before the nodes (flags and owner)
+	std::string header;
+	// Nodes in the serialized order, uncompressed
+	std::string nodes;
+	// Serialized node metadata, uncompressed
+	std::string metadata;
+
+	// Writes the same as MapBlock::serialize() would have written
+	void serialize(std::ostream &os);
+};
+
 enum ModifiedState
 {
 	// Has not been modified.
@@ -143,6 +176,8 @@ class MapBlock /*: public NodeContainer*/
 			data[i] = MapNode(CONTENT_IGNORE);
 		}
 		raiseModified(MOD_STATE_WRITE_NEEDED);
+		allNodesChanged();
+		updateContentPresence();
 	}
 
 	/*
@@ -190,6 +225,8 @@ class MapBlock /*: public NodeContainer*/
 	void raiseModified(u32 mod)
 	{
 		m_modified = MYMAX(m_modified, mod);
+		clearSendCache();
+		newChangeStamp();
 	}
 	u32 getModified()
 	{
@@ -324,6 +361,7 @@ class MapBlock /*: public NodeContainer*/
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
 		raiseModified(MOD_STATE_WRITE_NEEDED);
+		nodeChanged(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x);
 	}
 	
 	void setNode(v3s16 p, MapNode & n)
@@ -353,6 +391,7 @@ class MapBlock /*: public NodeContainer*/
 			throw InvalidPositionException();
 		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
 		raiseModified(MOD_STATE_WRITE_NEEDED);
+		nodeChanged(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x);
 	}
 	
 	void setNodeNoCheck(v3s16 p, MapNode & n)
@@ -360,6 +399,34 @@ class MapBlock /*: public NodeContainer*/
 		setNodeNoCheck(p.X, p.Y, p.Z, n);
 	}
 
+	/*
+		Sets a node without the change bookkeeping of setNode(), so
+		that distinct blocks can be written in parallel.
+		Returns the index of the node for nodesChanged().
+	*/
+	u16 setNodeNoTracking(v3s16 p, MapNode & n)
+	{
+		if(data == NULL)
+			throw InvalidPositionException();
+		u16 i = p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X;
+		data[i] = n;
+		return i;
+	}
+
+	/*
+		Content presence: whether the block may contain nodes of a
+		content type, for skipping blocks without looking at the nodes.
+		It is updated when nodes are set, but a content is only
+		forgotten when all the nodes are replaced or
+		updateContentPresence() is called.
+	*/
+	bool mayContainContent(content_t c)
+	{
+		return (m_content_presence[c >> 5] & ((u32)1 << (c & 31))) != 0;
+	}
+	// Rebuilds the content presence from the nodes
+	void updateContentPresence();
+
 	/*
 		These functions consult the parent container if the position
 		is not valid on this MapBlock.
@@ -422,6 +489,15 @@ class MapBlock /*: public NodeContainer*/
 	void copyTo(VoxelManipulator &dst);
 	// Copies data from VoxelManipulator getPosRelative()
 	void copyFrom(VoxelManipulator &dst);
+	/*
+		Copies the nodes that differ in the VoxelManipulator at
+		getPosRelative() and appends their indices to changed.
+		Nothing else is touched, so this can be done to distinct
+		blocks in parallel; call nodesChanged() afterwards.
+	*/
+	void copyChangedFrom(VoxelManipulator &src, core::array<u16> &changed);
+	// Does the bookkeeping of setNode() for the given nodes
+	void nodesChanged(core::array<u16> &changed);
 
 #ifndef SERVER // Only on client
 	/*
@@ -478,6 +554,9 @@ class MapBlock /*: public NodeContainer*/
 		to be taken into account. Use Map::dayNightDiffed().
 	*/
 	void updateDayNightDiff();
+	// The parts of updateDayNightDiff(); calcDayNightDiff() only reads
+	bool calcDayNightDiff();
+	void setDayNightDiff(bool differs);
 
 	bool dayNightDiffed()
 	{
@@ -532,9 +611,30 @@ class MapBlock /*: public NodeContainer*/
 		return m_usage_timer;
 	}
 
+	/*
+		Active liquid: the liquid (and air) nodes of this block that
+		may have to flow. Settled liquid is not in here; it is woken
+		up by a change next to it. See Map::transformLiquids().
+	*/
+	// Returns false if p was already active
+	bool activateLiquid(v3s16 p)
+	{
+		return m_active_liquids.push_back(p);
+	}
+	v3s16 popActiveLiquid()
+	{
+		return m_active_liquids.pop_front();
+	}
+	u32 getActiveLiquidCount()
+	{
+		return m_active_liquids.size();
+	}
+
 //j
 	void setOwner(u16 o)
 	{
+		if(o != m_owner)
+			clearSendCache();
 		m_owner = o;
 	}
 	u16 getOwner() const
@@ -545,7 +645,10 @@ class MapBlock /*: public NodeContainer*/
 	{
 		if(m_owner==0) return;
 		if(clansManager==NULL)return; //???
-		if(clansManager->clanDeleted(m_owner)) m_owner = 0;
+		if(clansManager->clanDeleted(m_owner)){
+			m_owner = 0;
+			clearSendCache();
+		}
 	}
 
 
@@ -558,6 +661,72 @@ class MapBlock /*: public NodeContainer*/
 	void deSerialize(std::istream &is, u8 version);
 	// Used after the basic ones when writing on disk (serverside)
 	void serializeDiskExtra(std::ostream &os, u8 version);
+
+	/*
+		Copies the data of serialize() to a snapshot that can be
+		serialized later without the block.
+		Only versions that compress the nodes in one piece are
+		supported, see snapshotSupported().
+	*/
+	void getSnapshot(MapBlockSnapshot &snapshot, u8 version);
+	static bool snapshotSupported(u8 version)
+	{
+		return version >= 11;
+	}
+
+	/*
+		Cache of serialize() output for sending to clients, see
+		Server::SendBlockNoLock. It is dropped when the block is modified
+		or deleted.
+		The parent map is told of the size of the cache, and getting
+		or setting it marks it used; see Map::trimSendCaches().
+	*/
+	bool getSendCache(u8 version, SharedBuffer<u8> &data);
+	void setSendCache(u8 version, SharedBuffer<u8> data);
+	void clearSendCache();
+	u32 getSendCacheSize()
+	{
+		if(m_send_cache_valid == false)
+			return 0;
+		return m_send_cache.getSize();
+	}
+	/*
+		Changes whenever the cache is set or dropped. Data serialized
+		from a snapshot can be cached if this hasn't changed since.
+	*/
+	u32 getSendCacheGeneration()
+	{
+		return m_send_cache_generation;
+	}
+	// Stamp of the last use of the cache, see Map::nextSendCacheStamp()
+	u32 getSendCacheUsed()
+	{
+		return m_send_cache_used;
+	}
+
+	/*
+		Change tracking for sending only the changed nodes to clients.
+
+		Every modification gets a new stamp from the parent map, so a
+		stamp also tells blocks loaded at the same position apart.
+	*/
+	u32 getChangeStamp()
+	{
+		return m_change_stamp;
+	}
+	// Call this when node metadata of the block is modified
+	void nodeMetadataChanged()
+	{
+		newChangeStamp();
+		m_metadata_stamp = m_change_stamp;
+	}
+	/*
+		Writes the changes made after the given stamp in the format of
+		TOCLIENT_BLOCKDATA_DELTA.
+		Returns false if the changes are not known that far back.
+	*/
+	bool serializeDelta(std::ostream &os, u8 version, u32 since_stamp);
+	void deSerializeDelta(std::istream &is, u8 version);
 	void deSerializeDiskExtra(std::istream &is, u8 version);
 
 private:
@@ -668,8 +837,57 @@ class MapBlock /*: public NodeContainer*/
 		Map will unload the block when this reaches a timeout.
 	*/
 	float m_usage_timer;
+
+	// See activateLiquid()
+	UniqueQueue<v3s16> m_active_liquids;
 	//j
 	u16 m_owner;
+
+	// See getSendCache()
+	SharedBuffer<u8> m_send_cache;
+	u8 m_send_cache_version;
+	bool m_send_cache_valid;
+	u32 m_send_cache_generation;
+	u32 m_send_cache_used;
+
+	/*
+		See getChangeStamp()
+	*/
+	void newChangeStamp();
+	void nodeChanged(u16 index)
+	{
+		contentAdded(data[index].getContent());
+		if(m_changes.size() >= MAPBLOCK_CHANGE_LOG_MAX)
+		{
+			m_changes.clear();
+			m_changes_base = m_change_stamp;
+			return;
+		}
+		MapBlockNodeChange c;
+		c.stamp = m_change_stamp;
+		c.index = index;
+		m_changes.push_back(c);
+	}
+	// Called when the node data is replaced in a way not tracked above
+	void allNodesChanged()
+	{
+		newChangeStamp();
+		m_changes.clear();
+		m_changes_base = m_change_stamp;
+		m_metadata_stamp = m_change_stamp;
+	}
+	u32 m_change_stamp;
+	// m_changes contains all node changes made after this stamp
+	u32 m_changes_base;
+	core::array<MapBlockNodeChange> m_changes;
+	u32 m_metadata_stamp;
+
+	// See mayContainContent()
+	void contentAdded(content_t c)
+	{
+		m_content_presence[c >> 5] |= (u32)1 << (c & 31);
+	}
+	u32 m_content_presence[(MAX_CONTENT+1)/32];
 };
 
 inline bool blockpos_over_limit(v3s16 p)
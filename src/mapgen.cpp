@@ -26,6 +26,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mineral.h"
 //#include "serverobject.h"
 #include "content_sao.h"
+#include "porting.h"
 
 namespace mapgen
 {
@@ -80,13 +81,14 @@ static s16 find_ground_level_clever(VoxelManipulator &vmanip, v2s16 p2d)
 }
 #endif
 
-void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0, bool is_apple_tree)
+void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0, bool is_apple_tree,
+		PseudoRandom &random)
 {
 	MapNode treenode(CONTENT_TREE);
 	MapNode leavesnode(CONTENT_LEAVES);
 	MapNode applenode(CONTENT_APPLE);
 	
-	s16 trunk_h = myrand_range(4, 5);
+	s16 trunk_h = random.range(4, 5);
 	v3s16 p1 = p0;
 	for(s16 ii=0; ii<trunk_h; ii++)
 	{
@@ -121,9 +123,9 @@ void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0, bool is_apple_tree)
 		s16 d = 1;
 
 		v3s16 p(
-			myrand_range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
-			myrand_range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
-			myrand_range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
+			random.range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
+			random.range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
+			random.range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
 		);
 
 		for(s16 z=0; z<=d; z++)
@@ -149,7 +151,7 @@ void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0, bool is_apple_tree)
 			continue;
 		u32 i = leaves_a.index(x,y,z);
 		if(leaves_d[i] == 1) {
-			bool is_apple = myrand_range(0,99) < 10;
+			bool is_apple = random.range(0,99) < 10;
 			if(is_apple_tree && is_apple) {
 				vmanip.m_data[vi] = applenode;
 			} else {
@@ -159,7 +161,8 @@ void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0, bool is_apple_tree)
 	}
 }
 
-static void make_jungletree(VoxelManipulator &vmanip, v3s16 p0)
+static void make_jungletree(VoxelManipulator &vmanip, v3s16 p0,
+		PseudoRandom &random)
 {
 	MapNode treenode(CONTENT_JUNGLETREE);
 	MapNode leavesnode(CONTENT_LEAVES);
@@ -167,7 +170,7 @@ static void make_jungletree(VoxelManipulator &vmanip, v3s16 p0)
 	for(s16 x=-1; x<=1; x++)
 	for(s16 z=-1; z<=1; z++)
 	{
-		if(myrand_range(0, 2) == 0)
+		if(random.range(0, 2) == 0)
 			continue;
 		v3s16 p1 = p0 + v3s16(x,0,z);
 		v3s16 p2 = p0 + v3s16(x,-1,z);
@@ -178,7 +181,7 @@ static void make_jungletree(VoxelManipulator &vmanip, v3s16 p0)
 			vmanip.m_data[vmanip.m_area.index(p1)] = treenode;
 	}
 
-	s16 trunk_h = myrand_range(8, 12);
+	s16 trunk_h = random.range(8, 12);
 	v3s16 p1 = p0;
 	for(s16 ii=0; ii<trunk_h; ii++)
 	{
@@ -213,9 +216,9 @@ static void make_jungletree(VoxelManipulator &vmanip, v3s16 p0)
 		s16 d = 1;
 
 		v3s16 p(
-			myrand_range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
-			myrand_range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
-			myrand_range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
+			random.range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
+			random.range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
+			random.range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
 		);
 
 		for(s16 z=0; z<=d; z++)
@@ -245,11 +248,11 @@ static void make_jungletree(VoxelManipulator &vmanip, v3s16 p0)
 	}
 }
 
-void make_papyrus(VoxelManipulator &vmanip, v3s16 p0)
+void make_papyrus(VoxelManipulator &vmanip, v3s16 p0, PseudoRandom &random)
 {
 	MapNode papyrusnode(CONTENT_PAPYRUS);
 
-	s16 trunk_h = myrand_range(2, 3);
+	s16 trunk_h = random.range(2, 3);
 	v3s16 p1 = p0;
 	for(s16 ii=0; ii<trunk_h; ii++)
 	{
@@ -274,11 +277,12 @@ void make_cactus(VoxelManipulator &vmanip, v3s16 p0)
 }
 
 #if 0
-static void make_randomstone(VoxelManipulator &vmanip, v3s16 p0)
+static void make_randomstone(VoxelManipulator &vmanip, v3s16 p0,
+		PseudoRandom &random)
 {
 	MapNode stonenode(CONTENT_STONE);
 
-	s16 size = myrand_range(3, 6);
+	s16 size = random.range(3, 6);
 	
 	VoxelArea stone_a(v3s16(-2,0,-2), v3s16(2,size,2));
 	Buffer<u8> stone_d(stone_a.getVolume());
@@ -321,9 +325,9 @@ static void make_randomstone(VoxelManipulator &vmanip, v3s16 p0)
 		s16 d = 1;
 
 		v3s16 p(
-			myrand_range(stone_a.MinEdge.X, stone_a.MaxEdge.X-d),
-			myrand_range(stone_a.MinEdge.Y, stone_a.MaxEdge.Y-d),
-			myrand_range(stone_a.MinEdge.Z, stone_a.MaxEdge.Z-d)
+			random.range(stone_a.MinEdge.X, stone_a.MaxEdge.X-d),
+			random.range(stone_a.MinEdge.Y, stone_a.MaxEdge.Y-d),
+			random.range(stone_a.MinEdge.Z, stone_a.MaxEdge.Z-d)
 		);
 
 		for(s16 z=0; z<=d; z++)
@@ -355,11 +359,12 @@ static void make_randomstone(VoxelManipulator &vmanip, v3s16 p0)
 #endif
 
 #if 0
-static void make_largestone(VoxelManipulator &vmanip, v3s16 p0)
+static void make_largestone(VoxelManipulator &vmanip, v3s16 p0,
+		PseudoRandom &random)
 {
 	MapNode stonenode(CONTENT_STONE);
 
-	s16 size = myrand_range(8, 16);
+	s16 size = random.range(8, 16);
 	
 	VoxelArea stone_a(v3s16(-size/2,0,-size/2), v3s16(size/2,size,size/2));
 	Buffer<u8> stone_d(stone_a.getVolume());
@@ -405,9 +410,9 @@ static void make_largestone(VoxelManipulator &vmanip, v3s16 p0)
 		s16 d = 1;
 
 		v3s16 p(
-			myrand_range(stone_a.MinEdge.X, stone_a.MaxEdge.X-d),
-			myrand_range(stone_a.MinEdge.Y, stone_a.MaxEdge.Y-d),
-			myrand_range(stone_a.MinEdge.Z, stone_a.MaxEdge.Z-d)
+			random.range(stone_a.MinEdge.X, stone_a.MaxEdge.X-d),
+			random.range(stone_a.MinEdge.Y, stone_a.MaxEdge.Y-d),
+			random.range(stone_a.MinEdge.Z, stone_a.MaxEdge.Z-d)
 		);
 
 		for(s16 z=0; z<=d; z++)
@@ -1094,23 +1099,46 @@ bool is_cave(u64 seed, v3s16 p)
 	      and buffered
 		  NOTE: The speed of these actually isn't terrible
 */
-bool val_is_ground(double ground_noise1_val, v3s16 p, u64 seed)
-{
-	//return ((double)p.Y < ground_noise1_val);
 
-	double f = 0.55 + noise2d_perlin(
-			0.5+(float)p.X/250, 0.5+(float)p.Z/250,
-			seed+920381, 3, 0.45);
+// Ground density factor from its noise
+static double ground_f_from_noise(double noise)
+{
+	double f = 0.55 + noise;
 	if(f < 0.01)
 		f = 0.01;
 	else if(f >= 1.0)
 		f *= 1.6;
-	double h = WATER_LEVEL + 10 * noise2d_perlin(
+	return f;
+}
+
+// Ground base height from its noise
+static double ground_h_from_noise(double noise)
+{
+	return WATER_LEVEL + 10 * noise;
+}
+
+/*
+	val_is_ground() with the 2D part of the column already calculated
+*/
+static bool val_is_ground_column(double ground_noise1_val, s16 y,
+		double f, double h)
+{
+	return ((double)y - h < ground_noise1_val * f);
+}
+
+bool val_is_ground(double ground_noise1_val, v3s16 p, u64 seed)
+{
+	//return ((double)p.Y < ground_noise1_val);
+
+	double f = ground_f_from_noise(noise2d_perlin(
+			0.5+(float)p.X/250, 0.5+(float)p.Z/250,
+			seed+920381, 3, 0.45));
+	double h = ground_h_from_noise(noise2d_perlin(
 			0.5+(float)p.X/250, 0.5+(float)p.Z/250,
-			seed+84174, 4, 0.5);
+			seed+84174, 4, 0.5));
 	/*double f = 1;
 	double h = 0;*/
-	return ((double)p.Y - h < ground_noise1_val * f);
+	return val_is_ground_column(ground_noise1_val, p.Y, f, h);
 }
 
 /*
@@ -1122,6 +1150,12 @@ bool is_ground(u64 seed, v3s16 p)
 	return val_is_ground(val1, p, seed);
 }
 
+static bool is_ground_column(u64 seed, v3s16 p, double f, double h)
+{
+	double val1 = noise3d_param(get_ground_noise1_params(seed), p.X,p.Y,p.Z);
+	return val_is_ground_column(val1, p.Y, f, h);
+}
+
 // Amount of trees per area in nodes
 double tree_amount_2d(u64 seed, v2s16 p)
 {
@@ -1178,13 +1212,15 @@ double largestone_amount_2d(u64 seed, v2s16 p)
 }
 
 /*
-	Incrementally find ground level from 3d noise
+	Incrementally find ground level from 3d noise.
+	f and h are the 2D ground values of the column (see val_is_ground()).
 */
-s16 find_ground_level_from_noise(u64 seed, v2s16 p2d, s16 precision)
+static s16 find_ground_level_from_noise(u64 seed, v2s16 p2d, s16 precision,
+		double f, double h, PseudoRandom &random)
 {
 	// Start a bit fuzzy to make averaging lower precision values
 	// more useful
-	s16 level = myrand_range(-precision/2, precision/2);
+	s16 level = random.range(-precision/2, precision/2);
 	s16 dec[] = {31000, 100, 20, 4, 1, 0};
 	s16 i;
 	for(i = 1; dec[i] != 0 && precision <= dec[i]; i++)
@@ -1196,7 +1232,7 @@ s16 find_ground_level_from_noise(u64 seed, v2s16 p2d, s16 precision)
 			v3s16 p(p2d.X, level, p2d.Y);
 			for(; p.Y < max; p.Y += dec[i])
 			{
-				if(!is_ground(seed, p))
+				if(!is_ground_column(seed, p, f, h))
 				{
 					level = p.Y;
 					break;
@@ -1210,7 +1246,7 @@ s16 find_ground_level_from_noise(u64 seed, v2s16 p2d, s16 precision)
 			v3s16 p(p2d.X, level, p2d.Y);
 			for(; p.Y>min; p.Y-=dec[i])
 			{
-				bool ground = is_ground(seed, p);
+				bool ground = is_ground_column(seed, p, f, h);
 				/*if(dec[i] == 1 && is_cave(seed, p))
 					ground = false;*/
 				if(ground)
@@ -1228,6 +1264,20 @@ s16 find_ground_level_from_noise(u64 seed, v2s16 p2d, s16 precision)
 	return level;
 }
 
+s16 find_ground_level_from_noise(u64 seed, v2s16 p2d, s16 precision)
+{
+	double f = ground_f_from_noise(noise2d_perlin(
+			0.5+(float)p2d.X/250, 0.5+(float)p2d.Y/250,
+			seed+920381, 3, 0.45));
+	double h = ground_h_from_noise(noise2d_perlin(
+			0.5+(float)p2d.X/250, 0.5+(float)p2d.Y/250,
+			seed+84174, 4, 0.5));
+	// Same fuzz every time for the same position
+	PseudoRandom random((u32)(seed%0x100000000ULL)
+			+ p2d.Y*38134234 + p2d.X*23 + 1);
+	return find_ground_level_from_noise(seed, p2d, precision, f, h, random);
+}
+
 double get_sector_average_ground_level(u64 seed, v2s16 sectorpos, double p=4);
 
 double get_sector_average_ground_level(u64 seed, v2s16 sectorpos, double p)
@@ -1322,6 +1372,19 @@ bool block_is_underground(u64 seed, v3s16 blockpos)
 		return false;
 }
 
+bool block_is_underground(const SectorGroundLevels &levels, v3s16 blockpos)
+{
+	return (blockpos.Y*MAP_BLOCKSIZE + MAP_BLOCKSIZE <= levels.minimum);
+}
+
+void get_sector_ground_levels(u64 seed, v2s16 sectorpos,
+		SectorGroundLevels &dst)
+{
+	dst.average = (s16)get_sector_average_ground_level(seed, sectorpos);
+	dst.minimum = (s16)get_sector_minimum_ground_level(seed, sectorpos);
+	dst.maximum = (s16)get_sector_maximum_ground_level(seed, sectorpos, 1);
+}
+
 #if 0
 #define AVERAGE_MUD_AMOUNT 4
 
@@ -1400,12 +1463,136 @@ bool get_have_sand(u64 seed, v2s16 p2d)
 	return (sandnoise > -0.15);
 }
 
+/*
+	Fills a MAP_BLOCKSIZE*MAP_BLOCKSIZE map of a sector with
+	noise2d_perlin(0.5+(float)x/divisor, 0.5+(float)z/divisor, ...)
+*/
+static void noise2d_sector_map(double *result, v2s16 node_min,
+		float divisor, int seed, int octaves, double persistence)
+{
+	double xs[MAP_BLOCKSIZE];
+	for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+		xs[x] = 0.5+(float)(s16)(node_min.X+x)/divisor;
+	for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+	{
+		s16 pz = node_min.Y+z;
+		noise2d_perlin_row(&result[z*MAP_BLOCKSIZE], xs, MAP_BLOCKSIZE,
+				0.5+(float)pz/divisor, seed, octaves, persistence);
+	}
+}
+
+void get_sector_columns(u64 seed, v2s16 sectorpos, SectorColumns &dst)
+{
+	v2s16 node_min = sectorpos*MAP_BLOCKSIZE;
+	double noise[SECTOR_COLUMNS];
+
+	noise2d_sector_map(noise, node_min, 250, seed+920381, 3, 0.45);
+	for(u32 i=0; i<SECTOR_COLUMNS; i++)
+		dst.ground_f[i] = ground_f_from_noise(noise[i]);
+
+	noise2d_sector_map(noise, node_min, 250, seed+84174, 4, 0.5);
+	for(u32 i=0; i<SECTOR_COLUMNS; i++)
+		dst.ground_h[i] = ground_h_from_noise(noise[i]);
+
+	// Same as get_have_sand()
+	noise2d_sector_map(noise, node_min, 500, seed+59420, 3, 0.50);
+	for(u32 i=0; i<SECTOR_COLUMNS; i++)
+		dst.have_sand[i] = (noise[i] > -0.15);
+
+	noise2d_sector_map(dst.claynoise, node_min, 500, seed+4321, 6, 0.95);
+	for(u32 i=0; i<SECTOR_COLUMNS; i++)
+		dst.claynoise[i] += 0.5;
+
+	v2s16 p2d_center = node_min + v2s16(MAP_BLOCKSIZE/2, MAP_BLOCKSIZE/2);
+	dst.surface_humidity = surface_humidity_2d(seed, p2d_center);
+	dst.tree_amount = tree_amount_2d(seed, p2d_center);
+}
+
+/*
+	SectorColumnsCache
+*/
+
+SectorColumnsCache::SectorColumnsCache(u32 max_size):
+	m_max_size(max_size),
+	m_use_counter(0)
+{
+	m_mutex.Init();
+}
+
+SectorColumnsCache::~SectorColumnsCache()
+{
+	for(core::map<v2s16, Entry*>::Iterator
+			i = m_entries.getIterator();
+			i.atEnd() == false; i++)
+	{
+		delete i.getNode()->getValue();
+	}
+}
+
+void SectorColumnsCache::get(u64 seed, v2s16 sectorpos, SectorColumns &dst)
+{
+	{
+		JMutexAutoLock lock(m_mutex);
+		core::map<v2s16, Entry*>::Node *n = m_entries.find(sectorpos);
+		if(n != NULL && n->getValue()->seed == seed)
+		{
+			Entry *e = n->getValue();
+			e->last_used = ++m_use_counter;
+			dst = e->columns;
+			return;
+		}
+	}
+
+	// Calculate without holding the lock so that others can proceed
+	get_sector_columns(seed, sectorpos, dst);
+
+	if(m_max_size == 0)
+		return;
+
+	JMutexAutoLock lock(m_mutex);
+
+	Entry *e = NULL;
+	core::map<v2s16, Entry*>::Node *n = m_entries.find(sectorpos);
+	if(n != NULL)
+	{
+		e = n->getValue();
+	}
+	else
+	{
+		// Drop the least recently used one if full
+		if(m_entries.size() >= m_max_size)
+		{
+			core::map<v2s16, Entry*>::Node *oldest = NULL;
+			for(core::map<v2s16, Entry*>::Iterator
+					i = m_entries.getIterator();
+					i.atEnd() == false; i++)
+			{
+				if(oldest == NULL || i.getNode()->getValue()->last_used
+						< oldest->getValue()->last_used)
+					oldest = i.getNode();
+			}
+			e = oldest->getValue();
+			m_entries.remove(oldest->getKey());
+		}
+		else
+		{
+			e = new Entry;
+		}
+		m_entries.insert(sectorpos, e);
+	}
+	e->columns = dst;
+	e->seed = seed;
+	e->last_used = ++m_use_counter;
+}
+
 /*
 	Adds random objects to block, depending on the content of the block
 */
 void add_random_objects(MapBlock *block)
 {
 #if 0
+	v3s16 bp = block->getPos();
+	PseudoRandom objectrandom(bp.Z*38134234 + bp.Y*42123 + bp.X*23);
 	for(s16 z0=0; z0<MAP_BLOCKSIZE; z0++)
 	for(s16 x0=0; x0<MAP_BLOCKSIZE; x0++)
 	{
@@ -1430,7 +1617,7 @@ void add_random_objects(MapBlock *block)
 				{
 					if(n.getLight(LIGHTBANK_DAY) <= 3)
 					{
-						if(myrand() % 300 == 0)
+						if(objectrandom.next() % 300 == 0)
 						{
 							v3f pos_f = intToFloat(p+block->getPosRelative(), BS);
 							pos_f.Y -= BS*0.4;
@@ -1447,7 +1634,7 @@ void add_random_objects(MapBlock *block)
 							block->m_static_objects.insert(0, s_obj);
 							delete obj;
 						}
-						if(myrand() % 1000 == 0)
+						if(objectrandom.next() % 1000 == 0)
 						{
 							v3f pos_f = intToFloat(p+block->getPosRelative(), BS);
 							pos_f.Y -= BS*0.4;
@@ -1469,127 +1656,88 @@ void add_random_objects(MapBlock *block)
 #endif
 }
 
-void make_block(BlockMakeData *data)
+/*
+	Makes the seed of the random values of a block
+*/
+static u32 get_blockseed(u64 seed, v3s16 blockpos)
 {
-	if(data->no_op)
-	{
-		//dstream<<"makeBlock: no-op"<<std::endl;
-		return;
-	}
-
-	v3s16 blockpos = data->blockpos;
-	
-	/*dstream<<"makeBlock(): ("<<blockpos.X<<","<<blockpos.Y<<","
-			<<blockpos.Z<<")"<<std::endl;*/
+	v3s16 full_node_min = (blockpos-1)*MAP_BLOCKSIZE;
+	return (u32)(seed%0x100000000ULL) + full_node_min.Z*38134234
+			+ full_node_min.Y*42123 + full_node_min.X*23;
+}
 
-	ManualMapVoxelManipulator &vmanip = *(data->vmanip);
-	v3s16 blockpos_min = blockpos - v3s16(1,1,1);
-	v3s16 blockpos_max = blockpos + v3s16(1,1,1);
-	// Area of center block
+void make_block_terrain(u64 seed, v3s16 blockpos,
+		const SectorGroundLevels &ground_levels,
+		SectorColumnsCache *columns_cache, BlockTerrain &dst)
+{
+	// Area of the block
 	v3s16 node_min = blockpos*MAP_BLOCKSIZE;
 	v3s16 node_max = (blockpos+v3s16(1,1,1))*MAP_BLOCKSIZE-v3s16(1,1,1);
-	// Full allocated area
-	v3s16 full_node_min = (blockpos-1)*MAP_BLOCKSIZE;
-	v3s16 full_node_max = (blockpos+2)*MAP_BLOCKSIZE-v3s16(1,1,1);
-	// Area of a block
-	double block_area_nodes = MAP_BLOCKSIZE*MAP_BLOCKSIZE;
 
-	v2s16 p2d_center(node_min.X+MAP_BLOCKSIZE/2, node_min.Z+MAP_BLOCKSIZE/2);
+	/*
+		Get the 2D values of the columns of this block
+	*/
+
+	SectorColumns columns;
+	if(columns_cache)
+		columns_cache->get(seed, v2s16(blockpos.X, blockpos.Z), columns);
+	else
+		get_sector_columns(seed, v2s16(blockpos.X, blockpos.Z), columns);
 
 	/*
 		Get average ground level from noise
 	*/
 	
-	s16 approx_groundlevel = (s16)get_sector_average_ground_level(
-			data->seed, v2s16(blockpos.X, blockpos.Z));
-	//dstream<<"approx_groundlevel="<<approx_groundlevel<<std::endl;
+	s16 approx_groundlevel = ground_levels.average;
 	
 	s16 approx_ground_depth = approx_groundlevel - (node_min.Y+MAP_BLOCKSIZE/2);
 	
-	s16 minimum_groundlevel = (s16)get_sector_minimum_ground_level(
-			data->seed, v2s16(blockpos.X, blockpos.Z));
-	// Minimum amount of ground above the top of the central block
-	s16 minimum_ground_depth = minimum_groundlevel - node_max.Y;
+	// Minimum amount of ground above the top of the block
+	s16 minimum_ground_depth = ground_levels.minimum - node_max.Y;
 
-	s16 maximum_groundlevel = (s16)get_sector_maximum_ground_level(
-			data->seed, v2s16(blockpos.X, blockpos.Z), 1);
-	// Maximum amount of ground above the bottom of the central block
-	s16 maximum_ground_depth = maximum_groundlevel - node_min.Y;
-
-	#if 0
-	/*
-		Special case for high air or water: Just fill with air and water.
-	*/
-	if(maximum_ground_depth < -20)
-	{
-		for(s16 x=node_min.X; x<=node_max.X; x++)
-		for(s16 z=node_min.Z; z<=node_max.Z; z++)
-		{
-			// Node position
-			v2s16 p2d(x,z);
-			{
-				// Use fast index incrementing
-				v3s16 em = vmanip.m_area.getExtent();
-				u32 i = vmanip.m_area.index(v3s16(p2d.X, node_min.Y, p2d.Y));
-				for(s16 y=node_min.Y; y<=node_max.Y; y++)
-				{
-					// Only modify places that have no content
-					if(vmanip.m_data[i].getContent() == CONTENT_IGNORE)
-					{
-						if(y <= WATER_LEVEL)
-							vmanip.m_data[i] = MapNode(CONTENT_WATERSOURCE);
-						else
-							vmanip.m_data[i] = MapNode(CONTENT_AIR);
-					}
-				
-					data->vmanip->m_area.add_y(em, i, 1);
-				}
-			}
-		}
-		
-		// We're done
-		return;
-	}
-	#endif
+	// Maximum amount of ground above the bottom of the block
+	s16 maximum_ground_depth = ground_levels.maximum - node_min.Y;
 
 	/*
 		If block is deep underground, this is set to true and ground
 		density noise is not generated, for speed optimization.
 	*/
 	bool all_is_ground_except_caves = (minimum_ground_depth > 40);
-	
+
 	/*
-		Create a block-specific seed
+		If close to ground level, the surface is made. It depends on
+		two rows of nodes above the block, which are made here too,
+		the same way as the block above makes them.
 	*/
-	u32 blockseed = (u32)(data->seed%0x100000000ULL) + full_node_min.Z*38134234
-			+ full_node_min.Y*42123 + full_node_min.X*23;
+	bool near_ground = (minimum_ground_depth < 5 && maximum_ground_depth > -5);
+	// The topmost row made
+	s16 top_y = near_ground ? node_max.Y+2 : node_max.Y;
+
+	u32 blockseed = get_blockseed(seed, blockpos);
+
+	VoxelManipulator vmanip;
+	vmanip.addArea(VoxelArea(node_min, v3s16(node_max.X, top_y, node_max.Z)));
 	
 	/*
 		Make some 3D noise
 	*/
 	
-	//NoiseBuffer noisebuf1;
-	//NoiseBuffer noisebuf2;
 	NoiseBuffer noisebuf_cave;
 	NoiseBuffer noisebuf_ground;
 	NoiseBuffer noisebuf_ground_crumbleness;
 	NoiseBuffer noisebuf_ground_wetness;
 	{
 		v3f minpos_f(node_min.X, node_min.Y, node_min.Z);
-		v3f maxpos_f(node_max.X, node_max.Y, node_max.Z);
-
-		//TimeTaker timer("noisebuf.create");
+		v3f maxpos_f(node_max.X, top_y, node_max.Z);
 
 		/*
 			Cave noise
 		*/
-#if 1
-		noisebuf_cave.create(get_cave_noise1_params(data->seed),
+		noisebuf_cave.create(get_cave_noise1_params(seed),
 				minpos_f.X, minpos_f.Y, minpos_f.Z,
 				maxpos_f.X, maxpos_f.Y, maxpos_f.Z,
 				2, 2, 2);
-		noisebuf_cave.multiply(get_cave_noise2_params(data->seed));
-#endif
+		noisebuf_cave.multiply(get_cave_noise2_params(seed));
 
 		/*
 			Ground noise
@@ -1602,8 +1750,7 @@ void make_block(BlockMakeData *data)
 			Density noise
 		*/
 		if(all_is_ground_except_caves == false)
-			//noisebuf_ground.create(data->seed+983240, 6, 0.60, false,
-			noisebuf_ground.create(get_ground_noise1_params(data->seed),
+			noisebuf_ground.create(get_ground_noise1_params(seed),
 					minpos_f.X, minpos_f.Y, minpos_f.Z,
 					maxpos_f.X, maxpos_f.Y, maxpos_f.Z,
 					sl.X, sl.Y, sl.Z);
@@ -1613,17 +1760,17 @@ void make_block(BlockMakeData *data)
 		*/
 		sl = v3f(2.5, 2.5, 2.5);
 		noisebuf_ground_crumbleness.create(
-				get_ground_crumbleness_params(data->seed),
+				get_ground_crumbleness_params(seed),
 				minpos_f.X, minpos_f.Y, minpos_f.Z,
-				maxpos_f.X, maxpos_f.Y+5, maxpos_f.Z,
+				maxpos_f.X, node_max.Y+5, maxpos_f.Z,
 				sl.X, sl.Y, sl.Z);
 		noisebuf_ground_wetness.create(
-				get_ground_wetness_params(data->seed),
+				get_ground_wetness_params(seed),
 				minpos_f.X, minpos_f.Y, minpos_f.Z,
-				maxpos_f.X, maxpos_f.Y+5, maxpos_f.Z,
+				maxpos_f.X, node_max.Y+5, maxpos_f.Z,
 				sl.X, sl.Y, sl.Z);
 	}
-	
+
 	/*
 		Make base ground level
 	*/
@@ -1633,33 +1780,31 @@ void make_block(BlockMakeData *data)
 	{
 		// Node position
 		v2s16 p2d(x,z);
+		u32 ci = columns.index(node_min, p2d);
 		{
 			// Use fast index incrementing
 			v3s16 em = vmanip.m_area.getExtent();
 			u32 i = vmanip.m_area.index(v3s16(p2d.X, node_min.Y, p2d.Y));
-			for(s16 y=node_min.Y; y<=node_max.Y; y++)
+			for(s16 y=node_min.Y; y<=top_y; y++)
 			{
-				// Only modify places that have no content
-				if(vmanip.m_data[i].getContent() == CONTENT_IGNORE)
+				// First priority: make air and water.
+				// This avoids caves inside water.
+				if(all_is_ground_except_caves == false
+						&& val_is_ground_column(noisebuf_ground.get(x,y,z),
+						y, columns.ground_f[ci], columns.ground_h[ci])
+						== false)
 				{
-					// First priority: make air and water.
-					// This avoids caves inside water.
-					if(all_is_ground_except_caves == false
-							&& val_is_ground(noisebuf_ground.get(x,y,z),
-							v3s16(x,y,z), data->seed) == false)
-					{
-						if(y <= WATER_LEVEL)
-							vmanip.m_data[i] = MapNode(CONTENT_WATERSOURCE);
-						else
-							vmanip.m_data[i] = MapNode(CONTENT_AIR);
-					}
-					else if(noisebuf_cave.get(x,y,z) > CAVE_NOISE_THRESHOLD)
-						vmanip.m_data[i] = MapNode(CONTENT_AIR);
+					if(y <= WATER_LEVEL)
+						vmanip.m_data[i] = MapNode(CONTENT_WATERSOURCE);
 					else
-						vmanip.m_data[i] = MapNode(CONTENT_STONE);
+						vmanip.m_data[i] = MapNode(CONTENT_AIR);
 				}
+				else if(noisebuf_cave.get(x,y,z) > CAVE_NOISE_THRESHOLD)
+					vmanip.m_data[i] = MapNode(CONTENT_AIR);
+				else
+					vmanip.m_data[i] = MapNode(CONTENT_STONE);
 			
-				data->vmanip->m_area.add_y(em, i, 1);
+				vmanip.m_area.add_y(em, i, 1);
 			}
 		}
 	}
@@ -1809,8 +1954,8 @@ void make_block(BlockMakeData *data)
 		{
 			// Use fast index incrementing
 			v3s16 em = vmanip.m_area.getExtent();
-			u32 i = vmanip.m_area.index(v3s16(p2d.X, node_max.Y, p2d.Y));
-			for(s16 y=node_max.Y; y>=node_min.Y; y--)
+			u32 i = vmanip.m_area.index(v3s16(p2d.X, top_y, p2d.Y));
+			for(s16 y=top_y; y>=node_min.Y; y--)
 			{
 				if(vmanip.m_data[i].getContent() == CONTENT_STONE)
 				{
@@ -1830,32 +1975,451 @@ void make_block(BlockMakeData *data)
 							-3.0 + MYMIN(0.1 * sqrt((float)MYMAX(0, -y)), 1.5))
 					{
 						vmanip.m_data[i] = MapNode(CONTENT_LAVASOURCE);
-						for(s16 x1=-1; x1<=1; x1++)
-						for(s16 y1=-1; y1<=1; y1++)
-						for(s16 z1=-1; z1<=1; z1++)
-							data->transforming_liquid.push_back(
-									v3s16(p2d.X+x1, y+y1, p2d.Y+z1));
+						if(y <= node_max.Y)
+							dst.lava.push_back(v3s16(p2d.X, y, p2d.Y));
 					}
 				}
 
-				data->vmanip->m_area.add_y(em, i, -1);
+				vmanip.m_area.add_y(em, i, -1);
 			}
 		}
 	}
 
 	/*
-		Add dungeons
+		Add grass, mud and sand to the surface
 	*/
+	if(near_ground)
+	{
+		/*
+			Add grass and mud
+		*/
+
+		for(s16 x=node_min.X; x<=node_max.X; x++)
+		for(s16 z=node_min.Z; z<=node_max.Z; z++)
+		{
+			// Node position
+			v2s16 p2d(x,z);
+			u32 ci = columns.index(node_min, p2d);
+			{
+				bool possibly_have_sand = columns.have_sand[ci];
+				bool have_sand = false;
+				u32 current_depth = 0;
+				bool air_detected = false;
+				bool water_detected = false;
+				bool have_clay = false;
+
+				// Use fast index incrementing
+				s16 start_y = node_max.Y+2;
+				v3s16 em = vmanip.m_area.getExtent();
+				u32 i = vmanip.m_area.index(v3s16(p2d.X, start_y, p2d.Y));
+				for(s16 y=start_y; y>=node_min.Y; y--)
+				{
+					if(vmanip.m_data[i].getContent() == CONTENT_WATERSOURCE)
+						water_detected = true;
+					if(vmanip.m_data[i].getContent() == CONTENT_AIR)
+						air_detected = true;
+
+					if((vmanip.m_data[i].getContent() == CONTENT_STONE
+							|| vmanip.m_data[i].getContent() == CONTENT_GRASS
+							|| vmanip.m_data[i].getContent() == CONTENT_MUD
+							|| vmanip.m_data[i].getContent() == CONTENT_SAND
+							|| vmanip.m_data[i].getContent() == CONTENT_GRAVEL
+							) && (air_detected || water_detected))
+					{
+						if(current_depth == 0 && y <= WATER_LEVEL+2
+								&& possibly_have_sand)
+							have_sand = true;
+						
+						if(current_depth < 4)
+						{
+							if(have_sand)
+							{
+								// Determine whether to have clay in the sand here
+								double claynoise = columns.claynoise[ci];
+				
+								have_clay = (y <= WATER_LEVEL) && (y >= WATER_LEVEL-2) && (
+									((claynoise > 0) && (claynoise < 0.04) && (current_depth == 0)) ||
+									((claynoise > 0) && (claynoise < 0.12) && (current_depth == 1))
+									);
+								if (have_clay)
+									vmanip.m_data[i] = MapNode(CONTENT_CLAY);
+								else
+									vmanip.m_data[i] = MapNode(CONTENT_SAND);
+							}
+							#if 1
+							else if(current_depth==0 && !water_detected
+									&& y >= WATER_LEVEL && air_detected)
+								vmanip.m_data[i] = MapNode(CONTENT_GRASS);
+							#endif
+							else
+								vmanip.m_data[i] = MapNode(CONTENT_MUD);
+						}
+						else
+						{
+							if(vmanip.m_data[i].getContent() == CONTENT_MUD
+								|| vmanip.m_data[i].getContent() == CONTENT_GRASS)
+								vmanip.m_data[i] = MapNode(CONTENT_STONE);
+						}
+
+						current_depth++;
+
+						if(current_depth >= 8)
+							break;
+					}
+					else if(current_depth != 0)
+						break;
+
+					vmanip.m_area.add_y(em, i, -1);
+				}
+			}
+		}
+	}
+
+	/*
+		Copy the block out
+	*/
+	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
+	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
+	vmanip.copyTo(dst.nodes, data_area, v3s16(0,0,0), node_min, data_size);
+}
+
+BlockTerrainCache::BlockTerrainCache(u32 max_size):
+	m_max_size(max_size),
+	m_use_counter(0)
+{
+	m_mutex.Init();
+}
+
+BlockTerrainCache::~BlockTerrainCache()
+{
+	for(core::map<v3s16, Entry*>::Iterator
+			i = m_entries.getIterator();
+			i.atEnd() == false; i++)
+	{
+		delete i.getNode()->getValue();
+	}
+}
+
+void BlockTerrainCache::get(u64 seed, v3s16 blockpos,
+		const SectorGroundLevels &ground_levels,
+		SectorColumnsCache *columns_cache, BlockTerrain &dst)
+{
+	{
+		JMutexAutoLock lock(m_mutex);
+		core::map<v3s16, Entry*>::Node *n = m_entries.find(blockpos);
+		if(n != NULL && n->getValue()->seed == seed)
+		{
+			Entry *e = n->getValue();
+			e->last_used = ++m_use_counter;
+			dst = e->terrain;
+			return;
+		}
+	}
+
+	// Make it without holding the lock so that others can proceed
+	make_block_terrain(seed, blockpos, ground_levels, columns_cache, dst);
+
+	if(m_max_size == 0)
+		return;
+
+	JMutexAutoLock lock(m_mutex);
+
+	Entry *e = NULL;
+	core::map<v3s16, Entry*>::Node *n = m_entries.find(blockpos);
+	if(n != NULL)
+	{
+		e = n->getValue();
+	}
+	else
+	{
+		// Drop the least recently used one if full
+		if(m_entries.size() >= m_max_size)
+		{
+			core::map<v3s16, Entry*>::Node *oldest = NULL;
+			for(core::map<v3s16, Entry*>::Iterator
+					i = m_entries.getIterator();
+					i.atEnd() == false; i++)
+			{
+				if(oldest == NULL || i.getNode()->getValue()->last_used
+						< oldest->getValue()->last_used)
+					oldest = i.getNode();
+			}
+			e = oldest->getValue();
+			m_entries.remove(oldest->getKey());
+		}
+		else
+		{
+			e = new Entry;
+		}
+		m_entries.insert(blockpos, e);
+	}
+	e->terrain = dst;
+	e->seed = seed;
+	e->last_used = ++m_use_counter;
+}
+
+bool written_node_wins(MapNode a, MapNode b)
+{
+	// Solid nodes, so that nothing gets holes
+	bool a_walkable = content_features(a).walkable;
+	if(a_walkable != content_features(b).walkable)
+		return a_walkable;
+	if(a.getContent() != b.getContent())
+		return a.getContent() > b.getContent();
+	if(a.param2 != b.param2)
+		return a.param2 > b.param2;
+	return a.param1 > b.param1;
+}
+
+bool same_node_ignoring_light(MapNode a, MapNode b)
+{
+	if(a.param0 != b.param0 || a.param2 != b.param2)
+		return false;
+	if(content_features(a).param_type == CPT_LIGHT)
+		return true;
+	return a.param1 == b.param1;
+}
+
+const char *block_make_stage_names[BMS_COUNT] =
+{
+	"terrain",
+	"dungeons",
+	"trees",
+	"lighting",
+};
+
+/*
+	Adds the time from stage_start to now to a stage and starts the
+	next one
+*/
+static void end_stage(BlockMakeData *data, BlockMakeStage stage,
+		u32 &stage_start)
+{
+	u32 time = porting::getTimeUs();
+	data->stage_time_us[stage] += time - stage_start;
+	stage_start = time;
+}
+
+/*
+	Lights the generated area from the sunlight coming in at the top
+	of it and from the light sources in it. Sunlight comes in if the
+	top is not under the water level and the blocks above it are not
+	underground by the heuristics, as in MapBlock::propagateSunlight()
+	when the block above is missing.
+*/
+static void make_light(BlockMakeData *data)
+{
+	ManualMapVoxelManipulator &vmanip = *(data->vmanip);
+	VoxelArea &area = vmanip.m_area;
+	v3s16 em = area.getExtent();
+
+	LightQueue light_sources;
+
+	for(s16 z=area.MinEdge.Z; z<=area.MaxEdge.Z; z++)
+	for(s16 x=area.MinEdge.X; x<=area.MaxEdge.X; x++)
+	{
+		v3s16 blockpos_above = getNodeBlockPos(
+				v3s16(x, area.MaxEdge.Y+1, z));
+		v3s16 d = blockpos_above - data->blockpos;
+		const SectorGroundLevels &levels =
+				data->ground_levels[(d.Z+1)*3 + (d.X+1)];
+
+		u8 light = 0;
+		if(area.MaxEdge.Y >= WATER_LEVEL
+				&& block_is_underground(levels, blockpos_above) == false)
+			light = LIGHT_SUN;
+
+		u32 i = area.index(x, area.MaxEdge.Y, z);
+		for(s16 y=area.MaxEdge.Y; y>=area.MinEdge.Y; y--)
+		{
+			MapNode &n = vmanip.m_data[i];
+
+			if(light == 0)
+			{
+				// Do nothing
+			}
+			else if(light == LIGHT_SUN && n.sunlight_propagates())
+			{
+				// Do nothing: Sunlight is continued
+			}
+			else if(n.light_propagates() == false)
+			{
+				// A solid object is on the way.
+				light = 0;
+			}
+			else
+			{
+				// Diminish light
+				light = diminish_light(light);
+			}
+
+			n.setLight(LIGHTBANK_DAY, light);
+
+			u8 banks = 0;
+			if(diminish_light(light) != 0)
+				banks |= LIGHTBANKS_DAY;
+			if(n.light_source() != 0)
+				banks |= LIGHTBANKS_BOTH;
+			if(banks != 0)
+			{
+				vmanip.m_flags[i] |= banks << VOXELFLAG_LIGHT_QUEUED_SHIFT;
+				light_sources.push_back(LightQueueNode(v3s16(x,y,z), banks));
+			}
+
+			area.add_y(em, i, -1);
+		}
+	}
+
+	vmanip.spreadLight(light_sources);
+}
+
+void make_block(BlockMakeData *data)
+{
+	if(data->no_op)
+	{
+		//dstream<<"makeBlock: no-op"<<std::endl;
+		return;
+	}
+
+	u32 stage_start = porting::getTimeUs();
+
+	v3s16 blockpos = data->blockpos;
+	
+	/*dstream<<"makeBlock(): ("<<blockpos.X<<","<<blockpos.Y<<","
+			<<blockpos.Z<<")"<<std::endl;*/
+
+	ManualMapVoxelManipulator &vmanip = *(data->vmanip);
+	// Area of center block
+	v3s16 node_min = blockpos*MAP_BLOCKSIZE;
+	v3s16 node_max = (blockpos+v3s16(1,1,1))*MAP_BLOCKSIZE-v3s16(1,1,1);
+	// Full area of the block and its neighbors
+	v3s16 full_node_min = (blockpos-1)*MAP_BLOCKSIZE;
+	v3s16 full_node_max = (blockpos+2)*MAP_BLOCKSIZE-v3s16(1,1,1);
+	// Area of a block
+	double block_area_nodes = MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+
+	v2s16 p2d_center(node_min.X+MAP_BLOCKSIZE/2, node_min.Z+MAP_BLOCKSIZE/2);
+
+	/*
+		Get the 2D values of the columns of this block
+	*/
+
+	SectorColumns columns;
+	if(data->columns_cache)
+		data->columns_cache->get(data->seed,
+				v2s16(blockpos.X, blockpos.Z), columns);
+	else
+		get_sector_columns(data->seed, v2s16(blockpos.X, blockpos.Z), columns);
+
+	/*
+		Get average ground level from noise
+	*/
+	
+	const SectorGroundLevels &ground_levels = data->ground_levels[4];
+
+	s16 approx_groundlevel = ground_levels.average;
 	
-	//if(node_min.Y < approx_groundlevel)
-	//if(myrand() % 3 == 0)
-	//if(myrand() % 3 == 0 && node_min.Y < approx_groundlevel)
-	//if(myrand() % 100 == 0 && node_min.Y < approx_groundlevel)
+	// Minimum amount of ground above the top of the central block
+	s16 minimum_ground_depth = ground_levels.minimum - node_max.Y;
+
+	// Maximum amount of ground above the bottom of the central block
+	s16 maximum_ground_depth = ground_levels.maximum - node_min.Y;
+
+	/*
+		Create a block-specific seed
+	*/
+	u32 blockseed = get_blockseed(data->seed, blockpos);
+
+	/*
+		Random values that are not tied to a specific feature.
+		make_block() runs in several threads at once, so myrand()
+		must not be used here.
+	*/
+	PseudoRandom blockrandom(blockseed+4);
+
+	/*
+		Find out what is added on the terrain
+	*/
+
 	//float dungeon_rarity = g_settings.getFloat("dungeon_rarity");
 	float dungeon_rarity = 0.02;
-	if(((noise3d(blockpos.X,blockpos.Y,blockpos.Z,data->seed)+1.0)/2.0)
+	bool have_dungeon =
+			((noise3d(blockpos.X,blockpos.Y,blockpos.Z,data->seed)+1.0)/2.0)
 			< dungeon_rarity
-			&& node_min.Y < approx_groundlevel)
+			&& node_min.Y < approx_groundlevel;
+
+	PseudoRandom ncrandom(blockseed+9324342);
+	bool have_nc = (ncrandom.range(0, 1000) == 0 && blockpos.Y <= -3);
+
+	// Trees and such are added if close to ground level
+	bool near_ground = (minimum_ground_depth < 5 && maximum_ground_depth > -5);
+
+	// Sunlight gets in the block just under the water level from above
+	bool under_water_level = (node_max.Y < WATER_LEVEL
+			&& node_max.Y + MAP_BLOCKSIZE >= WATER_LEVEL);
+
+	/*
+		Get the terrain of the area. The neighbors are needed if
+		something is added over to them, and for the light.
+	*/
+
+	v3s16 area_blocks_min = blockpos;
+	v3s16 area_blocks_max = blockpos;
+	if(have_dungeon || have_nc || near_ground || under_water_level)
+	{
+		area_blocks_min -= v3s16(1,1,1);
+		area_blocks_max += v3s16(1,1,1);
+	}
+	vmanip.addArea(VoxelArea(area_blocks_min*MAP_BLOCKSIZE,
+			(area_blocks_max+v3s16(1,1,1))*MAP_BLOCKSIZE-v3s16(1,1,1)));
+
+	{
+		BlockTerrain terrain;
+		v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
+		VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
+		for(s16 x=area_blocks_min.X; x<=area_blocks_max.X; x++)
+		for(s16 z=area_blocks_min.Z; z<=area_blocks_max.Z; z++)
+		for(s16 y=area_blocks_min.Y; y<=area_blocks_max.Y; y++)
+		{
+			v3s16 p(x,y,z);
+			const SectorGroundLevels &levels = data->ground_levels[
+					(z-blockpos.Z+1)*3 + (x-blockpos.X+1)];
+			if(data->terrain_cache)
+				data->terrain_cache->get(data->seed, p, levels,
+						data->columns_cache, terrain);
+			else
+				make_block_terrain(data->seed, p, levels,
+						data->columns_cache, terrain);
+			vmanip.copyFrom(terrain.nodes, data_area, v3s16(0,0,0),
+					p*MAP_BLOCKSIZE, data_size);
+
+			if(p != blockpos)
+				continue;
+			for(core::list<v3s16>::Iterator i = terrain.lava.begin();
+					i != terrain.lava.end(); i++)
+			{
+				for(s16 x1=-1; x1<=1; x1++)
+				for(s16 y1=-1; y1<=1; y1++)
+				for(s16 z1=-1; z1<=1; z1++)
+					data->transforming_liquid.push_back(
+							*i + v3s16(x1,y1,z1));
+			}
+		}
+	}
+
+	// Kept for finding out what is written on it
+	u32 volume = vmanip.m_area.getVolume();
+	data->terrain = new MapNode[volume];
+	for(u32 i=0; i<volume; i++)
+		data->terrain[i] = vmanip.m_data[i];
+
+	end_stage(data, BMS_TERRAIN, stage_start);
+
+	/*
+		Add dungeons
+	*/
+	
+	if(have_dungeon)
 	{
 		// Dungeon generator doesn't modify places which have this set
 		data->vmanip->clearFlag(VMANIP_FLAG_DUNGEON_INSIDE
@@ -1925,16 +2489,14 @@ void make_block(BlockMakeData *data)
 		}
 	}
 
+
+	end_stage(data, BMS_DUNGEONS, stage_start);
+
 	/*
 		Add NC
 	*/
-	{
-		PseudoRandom ncrandom(blockseed+9324342);
-		if(ncrandom.range(0, 1000) == 0 && blockpos.Y <= -3)
-		{
-			make_nc(vmanip, ncrandom);
-		}
-	}
+	if(have_nc)
+		make_nc(vmanip, ncrandom);
 	
 	/*
 		Add top and bottom side of water to transforming_liquid queue
@@ -1983,102 +2545,16 @@ void make_block(BlockMakeData *data)
 		If close to ground level
 	*/
 
-	//if(abs(approx_ground_depth) < 30)
-	if(minimum_ground_depth < 5 && maximum_ground_depth > -5)
+	if(near_ground)
 	{
-		/*
-			Add grass and mud
-		*/
-
-		for(s16 x=node_min.X; x<=node_max.X; x++)
-		for(s16 z=node_min.Z; z<=node_max.Z; z++)
-		{
-			// Node position
-			v2s16 p2d(x,z);
-			{
-				bool possibly_have_sand = get_have_sand(data->seed, p2d);
-				bool have_sand = false;
-				u32 current_depth = 0;
-				bool air_detected = false;
-				bool water_detected = false;
-				bool have_clay = false;
-
-				// Use fast index incrementing
-				s16 start_y = node_max.Y+2;
-				v3s16 em = vmanip.m_area.getExtent();
-				u32 i = vmanip.m_area.index(v3s16(p2d.X, start_y, p2d.Y));
-				for(s16 y=start_y; y>=node_min.Y-3; y--)
-				{
-					if(vmanip.m_data[i].getContent() == CONTENT_WATERSOURCE)
-						water_detected = true;
-					if(vmanip.m_data[i].getContent() == CONTENT_AIR)
-						air_detected = true;
-
-					if((vmanip.m_data[i].getContent() == CONTENT_STONE
-							|| vmanip.m_data[i].getContent() == CONTENT_GRASS
-							|| vmanip.m_data[i].getContent() == CONTENT_MUD
-							|| vmanip.m_data[i].getContent() == CONTENT_SAND
-							|| vmanip.m_data[i].getContent() == CONTENT_GRAVEL
-							) && (air_detected || water_detected))
-					{
-						if(current_depth == 0 && y <= WATER_LEVEL+2
-								&& possibly_have_sand)
-							have_sand = true;
-						
-						if(current_depth < 4)
-						{
-							if(have_sand)
-							{
-								// Determine whether to have clay in the sand here
-								double claynoise = noise2d_perlin(
-										0.5+(float)p2d.X/500, 0.5+(float)p2d.Y/500,
-										data->seed+4321, 6, 0.95) + 0.5;
-				
-								have_clay = (y <= WATER_LEVEL) && (y >= WATER_LEVEL-2) && (
-									((claynoise > 0) && (claynoise < 0.04) && (current_depth == 0)) ||
-									((claynoise > 0) && (claynoise < 0.12) && (current_depth == 1))
-									);
-								if (have_clay)
-									vmanip.m_data[i] = MapNode(CONTENT_CLAY);
-								else
-									vmanip.m_data[i] = MapNode(CONTENT_SAND);
-							}
-							#if 1
-							else if(current_depth==0 && !water_detected
-									&& y >= WATER_LEVEL && air_detected)
-								vmanip.m_data[i] = MapNode(CONTENT_GRASS);
-							#endif
-							else
-								vmanip.m_data[i] = MapNode(CONTENT_MUD);
-						}
-						else
-						{
-							if(vmanip.m_data[i].getContent() == CONTENT_MUD
-								|| vmanip.m_data[i].getContent() == CONTENT_GRASS)
-								vmanip.m_data[i] = MapNode(CONTENT_STONE);
-						}
-
-						current_depth++;
-
-						if(current_depth >= 8)
-							break;
-					}
-					else if(current_depth != 0)
-						break;
-
-					data->vmanip->m_area.add_y(em, i, -1);
-				}
-			}
-		}
-
 		/*
 			Calculate some stuff
 		*/
 		
-		float surface_humidity = surface_humidity_2d(data->seed, p2d_center);
+		float surface_humidity = columns.surface_humidity;
 		bool is_jungle = surface_humidity > 0.75;
 		// Amount of trees
-		u32 tree_count = block_area_nodes * tree_amount_2d(data->seed, p2d_center);
+		u32 tree_count = block_area_nodes * columns.tree_amount;
 		if(is_jungle)
 			tree_count *= 5;
 
@@ -2092,7 +2568,9 @@ void make_block(BlockMakeData *data)
 			s16 x = treerandom.range(node_min.X, node_max.X);
 			s16 z = treerandom.range(node_min.Z, node_max.Z);
 			//s16 y = find_ground_level(data->vmanip, v2s16(x,z));
-			s16 y = find_ground_level_from_noise(data->seed, v2s16(x,z), 4);
+			u32 ci = columns.index(node_min, v2s16(x,z));
+			s16 y = find_ground_level_from_noise(data->seed, v2s16(x,z), 4,
+					columns.ground_f[ci], columns.ground_h[ci], blockrandom);
 			// Don't make a tree under water level
 			if(y < WATER_LEVEL)
 				continue;
@@ -2130,7 +2608,7 @@ void make_block(BlockMakeData *data)
 				if(n->getContent() == CONTENT_MUD && y <= WATER_LEVEL)
 				{
 					p.Y++;
-					make_papyrus(vmanip, p);
+					make_papyrus(vmanip, p, blockrandom);
 				}
 				// Trees grow only on mud and grass, on land
 				else if((n->getContent() == CONTENT_MUD || n->getContent() == CONTENT_GRASS) && y > WATER_LEVEL + 2)
@@ -2140,16 +2618,16 @@ void make_block(BlockMakeData *data)
 					if(is_jungle == false)
 					{
 						bool is_apple_tree;
-						if(myrand_range(0,4) != 0)
+						if(blockrandom.range(0,4) != 0)
 							is_apple_tree = false;
 						else
 							is_apple_tree = noise2d_perlin(
 									0.5+(float)p.X/100, 0.5+(float)p.Z/100,
 									data->seed+342902, 3, 0.45) > 0.2;
-						make_tree(vmanip, p, is_apple_tree);
+						make_tree(vmanip, p, is_apple_tree, blockrandom);
 					}
 					else
-						make_jungletree(vmanip, p);
+						make_jungletree(vmanip, p, blockrandom);
 				}
 				// Cactii grow only on sand, on land
 				else if(n->getContent() == CONTENT_SAND && y > WATER_LEVEL + 2)
@@ -2170,7 +2648,9 @@ void make_block(BlockMakeData *data)
 			{
 				s16 x = grassrandom.range(node_min.X, node_max.X);
 				s16 z = grassrandom.range(node_min.Z, node_max.Z);
-				s16 y = find_ground_level_from_noise(data->seed, v2s16(x,z), 4);
+				u32 ci = columns.index(node_min, v2s16(x,z));
+				s16 y = find_ground_level_from_noise(data->seed, v2s16(x,z), 4,
+						columns.ground_f[ci], columns.ground_h[ci], blockrandom);
 				if(y < WATER_LEVEL)
 					continue;
 				if(y < node_min.Y || y > node_max.Y)
@@ -2218,8 +2698,8 @@ void make_block(BlockMakeData *data)
 		// Put in random places on part of division
 		for(u32 i=0; i<random_stone_count; i++)
 		{
-			s16 x = myrand_range(node_min.X, node_max.X);
-			s16 z = myrand_range(node_min.Z, node_max.Z);
+			s16 x = blockrandom.range(node_min.X, node_max.X);
+			s16 z = blockrandom.range(node_min.Z, node_max.Z);
 			s16 y = find_ground_level_from_noise(data->seed, v2s16(x,z), 1);
 			// Don't add under water level
 			/*if(y < WATER_LEVEL)
@@ -2238,7 +2718,7 @@ void make_block(BlockMakeData *data)
 			// Will be placed one higher
 			p.Y++;
 			// Add it
-			make_randomstone(data->vmanip, p);
+			make_randomstone(data->vmanip, p, blockrandom);
 		}
 #endif
 
@@ -2253,8 +2733,8 @@ void make_block(BlockMakeData *data)
 		// Put in random places on part of division
 		for(u32 i=0; i<large_stone_count; i++)
 		{
-			s16 x = myrand_range(node_min.X, node_max.X);
-			s16 z = myrand_range(node_min.Z, node_max.Z);
+			s16 x = blockrandom.range(node_min.X, node_max.X);
+			s16 z = blockrandom.range(node_min.Z, node_max.Z);
 			s16 y = find_ground_level_from_noise(data->seed, v2s16(x,z), 1);
 			// Don't add under water level
 			/*if(y < WATER_LEVEL)
@@ -2273,22 +2753,43 @@ void make_block(BlockMakeData *data)
 			// Will be placed one lower
 			p.Y--;
 			// Add it
-			make_largestone(data->vmanip, p);
+			make_largestone(data->vmanip, p, blockrandom);
 		}
 #endif
 	}
 
+	end_stage(data, BMS_TREES, stage_start);
+
+	/*
+		Mark the nodes that have been written on the terrain
+	*/
+	for(u32 i=0; i<volume; i++)
+	{
+		if(!(vmanip.m_data[i] == data->terrain[i]))
+			vmanip.m_flags[i] |= VMANIP_FLAG_MAPGEN_WRITTEN;
+	}
+
+	make_light(data);
+
+	end_stage(data, BMS_LIGHTING, stage_start);
 }
 
 BlockMakeData::BlockMakeData():
 	no_op(false),
 	vmanip(NULL),
-	seed(0)
-{}
+	terrain(NULL),
+	seed(0),
+	columns_cache(NULL),
+	terrain_cache(NULL)
+{
+	for(u32 i=0; i<BMS_COUNT; i++)
+		stage_time_us[i] = 0;
+}
 
 BlockMakeData::~BlockMakeData()
 {
 	delete vmanip;
+	delete[] terrain;
 }
 
 }; // namespace mapgen
@@ -22,19 +22,52 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "common_irrlicht.h"
 #include "utility.h" // UniqueQueue
+#include "constants.h" // MAP_BLOCKSIZE
+#include "mapnode.h"
+#include <jmutex.h>
 
-struct BlockMakeData;
 class MapBlock;
 class ManualMapVoxelManipulator;
+class PseudoRandom;
+
+// Number of node columns in a sector
+#define SECTOR_COLUMNS (MAP_BLOCKSIZE*MAP_BLOCKSIZE)
+
+/*
+	make_block() sets this voxel flag (see voxel.h) on the nodes of
+	BlockMakeData::vmanip that differ from the terrain, ie. the ones
+	it has written.
+*/
+#define VMANIP_FLAG_MAPGEN_WRITTEN VOXELFLAG_CHECKED3
 
 namespace mapgen
 {
+	struct BlockMakeData;
+
 	// Finds precise ground level at any position
 	s16 find_ground_level_from_noise(u64 seed, v2s16 p2d, s16 precision);
 
 	// Find out if block is completely underground
 	bool block_is_underground(u64 seed, v3s16 blockpos);
 
+	/*
+		Ground level statistics of a sector, sampled from noise.
+		These decide what is generated in the blocks of the sector.
+	*/
+	struct SectorGroundLevels
+	{
+		s16 average;
+		s16 minimum;
+		s16 maximum;
+	};
+
+	void get_sector_ground_levels(u64 seed, v2s16 sectorpos,
+			SectorGroundLevels &dst);
+
+	// Same as above, for a sector whose levels are known
+	bool block_is_underground(const SectorGroundLevels &levels,
+			v3s16 blockpos);
+
 	// Main map generation routine
 	void make_block(BlockMakeData *data);
 	
@@ -42,7 +75,8 @@ namespace mapgen
 	void add_random_objects(MapBlock *block);
 
 	// Add a tree
-	void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0, bool is_apple_tree);
+	void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0, bool is_apple_tree,
+			PseudoRandom &random);
 	
 	/*
 		These are used by FarMesh
@@ -50,14 +84,163 @@ namespace mapgen
 	bool get_have_sand(u64 seed, v2s16 p2d);
 	double tree_amount_2d(u64 seed, v2s16 p);
 	
+	/*
+		2D terrain values of all the node columns of a sector.
+		These are the same for all the blocks of a sector, so they are
+		calculated once for a sector and shared between the blocks.
+	*/
+	struct SectorColumns
+	{
+		// Ground density factor and base height used by val_is_ground()
+		double ground_f[SECTOR_COLUMNS];
+		double ground_h[SECTOR_COLUMNS];
+		// get_have_sand()
+		bool have_sand[SECTOR_COLUMNS];
+		// Noise that decides clay in sand
+		double claynoise[SECTOR_COLUMNS];
+		// At the center of the sector
+		double surface_humidity;
+		double tree_amount;
+
+		// Index of a column; node_min is the first node of the sector
+		static u32 index(v3s16 node_min, v2s16 p2d)
+		{
+			return (p2d.Y - node_min.Z) * MAP_BLOCKSIZE
+					+ (p2d.X - node_min.X);
+		}
+	};
+
+	void get_sector_columns(u64 seed, v2s16 sectorpos, SectorColumns &dst);
+
+	/*
+		Keeps the SectorColumns of the most recently generated sectors.
+		Shared by all the threads that generate blocks of a map.
+	*/
+	class SectorColumnsCache
+	{
+	public:
+		SectorColumnsCache(u32 max_size);
+		~SectorColumnsCache();
+
+		// Gets the columns of a sector, calculating them if not cached
+		void get(u64 seed, v2s16 sectorpos, SectorColumns &dst);
+
+	private:
+		struct Entry
+		{
+			SectorColumns columns;
+			u64 seed;
+			u32 last_used;
+		};
+		core::map<v2s16, Entry*> m_entries;
+		u32 m_max_size;
+		u32 m_use_counter;
+		JMutex m_mutex;
+	};
+
+
+	/*
+		The nodes of a block that depend only on the seed and the
+		position of the block: ground, caves, minerals and the surface.
+		make_block() adds the things that reach over to the neighboring
+		blocks (dungeons, trees...) on top of the terrain of the block
+		and its neighbors.
+	*/
+	struct BlockTerrain
+	{
+		// In the order of MapBlock::data
+		MapNode nodes[MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+		// Lava sources of the block, for the transforming liquid queue
+		core::list<v3s16> lava;
+	};
+
+	// columns_cache can be NULL
+	void make_block_terrain(u64 seed, v3s16 blockpos,
+			const SectorGroundLevels &ground_levels,
+			SectorColumnsCache *columns_cache, BlockTerrain &dst);
+
+	/*
+		Keeps the BlockTerrain of the most recently generated blocks,
+		as the terrain of a block is needed for generating each of its
+		neighbors. Shared by all the threads that generate blocks of a
+		map.
+	*/
+	class BlockTerrainCache
+	{
+	public:
+		BlockTerrainCache(u32 max_size);
+		~BlockTerrainCache();
+
+		// Gets the terrain of a block, making it if not cached
+		void get(u64 seed, v3s16 blockpos,
+				const SectorGroundLevels &ground_levels,
+				SectorColumnsCache *columns_cache, BlockTerrain &dst);
+
+	private:
+		struct Entry
+		{
+			BlockTerrain terrain;
+			u64 seed;
+			u32 last_used;
+		};
+		core::map<v3s16, Entry*> m_entries;
+		u32 m_max_size;
+		u32 m_use_counter;
+		JMutex m_mutex;
+	};
+
+	/*
+		Where the written nodes of several blocks overlap, the map gets
+		the one for which this returns true against all the others. As
+		this doesn't depend on which is written first, the map is the
+		same in whatever order the blocks are generated in.
+	*/
+	bool written_node_wins(MapNode a, MapNode b);
+
+	// Whether a and b are the same, not counting light
+	bool same_node_ignoring_light(MapNode a, MapNode b);
+
+	/*
+		Stages of generating a block whose time is measured
+	*/
+	enum BlockMakeStage
+	{
+		BMS_TERRAIN, // Terrain of the block and its neighbors
+		BMS_DUNGEONS,
+		BMS_TREES, // Liquids and trees
+		BMS_LIGHTING,
+		BMS_COUNT
+	};
+	extern const char *block_make_stage_names[BMS_COUNT];
 
 	struct BlockMakeData
 	{
 		bool no_op;
+		/*
+			The generated area: the block, or the block and its
+			neighbors if something has to be added over to them.
+			Not connected to the map.
+		*/
 		ManualMapVoxelManipulator *vmanip;
+		// The terrain in vmanip before anything was added on it
+		MapNode *terrain;
 		u64 seed;
 		v3s16 blockpos;
 		UniqueQueue<v3s16> transforming_liquid;
+		// If not NULL, sector columns are taken from here
+		SectorColumnsCache *columns_cache;
+		// If not NULL, block terrains are taken from here
+		BlockTerrainCache *terrain_cache;
+		// Of the 3x3 sectors around blockpos, at (z+1)*3+(x+1)
+		SectorGroundLevels ground_levels[9];
+		/*
+			MapBlock::getChangeStamp() of each block of the area after
+			initBlockMake(). Blocks changed after that are not
+			written by finishBlockMake().
+		*/
+		core::map<v3s16, u32> change_stamps;
+		// Time spent in each stage in microseconds
+		u32 stage_time_us[BMS_COUNT];
 
 		BlockMakeData();
 		~BlockMakeData();
@@ -22,6 +22,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <iostream>
 #include "debug.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define NOISE_USE_SSE2
+#endif
+
 #define NOISE_MAGIC_X 1619
 #define NOISE_MAGIC_Y 31337
 #define NOISE_MAGIC_Z 52591
@@ -222,6 +227,237 @@ double noise3d_perlin_abs(double x, double y, double z, int seed,
 	return a;
 }
 
+/*
+	Bulk evaluation of noise along a row of points.
+
+	All points of a row share y and z, so per octave the y/z part of the
+	lattice cell is computed once and the corner values of a cell are
+	reused for as long as the row stays inside it. The interpolation is
+	then done for the whole row at once.
+
+	The arithmetic is done in the same order as in the scalar functions,
+	so the results are bit-identical to them whenever the scalar code is
+	compiled with the same floating point unit (which is always the case
+	on SSE2 targets). Builds using x87 math for the scalar code may
+	differ by rounding of the last bits (< 1e-12).
+*/
+
+// Points are processed in chunks of this many to keep buffers on stack
+#define NOISE_ROW_CHUNK 64
+
+/*
+	Same as triLinearInterpolation() for each point of a row.
+	v contains the corner values in the order used by
+	triLinearInterpolation(), x the per-point coordinates within the cell.
+*/
+static void triLinearInterpolation_row(double *result,
+		double v[8][NOISE_ROW_CHUNK], const double *x, int count,
+		double y, double z)
+{
+	int i = 0;
+#ifdef NOISE_USE_SSE2
+	__m128d one = _mm_set1_pd(1.0);
+	__m128d ty = _mm_set1_pd(y);
+	__m128d tz = _mm_set1_pd(z);
+	__m128d ty1 = _mm_set1_pd(1-y);
+	__m128d tz1 = _mm_set1_pd(1-z);
+	for(; i+2<=count; i+=2)
+	{
+		__m128d tx = _mm_loadu_pd(&x[i]);
+		__m128d tx1 = _mm_sub_pd(one, tx);
+		__m128d r;
+		r = _mm_mul_pd(_mm_mul_pd(_mm_mul_pd(
+				_mm_loadu_pd(&v[0][i]), tx1), ty1), tz1);
+		r = _mm_add_pd(r, _mm_mul_pd(_mm_mul_pd(_mm_mul_pd(
+				_mm_loadu_pd(&v[1][i]), tx), ty1), tz1));
+		r = _mm_add_pd(r, _mm_mul_pd(_mm_mul_pd(_mm_mul_pd(
+				_mm_loadu_pd(&v[2][i]), tx1), ty), tz1));
+		r = _mm_add_pd(r, _mm_mul_pd(_mm_mul_pd(_mm_mul_pd(
+				_mm_loadu_pd(&v[3][i]), tx), ty), tz1));
+		r = _mm_add_pd(r, _mm_mul_pd(_mm_mul_pd(_mm_mul_pd(
+				_mm_loadu_pd(&v[4][i]), tx1), ty1), tz));
+		r = _mm_add_pd(r, _mm_mul_pd(_mm_mul_pd(_mm_mul_pd(
+				_mm_loadu_pd(&v[5][i]), tx), ty1), tz));
+		r = _mm_add_pd(r, _mm_mul_pd(_mm_mul_pd(_mm_mul_pd(
+				_mm_loadu_pd(&v[6][i]), tx1), ty), tz));
+		r = _mm_add_pd(r, _mm_mul_pd(_mm_mul_pd(_mm_mul_pd(
+				_mm_loadu_pd(&v[7][i]), tx), ty), tz));
+		_mm_storeu_pd(&result[i], r);
+	}
+#endif
+	for(; i<count; i++)
+	{
+		result[i] = triLinearInterpolation(
+				v[0][i], v[1][i], v[2][i], v[3][i],
+				v[4][i], v[5][i], v[6][i], v[7][i],
+				x[i], y, z);
+	}
+}
+
+/*
+	Adds g * noise3d_gradient(x[i], y, z, seed) to result[i].
+	count must be at most NOISE_ROW_CHUNK.
+*/
+static void noise3d_gradient_row_add(double *result, const double *x,
+		int count, double y, double z, int seed, double g, bool abs)
+{
+	int y0 = (y > 0.0 ? (int)y : (int)y - 1);
+	int z0 = (z > 0.0 ? (int)z : (int)z - 1);
+	double yl = y - (double)y0;
+	double zl = z - (double)z0;
+
+	double v[8][NOISE_ROW_CHUNK];
+	double xl[NOISE_ROW_CHUNK];
+	double d[NOISE_ROW_CHUNK];
+
+	// Corner values of the current cell
+	double c[8];
+	int cell_x0 = 0;
+	bool cell_valid = false;
+
+	for(int i=0; i<count; i++)
+	{
+		int x0 = (x[i] > 0.0 ? (int)x[i] : (int)x[i] - 1);
+		if(cell_valid && x0 == cell_x0 + 1)
+		{
+			// Moved to the next cell; the old +X side is the new -X side
+			c[0] = c[1];
+			c[2] = c[3];
+			c[4] = c[5];
+			c[6] = c[7];
+			c[1] = noise3d(x0+1, y0, z0, seed);
+			c[3] = noise3d(x0+1, y0+1, z0, seed);
+			c[5] = noise3d(x0+1, y0, z0+1, seed);
+			c[7] = noise3d(x0+1, y0+1, z0+1, seed);
+		}
+		else if(cell_valid == false || x0 != cell_x0)
+		{
+			c[0] = noise3d(x0, y0, z0, seed);
+			c[1] = noise3d(x0+1, y0, z0, seed);
+			c[2] = noise3d(x0, y0+1, z0, seed);
+			c[3] = noise3d(x0+1, y0+1, z0, seed);
+			c[4] = noise3d(x0, y0, z0+1, seed);
+			c[5] = noise3d(x0+1, y0, z0+1, seed);
+			c[6] = noise3d(x0, y0+1, z0+1, seed);
+			c[7] = noise3d(x0+1, y0+1, z0+1, seed);
+		}
+		cell_x0 = x0;
+		cell_valid = true;
+
+		xl[i] = x[i] - (double)x0;
+		for(int k=0; k<8; k++)
+			v[k][i] = c[k];
+	}
+
+	triLinearInterpolation_row(d, v, xl, count, yl, zl);
+
+	if(abs)
+	{
+		for(int i=0; i<count; i++)
+			result[i] += g * fabs(d[i]);
+	}
+	else
+	{
+		for(int i=0; i<count; i++)
+			result[i] += g * d[i];
+	}
+}
+
+/*
+	Adds g * noise2d_gradient(x[i], y, seed) to result[i].
+*/
+static void noise2d_gradient_row_add(double *result, const double *x,
+		int count, double y, int seed, double g, bool abs)
+{
+	int y0 = (y > 0.0 ? (int)y : (int)y - 1);
+	double yl = y - (double)y0;
+
+	// Corner values of the current cell
+	double v00 = 0, v10 = 0, v01 = 0, v11 = 0;
+	int cell_x0 = 0;
+	bool cell_valid = false;
+
+	for(int i=0; i<count; i++)
+	{
+		int x0 = (x[i] > 0.0 ? (int)x[i] : (int)x[i] - 1);
+		if(cell_valid && x0 == cell_x0 + 1)
+		{
+			v00 = v10;
+			v01 = v11;
+			v10 = noise2d(x0+1, y0, seed);
+			v11 = noise2d(x0+1, y0+1, seed);
+		}
+		else if(cell_valid == false || x0 != cell_x0)
+		{
+			v00 = noise2d(x0, y0, seed);
+			v10 = noise2d(x0+1, y0, seed);
+			v01 = noise2d(x0, y0+1, seed);
+			v11 = noise2d(x0+1, y0+1, seed);
+		}
+		cell_x0 = x0;
+		cell_valid = true;
+
+		double xl = x[i] - (double)x0;
+		double d = biLinearInterpolation(v00,v10,v01,v11,xl,yl);
+		if(abs)
+			result[i] += g * fabs(d);
+		else
+			result[i] += g * d;
+	}
+}
+
+void noise3d_perlin_row(double *result, const double *x, int count,
+		double y, double z, int seed, int octaves, double persistence,
+		bool abs)
+{
+	double xf[NOISE_ROW_CHUNK];
+	for(int start=0; start<count; start+=NOISE_ROW_CHUNK)
+	{
+		int n = count - start;
+		if(n > NOISE_ROW_CHUNK)
+			n = NOISE_ROW_CHUNK;
+		double *r = &result[start];
+		for(int i=0; i<n; i++)
+			r[i] = 0;
+		double f = 1.0;
+		double g = 1.0;
+		for(int o=0; o<octaves; o++)
+		{
+			for(int i=0; i<n; i++)
+				xf[i] = x[start+i] * f;
+			noise3d_gradient_row_add(r, xf, n, y*f, z*f, seed+o, g, abs);
+			f *= 2.0;
+			g *= persistence;
+		}
+	}
+}
+
+void noise2d_perlin_row(double *result, const double *x, int count,
+		double y, int seed, int octaves, double persistence,
+		bool abs)
+{
+	double xf[NOISE_ROW_CHUNK];
+	for(int start=0; start<count; start+=NOISE_ROW_CHUNK)
+	{
+		int n = count - start;
+		if(n > NOISE_ROW_CHUNK)
+			n = NOISE_ROW_CHUNK;
+		double *r = &result[start];
+		for(int i=0; i<n; i++)
+			r[i] = 0;
+		double f = 1.0;
+		double g = 1.0;
+		for(int o=0; o<octaves; o++)
+		{
+			for(int i=0; i<n; i++)
+				xf[i] = x[start+i] * f;
+			noise2d_gradient_row_add(r, xf, n, y*f, seed+o, g, abs);
+			f *= 2.0;
+			g *= persistence;
+		}
+	}
+}
+
 // -1->0, 0->1, 1->0
 double contour(double v)
 {
@@ -269,6 +505,62 @@ double noise3d_param(const NoiseParams &param, double x, double y, double z)
 	else assert(0);
 }
 
+void noise3d_param_row(const NoiseParams &param, double *result, int count,
+		double x, double step_x, double y, double z)
+{
+	double s = param.pos_scale;
+	y /= s;
+	z /= s;
+
+	if(param.type == NOISE_CONSTANT_ONE)
+	{
+		for(int i=0; i<count; i++)
+			result[i] = 1.0;
+		return;
+	}
+
+	double xs[NOISE_ROW_CHUNK];
+	for(int start=0; start<count; start+=NOISE_ROW_CHUNK)
+	{
+		int n = count - start;
+		if(n > NOISE_ROW_CHUNK)
+			n = NOISE_ROW_CHUNK;
+		double *r = &result[start];
+		for(int i=0; i<n; i++)
+			xs[i] = (x + (double)(start+i)*step_x) / s;
+
+		if(param.type == NOISE_PERLIN)
+		{
+			noise3d_perlin_row(r, xs, n, y, z, param.seed,
+					param.octaves, param.persistence, false);
+			for(int i=0; i<n; i++)
+				r[i] = param.noise_scale * r[i];
+		}
+		else if(param.type == NOISE_PERLIN_ABS)
+		{
+			noise3d_perlin_row(r, xs, n, y, z, param.seed,
+					param.octaves, param.persistence, true);
+			for(int i=0; i<n; i++)
+				r[i] = param.noise_scale * r[i];
+		}
+		else if(param.type == NOISE_PERLIN_CONTOUR)
+		{
+			noise3d_perlin_row(r, xs, n, y, z, param.seed,
+					param.octaves, param.persistence, false);
+			for(int i=0; i<n; i++)
+				r[i] = contour(param.noise_scale * r[i]);
+		}
+		else if(param.type == NOISE_PERLIN_CONTOUR_FLIP_YZ)
+		{
+			noise3d_perlin_row(r, xs, n, z, y, param.seed,
+					param.octaves, param.persistence, false);
+			for(int i=0; i<n; i++)
+				r[i] = contour(param.noise_scale * r[i]);
+		}
+		else assert(0);
+	}
+}
+
 /*
 	NoiseBuffer
 */
@@ -313,15 +605,15 @@ void NoiseBuffer::create(const NoiseParams &param,
 
 	m_data = new double[m_size_x*m_size_y*m_size_z];
 
-	for(int x=0; x<m_size_x; x++)
-	for(int y=0; y<m_size_y; y++)
+	// Data is stored X-fastest; fill it one X row at a time
 	for(int z=0; z<m_size_z; z++)
+	for(int y=0; y<m_size_y; y++)
 	{
-		double xd = (m_start_x + (double)x*m_samplelength_x);
 		double yd = (m_start_y + (double)y*m_samplelength_y);
 		double zd = (m_start_z + (double)z*m_samplelength_z);
-		double a = noise3d_param(param, xd,yd,zd);
-		intSet(x,y,z, a);
+		double *row = &m_data[m_size_x*m_size_y*z + m_size_x*y];
+		noise3d_param_row(param, row, m_size_x,
+				m_start_x, m_samplelength_x, yd, zd);
 	}
 }
 
@@ -329,16 +621,19 @@ void NoiseBuffer::multiply(const NoiseParams &param)
 {
 	assert(m_data != NULL);
 
-	for(int x=0; x<m_size_x; x++)
-	for(int y=0; y<m_size_y; y++)
+	double *a = new double[m_size_x];
 	for(int z=0; z<m_size_z; z++)
+	for(int y=0; y<m_size_y; y++)
 	{
-		double xd = (m_start_x + (double)x*m_samplelength_x);
 		double yd = (m_start_y + (double)y*m_samplelength_y);
 		double zd = (m_start_z + (double)z*m_samplelength_z);
-		double a = noise3d_param(param, xd,yd,zd);
-		intMultiply(x,y,z, a);
+		double *row = &m_data[m_size_x*m_size_y*z + m_size_x*y];
+		noise3d_param_row(param, a, m_size_x,
+				m_start_x, m_samplelength_x, yd, zd);
+		for(int x=0; x<m_size_x; x++)
+			row[x] = row[x] * a[x];
 	}
+	delete[] a;
 }
 
 // Deprecated
@@ -80,6 +80,18 @@ double noise3d_perlin(double x, double y, double z, int seed,
 double noise3d_perlin_abs(double x, double y, double z, int seed,
 		int octaves, double persistence);
 
+/*
+	Row versions of the above: result[i] is the noise at (x[i], y[, z]).
+	The results are the same as from the single point functions.
+*/
+void noise2d_perlin_row(double *result, const double *x, int count,
+		double y, int seed, int octaves, double persistence,
+		bool abs=false);
+
+void noise3d_perlin_row(double *result, const double *x, int count,
+		double y, double z, int seed, int octaves, double persistence,
+		bool abs=false);
+
 enum NoiseType
 {
 	NOISE_CONSTANT_ONE,
@@ -113,6 +125,10 @@ struct NoiseParams
 
 double noise3d_param(const NoiseParams &param, double x, double y, double z);
 
+// Evaluates noise3d_param() at (x + i*step_x, y, z) for i = 0...count-1
+void noise3d_param_row(const NoiseParams &param, double *result, int count,
+		double x, double step_x, double y, double z);
+
 class NoiseBuffer
 {
 public:
@@ -118,6 +118,62 @@ void signal_handler_init(void)
 
 #endif
 
+/*
+	Processor count
+*/
+
+#if defined(_WIN32)
+
+u32 getNumberOfProcessors()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	if(info.dwNumberOfProcessors < 1)
+		return 1;
+	return info.dwNumberOfProcessors;
+}
+
+#else
+
+u32 getNumberOfProcessors()
+{
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	if(count < 1)
+		return 1;
+	return count;
+}
+
+#endif
+
+/*
+	Memory usage
+*/
+
+#if defined(_WIN32)
+
+u32 getPeakMemoryUsage()
+{
+	return 0;
+}
+
+#else
+	#include <sys/resource.h>
+
+u32 getPeakMemoryUsage()
+{
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#if defined(__APPLE__)
+	// In bytes
+	return usage.ru_maxrss / 1024;
+#else
+	return usage.ru_maxrss;
+#endif
+}
+
+#endif
+
 /*
 	Path mangler
 */
@@ -83,6 +83,17 @@ inline std::string getDataPath(const char *subpath)
 */
 void initializePaths();
 
+/*
+	Number of processors, 1 if it can't be found out.
+*/
+u32 getNumberOfProcessors();
+
+/*
+	Peak resident memory of the process in kilobytes, 0 if it can't be
+	found out.
+*/
+u32 getPeakMemoryUsage();
+
 /*
 	Resolution is 10-20ms.
 	Remember to check for overflows.
@@ -94,6 +105,15 @@ void initializePaths();
 	{
 		return GetTickCount();
 	}
+	// For measuring short intervals; wraps around every ~70 minutes
+	inline u32 getTimeUs()
+	{
+		LARGE_INTEGER freq, t;
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&t);
+		return (u32)(t.QuadPart / freq.QuadPart * 1000000
+				+ t.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+	}
 #else // Posix
 	#include <sys/time.h>
 	inline u32 getTimeMs()
@@ -102,6 +122,13 @@ void initializePaths();
 		gettimeofday(&tv, NULL);
 		return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 	}
+	// For measuring short intervals; wraps around every ~70 minutes
+	inline u32 getTimeUs()
+	{
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return tv.tv_sec * 1000000 + tv.tv_usec;
+	}
 	/*#include <sys/timeb.h>
 	inline u32 getTimeMs()
 	{
@@ -39,11 +39,36 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "settings.h"
 #include "profiler.h"
 #include "log.h"
+#include "mapsector.h"
+#include "mapgen.h"
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
 #define BLOCK_EMERGE_FLAG_FROMDISK (1<<0)
 
+// Block deltas up to this size are sent without comparing to the whole block
+#define BLOCK_DELTA_ALWAYS_SIZE 256
+
+/*
+	The block send window of a client is
+	goodput * (round trip time + EXTRA_TIME) * FACTOR
+	bytes. EXTRA_TIME covers the delay of the server steps in handling
+	GOTBLOCKS. The smallest seen round trip time is used so that
+	queueing on a slow link doesn't make the window grow.
+*/
+#define BLOCK_SEND_INITIAL_WINDOW 16384
+#define BLOCK_SEND_WINDOW_EXTRA_TIME 0.2
+#define BLOCK_SEND_WINDOW_FACTOR 2.0
+// Seconds of max_block_send_rate that can be sent at once after a pause
+#define BLOCK_SEND_RATE_BURST 0.5
+// Size estimate of a block packet before any have been sent
+#define BLOCK_SEND_INITIAL_SIZE_ESTIMATE 2048
+
+// Size of the areas of columns pregenerated at a time, in blocks
+#define PREGENERATE_WINDOW 12
+// Pregenerated blocks are unloaded after not being used for this long
+#define PREGENERATE_UNLOAD_TIMEOUT 10.0
+
 class MapEditEventIgnorer
 {
 public:
@@ -69,6 +94,304 @@ class MapEditEventIgnorer
 	bool *m_flag;
 };
 
+/*
+	BlockEmergeQueue
+*/
+
+bool BlockEmergeQueue::addBlock(u16 peer_id, v3s16 pos, u8 flags)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	JMutexAutoLock lock(m_mutex);
+
+	if(peer_id != 0)
+	{
+		bool full = false;
+		if(m_peer_limit != 0)
+		{
+			core::map<u16, u32>::Node *n = m_peer_counts.find(peer_id);
+			full = (n != NULL && n->getValue() >= m_peer_limit);
+		}
+
+		/*
+			Find if block is already in queue.
+			If it is, update the peer to it and quit.
+		*/
+		core::list<QueuedBlockEmerge*>::Iterator i;
+		for(i=m_queue.begin(); i!=m_queue.end(); i++)
+		{
+			QueuedBlockEmerge *q = *i;
+			if(q->pos == pos)
+			{
+				if(q->peer_ids.find(peer_id) == NULL)
+				{
+					if(full)
+						return false;
+					addPeerCount(peer_id);
+				}
+				q->peer_ids[peer_id] = flags;
+				q->priority = getPriority(q);
+				return true;
+			}
+		}
+
+		if(full)
+			return false;
+	}
+	
+	/*
+		Add the block
+	*/
+	QueuedBlockEmerge *q = new QueuedBlockEmerge;
+	q->pos = pos;
+	q->queued_time_ms = porting::getTimeMs();
+	q->wait_area = false;
+	if(peer_id != 0)
+	{
+		q->peer_ids[peer_id] = flags;
+		addPeerCount(peer_id);
+	}
+	q->priority = getPriority(q);
+	m_queue.push_back(q);
+	return true;
+}
+
+void BlockEmergeQueue::requeue(QueuedBlockEmerge &q0, bool wait_area)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	/*
+		Leave out the peers removed by removePeer() since the block
+		was popped, and the block itself if none of its peers is left
+	*/
+	core::map<u16, u8> peer_ids;
+	for(core::map<u16, u8>::Iterator
+			j = q0.peer_ids.getIterator();
+			j.atEnd() == false; j++)
+	{
+		u16 peer_id = j.getNode()->getKey();
+		if(m_peer_counts.find(peer_id) != NULL)
+			peer_ids.insert(peer_id, j.getNode()->getValue());
+	}
+	if(q0.peer_ids.size() != 0 && peer_ids.size() == 0)
+		return;
+
+	QueuedBlockEmerge *q = NULL;
+	core::list<QueuedBlockEmerge*>::Iterator i;
+	for(i=m_queue.begin(); i!=m_queue.end(); i++)
+	{
+		if((*i)->pos == q0.pos)
+		{
+			q = *i;
+			break;
+		}
+	}
+	if(q == NULL)
+	{
+		q = new QueuedBlockEmerge;
+		q->pos = q0.pos;
+		q->queued_time_ms = q0.queued_time_ms;
+		q->wait_area = false;
+		m_queue.push_back(q);
+	}
+	if(wait_area)
+		q->wait_area = true;
+
+	for(core::map<u16, u8>::Iterator
+			j = peer_ids.getIterator();
+			j.atEnd() == false; j++)
+	{
+		u16 peer_id = j.getNode()->getKey();
+		if(q->peer_ids.find(peer_id) == NULL)
+			addPeerCount(peer_id);
+		q->peer_ids[peer_id] = j.getNode()->getValue();
+	}
+	q->priority = getPriority(q);
+}
+
+QueuedBlockEmerge * BlockEmergeQueue::pop()
+{
+	JMutexAutoLock lock(m_mutex);
+
+	core::list<QueuedBlockEmerge*>::Iterator best = m_queue.end();
+	core::list<QueuedBlockEmerge*>::Iterator i;
+	for(i=m_queue.begin(); i!=m_queue.end(); i++)
+	{
+		if(best != m_queue.end() && (*i)->priority >= (*best)->priority)
+			continue;
+		if((*i)->wait_area)
+		{
+			if(areaInUse((*i)->pos))
+				continue;
+			(*i)->wait_area = false;
+		}
+		best = i;
+	}
+	if(best == m_queue.end())
+		return NULL;
+
+	QueuedBlockEmerge *q = *best;
+	m_queue.erase(best);
+
+	for(core::map<u16, u8>::Iterator
+			j = q->peer_ids.getIterator();
+			j.atEnd() == false; j++)
+	{
+		u16 peer_id = j.getNode()->getKey();
+		core::map<u16, u32>::Node *n = m_peer_counts.find(peer_id);
+		assert(n != NULL && n->getValue() > 0);
+		n->setValue(n->getValue() - 1);
+	}
+	return q;
+}
+
+bool BlockEmergeQueue::reserveArea(v3s16 p)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	if(areaInUse(p))
+		return false;
+	m_areas.insert(p, true);
+	return true;
+}
+
+void BlockEmergeQueue::releaseArea(v3s16 p)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	m_areas.remove(p);
+}
+
+u32 BlockEmergeQueue::setPeerView(u16 peer_id, v3s16 center, v3f dir,
+		s16 max_d)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	EmergePeerView view;
+	view.center = center;
+	view.dir = dir;
+	m_peer_views[peer_id] = view;
+
+	u32 dropped = 0;
+	core::list<QueuedBlockEmerge*>::Iterator i = m_queue.begin();
+	while(i != m_queue.end())
+	{
+		QueuedBlockEmerge *q = *i;
+		if(q->peer_ids.find(peer_id) != NULL)
+		{
+			v3s16 d = q->pos - center;
+			if(abs(d.X) > max_d || abs(d.Y) > max_d || abs(d.Z) > max_d)
+			{
+				removePeerFromBlock(q, peer_id);
+				if(q->peer_ids.size() == 0)
+				{
+					delete q;
+					i = m_queue.erase(i);
+					dropped++;
+					continue;
+				}
+			}
+			q->priority = getPriority(q);
+		}
+		i++;
+	}
+	return dropped;
+}
+
+u32 BlockEmergeQueue::removePeer(u16 peer_id)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	m_peer_views.remove(peer_id);
+
+	u32 dropped = 0;
+	core::list<QueuedBlockEmerge*>::Iterator i = m_queue.begin();
+	while(i != m_queue.end())
+	{
+		QueuedBlockEmerge *q = *i;
+		if(q->peer_ids.find(peer_id) != NULL)
+		{
+			removePeerFromBlock(q, peer_id);
+			if(q->peer_ids.size() == 0)
+			{
+				delete q;
+				i = m_queue.erase(i);
+				dropped++;
+				continue;
+			}
+			q->priority = getPriority(q);
+		}
+		i++;
+	}
+	m_peer_counts.remove(peer_id);
+	return dropped;
+}
+
+/*
+	Distance in blocks from the nearest peer wanting the block, up to
+	doubled for blocks behind the peer.
+	Blocks without a known viewer were wanted by the server itself and
+	are emerged first.
+*/
+float BlockEmergeQueue::getPriority(QueuedBlockEmerge *q)
+{
+	float priority = 0;
+	bool found = false;
+	for(core::map<u16, u8>::Iterator
+			i = q->peer_ids.getIterator();
+			i.atEnd() == false; i++)
+	{
+		core::map<u16, EmergePeerView>::Node *n =
+				m_peer_views.find(i.getNode()->getKey());
+		if(n == NULL)
+			continue;
+		EmergePeerView &view = n->getValue();
+		v3f d(q->pos.X - view.center.X,
+				q->pos.Y - view.center.Y,
+				q->pos.Z - view.center.Z);
+		float dist = d.getLength();
+		float p = 0;
+		if(dist > 0.001)
+			p = dist * (1.5 - 0.5 * d.dotProduct(view.dir) / dist);
+		if(found == false || p < priority)
+			priority = p;
+		found = true;
+	}
+	return priority;
+}
+
+bool BlockEmergeQueue::areaInUse(v3s16 p)
+{
+	for(core::map<v3s16, bool>::Iterator
+			i = m_areas.getIterator();
+			i.atEnd() == false; i++)
+	{
+		v3s16 d = i.getNode()->getKey() - p;
+		// The 3x3x3 areas overlap
+		if(abs(d.X) <= 2 && abs(d.Y) <= 2 && abs(d.Z) <= 2)
+			return true;
+	}
+	return false;
+}
+
+void BlockEmergeQueue::addPeerCount(u16 peer_id)
+{
+	core::map<u16, u32>::Node *n = m_peer_counts.find(peer_id);
+	if(n == NULL)
+		m_peer_counts.insert(peer_id, 1);
+	else
+		n->setValue(n->getValue() + 1);
+}
+
+void BlockEmergeQueue::removePeerFromBlock(QueuedBlockEmerge *q,
+		u16 peer_id)
+{
+	q->peer_ids.remove(peer_id);
+	core::map<u16, u32>::Node *n = m_peer_counts.find(peer_id);
+	if(n != NULL && n->getValue() > 0)
+		n->setValue(n->getValue() - 1);
+}
+
 void * ServerThread::Thread()
 {
 	ThreadStarted();
@@ -106,6 +429,39 @@ void * ServerThread::Thread()
 	return NULL;
 }
 
+/*
+	Called with the environment locked after a block has been loaded
+	or generated
+*/
+void EmergeThread::activateEmergedBlock(MapBlock *block,
+		bool enable_mapgen_debug_info)
+{
+	if(enable_mapgen_debug_info)
+		infostream<<"EmergeThread: ended up with: "
+				<<analyze_block(block)<<std::endl;
+
+	if(block == NULL)
+		return;
+
+	/*
+		Pregenerated blocks are activated when they are loaded for
+		playing. Activating them here would make the map depend on
+		the order the blocks are generated in.
+	*/
+	if(m_server->m_pregenerating)
+		return;
+
+	/*
+		Ignore map edit events, they will not need to be
+		sent to anybody because the block hasn't been sent
+		to anybody
+	*/
+	MapEditEventIgnorer ign(&m_server->m_ignore_map_edit_events);
+	
+	// Activate objects and stuff
+	m_server->m_env.activateBlock(block, 3600);
+}
+
 void * EmergeThread::Thread()
 {
 	ThreadStarted();
@@ -124,6 +480,7 @@ void * EmergeThread::Thread()
 
 		After queue is empty, exit.
 	*/
+
 	while(getRun())
 	{
 		QueuedBlockEmerge *qptr = m_server->m_emerge_queue.pop();
@@ -195,7 +552,23 @@ void * EmergeThread::Thread()
 		core::map<v3s16, MapBlock*> modified_blocks;
 		
 		/*
-			Fetch block from map or generate a single block
+			Read the block from disk before locking the environment.
+			If the map saves anything meanwhile, it is read again
+			below.
+		*/
+		std::string blockdata;
+		u32 save_count = map.getSaveCount();
+		bool blockdata_found = map.readBlock(p, blockdata);
+
+		/*
+			Set if the block has to be generated. The generation
+			itself is done without locking the environment.
+		*/
+		mapgen::BlockMakeData data;
+		bool generate = false;
+		
+		/*
+			Fetch block from map or start generating a single block
 		*/
 		{
 			JMutexAutoLock envlock(m_server->m_env_mutex);
@@ -211,47 +584,46 @@ void * EmergeThread::Thread()
 				if(enable_mapgen_debug_info)
 					infostream<<"EmergeThread: not in memory, loading"<<std::endl;
 
-				// Get, load or create sector
-				/*ServerMapSector *sector =
-						(ServerMapSector*)map.createSector(p2d);*/
-
-				// Load/generate block
-
-				/*block = map.emergeBlock(p, sector, changed_blocks,
-						lighting_invalidated_blocks);*/
-
-				block = map.loadBlock(p);
+				// Load block
+				if(blockdata_found && map.getSaveCount() == save_count)
+				{
+					MapSector *sector = map.createSector(p2d);
+					map.loadBlock(&blockdata, p, sector, false);
+					block = map.getBlockNoCreateNoEx(p);
+				}
+				else
+				{
+					block = map.loadBlock(p);
+				}
 				
 				if(only_from_disk == false)
 				{
 					if(block == NULL || block->isGenerated() == false)
 					{
+						/*
+							Generation modifies the 3x3x3 blocks around
+							the block. If another thread is generating
+							an overlapping area, the block waits in the
+							queue until it is done, and this thread goes
+							on with other blocks.
+						*/
+						if(m_server->m_emerge_queue.reserveArea(p) == false)
+						{
+							g_profiler->add("EmergeThread: deferred blocks", 1);
+							m_server->m_emerge_queue.requeue(*q, true);
+							continue;
+						}
+
 						if(enable_mapgen_debug_info)
 							infostream<<"EmergeThread: generating"<<std::endl;
-						block = map.generateBlock(p, modified_blocks);
+						
+						map.initBlockMake(&data, p);
+						generate = true;
 					}
 				}
 
-				if(enable_mapgen_debug_info)
-					infostream<<"EmergeThread: ended up with: "
-							<<analyze_block(block)<<std::endl;
-
-				if(block == NULL)
-				{
-					got_block = false;
-				}
-				else
-				{
-					/*
-						Ignore map edit events, they will not need to be
-						sent to anybody because the block hasn't been sent
-						to anybody
-					*/
-					MapEditEventIgnorer ign(&m_server->m_ignore_map_edit_events);
-					
-					// Activate objects and stuff
-					m_server->m_env.activateBlock(block, 3600);
-				}
+				if(generate == false)
+					activateEmergedBlock(block, enable_mapgen_debug_info);
 			}
 			else
 			{
@@ -259,11 +631,35 @@ void * EmergeThread::Thread()
 					lighting_invalidated_blocks[block->getPos()] = block;
 				}*/
 			}
+		}
+
+		if(generate)
+		{
+			/*
+				The block is made from the seed alone, so other
+				threads can use the environment meanwhile
+			*/
+			{
+				ScopeProfiler sp(g_profiler,
+						"EmergeThread: make_block avg", SPT_AVG);
+				mapgen::make_block(&data);
+			}
 
-			// TODO: Some additional checking and lighting updating,
-			//       see emergeBlock
+			JMutexAutoLock envlock(m_server->m_env_mutex);
+			
+			// Merge data to map, add mobs...
+			block = map.finishBlockMake(&data, modified_blocks);
+			
+			m_server->m_emerge_queue.releaseArea(p);
+			
+			g_profiler->add("EmergeThread: generated blocks", 1);
+
+			activateEmergedBlock(block, enable_mapgen_debug_info);
 		}
 
+		if(block == NULL)
+			got_block = false;
+
 		{//envlock
 		JMutexAutoLock envlock(m_server->m_env_mutex);
 		
@@ -305,6 +701,25 @@ void * EmergeThread::Thread()
 
 		}//envlock
 
+		/*
+			Histogram of the time blocks waited in the queue until
+			they were emerged
+		*/
+		{
+			u32 wait_ms = porting::getTimeMs() - q->queued_time_ms;
+			const char *bucket;
+			if(wait_ms < 10)
+				bucket = "EmergeQueue: waited 0-9ms";
+			else if(wait_ms < 100)
+				bucket = "EmergeQueue: waited 10-99ms";
+			else if(wait_ms < 1000)
+				bucket = "EmergeQueue: waited 100-999ms";
+			else
+				bucket = "EmergeQueue: waited 1000ms-";
+			g_profiler->add(bucket, 1);
+			g_profiler->avg("EmergeQueue: wait avg (ms)", wait_ms);
+		}
+
 		/*
 			Set sent status of modified blocks on clients
 		*/
@@ -344,6 +759,212 @@ void * EmergeThread::Thread()
 	return NULL;
 }
 
+void * BlockSendThread::Thread()
+{
+	ThreadStarted();
+
+	log_register_thread("BlockSendThread");
+
+	DSTACK(__FUNCTION_NAME);
+
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	/*
+		Serialize queued blocks. Exit after the queue has been empty
+		for a while.
+	*/
+	while(getRun())
+	{
+		BlockSendJob *job = NULL;
+		try{
+			job = m_server->m_block_send_queue.pop_front(100);
+		}
+		catch(ItemNotFoundException &e)
+		{
+			break;
+		}
+
+		std::ostringstream os(std::ios_base::binary);
+		{
+			ScopeProfiler sp(g_profiler, "BlockSendThread: serialize avg",
+					SPT_AVG);
+			job->snapshot.serialize(os);
+		}
+		
+		std::string s = os.str();
+		
+		/*
+			The buffer is made while locked, so that no reference to it
+			is left in this thread when the server takes it
+		*/
+		JMutexAutoLock lock(m_server->m_block_send_jobs_mutex);
+		job->data = SharedBuffer<u8>((u8*)s.c_str(), s.size());
+		job->done = true;
+	}
+	
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	return NULL;
+}
+
+/*
+	BlockSendFrontier
+*/
+
+BlockSendFrontier::BlockSendFrontier():
+	m_radius(0),
+	m_y_limit(0),
+	m_side(1),
+	m_center(0,0,0),
+	m_flags(NULL)
+{
+}
+
+BlockSendFrontier::~BlockSendFrontier()
+{
+	delete[] m_flags;
+}
+
+s16 BlockSendFrontier::update(s16 radius, s16 y_limit, v3s16 center,
+		core::map<v3s16, bool> &sent,
+		core::map<v3s16, BlockSending> &sending)
+{
+	v3s16 r(radius, radius, radius);
+
+	if(m_flags == NULL || radius != m_radius || y_limit != m_y_limit)
+	{
+		delete[] m_flags;
+		m_radius = radius;
+		m_y_limit = y_limit;
+		m_side = 2 * radius + 1;
+		m_center = center;
+		m_flags = new u8[m_side * m_side * m_side];
+		
+		m_shell_positions.clear();
+		m_shell_starts.clear();
+		for(s16 d = 0; d <= radius; d++)
+		{
+			m_shell_starts.push_back(m_shell_positions.size());
+			core::list<v3s16> list;
+			getFacePositions(list, d);
+			for(core::list<v3s16>::Iterator
+					i = list.begin(); i != list.end(); i++)
+			{
+				if(abs(i->Y) <= y_limit)
+					m_shell_positions.push_back(*i);
+			}
+		}
+		m_shell_starts.push_back(m_shell_positions.size());
+		
+		m_shell_done.set_used(radius + 1);
+		clearShellsDone();
+
+		fillArea(center - r, center + r, sent, sending);
+		return radius + 1;
+	}
+
+	v3s16 move = center - m_center;
+	s16 moved = MYMAX(abs(move.X), MYMAX(abs(move.Y), abs(move.Z)));
+	if(moved == 0)
+		return 0;
+
+	v3s16 old_min = m_center - r;
+	v3s16 old_max = m_center + r;
+	v3s16 new_min = center - r;
+	v3s16 new_max = center + r;
+	m_center = center;
+	clearShellsDone();
+
+	if(moved >= m_side)
+	{
+		fillArea(new_min, new_max, sent, sending);
+		return moved;
+	}
+
+	/*
+		Fill in the slabs that came into the cube. Corners where the
+		slabs overlap are filled more than once, which is harmless.
+	*/
+	if(move.X > 0)
+		fillArea(v3s16(old_max.X+1, new_min.Y, new_min.Z), new_max,
+				sent, sending);
+	else if(move.X < 0)
+		fillArea(new_min, v3s16(old_min.X-1, new_max.Y, new_max.Z),
+				sent, sending);
+	if(move.Y > 0)
+		fillArea(v3s16(new_min.X, old_max.Y+1, new_min.Z), new_max,
+				sent, sending);
+	else if(move.Y < 0)
+		fillArea(new_min, v3s16(new_max.X, old_min.Y-1, new_max.Z),
+				sent, sending);
+	if(move.Z > 0)
+		fillArea(v3s16(new_min.X, new_min.Y, old_max.Z+1), new_max,
+				sent, sending);
+	else if(move.Z < 0)
+		fillArea(new_min, v3s16(new_max.X, new_max.Y, old_min.Z-1),
+				sent, sending);
+	
+	return moved;
+}
+
+void BlockSendFrontier::setFlags(v3s16 p, u8 flags)
+{
+	if(m_flags == NULL || contains(p) == false)
+		return;
+	m_flags[index(p)] = flags;
+	if((flags & BLOCKSEND_FLAG_SENT) == 0)
+	{
+		v3s16 d = p - m_center;
+		m_shell_done[MYMAX(abs(d.X), MYMAX(abs(d.Y), abs(d.Z)))] = false;
+	}
+}
+
+u8 BlockSendFrontier::getFlags(v3s16 p)
+{
+	if(m_flags == NULL || contains(p) == false)
+		return 0;
+	return m_flags[index(p)];
+}
+
+const v3s16* BlockSendFrontier::getShell(s16 d, u32 &count)
+{
+	if(d < 0 || d > m_radius || m_flags == NULL)
+	{
+		count = 0;
+		return NULL;
+	}
+	count = m_shell_starts[d+1] - m_shell_starts[d];
+	return m_shell_positions.const_pointer() + m_shell_starts[d];
+}
+
+void BlockSendFrontier::fillArea(v3s16 p0, v3s16 p1,
+		core::map<v3s16, bool> &sent,
+		core::map<v3s16, BlockSending> &sending)
+{
+	for(s16 z=p0.Z; z<=p1.Z; z++)
+	for(s16 y=p0.Y; y<=p1.Y; y++)
+	for(s16 x=p0.X; x<=p1.X; x++)
+	{
+		v3s16 p(x,y,z);
+		u8 flags = 0;
+		if(sent.find(p) != NULL)
+			flags |= BLOCKSEND_FLAG_SENT;
+		if(sending.find(p) != NULL)
+			flags |= BLOCKSEND_FLAG_SENDING;
+		m_flags[index(p)] = flags;
+	}
+}
+
+void BlockSendFrontier::clearShellsDone()
+{
+	for(u32 i=0; i<m_shell_done.size(); i++)
+		m_shell_done[i] = false;
+}
+
+/*
+	RemoteClient
+*/
+
 void RemoteClient::GetNextBlocks(Server *server, float dtime,
 		core::array<PrioritySortedBlockTransfer> &dest)
 {
@@ -398,12 +1019,42 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 
 	/*
 		Get the starting value of the block finder radius.
+
+		When the center moves, the distance of any block changes by
+		at most the distance moved, so the blocks nearer than that
+		have been handled already.
 	*/
-		
-	if(m_last_center != center)
+	
 	{
+		s16 d_max_send = g_settings->getS16("max_block_send_distance");
+		s16 moved = m_frontier.update(d_max_send, d_max_send / 2, center,
+				m_blocks_sent, m_blocks_sending);
+		m_nearest_unsent_d = MYMAX(0, m_nearest_unsent_d - moved);
+	}
+
+	// Blocks that were out of sight have to be checked again after
+	// turning around
+	if(camera_dir.dotProduct(m_frontier_dir) < 0.9)
+	{
+		m_frontier_dir = camera_dir;
 		m_nearest_unsent_d = 0;
-		m_last_center = center;
+	}
+
+	/*
+		Re-prioritize the emerge queue when moving to a new block or
+		turning around, and forget blocks that went out of range
+	*/
+	if(center != m_emerge_view_center
+			|| camera_dir.dotProduct(m_emerge_view_dir) < 0.9)
+	{
+		m_emerge_view_center = center;
+		m_emerge_view_dir = camera_dir;
+		s16 d_max_gen = g_settings->getS16("max_block_generate_distance");
+		s16 d_max_send = g_settings->getS16("max_block_send_distance");
+		u32 dropped = server->m_emerge_queue.setPeerView(peer_id, center,
+				camera_dir, MYMAX(d_max_gen, d_max_send) + 1);
+		if(dropped != 0)
+			g_profiler->add("EmergeQueue: dropped out of range", dropped);
 	}
 
 	/*infostream<<"m_nearest_unsent_reset_timer="
@@ -421,6 +1072,11 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 	//s16 last_nearest_unsent_d = m_nearest_unsent_d;
 	s16 d_start = m_nearest_unsent_d;
 
+	// Skip the shells that have been sent completely
+	while(d_start <= g_settings->getS16("max_block_send_distance")
+			&& m_frontier.isShellDone(d_start))
+		d_start++;
+
 	//infostream<<"d_start="<<d_start<<std::endl;
 
 	u16 max_simul_sends_setting = g_settings->getU16
@@ -494,13 +1150,16 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 			Get the border/face dot coordinates of a "d-radiused"
 			box
 		*/
-		core::list<v3s16> list;
-		getFacePositions(list, d);
+		if(m_frontier.isShellDone(d))
+			continue;
+		u32 shell_count = 0;
+		const v3s16 *shell = m_frontier.getShell(d, shell_count);
+		bool shell_sent = true;
 		
-		core::list<v3s16>::Iterator li;
-		for(li=list.begin(); li!=list.end(); li++)
+		for(u32 si=0; si<shell_count; si++)
 		{
-			v3s16 p = *li + center;
+			v3s16 p = shell[si] + center;
+			u8 frontier_flags = m_frontier.getFlags(p);
 			
 			/*
 				Send throttling
@@ -525,8 +1184,19 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 			}
 			
 			// Don't send blocks that are currently being transferred
-			if(m_blocks_sending.find(p) != NULL)
+			if(frontier_flags & BLOCKSEND_FLAG_SENDING)
+			{
+				shell_sent = false;
+				continue;
+			}
+			
+			/*
+				Don't send already sent blocks
+			*/
+			if(frontier_flags & BLOCKSEND_FLAG_SENT)
 				continue;
+			
+			shell_sent = false;
 		
 			/*
 				Do not go over-limit
@@ -598,16 +1268,6 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 				continue;
 			}
 #endif
-			/*
-				Don't send already sent blocks
-			*/
-			{
-				if(m_blocks_sent.find(p) != NULL)
-				{
-					continue;
-				}
-			}
-
 			/*
 				Check if map has this block
 			*/
@@ -678,23 +1338,17 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 			*/
 			if(block == NULL || surely_not_found_on_disk || block_is_invalid)
 			{
-				//TODO: Get value from somewhere
-				// Allow only one block in emerge queue
-				//if(server->m_emerge_queue.peerItemCount(peer_id) < 1)
-				// Allow two blocks in queue per client
-				//if(server->m_emerge_queue.peerItemCount(peer_id) < 2)
-				if(server->m_emerge_queue.peerItemCount(peer_id) < 25)
+				u8 flags = 0;
+				if(generate == false)
+					flags |= BLOCK_EMERGE_FLAG_FROMDISK;
+				
+				// This fails if the client has too many blocks queued
+				if(server->m_emerge_queue.addBlock(peer_id, p, flags))
 				{
 					//infostream<<"Adding block to emerge queue"<<std::endl;
 					
-					// Add it to the emerge queue and trigger the thread
-					
-					u8 flags = 0;
-					if(generate == false)
-						flags |= BLOCK_EMERGE_FLAG_FROMDISK;
-					
-					server->m_emerge_queue.addBlock(peer_id, p, flags);
-					server->m_emergethread.trigger();
+					// Trigger the emerge threads
+					server->triggerEmergeThreads();
 
 					if(nearest_emerged_d == -1)
 						nearest_emerged_d = d;
@@ -723,6 +1377,9 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 
 			num_blocks_selected += 1;
 		}
+
+		if(shell_sent)
+			m_frontier.setShellDone(d);
 	}
 queue_full_break:
 
@@ -853,13 +1510,22 @@ void RemoteClient::SendObjectData(
 	std::string s = os.str();
 	SharedBuffer<u8> data((u8*)s.c_str(), s.size());
 	// Send as unreliable
-	server->m_con.Send(peer_id, 0, data, false);
+	server->sendCompressible(peer_id, 0, data, false);
 }
 
 void RemoteClient::GotBlock(v3s16 p)
 {
-	if(m_blocks_sending.find(p) != NULL)
+	core::map<v3s16, BlockSending>::Node *n = m_blocks_sending.find(p);
+	if(n != NULL)
+	{
+		BlockSending sending = n->getValue();
 		m_blocks_sending.remove(p);
+		m_sending_bytes -= sending.bytes;
+		m_acked_bytes += sending.bytes;
+		m_delivery_time = m_delivery_time * 0.9 + sending.time * 0.1;
+		g_profiler->avg("Server: block delivery time (ms)",
+				sending.time * 1000.0);
+	}
 	else
 	{
 		/*infostream<<"RemoteClient::GotBlock(): Didn't find in"
@@ -867,25 +1533,125 @@ void RemoteClient::GotBlock(v3s16 p)
 		m_excess_gotblocks++;
 	}
 	m_blocks_sent.insert(p, true);
+	updateFrontier(p);
 }
 
-void RemoteClient::SentBlock(v3s16 p)
+void RemoteClient::SentBlock(v3s16 p, u32 stamp, u32 bytes)
 {
 	if(m_blocks_sending.find(p) == NULL)
-		m_blocks_sending.insert(p, 0.0);
+	{
+		m_blocks_sending.insert(p, BlockSending(bytes));
+		m_sending_bytes += bytes;
+	}
 	else
 		infostream<<"RemoteClient::SentBlock(): Sent block"
 				" already in m_blocks_sending"<<std::endl;
+	m_block_stamps[p] = stamp;
+	updateFrontier(p);
+}
+
+void RemoteClient::SentBlockSize(v3s16 p, u32 bytes)
+{
+	core::map<v3s16, BlockSending>::Node *n = m_blocks_sending.find(p);
+	if(n == NULL)
+		return;
+	m_sending_bytes -= n->getValue().bytes;
+	m_sending_bytes += bytes;
+	n->getValue().bytes = bytes;
 }
 
 void RemoteClient::SetBlockNotSent(v3s16 p)
 {
 	m_nearest_unsent_d = 0;
 	
-	if(m_blocks_sending.find(p) != NULL)
+	core::map<v3s16, BlockSending>::Node *n = m_blocks_sending.find(p);
+	if(n != NULL)
+	{
+		m_sending_bytes -= n->getValue().bytes;
 		m_blocks_sending.remove(p);
+	}
 	if(m_blocks_sent.find(p) != NULL)
 		m_blocks_sent.remove(p);
+	updateFrontier(p);
+}
+
+void RemoteClient::DeletedBlock(v3s16 p)
+{
+	SetBlockNotSent(p);
+	m_block_stamps.remove(p);
+}
+
+void RemoteClient::updateSendStats(float dtime, float rtt)
+{
+	for(core::map<v3s16, BlockSending>::Iterator
+			i = m_blocks_sending.getIterator();
+			i.atEnd() == false; i++)
+	{
+		i.getNode()->getValue().time += dtime;
+	}
+
+	if(rtt >= 0.0)
+	{
+		if(m_min_rtt < 0.0 || rtt < m_min_rtt)
+			m_min_rtt = rtt;
+		else
+			m_min_rtt += (rtt - m_min_rtt) * MYMIN(1.0, dtime * 0.01);
+	}
+
+	/*
+		Measure goodput once a second, when there has been something
+		to send
+	*/
+	m_goodput_timer += dtime;
+	if(m_goodput_timer >= 1.0)
+	{
+		if(m_acked_bytes != 0 || m_blocks_sending.size() != 0)
+		{
+			float goodput = (float)m_acked_bytes / m_goodput_timer;
+			if(m_goodput < 0.0)
+				m_goodput = goodput;
+			else
+				m_goodput = m_goodput * 0.5 + goodput * 0.5;
+			g_profiler->avg("Server: block goodput per client (kB/s)",
+					m_goodput / 1024.0);
+		}
+		m_acked_bytes = 0;
+		m_goodput_timer = 0.0;
+	}
+}
+
+s32 RemoteClient::getSendWindowLeft()
+{
+	float window = BLOCK_SEND_INITIAL_WINDOW;
+	if(m_goodput >= 0.0)
+	{
+		float rtt = m_min_rtt >= 0.0 ? m_min_rtt : 0.0;
+		window = m_goodput * (rtt + BLOCK_SEND_WINDOW_EXTRA_TIME)
+				* BLOCK_SEND_WINDOW_FACTOR;
+	}
+	s32 left = (s32)window - (s32)m_sending_bytes;
+	if(m_blocks_sending.size() == 0 && left < 1)
+		left = 1;
+	return left;
+}
+
+void RemoteClient::updateFrontier(v3s16 p)
+{
+	u8 flags = 0;
+	if(m_blocks_sent.find(p) != NULL)
+		flags |= BLOCKSEND_FLAG_SENT;
+	if(m_blocks_sending.find(p) != NULL)
+		flags |= BLOCKSEND_FLAG_SENDING;
+	m_frontier.setFlags(p, flags);
+}
+
+bool RemoteClient::getBlockStamp(v3s16 p, u32 &stamp)
+{
+	core::map<v3s16, u32>::Node *n = m_block_stamps.find(p);
+	if(n == NULL)
+		return false;
+	stamp = n->getValue();
+	return true;
 }
 
 void RemoteClient::SetBlocksNotSent(core::map<v3s16, MapBlock*> &blocks)
@@ -898,10 +1664,15 @@ void RemoteClient::SetBlocksNotSent(core::map<v3s16, MapBlock*> &blocks)
 	{
 		v3s16 p = i.getNode()->getKey();
 
-		if(m_blocks_sending.find(p) != NULL)
+		core::map<v3s16, BlockSending>::Node *n = m_blocks_sending.find(p);
+		if(n != NULL)
+		{
+			m_sending_bytes -= n->getValue().bytes;
 			m_blocks_sending.remove(p);
+		}
 		if(m_blocks_sent.find(p) != NULL)
 			m_blocks_sent.remove(p);
+		updateFrontier(p);
 	}
 }
 
@@ -950,10 +1721,11 @@ Server::Server(
 	):
 	m_env(new ServerMap(mapsavedir), this),
 	m_con(PROTOCOL_ID, 512, CONNECTION_TIMEOUT, this),
+	m_compression_threshold(
+			g_settings->getU16("network_compression_threshold")),
 	m_authmanager(mapsavedir+"/auth.txt"),
 	m_banmanager(mapsavedir+"/ipban.txt"),
 	m_thread(this),
-	m_emergethread(this),
 	m_time_counter(0),
 	m_time_of_day_send_timer(0),
 	m_uptime(0),
@@ -961,9 +1733,16 @@ Server::Server(
 	m_configpath(configpath),
 	m_shutdown_requested(false),
 	m_ignore_map_edit_events(false),
-	m_ignore_map_edit_events_peer_id(0)
+	m_ignore_map_edit_events_peer_id(0),
+	m_pregenerating(false),
+	m_block_send_cache_max(
+			g_settings->getU16("server_block_send_cache_size") * 1024 * 1024),
+	m_block_send_bytes_left(0),
+	m_block_send_size_avg(BLOCK_SEND_INITIAL_SIZE_ESTIMATE)
 {
+	m_block_send_jobs_mutex.Init();
 	m_liquid_transform_timer = 0.0;
+	m_liquid_transform_unfinished = false;
 	m_print_info_timer = 0.0;
 	m_objectdata_timer = 0.0;
 	m_emergethread_trigger_timer = 0.0;
@@ -974,6 +1753,26 @@ Server::Server(
 	m_step_dtime_mutex.Init();
 	m_step_dtime = 0.0;
 	
+	m_emerge_queue.setPeerLimit(
+			g_settings->getU16("max_emerge_queue_blocks_per_client"));
+
+	// Create emerge threads
+	{
+		u16 count = g_settings->getU16("num_emerge_threads");
+		if(count == 0)
+			count = 1;
+		for(u16 i=0; i<count; i++)
+			m_emergethreads.push_back(new EmergeThread(this));
+		infostream<<"Server: Using "<<count<<" emerge threads"<<std::endl;
+	}
+
+	// Create block send threads
+	{
+		u16 count = g_settings->getU16("num_block_send_threads");
+		for(u16 i=0; i<count; i++)
+			m_blocksendthreads.push_back(new BlockSendThread(this));
+	}
+	
 	// Register us to receive map edit events
 	m_env.getMap().addEventReceiver(this);
 
@@ -1039,9 +1838,38 @@ Server::~Server()
 	}
 	
 	/*
-		Stop threads
+		Stop threads
+	*/
+	stop();
+
+	for(core::list<EmergeThread*>::Iterator
+			i = m_emergethreads.begin();
+			i != m_emergethreads.end(); i++)
+		delete *i;
+	m_emergethreads.clear();
+
+	for(core::list<BlockSendThread*>::Iterator
+			i = m_blocksendthreads.begin();
+			i != m_blocksendthreads.end(); i++)
+		delete *i;
+	m_blocksendthreads.clear();
+
+	// Drop the block packets that were not sent
+	for(core::list<BlockSendJob*>::Iterator
+			i = m_block_send_jobs.begin();
+			i != m_block_send_jobs.end(); i++)
+		delete *i;
+	m_block_send_jobs.clear();
+
+	/*
+		Write blocks still waiting in the map save queue
 	*/
-	stop();
+	{
+		JMutexAutoLock envlock(m_env_mutex);
+
+		infostream<<"Server: Flushing map save queue"<<std::endl;
+		m_env.getServerMap().flushSaveQueue();
+	}
 	
 	/*
 		Delete clients
@@ -1092,13 +1920,35 @@ void Server::stop()
 
 	// Stop threads (set run=false first so both start stopping)
 	m_thread.setRun(false);
-	m_emergethread.setRun(false);
+	for(core::list<EmergeThread*>::Iterator
+			i = m_emergethreads.begin();
+			i != m_emergethreads.end(); i++)
+		(*i)->setRun(false);
+	for(core::list<BlockSendThread*>::Iterator
+			i = m_blocksendthreads.begin();
+			i != m_blocksendthreads.end(); i++)
+		(*i)->setRun(false);
 	m_thread.stop();
-	m_emergethread.stop();
+	for(core::list<EmergeThread*>::Iterator
+			i = m_emergethreads.begin();
+			i != m_emergethreads.end(); i++)
+		(*i)->stop();
+	for(core::list<BlockSendThread*>::Iterator
+			i = m_blocksendthreads.begin();
+			i != m_blocksendthreads.end(); i++)
+		(*i)->stop();
 	
 	infostream<<"Server: Threads stopped"<<std::endl;
 }
 
+void Server::triggerEmergeThreads()
+{
+	for(core::list<EmergeThread*>::Iterator
+			i = m_emergethreads.begin();
+			i != m_emergethreads.end(); i++)
+		(*i)->trigger();
+}
+
 void Server::step(float dtime)
 {
 	DSTACK(__FUNCTION_NAME);
@@ -1227,19 +2077,24 @@ void Server::AsyncRunStep()
 	*/
 	
 	/*
-		Transform liquids
+		Transform liquids.
+		A pass that runs out of time is continued on the next steps.
 	*/
 	m_liquid_transform_timer += dtime;
-	if(m_liquid_transform_timer >= 1.00)
+	if(m_liquid_transform_timer >= 1.00 || m_liquid_transform_unfinished)
 	{
-		m_liquid_transform_timer -= 1.00;
+		if(m_liquid_transform_unfinished == false)
+			m_liquid_transform_timer -= 1.00;
 		
 		JMutexAutoLock lock(m_env_mutex);
 
 		ScopeProfiler sp(g_profiler, "Server: liquid transform");
 
+		u32 max_time_ms = 1000 *
+				g_settings->getFloat("liquid_transform_max_time");
 		core::map<v3s16, MapBlock*> modified_blocks;
-		m_env.getMap().transformLiquids(modified_blocks);
+		m_liquid_transform_unfinished = !m_env.getMap().transformLiquids(
+				modified_blocks, max_time_ms);
 #if 0		
 		/*
 			Update lighting
@@ -1300,6 +2155,7 @@ void Server::AsyncRunStep()
 					continue;
 				infostream<<"* "<<player->getName()<<"\t";
 				client->PrintInfo(infostream);
+				m_con.PrintInfo(infostream, client->peer_id);
 			}
 		}
 	}
@@ -1421,7 +2277,7 @@ void Server::AsyncRunStep()
 			memcpy((char*)&reply[2], data_buffer.c_str(),
 					data_buffer.size());
 			// Send as reliable
-			m_con.Send(client->peer_id, 0, reply, true);
+			sendCompressible(client->peer_id, 0, reply, true);
 
 			infostream<<"Server: Sent object remove/add: "
 					<<removed_objects.size()<<" removed, "
@@ -1542,7 +2398,7 @@ void Server::AsyncRunStep()
 				memcpy((char*)&reply[2], reliable_data.c_str(),
 						reliable_data.size());
 				// Send as reliable
-				m_con.Send(client->peer_id, 0, reply, true);
+				sendCompressible(client->peer_id, 0, reply, true);
 			}
 			if(unreliable_data.size() > 0)
 			{
@@ -1551,7 +2407,7 @@ void Server::AsyncRunStep()
 				memcpy((char*)&reply[2], unreliable_data.c_str(),
 						unreliable_data.size());
 				// Send as unreliable
-				m_con.Send(client->peer_id, 0, reply, false);
+				sendCompressible(client->peer_id, 0, reply, false);
 			}
 
 			/*if(reliable_data.size() > 0 || unreliable_data.size() > 0)
@@ -1723,7 +2579,7 @@ void Server::AsyncRunStep()
 		{
 			counter = 0.0;
 			
-			m_emergethread.trigger();
+			triggerEmergeThreads();
 		}
 	}
 
@@ -2062,6 +2918,25 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 
 		getClient(peer_id)->net_proto_version = net_proto_version;
 
+		/*
+			Read flags
+		*/
+
+		u8 client_flags = 0;
+		if(datasize >= 2+1+PLAYERNAME_SIZE+PASSWORD_SIZE+2+1)
+		{
+			client_flags = readU8(&data[2+1+PLAYERNAME_SIZE+PASSWORD_SIZE+2]);
+		}
+
+		// Accept the flags this server supports
+		u8 flags = 0;
+		if((client_flags & PROTOCOL_FLAG_COMPRESSION)
+				&& m_compression_threshold != 0)
+			flags |= PROTOCOL_FLAG_COMPRESSION;
+
+		getClient(peer_id)->net_compression =
+				(flags & PROTOCOL_FLAG_COMPRESSION) != 0;
+
 		if(net_proto_version == 0)
 		{
 			SendAccessDenied(m_con, peer_id,
@@ -2184,11 +3059,12 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 			Answer with a TOCLIENT_INIT
 		*/
 		{
-			SharedBuffer<u8> reply(2+1+6+8);
+			SharedBuffer<u8> reply(2+1+6+8+1);
 			writeU16(&reply[0], TOCLIENT_INIT);
 			writeU8(&reply[2], deployed);
 			writeV3S16(&reply[2+1], floatToInt(player->getPosition()+v3f(0,BS/2,0), BS));
 			writeU64(&reply[2+1+6], m_env.getServerMap().getSeed());
+			writeU8(&reply[2+1+6+8], flags);
 			
 			// Send as reliable
 			m_con.Send(peer_id, 0, reply, true);
@@ -2466,7 +3342,7 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 			/*infostream<<"Server: DELETEDBLOCKS ("
 					<<p.X<<","<<p.Y<<","<<p.Z<<")"<<std::endl;*/
 			RemoteClient *client = getClient(peer_id);
-			client->SetBlockNotSent(p);
+			client->DeletedBlock(p);
 		}
 	}
 	else if(command == TOSERVER_CLICK_OBJECT)
@@ -3729,6 +4605,35 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 void Server::onMapEditEvent(MapEditEvent *event)
 {
 	//infostream<<"Server::onMapEditEvent()"<<std::endl;
+
+	/*
+		Drop the cached serialized data of the modified blocks and
+		note the metadata changes for sending block deltas. Most
+		modifications do these by themselves, but node metadata is
+		modified directly.
+	*/
+	{
+		core::list<v3s16> blocks;
+		if(event->type == MEET_ADDNODE || event->type == MEET_REMOVENODE)
+			blocks.push_back(getNodeBlockPos(event->p));
+		else if(event->type == MEET_BLOCK_NODE_METADATA_CHANGED)
+			blocks.push_back(event->p);
+		for(core::map<v3s16, bool>::Iterator
+				i = event->modified_blocks.getIterator();
+				i.atEnd() == false; i++)
+			blocks.push_back(i.getNode()->getKey());
+		for(core::list<v3s16>::Iterator
+				i = blocks.begin(); i != blocks.end(); i++)
+		{
+			MapBlock *block = m_env.getMap().getBlockNoCreateNoEx(*i);
+			if(block == NULL)
+				continue;
+			block->clearSendCache();
+			if(event->type == MEET_BLOCK_NODE_METADATA_CHANGED)
+				block->nodeMetadataChanged();
+		}
+	}
+
 	if(m_ignore_map_edit_events)
 		return;
 	MapEditEvent *e = event->clone();
@@ -3989,7 +4894,7 @@ void Server::SendPlayerInfos()
 	//JMutexAutoLock conlock(m_con_mutex);
 
 	// Send as reliable
-	m_con.SendToAll(0, data, true);
+	sendCompressibleToAll(0, data, true);
 }
 
 void Server::SendInventory(u16 peer_id)
@@ -4015,7 +4920,7 @@ void Server::SendInventory(u16 peer_id)
 	memcpy(&data[2], s.c_str(), s.size());
 	
 	// Send as reliable
-	m_con.Send(peer_id, 0, data, true);
+	sendCompressible(peer_id, 0, data, true);
 }
 
 std::string getWieldedItemString(const Player *player)
@@ -4072,10 +4977,8 @@ void Server::SendPlayerItems()
 	m_con.SendToAll(0, data, true);
 }
 
-void Server::SendChatMessage(u16 peer_id, const std::wstring &message)
+static SharedBuffer<u8> makeChatMessagePacket(const std::wstring &message)
 {
-	DSTACK(__FUNCTION_NAME);
-	
 	std::ostringstream os(std::ios_base::binary);
 	u8 buf[12];
 	
@@ -4097,13 +5000,27 @@ void Server::SendChatMessage(u16 peer_id, const std::wstring &message)
 	
 	// Make data buffer
 	std::string s = os.str();
-	SharedBuffer<u8> data((u8*)s.c_str(), s.size());
+	return SharedBuffer<u8>((u8*)s.c_str(), s.size());
+}
+
+void Server::SendChatMessage(u16 peer_id, const std::wstring &message)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	SharedBuffer<u8> data = makeChatMessagePacket(message);
 	// Send as reliable
-	m_con.Send(peer_id, 0, data, true);
+	sendCompressible(peer_id, 0, data, true);
 }
 
 void Server::BroadcastChatMessage(const std::wstring &message)
 {
+	DSTACK(__FUNCTION_NAME);
+
+	// Built and compressed only once, like in sendCompressibleToAll()
+	SharedBuffer<u8> data = makeChatMessagePacket(message);
+	SharedBuffer<u8> compressed;
+	bool compressed_made = false;
+
 	for(core::map<u16, RemoteClient*>::Iterator
 		i = m_clients.getIterator();
 		i.atEnd() == false; i++)
@@ -4114,7 +5031,17 @@ void Server::BroadcastChatMessage(const std::wstring &message)
 		if(client->serialization_version == SER_FMT_VER_INVALID)
 			continue;
 
-		SendChatMessage(client->peer_id, message);
+		if(client->net_compression == false)
+		{
+			m_con.Send(client->peer_id, 0, data, true);
+			continue;
+		}
+		if(compressed_made == false)
+		{
+			compressed = compressPacket(data);
+			compressed_made = true;
+		}
+		m_con.Send(client->peer_id, 0, compressed, true);
 	}
 }
 
@@ -4123,6 +5050,80 @@ void Server::SendPlayerHP(Player *player)
 	SendHP(m_con, player->peer_id, player->hp);
 }
 
+SharedBuffer<u8> Server::compressPacket(SharedBuffer<u8> data)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	if(m_compression_threshold == 0 || data.getSize() < 2
+			|| data.getSize() < m_compression_threshold)
+		return data;
+
+	u16 command = readU16(&data[0]);
+
+	u32 time_start = porting::getTimeUs();
+
+	std::ostringstream os(std::ios_base::binary);
+	u8 buf[6];
+	writeU16(&buf[0], TOCLIENT_COMPRESSED);
+	writeU32(&buf[2], data.getSize());
+	os.write((char*)buf, 6);
+	// Level 1 (Z_BEST_SPEED); these are compressed on every send
+	compressZlib(data, os, 1);
+	std::string s = os.str();
+
+	u32 time_us = porting::getTimeUs() - time_start;
+
+	/*
+		Report the ratio and CPU cost of each command
+	*/
+	std::ostringstream name(std::ios_base::binary);
+	name<<" (cmd 0x"<<std::hex<<command<<")";
+	g_profiler->avg("Server: packet compression ratio"+name.str(),
+			(float)s.size() / data.getSize());
+	g_profiler->avg("Server: packet compression time (us)"+name.str(),
+			time_us);
+
+	if(s.size() >= data.getSize())
+		return data;
+
+	return SharedBuffer<u8>((u8*)s.c_str(), s.size());
+}
+
+void Server::sendCompressible(u16 peer_id, u8 channelnum,
+		SharedBuffer<u8> data, bool reliable)
+{
+	core::map<u16, RemoteClient*>::Node *n = m_clients.find(peer_id);
+	if(n != NULL && n->getValue()->net_compression)
+		data = compressPacket(data);
+	m_con.Send(peer_id, channelnum, data, reliable);
+}
+
+void Server::sendCompressibleToAll(u8 channelnum,
+		SharedBuffer<u8> data, bool reliable)
+{
+	// Compressed only once, when the first client accepting it is found
+	SharedBuffer<u8> compressed;
+	bool compressed_made = false;
+
+	for(core::map<u16, RemoteClient*>::Iterator
+		i = m_clients.getIterator();
+		i.atEnd() == false; i++)
+	{
+		RemoteClient *client = i.getNode()->getValue();
+		if(client->net_compression == false)
+		{
+			m_con.Send(client->peer_id, channelnum, data, reliable);
+			continue;
+		}
+		if(compressed_made == false)
+		{
+			compressed = compressPacket(data);
+			compressed_made = true;
+		}
+		m_con.Send(client->peer_id, channelnum, compressed, reliable);
+	}
+}
+
 void Server::SendMovePlayer(Player *player)
 {
 	DSTACK(__FUNCTION_NAME);
@@ -4312,7 +5313,7 @@ void Server::SendClans(u16 peer_id, const std::map<u16,Clan>& clans, const std::
 	std::string s = os.str();
 	SharedBuffer<u8> data((u8*)s.c_str(), s.size());
 	// Send as reliable
-	m_con.Send(peer_id, 0, data, true);
+	sendCompressible(peer_id, 0, data, true);
 }
 
 //j
@@ -4524,7 +5525,7 @@ void Server::setBlockNotSent(v3s16 p)
 	}
 }
 
-void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver)
+u32 Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver)
 {
 	DSTACK(__FUNCTION_NAME);
 
@@ -4552,31 +5553,219 @@ void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver)
 #endif
 
 	/*
-		Create a packet with the block in the right format
+		If the client has an older version of the block, try sending
+		only the changes
 	*/
-	
+	RemoteClient *client = getClient(peer_id);
+	u32 client_stamp = 0;
+	if(client->net_proto_version >= 4
+			&& client->getBlockStamp(p, client_stamp))
+	{
+		std::ostringstream os(std::ios_base::binary);
+		if(block->serializeDelta(os, ver, client_stamp))
+		{
+			std::string s = os.str();
+			
+			/*
+				Send the whole block instead if it is smaller. If
+				it isn't serialized, compare to the average size.
+			*/
+			bool use_delta = true;
+			if(s.size() > BLOCK_DELTA_ALWAYS_SIZE)
+			{
+				SharedBuffer<u8> blockdata;
+				if(block->getSendCache(ver, blockdata))
+					use_delta = (s.size() < blockdata.getSize());
+				else
+					use_delta = (s.size() < m_block_send_size_avg);
+			}
+
+			if(use_delta)
+			{
+				g_profiler->add("Server: block deltas sent", 1);
+				g_profiler->avg("Server: block delta size (bytes)", s.size());
+
+				BlockSendJob *job = new BlockSendJob;
+				job->peer_id = peer_id;
+				job->pos = p;
+				job->ver = ver;
+				job->command = TOCLIENT_BLOCKDATA_DELTA;
+				job->serialize = false;
+				job->cache_generation = 0;
+				job->data = SharedBuffer<u8>((u8*)s.c_str(), s.size());
+				job->done = true;
+				m_block_send_jobs.push_back(job);
+				return 8 + s.size();
+			}
+		}
+		g_profiler->add("Server: block deltas replaced by full block", 1);
+	}
+
+	BlockSendJob *job = new BlockSendJob;
+	job->peer_id = peer_id;
+	job->pos = p;
+	job->ver = ver;
+	job->command = TOCLIENT_BLOCKDATA;
+	job->serialize = false;
+	job->cache_generation = 0;
+	job->done = true;
+	m_block_send_jobs.push_back(job);
+
+	/*
+		Serialize and compress in a BlockSendThread if the data isn't
+		cached already. Only the copying is done here.
+	*/
+	SharedBuffer<u8> blockdata;
+	if(m_blocksendthreads.size() != 0
+			&& MapBlock::snapshotSupported(ver)
+			&& block->getSendCache(ver, blockdata) == false)
+	{
+		g_profiler->add("Server: block send cache misses", 1);
+
+		job->serialize = true;
+		job->cache_generation = block->getSendCacheGeneration();
+		block->getSnapshot(job->snapshot, ver);
+		job->done = false;
+		m_block_send_queue.push_back(job);
+
+		for(core::list<BlockSendThread*>::Iterator
+				i = m_blocksendthreads.begin();
+				i != m_blocksendthreads.end(); i++)
+			(*i)->trigger();
+
+		return 8 + (u32)m_block_send_size_avg;
+	}
+
+	blockdata = getSendBlockData(block, ver);
+	job->data = blockdata;
+
+	u32 replysize = 8 + blockdata.getSize();
+	m_block_send_size_avg = m_block_send_size_avg * 0.95 + replysize * 0.05;
+	return replysize;
+}
+
+void Server::sendQueuedBlocks()
+{
+	DSTACK(__FUNCTION_NAME);
+
+	while(m_block_send_jobs.empty() == false)
+	{
+		core::list<BlockSendJob*>::Iterator i = m_block_send_jobs.begin();
+		BlockSendJob *job = *i;
+		{
+			JMutexAutoLock lock(m_block_send_jobs_mutex);
+			if(job->done == false)
+				break;
+		}
+		m_block_send_jobs.erase(i);
+		
+		core::map<u16, RemoteClient*>::Node *n = m_clients.find(job->peer_id);
+
+		/*
+			Cache the data serialized in a BlockSendThread, if the block
+			hasn't changed since the snapshot
+		*/
+		if(job->serialize)
+		{
+			MapBlock *block = m_env.getMap().getBlockNoCreateNoEx(job->pos);
+			if(block != NULL && block->getSendCacheGeneration()
+					== job->cache_generation)
+				cacheSentBlock(block, job->ver, job->data);
+			
+			u32 replysize = 8 + job->data.getSize();
+			m_block_send_size_avg = m_block_send_size_avg * 0.95
+					+ replysize * 0.05;
+			if(n != NULL)
+				n->getValue()->SentBlockSize(job->pos, replysize);
+		}
+
+		// The client may have left while the block was being serialized
+		if(n != NULL)
+		{
+			// The command and position are put in front of the data
+			con::GatherBuffer reply(job->data);
+			u8 *header = reply.addHeader(8);
+			writeU16(&header[0], job->command);
+			writeS16(&header[2], job->pos.X);
+			writeS16(&header[4], job->pos.Y);
+			writeS16(&header[6], job->pos.Z);
+
+			/*infostream<<"Server: Sending block ("<<job->pos.X<<","
+					<<job->pos.Y<<","<<job->pos.Z<<")"
+					<<":  \tpacket size: "<<reply.getSize()<<std::endl;*/
+			
+			/*
+				Send packet
+			*/
+			m_con.Send(job->peer_id, 1, reply, true);
+		}
+
+		delete job;
+	}
+}
+
+SharedBuffer<u8> Server::getSendBlockData(MapBlock *block, u8 ver)
+{
+	/*
+		Serializing compresses the block, so the result is cached in
+		the block for the other clients
+	*/
+	SharedBuffer<u8> blockdata;
+	if(block->getSendCache(ver, blockdata))
+	{
+		g_profiler->add("Server: block send cache hits", 1);
+		return blockdata;
+	}
+
+	g_profiler->add("Server: block send cache misses", 1);
+
 	std::ostringstream os(std::ios_base::binary);
 	block->serialize(os, ver);
 	std::string s = os.str();
-	SharedBuffer<u8> blockdata((u8*)s.c_str(), s.size());
+	blockdata = SharedBuffer<u8>((u8*)s.c_str(), s.size());
+	
+	cacheSentBlock(block, ver, blockdata);
+	return blockdata;
+}
 
-	u32 replysize = 8 + blockdata.getSize();
-	SharedBuffer<u8> reply(replysize);
-	writeU16(&reply[0], TOCLIENT_BLOCKDATA);
-	writeS16(&reply[2], p.X);
-	writeS16(&reply[4], p.Y);
-	writeS16(&reply[6], p.Z);
-	memcpy(&reply[8], *blockdata, blockdata.getSize());
+void Server::cacheSentBlock(MapBlock *block, u8 ver, SharedBuffer<u8> data)
+{
+	if(data.getSize() > m_block_send_cache_max)
+		return;
+
+	block->setSendCache(ver, data);
 
-	/*infostream<<"Server: Sending block ("<<p.X<<","<<p.Y<<","<<p.Z<<")"
-			<<":  \tpacket size: "<<replysize<<std::endl;*/
-	
 	/*
-		Send packet
+		The map keeps count of the cached bytes, including the drops
+		of modified and unloaded blocks. Drop the least recently used
+		caches until half of the space is free.
 	*/
-	m_con.Send(peer_id, 1, reply, true);
+	Map &map = m_env.getMap();
+	if(map.getSendCacheSize() > m_block_send_cache_max)
+	{
+		map.trimSendCaches(m_block_send_cache_max / 2);
+		g_profiler->add("Server: block send cache trims", 1);
+	}
+	
+	g_profiler->avg("Server: block send cache (kB)",
+			map.getSendCacheSize() / 1024);
 }
 
+/*
+	Blocks selected for sending to one client
+*/
+struct BlockSendPeer
+{
+	RemoteClient *client;
+	core::array<PrioritySortedBlockTransfer> blocks;
+	// Index of the next block to send
+	u32 next;
+	// Bytes that can still be sent to the client
+	s32 window_left;
+	// Bytes sent to the client in this step
+	u32 bytes_sent;
+};
+
 void Server::SendBlocks(float dtime)
 {
 	DSTACK(__FUNCTION_NAME);
@@ -4586,7 +5775,10 @@ void Server::SendBlocks(float dtime)
 
 	//TimeTaker timer("Server::SendBlocks");
 
-	core::array<PrioritySortedBlockTransfer> queue;
+	// Send the blocks serialized since the last time
+	sendQueuedBlocks();
+
+	core::array<BlockSendPeer> peers;
 
 	s32 total_sending = 0;
 	
@@ -4605,23 +5797,72 @@ void Server::SendBlocks(float dtime)
 			if(client->serialization_version == SER_FMT_VER_INVALID)
 				continue;
 			
-			client->GetNextBlocks(this, dtime, queue);
+			float rtt = -1.0;
+			try{
+				rtt = m_con.GetPeerAvgRTT(client->peer_id);
+			}
+			catch(con::PeerNotFoundException &e)
+			{
+			}
+			client->updateSendStats(dtime, rtt);
+
+			BlockSendPeer peer;
+			peer.client = client;
+			peer.next = 0;
+			peer.window_left = client->getSendWindowLeft();
+			peer.bytes_sent = 0;
+			peers.push_back(peer);
+
+			core::array<PrioritySortedBlockTransfer> &blocks
+					= peers.getLast().blocks;
+			client->GetNextBlocks(this, dtime, blocks);
+			
+			// Sort.
+			// Lowest priority number comes first.
+			// Lowest is most important.
+			blocks.sort();
 		}
 	}
 
-	// Sort.
-	// Lowest priority number comes first.
-	// Lowest is most important.
-	queue.sort();
+	/*
+		Refill the server wide rate limit
+	*/
+	float max_rate = g_settings->getFloat("max_block_send_rate") * 1024.0;
+	if(max_rate > 0)
+	{
+		m_block_send_bytes_left = MYMIN(m_block_send_bytes_left
+				+ max_rate * dtime, max_rate * BLOCK_SEND_RATE_BURST);
+	}
 
-	for(u32 i=0; i<queue.size(); i++)
+	s32 max_total_sending = g_settings->getS32
+			("max_simultaneous_block_sends_server_total");
+
+	/*
+		Each block goes to the client that has been sent the least
+		bytes in this step, so that clients get a fair share of the
+		rate limit. Clients are skipped when their send window is full.
+	*/
+	for(;;)
 	{
-		//TODO: Calculate limit dynamically
-		if(total_sending >= g_settings->getS32
-				("max_simultaneous_block_sends_server_total"))
+		if(total_sending >= max_total_sending)
+			break;
+		if(max_rate > 0 && m_block_send_bytes_left <= 0)
+			break;
+
+		BlockSendPeer *peer = NULL;
+		for(u32 i=0; i<peers.size(); i++)
+		{
+			BlockSendPeer &p = peers[i];
+			if(p.next >= p.blocks.size() || p.window_left <= 0)
+				continue;
+			if(peer == NULL || p.bytes_sent < peer->bytes_sent)
+				peer = &p;
+		}
+		if(peer == NULL)
 			break;
 		
-		PrioritySortedBlockTransfer q = queue[i];
+		PrioritySortedBlockTransfer q = peer->blocks[peer->next];
+		peer->next++;
 
 		MapBlock *block = NULL;
 		try
@@ -4633,14 +5874,23 @@ void Server::SendBlocks(float dtime)
 			continue;
 		}
 
-		RemoteClient *client = getClient(q.peer_id);
+		RemoteClient *client = peer->client;
 
-		SendBlockNoLock(q.peer_id, block, client->serialization_version);
+		u32 bytes = SendBlockNoLock(q.peer_id, block,
+				client->serialization_version);
 
-		client->SentBlock(q.pos);
+		client->SentBlock(q.pos, block->getChangeStamp(), bytes);
+
+		peer->bytes_sent += bytes;
+		peer->window_left -= bytes;
+		if(max_rate > 0)
+			m_block_send_bytes_left -= bytes;
 
 		total_sending++;
 	}
+
+	// Send the blocks that didn't need serializing
+	sendQueuedBlocks();
 }
 
 /*
@@ -4783,6 +6033,201 @@ std::wstring Server::getStatusString()
 	return os.str();
 }
 
+/*
+	Appends the positions of a box that belong to the given phase
+	(0...26) to dst. The 3x3x3 areas modified by generating the
+	positions of one phase don't overlap, so emerge threads don't have
+	to wait for each other and the order they are generated in doesn't
+	matter.
+*/
+static void getPhasePositions(v3s16 p_min, v3s16 p_max, s16 phase,
+		core::list<v3s16> &dst)
+{
+	v3s16 o(phase % 3, (phase / 3) % 3, phase / 9);
+	for(s16 z=p_min.Z+o.Z; z<=p_max.Z; z+=3)
+	for(s16 x=p_min.X+o.X; x<=p_max.X; x+=3)
+	for(s16 y=p_min.Y+o.Y; y<=p_max.Y; y+=3)
+		dst.push_back(v3s16(x,y,z));
+}
+
+void Server::pregenerate(v3s16 p_min, v3s16 p_max, bool &kill)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	ServerMap &map = m_env.getServerMap();
+
+	m_pregenerating = true;
+
+	/*
+		Use the wanted number of emerge threads (by default one for
+		every processor) and keep a few blocks queued for each
+	*/
+	u32 thread_count = g_settings->getU16("num_pregenerate_threads");
+	if(thread_count == 0)
+		thread_count = porting::getNumberOfProcessors();
+	while(m_emergethreads.size() < thread_count)
+		m_emergethreads.push_back(new EmergeThread(this));
+	// The threads are not running before start()
+	while(m_emergethreads.size() > thread_count)
+	{
+		core::list<EmergeThread*>::Iterator i = m_emergethreads.getLast();
+		delete *i;
+		m_emergethreads.erase(i);
+	}
+	m_emerge_queue.setPeerLimit(m_emergethreads.size() * 4);
+
+	u32 total = (u32)(p_max.X - p_min.X + 1) * (u32)(p_max.Y - p_min.Y + 1)
+			* (u32)(p_max.Z - p_min.Z + 1);
+	actionstream<<"Pregenerating "<<total<<" blocks from ("
+			<<p_min.X<<","<<p_min.Y<<","<<p_min.Z<<") to ("
+			<<p_max.X<<","<<p_max.Y<<","<<p_max.Z<<") with "
+			<<m_emergethreads.size()<<" threads"<<std::endl;
+
+	u32 queued = 0;
+	u32 skipped = 0;
+
+	/*
+		The box is done in windows of columns, so that the blocks of
+		finished windows can be unloaded.
+
+		A window is done in phases (see getPhasePositions()). A phase
+		is started only after the previous one has been generated
+		completely, so that the result doesn't depend on the number of
+		threads.
+	*/
+	// Of the current phase; not queued yet
+	core::list<v3s16> positions;
+	// Of the current phase; queued but not generated yet
+	core::list<v3s16> pending;
+	v2s16 window(p_min.X, p_min.Z);
+	s16 phase = 0;
+
+	u32 start_ms = porting::getTimeMs();
+	u32 last_ms = start_ms;
+	u32 print_ms = start_ms;
+
+	while(kill == false)
+	{
+		/*
+			Start the next phase when the current one is done
+		*/
+		if(positions.empty() && pending.empty())
+		{
+			if(window.Y > p_max.Z)
+				break;
+			v3s16 w_min(window.X, p_min.Y, window.Y);
+			v3s16 w_max(
+					MYMIN(window.X + PREGENERATE_WINDOW - 1, p_max.X),
+					p_max.Y,
+					MYMIN(window.Y + PREGENERATE_WINDOW - 1, p_max.Z));
+			getPhasePositions(w_min, w_max, phase, positions);
+			phase++;
+			if(phase == 27)
+			{
+				phase = 0;
+				window.X += PREGENERATE_WINDOW;
+				if(window.X > p_max.X)
+				{
+					window.X = p_min.X;
+					window.Y += PREGENERATE_WINDOW;
+				}
+			}
+			continue;
+		}
+
+		/*
+			Queue blocks of the phase until the queue is full
+		*/
+		while(positions.empty() == false)
+		{
+			core::list<v3s16>::Iterator i = positions.begin();
+			v3s16 p = *i;
+			// Blocks next to the map limit are not generated
+			if(blockpos_over_limit(p - v3s16(1,1,1))
+					|| blockpos_over_limit(p + v3s16(1,1,1))
+					|| map.isBlockGeneratedOnDisk(p))
+				skipped++;
+			else if(m_emerge_queue.addBlock(PEER_ID_SERVER, p, 0))
+			{
+				queued++;
+				pending.push_back(p);
+			}
+			else
+				break;
+			positions.erase(i);
+		}
+
+		triggerEmergeThreads();
+
+		sleep_ms(10);
+
+		u32 time_ms = porting::getTimeMs();
+
+		{
+			JMutexAutoLock envlock(m_env_mutex);
+
+			/*
+				Find out which blocks of the phase have been generated
+			*/
+			for(core::list<v3s16>::Iterator i = pending.begin();
+					i != pending.end();)
+			{
+				MapBlock *block = map.getBlockNoCreateNoEx(*i);
+				bool generated;
+				if(block)
+					generated = block->isGenerated();
+				else
+					generated = map.isBlockGeneratedOnDisk(*i);
+				if(generated)
+					i = pending.erase(i);
+				else
+					i++;
+			}
+
+			/*
+				Save and unload the blocks that are not used anymore
+			*/
+			map.timerUpdate((float)(time_ms - last_ms) / 1000.0,
+					PREGENERATE_UNLOAD_TIMEOUT);
+		}
+		last_ms = time_ms;
+
+		if(time_ms - print_ms >= 5000)
+		{
+			print_ms = time_ms;
+			u32 done = queued - pending.size();
+			float seconds = (float)(time_ms - start_ms) / 1000.0;
+			actionstream<<"Pregenerated "<<(done + skipped)<<"/"<<total
+					<<" blocks ("<<skipped<<" done before), "
+					<<(done / seconds)<<" blocks/s"<<std::endl;
+		}
+	}
+
+	// Let the threads finish the blocks they have started
+	for(core::list<EmergeThread*>::Iterator
+			i = m_emergethreads.begin();
+			i != m_emergethreads.end(); i++)
+		(*i)->stop();
+
+	m_pregenerating = false;
+	
+	{
+		JMutexAutoLock envlock(m_env_mutex);
+		map.save(true);
+	}
+	
+	u32 done = queued - pending.size();
+	float seconds = (float)(porting::getTimeMs() - start_ms) / 1000.0;
+	if(seconds < 0.001)
+		seconds = 0.001;
+	actionstream<<"Pregenerated "<<done<<" blocks in "<<seconds<<" s ("
+			<<(done / seconds)<<" blocks/s), "<<skipped
+			<<" were done before";
+	if(kill)
+		actionstream<<"; interrupted";
+	actionstream<<std::endl;
+}
+
 // Saves g_settings to configpath given at initialization
 void Server::saveConfig()
 {
@@ -5069,6 +6514,14 @@ void Server::handlePeerChange(PeerChange &c)
 			}
 		}
 		
+		// Forget the blocks nobody else is waiting for
+		{
+			u32 dropped = m_emerge_queue.removePeer(c.peer_id);
+			if(dropped != 0)
+				g_profiler->add("EmergeQueue: dropped for removed peer",
+						dropped);
+		}
+
 		// Delete client
 		delete m_clients[c.peer_id];
 		m_clients.remove(c.peer_id);
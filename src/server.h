@@ -44,15 +44,40 @@ struct QueuedBlockEmerge
 	v3s16 pos;
 	// key = peer_id, value = flags
 	core::map<u16, u8> peer_ids;
+	// Lower is emerged first
+	float priority;
+	// Time when the block was first queued
+	u32 queued_time_ms;
+	/*
+		Set when the block was put back because its generation area
+		overlapped a reserved one; pop() skips it while that is so
+	*/
+	bool wait_area;
+};
+
+/*
+	Where a peer is and where it is looking, for prioritizing its blocks
+*/
+struct EmergePeerView
+{
+	v3s16 center;
+	v3f dir;
 };
 
 /*
+	Queue of blocks to be emerged, ordered by the distance and view
+	direction of the peers that want them.
+
+	The queue is kept short by limiting the number of blocks per peer,
+	so it is a plain list and pop() looks for the most urgent block.
+
 	This is a thread-safe class.
 */
 class BlockEmergeQueue
 {
 public:
-	BlockEmergeQueue()
+	BlockEmergeQueue():
+		m_peer_limit(0)
 	{
 		m_mutex.Init();
 	}
@@ -68,57 +93,62 @@ class BlockEmergeQueue
 			delete q;
 		}
 	}
+
+	// Maximum number of blocks queued for one peer, 0 = no limit
+	void setPeerLimit(u32 limit)
+	{
+		JMutexAutoLock lock(m_mutex);
+		m_peer_limit = limit;
+	}
 	
 	/*
 		peer_id=0 adds with nobody to send to
+		Returns false if the peer already has too many blocks queued.
 	*/
-	void addBlock(u16 peer_id, v3s16 pos, u8 flags)
-	{
-		DSTACK(__FUNCTION_NAME);
-	
-		JMutexAutoLock lock(m_mutex);
+	bool addBlock(u16 peer_id, v3s16 pos, u8 flags);
 
-		if(peer_id != 0)
-		{
-			/*
-				Find if block is already in queue.
-				If it is, update the peer to it and quit.
-			*/
-			core::list<QueuedBlockEmerge*>::Iterator i;
-			for(i=m_queue.begin(); i!=m_queue.end(); i++)
-			{
-				QueuedBlockEmerge *q = *i;
-				if(q->pos == pos)
-				{
-					q->peer_ids[peer_id] = flags;
-					return;
-				}
-			}
-		}
-		
-		/*
-			Add the block
-		*/
-		QueuedBlockEmerge *q = new QueuedBlockEmerge;
-		q->pos = pos;
-		if(peer_id != 0)
-			q->peer_ids[peer_id] = flags;
-		m_queue.push_back(q);
-	}
+	/*
+		Puts back a block got from pop() without checking the limit.
+		The time it was first queued is kept. Peers removed in the
+		meantime are left out.
+		wait_area: the block is not popped again until its generation
+		area is free
+	*/
+	void requeue(QueuedBlockEmerge &q, bool wait_area);
 
-	// Returned pointer must be deleted
-	// Returns NULL if queue is empty
-	QueuedBlockEmerge * pop()
-	{
-		JMutexAutoLock lock(m_mutex);
+	/*
+		Returns the most urgent block, leaving out the ones waiting
+		for a reserved area.
+		Returned pointer must be deleted.
+		Returns NULL if there is no such block.
+	*/
+	QueuedBlockEmerge * pop();
 
-		core::list<QueuedBlockEmerge*>::Iterator i = m_queue.begin();
-		if(i == m_queue.end())
-			return NULL;
-		QueuedBlockEmerge *q = *i;
-		m_queue.erase(i);
-		return q;
-	}
+	/*
+		Generating a block modifies the 3x3x3 blocks around it. An
+		emerge thread reserves the area before generating p with the
+		environment unlocked, and releases it when done.
+		reserveArea() returns false if the area overlaps a reserved one.
+	*/
+	bool reserveArea(v3s16 p);
+	void releaseArea(v3s16 p);
+
+	/*
+		Updates the position and view direction of a peer and
+		re-prioritizes the queue.
+		The peer is removed from the blocks farther than max_d
+		from the center.
+		Returns the number of blocks dropped because nobody wants
+		them anymore.
+	*/
+	u32 setPeerView(u16 peer_id, v3s16 center, v3f dir, s16 max_d);
+
+	/*
+		Removes a peer from the queue.
+		Returns the number of blocks dropped because nobody wants
+		them anymore.
+	*/
+	u32 removePeer(u16 peer_id);
 
 	u32 size()
 	{
@@ -130,21 +160,26 @@ class BlockEmergeQueue
 	{
 		JMutexAutoLock lock(m_mutex);
 
-		u32 count = 0;
-
-		core::list<QueuedBlockEmerge*>::Iterator i;
-		for(i=m_queue.begin(); i!=m_queue.end(); i++)
-		{
-			QueuedBlockEmerge *q = *i;
-			if(q->peer_ids.find(peer_id) != NULL)
-				count++;
-		}
-
-		return count;
+		core::map<u16, u32>::Node *n = m_peer_counts.find(peer_id);
+		if(n == NULL)
+			return 0;
+		return n->getValue();
 	}
 
 private:
+	// These are called with m_mutex locked
+	float getPriority(QueuedBlockEmerge *q);
+	bool areaInUse(v3s16 p);
+	void addPeerCount(u16 peer_id);
+	void removePeerFromBlock(QueuedBlockEmerge *q, u16 peer_id);
+
 	core::list<QueuedBlockEmerge*> m_queue;
+	// Number of queued blocks of each peer
+	core::map<u16, u32> m_peer_counts;
+	core::map<u16, EmergePeerView> m_peer_views;
+	// Blocks being generated; see reserveArea()
+	core::map<v3s16, bool> m_areas;
+	u32 m_peer_limit;
 	JMutex m_mutex;
 };
 
@@ -179,6 +214,60 @@ class EmergeThread : public SimpleThread
 
 	void * Thread();
 
+	void trigger()
+	{
+		setRun(true);
+		if(IsRunning() == false)
+		{
+			Start();
+		}
+	}
+
+private:
+	void activateEmergedBlock(MapBlock *block, bool enable_mapgen_debug_info);
+};
+
+/*
+	A block packet to be sent to a client. The packets are sent in the
+	order they were queued, when the serialization of each one has
+	been done by a BlockSendThread.
+*/
+struct BlockSendJob
+{
+	u16 peer_id;
+	v3s16 pos;
+	u8 ver;
+	// TOCLIENT_BLOCKDATA or TOCLIENT_BLOCKDATA_DELTA
+	u16 command;
+	// Set if data has to be serialized from snapshot
+	bool serialize;
+	MapBlockSnapshot snapshot;
+	// MapBlock::getSendCacheGeneration() when the snapshot was taken
+	u32 cache_generation;
+	// The data of the packet after the command and position
+	SharedBuffer<u8> data;
+	// Set when data is ready; behind Server::m_block_send_jobs_mutex
+	bool done;
+};
+
+/*
+	Serializes and compresses the blocks queued for sending, without
+	the environment lock.
+*/
+class BlockSendThread : public SimpleThread
+{
+	Server *m_server;
+
+public:
+
+	BlockSendThread(Server *server):
+		SimpleThread(),
+		m_server(server)
+	{
+	}
+
+	void * Thread();
+
 	void trigger()
 	{
 		setRun(true);
@@ -225,6 +314,115 @@ struct PrioritySortedBlockTransfer
 	u16 peer_id;
 };
 
+/*
+	A block on the way to a client
+*/
+struct BlockSending
+{
+	BlockSending():
+		time(0.0),
+		bytes(0)
+	{}
+	BlockSending(u32 a_bytes):
+		time(0.0),
+		bytes(a_bytes)
+	{}
+	// Time from sending
+	float time;
+	// Size of the sent packet
+	u32 bytes;
+};
+
+#define BLOCKSEND_FLAG_SENT (1<<0)
+#define BLOCKSEND_FLAG_SENDING (1<<1)
+
+/*
+	Sent state of the blocks around a client, used for selecting the
+	blocks to send without looking up the sent block maps for every
+	position.
+
+	The state is kept in a cube around the center. The cube wraps
+	around in all directions, so when the center moves, only the
+	positions that came into the cube have to be looked up.
+
+	Shells are the positions at one distance from the center, in the
+	order of getFacePositions(). A shell is marked done when all of it
+	has been sent, and it can then be skipped until the center moves
+	or a block in it is set not sent.
+*/
+class BlockSendFrontier
+{
+public:
+	BlockSendFrontier();
+	~BlockSendFrontier();
+
+	/*
+		Moves the cube to center. The state of the positions that came
+		into the cube is read from sent and sending.
+		The whole cube is rebuilt if radius or y_limit changed. Shells
+		only contain positions with abs(y) <= y_limit.
+		Returns how many blocks the center moved. After a rebuild,
+		this is more than radius.
+	*/
+	s16 update(s16 radius, s16 y_limit, v3s16 center,
+			core::map<v3s16, bool> &sent,
+			core::map<v3s16, BlockSending> &sending);
+	
+	// Positions outside the cube are ignored
+	void setFlags(v3s16 p, u8 flags);
+	// Returns 0 for positions outside the cube
+	u8 getFlags(v3s16 p);
+
+	bool isShellDone(s16 d)
+	{
+		if(d < 0 || d > m_radius)
+			return false;
+		return m_shell_done[d];
+	}
+	void setShellDone(s16 d)
+	{
+		if(d < 0 || d > m_radius)
+			return;
+		m_shell_done[d] = true;
+	}
+
+	// Returns the positions of a shell, relative to the center
+	const v3s16* getShell(s16 d, u32 &count);
+
+private:
+	u32 index(v3s16 p)
+	{
+		s32 x = p.X % m_side;
+		s32 y = p.Y % m_side;
+		s32 z = p.Z % m_side;
+		if(x < 0) x += m_side;
+		if(y < 0) y += m_side;
+		if(z < 0) z += m_side;
+		return (u32)(z * m_side * m_side + y * m_side + x);
+	}
+	bool contains(v3s16 p)
+	{
+		v3s16 d = p - m_center;
+		return (abs(d.X) <= m_radius && abs(d.Y) <= m_radius
+				&& abs(d.Z) <= m_radius);
+	}
+	void fillArea(v3s16 p0, v3s16 p1,
+			core::map<v3s16, bool> &sent,
+			core::map<v3s16, BlockSending> &sending);
+	void clearShellsDone();
+
+	s16 m_radius;
+	s16 m_y_limit;
+	s32 m_side;
+	v3s16 m_center;
+	// Flags of the cube, (m_side)^3 values; NULL before the first update
+	u8 *m_flags;
+	core::array<bool> m_shell_done;
+	// Positions of all shells, shell d starts at m_shell_starts[d]
+	core::array<v3s16> m_shell_positions;
+	core::array<u32> m_shell_starts;
+};
+
 class RemoteClient
 {
 public:
@@ -237,6 +435,8 @@ class RemoteClient
 	u8 serialization_version;
 	//
 	u16 net_proto_version;
+	// Whether the client accepts TOCLIENT_COMPRESSED
+	bool net_compression;
 	// Version is stored in here after INIT before INIT2
 	u8 pending_serialization_version;
 
@@ -247,11 +447,20 @@ class RemoteClient
 		peer_id = 0;
 		serialization_version = SER_FMT_VER_INVALID;
 		net_proto_version = 0;
+		net_compression = false;
 		pending_serialization_version = SER_FMT_VER_INVALID;
 		m_nearest_unsent_d = 0;
 		m_nearest_unsent_reset_timer = 0.0;
 		m_nothing_to_send_counter = 0;
 		m_nothing_to_send_pause_timer = 0;
+		m_emerge_view_dir = v3f(0,0,0);
+		m_frontier_dir = v3f(0,0,0);
+		m_sending_bytes = 0;
+		m_acked_bytes = 0;
+		m_goodput_timer = 0.0;
+		m_goodput = -1.0;
+		m_min_rtt = -1.0;
+		m_delivery_time = 0.0;
 	}
 	~RemoteClient()
 	{
@@ -278,15 +487,44 @@ class RemoteClient
 
 	void GotBlock(v3s16 p);
 
-	void SentBlock(v3s16 p);
+	/*
+		stamp is the MapBlock::getChangeStamp() of the sent data and
+		bytes is the size of the sent packet
+	*/
+	void SentBlock(v3s16 p, u32 stamp, u32 bytes);
+	// Corrects the size given to SentBlock()
+	void SentBlockSize(v3s16 p, u32 bytes);
 
 	void SetBlockNotSent(v3s16 p);
 	void SetBlocksNotSent(core::map<v3s16, MapBlock*> &blocks);
+	
+	// Called when the client has deleted a block from its memory
+	void DeletedBlock(v3s16 p);
+
+	/*
+		Gets the change stamp of the block data the client has.
+		Returns false if the client doesn't have the block.
+	*/
+	bool getBlockStamp(v3s16 p, u32 &stamp);
 
 	s32 SendingCount()
 	{
 		return m_blocks_sending.size();
 	}
+
+	/*
+		Updates the timers of the blocks being sent and the measured
+		goodput. rtt is the average round trip time of the peer,
+		negative if not known yet.
+	*/
+	void updateSendStats(float dtime, float rtt);
+
+	/*
+		Returns how many bytes of blocks can be sent to the client now.
+		The window is sized by the measured goodput and the round trip
+		time. One block can always be sent if none is on the way.
+	*/
+	s32 getSendWindowLeft();
 	
 	// Increments timeouts and removes timed-out blocks from list
 	// NOTE: This doesn't fix the server-not-sending-block bug
@@ -298,6 +536,9 @@ class RemoteClient
 		o<<"RemoteClient "<<peer_id<<": "
 				<<"m_blocks_sent.size()="<<m_blocks_sent.size()
 				<<", m_blocks_sending.size()="<<m_blocks_sending.size()
+				<<", m_sending_bytes="<<m_sending_bytes
+				<<", goodput="<<(m_goodput/1024.0)<<"kB/s"
+				<<", delivery_time="<<(m_delivery_time*1000.0)<<"ms"
 				<<", m_nearest_unsent_d="<<m_nearest_unsent_d
 				<<", m_excess_gotblocks="<<m_excess_gotblocks
 				<<std::endl;
@@ -330,8 +571,22 @@ class RemoteClient
 		No MapBlock* is stored here because the blocks can get deleted.
 	*/
 	core::map<v3s16, bool> m_blocks_sent;
+	/*
+		Change stamps of the block data sent to the client.
+		Unlike m_blocks_sent, these are kept when blocks are modified
+		so that only the changes can be sent.
+	*/
+	core::map<v3s16, u32> m_block_stamps;
 	s16 m_nearest_unsent_d;
-	v3s16 m_last_center;
+	// Sent state of the blocks around the player
+	BlockSendFrontier m_frontier;
+	// Camera direction when the frontier was last restarted
+	v3f m_frontier_dir;
+	// Updates the frontier from the sent block maps at p
+	void updateFrontier(v3s16 p);
+	// View last given to the emerge queue
+	v3s16 m_emerge_view_center;
+	v3f m_emerge_view_dir;
 	float m_nearest_unsent_reset_timer;
 	
 	/*
@@ -340,9 +595,22 @@ class RemoteClient
 		- The size of this list is limited to some value
 		Block is added when it is sent with BLOCKDATA.
 		Block is removed when GOTBLOCKS is received.
-		Value is time from sending. (not used at the moment)
 	*/
-	core::map<v3s16, float> m_blocks_sending;
+	core::map<v3s16, BlockSending> m_blocks_sending;
+	// Total bytes in m_blocks_sending
+	u32 m_sending_bytes;
+	
+	/*
+		Goodput measurement, in bytes of acknowledged blocks per second.
+		Negative when not measured yet.
+	*/
+	u32 m_acked_bytes;
+	float m_goodput_timer;
+	float m_goodput;
+	// Smallest seen round trip time, slowly raised towards the average
+	float m_min_rtt;
+	// Average time from sending a block to GOTBLOCKS
+	float m_delivery_time;
 
 	/*
 		Count of excess GotBlocks().
@@ -416,6 +684,15 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	// Connection must be locked when called
 	std::wstring getStatusString();
 
+	/*
+		Generates and saves the blocks from p_min to p_max, with an
+		emerge thread on every processor. Blocks that have been
+		generated before are skipped, so an interrupted run can be
+		continued. Returns when done or when kill is set.
+		The server must not be running.
+	*/
+	void pregenerate(v3s16 p_min, v3s16 p_max, bool &kill);
+
 	void requestShutdown(void)
 	{
 		m_shutdown_requested = true;
@@ -496,6 +773,8 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	void peerAdded(con::Peer *peer);
 	void deletingPeer(con::Peer *peer, bool timeout);
 	
+	// Starts the emerge threads that are not running
+	void triggerEmergeThreads();
 	/*
 		Static send methods
 	*/
@@ -519,6 +798,17 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	// send wielded item info about all players to all players
 	void SendPlayerItems();
 	void SendPlayerHP(Player *player);
+	/*
+		Returns data wrapped in a TOCLIENT_COMPRESSED packet, or data
+		itself if it is too small or doesn't compress.
+	*/
+	SharedBuffer<u8> compressPacket(SharedBuffer<u8> data);
+	// Like m_con.Send() and m_con.SendToAll(), but compress data for
+	// clients that accept it
+	void sendCompressible(u16 peer_id, u8 channelnum,
+			SharedBuffer<u8> data, bool reliable);
+	void sendCompressibleToAll(u8 channelnum,
+			SharedBuffer<u8> data, bool reliable);
 	/*
 		Send a node removal/addition event to all clients except ignore_id.
 		Additionally, if far_players!=NULL, players further away than
@@ -531,8 +821,31 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 			core::list<u16> *far_players=NULL, float far_d_nodes=100);
 	void setBlockNotSent(v3s16 p);
 	
-	// Environment and Connection must be locked when called
-	void SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver);
+	/*
+		Queues a block for sending. The packet is sent by
+		sendQueuedBlocks() after it has been serialized.
+		Returns the size of the packet, estimated if the block is
+		serialized in a BlockSendThread.
+		Environment and Connection must be locked when called
+	*/
+	u32 SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver);
+	/*
+		Sends the queued block packets that are ready, in order.
+		Environment and Connection must be locked when called
+	*/
+	void sendQueuedBlocks();
+	/*
+		Returns serialized data of a block for sending, from the cache
+		if possible.
+		Environment must be locked when called.
+	*/
+	SharedBuffer<u8> getSendBlockData(MapBlock *block, u8 ver);
+	/*
+		Stores serialized data of a block sent to a client in the
+		block, and keeps the memory used for this in limits.
+		Environment must be locked when called.
+	*/
+	void cacheSentBlock(MapBlock *block, u8 ver, SharedBuffer<u8> data);
 	
 	// Sends blocks to clients (locks env and con on its own)
 	void SendBlocks(float dtime);
@@ -581,6 +894,8 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	
 	// Some timers
 	float m_liquid_transform_timer;
+	// A liquid pass ran out of time and is continued on the next step
+	bool m_liquid_transform_unfinished;
 	float m_print_info_timer;
 	float m_objectdata_timer;
 	float m_emergethread_trigger_timer;
@@ -599,6 +914,9 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	JMutex m_con_mutex;
 	// Connected clients (behind the con mutex)
 	core::map<u16, RemoteClient*> m_clients;
+	// Packets at least this large are compressed for clients that
+	// accept it (network_compression_threshold, 0 disables)
+	u32 m_compression_threshold;
 
 	// User authentication
 	AuthManager m_authmanager;
@@ -617,9 +935,9 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 
 	// The server mainly operates in this thread
 	ServerThread m_thread;
-	// This thread fetches and generates map
-	EmergeThread m_emergethread;
-	// Queue of block coordinates to be processed by the emerge thread
+	// These threads fetch and generate map
+	core::list<EmergeThread*> m_emergethreads;
+	// Queue of block coordinates to be processed by the emerge threads
 	BlockEmergeQueue m_emerge_queue;
 	
 	/*
@@ -692,9 +1010,45 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	*/
 	u16 m_ignore_map_edit_events_peer_id;
 
+	/*
+		Set to true by pregenerate(). The generated blocks are not
+		activated then; see EmergeThread::activateEmergedBlock()
+	*/
+	bool m_pregenerating;
+
+	/*
+		Limit of the blocks' caches of their serialized data for
+		sending; see Map::trimSendCaches()
+	*/
+	u32 m_block_send_cache_max;
+
+	/*
+		Bytes of blocks that can be sent before reaching the server
+		wide rate limit. Refilled at max_block_send_rate in SendBlocks.
+		This is behind m_env_mutex
+	*/
+	float m_block_send_bytes_left;
+
+	/*
+		Threads serializing blocks for sending.
+		If there are none, the blocks are serialized by SendBlockNoLock.
+	*/
+	core::list<BlockSendThread*> m_blocksendthreads;
+	// Jobs for m_blocksendthreads
+	MutexedQueue<BlockSendJob*> m_block_send_queue;
+	/*
+		Queued block packets in sending order.
+		This is behind m_env_mutex
+	*/
+	core::list<BlockSendJob*> m_block_send_jobs;
+	JMutex m_block_send_jobs_mutex;
+	// Average size of a full block packet, for estimating
+	float m_block_send_size_avg;
+
 	Profiler *m_profiler;
 
 	friend class EmergeThread;
+	friend class BlockSendThread;
 	friend class RemoteClient;
 };
 
@@ -60,6 +60,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "player.h"
 #include "main.h"
 #include "test.h"
+#include "benchmark.h"
 #include "environment.h"
 #include "server.h"
 #include "serialization.h"
@@ -212,6 +213,24 @@ int main(int argc, char *argv[])
 	allowed_options.insert("enable-unittests", ValueSpec(VALUETYPE_FLAG));
 	allowed_options.insert("map-dir", ValueSpec(VALUETYPE_STRING));
 	allowed_options.insert("info-on-stderr", ValueSpec(VALUETYPE_FLAG));
+	allowed_options.insert("pregenerate", ValueSpec(VALUETYPE_STRING,
+			"Generate the blocks from <min> to <max> and exit; given as\n"
+			"      \"x,y,z:x,y,z\" in block coordinates"));
+	allowed_options.insert("mapgen-benchmark", ValueSpec(VALUETYPE_FLAG,
+			"Measure map generation speed in a new world (the directory\n"
+			"      given with --map-dir must not exist) and exit"));
+	allowed_options.insert("lighting-benchmark", ValueSpec(VALUETYPE_FLAG,
+			"Compare the speed of the light algorithms and exit"));
+	allowed_options.insert("network-test", ValueSpec(VALUETYPE_FLAG,
+			"Run the tests of the connection buffers and the block delta\n"
+			"      format and exit"));
+	allowed_options.insert("liquid-replay-test", ValueSpec(VALUETYPE_FLAG,
+			"Check that liquids flow the same with any number of map\n"
+			"      threads in a new world (see --mapgen-benchmark) and exit"));
+	allowed_options.insert("pregenerate-test", ValueSpec(VALUETYPE_FLAG,
+			"Check that --pregenerate makes the same blocks as generating\n"
+			"      them for a player in a new world (see --mapgen-benchmark)\n"
+			"      and exit"));
 
 	Settings cmd_args;
 	
@@ -315,6 +334,14 @@ int main(int argc, char *argv[])
 		run_tests();
 	}
 
+	// Test the network code instead of serving?
+	if(cmd_args.getFlag("network-test"))
+	{
+		run_network_tests();
+		actionstream<<"Network tests passed"<<std::endl;
+		return 0;
+	}
+
 	/*
 		Check parameters
 	*/
@@ -348,6 +375,37 @@ int main(int argc, char *argv[])
 				<<std::endl;
 	}
 	
+	// Benchmark the map generator instead of serving?
+	if(cmd_args.getFlag("mapgen-benchmark"))
+	{
+		std::string dir = porting::path_userdata+DIR_DELIM+"mapgen_benchmark";
+		if(cmd_args.exists("map-dir"))
+			dir = cmd_args.get("map-dir");
+		return run_mapgen_benchmark(dir) ? 0 : 1;
+	}
+
+	// Benchmark lighting instead of serving?
+	if(cmd_args.getFlag("lighting-benchmark"))
+		return run_lighting_benchmark() ? 0 : 1;
+
+	// Test liquids instead of serving?
+	if(cmd_args.getFlag("liquid-replay-test"))
+	{
+		std::string dir = porting::path_userdata+DIR_DELIM+"liquid_replay_test";
+		if(cmd_args.exists("map-dir"))
+			dir = cmd_args.get("map-dir");
+		return run_liquid_replay_test(dir) ? 0 : 1;
+	}
+
+	// Test pregenerating instead of serving?
+	if(cmd_args.getFlag("pregenerate-test"))
+	{
+		std::string dir = porting::path_userdata+DIR_DELIM+"pregenerate_test";
+		if(cmd_args.exists("map-dir"))
+			dir = cmd_args.get("map-dir");
+		return run_pregenerate_test(dir) ? 0 : 1;
+	}
+
 	// Figure out path to map
 	std::string map_dir = porting::path_userdata+DIR_DELIM+"world";
 	if(cmd_args.exists("map-dir"))
@@ -357,6 +415,29 @@ int main(int argc, char *argv[])
 	
 	// Create server
 	Server server(map_dir.c_str(), configpath);
+
+	// Pregenerate the map instead of serving?
+	if(cmd_args.exists("pregenerate"))
+	{
+		v3s16 p_min, p_max;
+		if(sscanf(cmd_args.get("pregenerate").c_str(),
+				"%hd,%hd,%hd:%hd,%hd,%hd",
+				&p_min.X, &p_min.Y, &p_min.Z,
+				&p_max.X, &p_max.Y, &p_max.Z) != 6)
+		{
+			errorstream<<"Invalid --pregenerate value, expected "
+					<<"\"x,y,z:x,y,z\""<<std::endl;
+			return 1;
+		}
+		v3s16 p0 = p_min;
+		p_min = v3s16(MYMIN(p0.X, p_max.X), MYMIN(p0.Y, p_max.Y),
+				MYMIN(p0.Z, p_max.Z));
+		p_max = v3s16(MYMAX(p0.X, p_max.X), MYMAX(p0.Y, p_max.Y),
+				MYMAX(p0.Z, p_max.Z));
+		server.pregenerate(p_min, p_max, kill);
+		return 0;
+	}
+
 	server.start(port);
 
 	// Run server
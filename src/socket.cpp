@@ -31,6 +31,20 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 // This is prepended to everything printed here
 #define DPS ""
 
+/*
+	recvmmsg() and sendmmsg() move several datagrams per system call.
+	If the kernel doesn't have them, datagrams are moved one by one.
+*/
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+	#define USE_MMSG 1
+	#include <sys/uio.h>
+	// Datagrams per system call
+	#define UDP_MMSG_MAX 64
+	static bool g_mmsg_works = true;
+#else
+	#define USE_MMSG 0
+#endif
+
 bool g_sockets_initialized = false;
 
 void sockets_init()
@@ -299,6 +313,138 @@ int UDPSocket::Receive(Address & sender, void * data, int size)
 	return received;
 }
 
+int UDPSocket::SendMany(UDPDatagram *datagrams, int count)
+{
+	int sent = 0;
+	int i = 0;
+#if USE_MMSG
+	if(INTERNET_SIMULATOR == false && DP == 0 && g_mmsg_works)
+	{
+		struct mmsghdr msgs[UDP_MMSG_MAX];
+		struct iovec iovs[UDP_MMSG_MAX * 2];
+		sockaddr_in addresses[UDP_MMSG_MAX];
+		while(i < count)
+		{
+			int n = count - i;
+			if(n > UDP_MMSG_MAX)
+				n = UDP_MMSG_MAX;
+			for(int j=0; j<n; j++)
+			{
+				UDPDatagram &d = datagrams[i+j];
+				addresses[j].sin_family = AF_INET;
+				addresses[j].sin_addr.s_addr = htonl(d.address.getAddress());
+				addresses[j].sin_port = htons(d.address.getPort());
+				iovs[j*2].iov_base = d.data;
+				iovs[j*2].iov_len = d.size;
+				iovs[j*2+1].iov_base = (void*)d.tail;
+				iovs[j*2+1].iov_len = d.tail_size;
+				memset(&msgs[j], 0, sizeof(msgs[j]));
+				msgs[j].msg_hdr.msg_name = &addresses[j];
+				msgs[j].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+				msgs[j].msg_hdr.msg_iov = &iovs[j*2];
+				msgs[j].msg_hdr.msg_iovlen = d.tail_size == 0 ? 1 : 2;
+			}
+			int r = sendmmsg(m_handle, msgs, n, 0);
+			if(r < 0)
+			{
+				if(errno == ENOSYS)
+				{
+					// Fall back to sending them one by one
+					g_mmsg_works = false;
+					break;
+				}
+				// The first one failed; skip it
+				i++;
+				continue;
+			}
+			i += r;
+			sent += r;
+		}
+	}
+#endif
+	for(; i<count; i++)
+	{
+		UDPDatagram &d = datagrams[i];
+		try{
+			if(d.tail_size == 0)
+			{
+				Send(d.address, d.data, d.size);
+			}
+			else
+			{
+				// Gather the parts here
+				std::string buf((const char*)d.data, d.size);
+				buf.append((const char*)d.tail, d.tail_size);
+				Send(d.address, buf.c_str(), buf.size());
+			}
+			sent++;
+		}catch(SendFailedException &e){
+		}
+	}
+	return sent;
+}
+
+int UDPSocket::ReceiveMany(UDPDatagram *datagrams, int count, bool wait)
+{
+	int received = 0;
+#if USE_MMSG
+	if(DP == 0 && g_mmsg_works)
+	{
+		if(wait && WaitData(m_timeout_ms) == false)
+			return 0;
+		struct mmsghdr msgs[UDP_MMSG_MAX];
+		struct iovec iovs[UDP_MMSG_MAX];
+		sockaddr_in addresses[UDP_MMSG_MAX];
+		if(count > UDP_MMSG_MAX)
+			count = UDP_MMSG_MAX;
+		for(int j=0; j<count; j++)
+		{
+			iovs[j].iov_base = datagrams[j].data;
+			iovs[j].iov_len = datagrams[j].size;
+			memset(&msgs[j], 0, sizeof(msgs[j]));
+			msgs[j].msg_hdr.msg_name = &addresses[j];
+			msgs[j].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+			msgs[j].msg_hdr.msg_iov = &iovs[j];
+			msgs[j].msg_hdr.msg_iovlen = 1;
+		}
+		int r = recvmmsg(m_handle, msgs, count, MSG_DONTWAIT, NULL);
+		if(r < 0 && errno == ENOSYS)
+		{
+			// Fall back to receiving them one by one
+			g_mmsg_works = false;
+		}
+		else
+		{
+			for(int j=0; j<r; j++)
+			{
+				datagrams[j].address = Address(
+						ntohl(addresses[j].sin_addr.s_addr),
+						ntohs(addresses[j].sin_port));
+				datagrams[j].size = msgs[j].msg_len;
+			}
+			return r < 0 ? 0 : r;
+		}
+	}
+#endif
+	for(; received<count; received++)
+	{
+		// Wait only for the first one
+		if(WaitData(wait && received == 0 ? m_timeout_ms : 0) == false)
+			break;
+		sockaddr_in address;
+		socklen_t address_len = sizeof(address);
+		int size = recvfrom(m_handle, (char*)datagrams[received].data,
+				datagrams[received].size, 0, (sockaddr*)&address,
+				&address_len);
+		if(size < 0)
+			break;
+		datagrams[received].address = Address(
+				ntohl(address.sin_addr.s_addr), ntohs(address.sin_port));
+		datagrams[received].size = size;
+	}
+	return received;
+}
+
 int UDPSocket::GetHandle()
 {
 	return m_handle;
@@ -103,6 +103,27 @@ class Address
 	unsigned short m_port;
 };
 
+/*
+	A datagram for sending or receiving several in one call.
+	When receiving, size is the size of the buffer at data and is
+	set to the size of the received datagram. When sending, tail is
+	sent after data, if tail_size != 0.
+*/
+struct UDPDatagram
+{
+	UDPDatagram():
+		data(NULL),
+		size(0),
+		tail(NULL),
+		tail_size(0)
+	{}
+	Address address;
+	void *data;
+	int size;
+	const void *tail;
+	int tail_size;
+};
+
 class UDPSocket
 {
 public:
@@ -114,6 +135,15 @@ class UDPSocket
 	void Send(const Address & destination, const void * data, int size);
 	// Returns -1 if there is no data
 	int Receive(Address & sender, void * data, int size);
+	/*
+		These use as few system calls as the platform allows.
+		SendMany() returns the number of datagrams sent; the failed
+		ones are skipped. ReceiveMany() returns the number of datagrams
+		received; if wait is true, it waits for the first one like
+		Receive() does.
+	*/
+	int SendMany(UDPDatagram *datagrams, int count);
+	int ReceiveMany(UDPDatagram *datagrams, int count, bool wait);
 	int GetHandle(); // For debugging purposes only
 	void setTimeoutMs(int timeout_ms);
 	// Returns true if there is data, false if timeout occurred
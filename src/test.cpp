@@ -1136,6 +1136,287 @@ struct TestConnection
 	}
 };
 
+/*
+	Runs reliable and split packets through the connection buffers
+	with simulated loss, without sockets, and prints the time it took.
+*/
+struct TestConnectionBuffers
+{
+	// Loss in percents
+	u32 loss;
+	// Counters of the reliable transfer
+	u16 next_incoming_seqnum;
+	u32 next_expected;
+	u32 resent;
+	con::ReliablePacketBuffer outgoing;
+	con::ReliablePacketBuffer incoming;
+
+	bool lose()
+	{
+		return (u32)myrand_range(0, 99) < loss;
+	}
+
+	void receive(con::BufferedPacket &p)
+	{
+		if(lose())
+			return;
+		u16 seqnum = readU16(&p.data[BASE_HEADER_SIZE+1]);
+		if(seqnum == next_incoming_seqnum)
+		{
+			deliver(p);
+			// Unbuffer the ones which were waiting for this
+			while(incoming.empty() == false)
+			{
+				u16 first = incoming.getFirstSeqnum();
+				if(con::seqnum_higher(next_incoming_seqnum, first))
+				{
+					// Old one
+					incoming.popFirst();
+					continue;
+				}
+				if(first != next_incoming_seqnum)
+					break;
+				con::BufferedPacket p2 = incoming.popFirst();
+				deliver(p2);
+			}
+		}
+		else if(con::seqnum_higher(seqnum, next_incoming_seqnum))
+		{
+			// Too far ahead; dropped without an ACK like Connection does
+			if((u16)(seqnum - next_incoming_seqnum)
+					>= RELIABLE_INCOMING_WINDOW)
+				return;
+			try{
+				incoming.insert(p);
+			}catch(AlreadyExistsException &e){
+			}
+		}
+		// ACK
+		if(lose())
+			return;
+		try{
+			outgoing.popSeqnum(seqnum);
+		}catch(con::NotFoundException &e){
+			return;
+		}
+		core::list<con::BufferedPacket> lost =
+				outgoing.getPassedByAck(seqnum);
+		resend(lost);
+	}
+
+	void deliver(con::BufferedPacket &p)
+	{
+		u32 headers_size = BASE_HEADER_SIZE + RELIABLE_HEADER_SIZE;
+		assert(readU32(&p.data[headers_size]) == next_expected);
+		next_expected++;
+		next_incoming_seqnum++;
+	}
+
+	void resend(core::list<con::BufferedPacket> &packets)
+	{
+		for(core::list<con::BufferedPacket>::Iterator
+				i = packets.begin(); i != packets.end(); i++)
+		{
+			resent++;
+			receive(*i);
+		}
+	}
+
+	void TestReliable(u32 count, u32 window)
+	{
+		Address a(127,0,0,1, 10);
+		next_incoming_seqnum = SEQNUM_INITIAL;
+		next_expected = 0;
+		resent = 0;
+		u16 next_outgoing_seqnum = SEQNUM_INITIAL;
+		u32 sent = 0;
+		u32 steps = 0;
+		while(next_expected < count)
+		{
+			assert(steps < count * 10);
+			// Send until window packets from the first unACKed one
+			while(sent < count && (outgoing.empty() ||
+					(u16)(next_outgoing_seqnum
+					- outgoing.getFirstSeqnum()) < window))
+			{
+				SharedBuffer<u8> data(4);
+				writeU32(&data[0], sent);
+				SharedBuffer<u8> reliable = con::makeReliablePacket(
+						data, next_outgoing_seqnum++);
+				con::BufferedPacket p = con::makePacket(a, reliable,
+						0x12345678, 2, 0);
+				outgoing.insert(p);
+				sent++;
+				receive(p);
+			}
+			outgoing.incrementTimeouts(0.1);
+			core::list<con::BufferedPacket> timed_outs =
+					outgoing.getTimedOuts(0.5);
+			outgoing.resetTimedOuts(0.5);
+			resend(timed_outs);
+			assert(outgoing.anyTotaltimeReached(60.0) == false);
+			steps++;
+		}
+		assert(incoming.empty());
+	}
+
+	void TestSplit(u32 count)
+	{
+		con::IncomingSplitBuffer buf;
+		Address a(127,0,0,1, 10);
+		u32 received = 0;
+		for(u32 i=0; i<count; i++)
+		{
+			SharedBuffer<u8> data(1000 + i % 1000);
+			for(u32 j=0; j<data.getSize(); j++)
+				data[j] = (i + j) & 0xff;
+			core::list<SharedBuffer<u8> > chunks =
+					con::makeSplitPacket(data, 100, i);
+			// Every other one is reliable and gets all its chunks
+			bool reliable = (i % 2 == 0);
+			for(core::list<SharedBuffer<u8> >::Iterator
+					j = chunks.begin(); j != chunks.end(); j++)
+			{
+				if(reliable == false && lose())
+					continue;
+				con::BufferedPacket p = con::makePacket(a, *j,
+						0x12345678, 2, 0);
+				SharedBuffer<u8> full = buf.insert(p, reliable);
+				if(full.getSize() == 0)
+					continue;
+				assert(full.getSize() == data.getSize());
+				assert(memcmp(*full, *data, data.getSize()) == 0);
+				received++;
+			}
+			buf.removeUnreliableTimedOuts(0.1, 30.0);
+		}
+		assert(received >= count / 2);
+	}
+
+	void Run()
+	{
+		// A sender's window has to fit in the receiver's one
+		assert(CONGESTION_WINDOW_MAX < RELIABLE_INCOMING_WINDOW);
+		// Across the wrap-around
+		assert(con::seqnum_higher(3, 65535) == true);
+		assert(con::seqnum_higher(65535, 3) == false);
+		u32 losses[] = {0, 1, 10, 30};
+		for(u32 i=0; i<sizeof(losses)/sizeof(losses[0]); i++)
+		{
+			loss = losses[i];
+			mysrand(loss);
+			u32 t0 = porting::getTimeMs();
+			TestReliable(100000, 256);
+			u32 t1 = porting::getTimeMs();
+			TestSplit(2000);
+			u32 t2 = porting::getTimeMs();
+			infostream<<"TestConnectionBuffers: loss="<<loss<<"%: "
+					<<"100000 reliables in "<<(t1-t0)<<"ms ("
+					<<resent<<" re-sent), "
+					<<"2000 split packets in "<<(t2-t1)<<"ms"
+					<<std::endl;
+		}
+	}
+};
+
+/*
+	Checks that a block updated with MapBlock::serializeDelta() and
+	deSerializeDelta() equals the original one
+*/
+struct TestMapBlockDelta
+{
+	void Copy(MapBlock &from, MapBlock &to)
+	{
+		std::ostringstream os(std::ios_base::binary);
+		from.serialize(os, SER_FMT_VER_HIGHEST);
+		std::istringstream is(os.str(), std::ios_base::binary);
+		to.deSerialize(is, SER_FMT_VER_HIGHEST);
+	}
+
+	// Applies the changes of from after stamp to to
+	bool Delta(MapBlock &from, MapBlock &to, u32 stamp)
+	{
+		std::ostringstream os(std::ios_base::binary);
+		if(from.serializeDelta(os, SER_FMT_VER_HIGHEST, stamp) == false)
+			return false;
+		std::istringstream is(os.str(), std::ios_base::binary);
+		to.deSerializeDelta(is, SER_FMT_VER_HIGHEST);
+		return true;
+	}
+
+	void CheckEqual(MapBlock &a, MapBlock &b)
+	{
+		for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+		{
+			MapNode n1 = a.getNodeNoCheck(x,y,z);
+			MapNode n2 = b.getNodeNoCheck(x,y,z);
+			assert(n1.param0 == n2.param0);
+			assert(n1.param1 == n2.param1);
+			assert(n1.param2 == n2.param2);
+		}
+		assert(a.getIsUnderground() == b.getIsUnderground());
+		assert(a.getOwner() == b.getOwner());
+		assert(a.isGenerated() == b.isGenerated());
+	}
+
+	void Run()
+	{
+		MapBlock original(NULL, v3s16(0,0,0));
+		MapBlock server(NULL, v3s16(0,0,0));
+		MapBlock client(NULL, v3s16(0,0,0));
+
+		MapNode stone(CONTENT_STONE);
+		for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+			original.setNodeNoCheck(x,y,z, stone);
+		original.setGenerated(true);
+		// Like a block loaded from disk and sent to a client
+		Copy(original, server);
+		Copy(server, client);
+		CheckEqual(server, client);
+		u32 stamp = server.getChangeStamp();
+
+		// Nothing changed
+		assert(Delta(server, client, stamp));
+		CheckEqual(server, client);
+
+		// Single nodes, a run and nodes one apart, at both ends
+		MapNode air(CONTENT_AIR);
+		MapNode torch(CONTENT_TORCH, 14, 3);
+		server.setNode(0,0,0, air);
+		server.setNode(5,5,5, torch);
+		for(s16 x=2; x<14; x++)
+			server.setNode(x,8,3, air);
+		server.setNode(1,9,3, air);
+		server.setNode(3,9,3, air);
+		server.setNode(15,15,15, torch);
+		server.setIsUnderground(true);
+		server.setOwner(7);
+		assert(Delta(server, client, stamp));
+		CheckEqual(server, client);
+
+		// Only the changes after the second stamp are needed
+		stamp = server.getChangeStamp();
+		server.setNode(5,5,5, stone);
+		assert(Delta(server, client, stamp));
+		CheckEqual(server, client);
+
+		// Too many changes to be sent as a delta
+		stamp = server.getChangeStamp();
+		for(u32 i=0; i<=MAPBLOCK_CHANGE_LOG_MAX; i++)
+			server.setNode(i%MAP_BLOCKSIZE, (i/MAP_BLOCKSIZE)%MAP_BLOCKSIZE,
+					10, air);
+		assert(Delta(server, client, stamp) == false);
+
+		// Old formats don't have deltas
+		assert(server.serializeDelta(infostream, 17,
+				server.getChangeStamp()) == false);
+	}
+};
+
 #define TEST(X)\
 {\
 	X x;\
@@ -1153,14 +1434,25 @@ void run_tests()
 	TEST(TestCompress);
 	TEST(TestMapNode);
 	TEST(TestVoxelManipulator);
+	TEST(TestMapBlockDelta);
 	//TEST(TestMapBlock);
 	//TEST(TestMapSector);
 	if(INTERNET_SIMULATOR == false){
 		TEST(TestSocket);
 		dout_con<<"=== BEGIN RUNNING UNIT TESTS FOR CONNECTION ==="<<std::endl;
 		TEST(TestConnection);
+		TEST(TestConnectionBuffers);
 		dout_con<<"=== END RUNNING UNIT TESTS FOR CONNECTION ==="<<std::endl;
 	}
 	infostream<<"run_tests() passed"<<std::endl;
 }
 
+void run_network_tests()
+{
+	DSTACK(__FUNCTION_NAME);
+	infostream<<"run_network_tests() started"<<std::endl;
+	TEST(TestMapBlockDelta);
+	TEST(TestConnectionBuffers);
+	infostream<<"run_network_tests() passed"<<std::endl;
+}
+
@@ -21,6 +21,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define TEST_HEADER
 
 void run_tests();
+// Runs the tests of the network code and the block delta format,
+// which run_tests() leaves out
+void run_network_tests();
 
 #endif
 
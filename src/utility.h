@@ -1002,6 +1002,72 @@ inline void str_replace_char(std::string & str, char from, char to)
 	}
 }
 
+/*
+	A counting semaphore for waking up threads without polling.
+	wait() blocks until the count is above zero and decrements it;
+	post() increments it.
+*/
+
+class Semaphore
+{
+public:
+	Semaphore(u32 count=0)
+	{
+#ifdef _WIN32
+		m_semaphore = CreateSemaphore(NULL, count, 0x7fffffff, NULL);
+		assert(m_semaphore != NULL);
+#else
+		pthread_mutex_init(&m_mutex, NULL);
+		pthread_cond_init(&m_cond, NULL);
+		m_count = count;
+#endif
+	}
+
+	~Semaphore()
+	{
+#ifdef _WIN32
+		CloseHandle(m_semaphore);
+#else
+		pthread_cond_destroy(&m_cond);
+		pthread_mutex_destroy(&m_mutex);
+#endif
+	}
+
+	void post()
+	{
+#ifdef _WIN32
+		ReleaseSemaphore(m_semaphore, 1, NULL);
+#else
+		pthread_mutex_lock(&m_mutex);
+		m_count++;
+		pthread_cond_signal(&m_cond);
+		pthread_mutex_unlock(&m_mutex);
+#endif
+	}
+
+	void wait()
+	{
+#ifdef _WIN32
+		WaitForSingleObject(m_semaphore, INFINITE);
+#else
+		pthread_mutex_lock(&m_mutex);
+		while(m_count == 0)
+			pthread_cond_wait(&m_cond, &m_mutex);
+		m_count--;
+		pthread_mutex_unlock(&m_mutex);
+#endif
+	}
+
+private:
+#ifdef _WIN32
+	HANDLE m_semaphore;
+#else
+	pthread_mutex_t m_mutex;
+	pthread_cond_t m_cond;
+	u32 m_count;
+#endif
+};
+
 /*
 	A base class for simple background thread implementation
 */
@@ -1086,6 +1152,96 @@ class Queue
 	core::list<T> m_list;
 };
 
+/*
+	FIFO queue in a ring buffer.
+	Unlike Queue, this doesn't allocate for every element; the buffer
+	grows in powers of two and is kept over clear().
+*/
+template<typename T>
+class RingQueue
+{
+public:
+	RingQueue():
+		m_data(NULL),
+		m_capacity(0),
+		m_head(0),
+		m_size(0)
+	{
+	}
+	~RingQueue()
+	{
+		delete[] m_data;
+	}
+
+	void push_back(const T &t)
+	{
+		if(m_size == m_capacity)
+			grow();
+		m_data[(m_head + m_size) & (m_capacity - 1)] = t;
+		m_size++;
+	}
+
+	T pop_front()
+	{
+		assert(m_size != 0);
+		T t = m_data[m_head];
+		m_head = (m_head + 1) & (m_capacity - 1);
+		m_size--;
+		return t;
+	}
+
+	T & front()
+	{
+		assert(m_size != 0);
+		return m_data[m_head];
+	}
+
+	// i is counted from the front
+	T & operator[](u32 i)
+	{
+		assert(i < m_size);
+		return m_data[(m_head + i) & (m_capacity - 1)];
+	}
+
+	bool empty() const
+	{
+		return m_size == 0;
+	}
+
+	u32 size() const
+	{
+		return m_size;
+	}
+
+	void clear()
+	{
+		m_head = 0;
+		m_size = 0;
+	}
+
+private:
+	void grow()
+	{
+		u32 capacity = m_capacity == 0 ? 64 : m_capacity * 2;
+		T *data = new T[capacity];
+		for(u32 i=0; i<m_size; i++)
+			data[i] = m_data[(m_head + i) & (m_capacity - 1)];
+		delete[] m_data;
+		m_data = data;
+		m_capacity = capacity;
+		m_head = 0;
+	}
+
+	// Not copyable
+	RingQueue(const RingQueue &);
+	RingQueue & operator=(const RingQueue &);
+
+	T *m_data;
+	u32 m_capacity;
+	u32 m_head;
+	u32 m_size;
+};
+
 /*
 	Thread-safe FIFO queue (well, actually a FILO also)
 */
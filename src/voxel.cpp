@@ -670,4 +670,185 @@ void VoxelManipulator::spreadLight(enum LightBank bank,
 }
 #endif
 
+/*
+	Queue-based unspreadLight.
+
+	Works like the recursive version above, but for all the banks
+	of the queued nodes at once and without emerging anything.
+*/
+void VoxelManipulator::unspreadLight(LightQueue & from_nodes,
+		LightQueue & light_sources)
+{
+	const v3s16 dirs[6] = {
+		v3s16(0,0,1), // back
+		v3s16(0,1,0), // top
+		v3s16(1,0,0), // right
+		v3s16(0,0,-1), // front
+		v3s16(0,-1,0), // bottom
+		v3s16(-1,0,0), // left
+	};
+
+	while(from_nodes.empty() == false)
+	{
+		LightQueueNode q = from_nodes.pop_front();
+
+		// Loop through 6 neighbors
+		for(u16 i=0; i<6; i++)
+		{
+			// Get the position of the neighbor node
+			v3s16 n2pos = q.p + dirs[i];
+
+			if(m_area.contains(n2pos) == false)
+				continue;
+
+			u32 n2i = m_area.index(n2pos);
+
+			if(m_flags[n2i] & (VOXELFLAG_INEXISTENT | VOXELFLAG_NOT_LOADED))
+				continue;
+
+			MapNode &n2 = m_data[n2i];
+
+			u8 light2 = n2.getLightBanksWithSource();
+			bool propagates = n2.light_propagates();
+			u8 unlighted = 0;
+			u8 sources = 0;
+
+			for(u8 bank=0; bank<2; bank++)
+			{
+				if((q.banks & (1<<bank)) == 0)
+					continue;
+
+				u8 oldlight = light_of_bank(q.light, bank);
+				u8 current_light = light_of_bank(light2, bank);
+
+				/*
+					If the neighbor is dimmer than the node was,
+					unlight it if it is transparent and has some light.
+					Otherwise it will light this node up again.
+				*/
+				if(current_light < oldlight)
+				{
+					if(propagates && current_light != 0)
+					{
+						n2.setLight((enum LightBank)bank, 0);
+						unlighted |= 1<<bank;
+					}
+				}
+				else
+				{
+					sources |= 1<<bank;
+				}
+			}
+
+			if(unlighted != 0)
+				from_nodes.push_back(LightQueueNode(n2pos, unlighted, light2));
+
+			// Don't queue the same source twice
+			sources &= ~(m_flags[n2i] >> VOXELFLAG_LIGHT_QUEUED_SHIFT);
+			if(sources != 0)
+			{
+				m_flags[n2i] |= sources << VOXELFLAG_LIGHT_QUEUED_SHIFT;
+				light_sources.push_back(LightQueueNode(n2pos, sources));
+			}
+		}
+	}
+}
+
+/*
+	Queue-based spreadLight.
+
+	Lights neighbors of the queued nodes and queues them in turn,
+	for all the banks of the queued nodes at once.
+*/
+void VoxelManipulator::spreadLight(LightQueue & from_nodes)
+{
+	spreadLight(from_nodes, m_area);
+}
+
+void VoxelManipulator::spreadLight(LightQueue & from_nodes, VoxelArea area)
+{
+	const v3s16 dirs[6] = {
+		v3s16(0,0,1), // back
+		v3s16(0,1,0), // top
+		v3s16(1,0,0), // right
+		v3s16(0,0,-1), // front
+		v3s16(0,-1,0), // bottom
+		v3s16(-1,0,0), // left
+	};
+
+	while(from_nodes.empty() == false)
+	{
+		LightQueueNode q = from_nodes.pop_front();
+
+		if(area.contains(q.p) == false)
+			continue;
+
+		u32 i = m_area.index(q.p);
+
+		m_flags[i] &= ~(q.banks << VOXELFLAG_LIGHT_QUEUED_SHIFT);
+
+		if(m_flags[i] & (VOXELFLAG_INEXISTENT | VOXELFLAG_NOT_LOADED))
+			continue;
+
+		u8 light = m_data[i].getLightBanksWithSource();
+
+		// Loop through 6 neighbors
+		for(u16 j=0; j<6; j++)
+		{
+			// Get the position of the neighbor node
+			v3s16 n2pos = q.p + dirs[j];
+
+			if(area.contains(n2pos) == false)
+				continue;
+
+			u32 n2i = m_area.index(n2pos);
+
+			if(m_flags[n2i] & (VOXELFLAG_INEXISTENT | VOXELFLAG_NOT_LOADED))
+				continue;
+
+			MapNode &n2 = m_data[n2i];
+
+			u8 light2 = n2.getLightBanksWithSource();
+			bool propagates = n2.light_propagates();
+			u8 lighted = 0;
+
+			for(u8 bank=0; bank<2; bank++)
+			{
+				if((q.banks & (1<<bank)) == 0)
+					continue;
+
+				u8 oldlight = light_of_bank(light, bank);
+				u8 newlight = diminish_light(oldlight);
+				u8 current_light = light_of_bank(light2, bank);
+
+				/*
+					If the neighbor is brighter than the current node,
+					queue it (it will light up this node on its turn)
+				*/
+				if(current_light > undiminish_light(oldlight))
+				{
+					lighted |= 1<<bank;
+				}
+				/*
+					If the neighbor is dimmer than how much light this node
+					would spread on it, light it and queue it
+				*/
+				if(current_light < newlight && propagates)
+				{
+					n2.setLight((enum LightBank)bank, newlight);
+					lighted |= 1<<bank;
+				}
+			}
+
+			// Don't queue the same node twice
+			lighted &= ~(m_flags[n2i] >> VOXELFLAG_LIGHT_QUEUED_SHIFT);
+			if(lighted != 0)
+			{
+				m_flags[n2i] |= lighted << VOXELFLAG_LIGHT_QUEUED_SHIFT;
+				from_nodes.push_back(LightQueueNode(n2pos, lighted));
+			}
+		}
+	}
+}
+
 //END
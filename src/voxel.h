@@ -24,6 +24,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <iostream>
 #include "debug.h"
 #include "mapnode.h"
+#include "utility.h"
 
 // For VC++
 #undef min
@@ -325,6 +326,52 @@ class VoxelArea
 #define VOXELFLAG_CHECKED3 (1<<4)
 // Algorithm-dependent
 #define VOXELFLAG_CHECKED4 (1<<5)
+// Queued as a light source in the day/night bank (queue-based lighting)
+#define VOXELFLAG_LIGHT_QUEUED_DAY (1<<6)
+#define VOXELFLAG_LIGHT_QUEUED_NIGHT (1<<7)
+#define VOXELFLAG_LIGHT_QUEUED_SHIFT 6
+
+/*
+	Light bank masks for the queue-based light algorithms
+*/
+#define LIGHTBANKS_DAY (1<<LIGHTBANK_DAY)
+#define LIGHTBANKS_NIGHT (1<<LIGHTBANK_NIGHT)
+#define LIGHTBANKS_BOTH (LIGHTBANKS_DAY|LIGHTBANKS_NIGHT)
+
+/*
+	Light of the given bank out of a value packed like
+	MapNode::param1 (eg. from MapNode::getLightBanksWithSource())
+*/
+inline u8 light_of_bank(u8 lightbanks, u8 bank)
+{
+	return (lightbanks >> (bank*4)) & 0x0f;
+}
+
+/*
+	An entry in a light propagation queue.
+
+	banks: LIGHTBANKS_* of the banks the node is queued for
+	light: when unlighting, the light the node had before
+	       (packed like MapNode::param1)
+*/
+struct LightQueueNode
+{
+	LightQueueNode()
+	{
+	}
+	LightQueueNode(v3s16 a_p, u8 a_banks, u8 a_light=0):
+		p(a_p),
+		banks(a_banks),
+		light(a_light)
+	{
+	}
+
+	v3s16 p;
+	u8 banks;
+	u8 light;
+};
+
+typedef RingQueue<LightQueueNode> LightQueue;
 
 enum VoxelPrintMode
 {
@@ -505,6 +552,27 @@ class VoxelManipulator /*: public NodeContainer*/
 	void spreadLight(enum LightBank bank, v3s16 p);
 	void spreadLight(enum LightBank bank,
 			core::map<v3s16, bool> & from_nodes);
+
+	/*
+		Queue-based versions of the above.
+
+		These handle all the banks of the queued nodes at once and
+		work only inside m_area; nothing is emerged and nodes outside
+		it or not loaded are skipped like inexistent ones.
+
+		unspreadLight() empties from_nodes and queues the nodes
+		that border the unlighted area into light_sources, marking
+		them with VOXELFLAG_LIGHT_QUEUED_*. spreadLight() has to be
+		called on light_sources afterwards; it clears the marks.
+
+		The second spreadLight() works only inside area, which has to
+		be inside m_area, so that
+		distinct areas can be lighted by separate threads. Nodes
+		outside area must not be queued to it.
+	*/
+	void unspreadLight(LightQueue & from_nodes, LightQueue & light_sources);
+	void spreadLight(LightQueue & from_nodes);
+	void spreadLight(LightQueue & from_nodes, VoxelArea area);
 	
 	/*
 		Virtual functions